@@ -37,47 +37,113 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <float.h> // FLT_EVAL_METHOD, for the exact fast paths of parse_number()/format_number()
 #include <time.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <limits.h> // INT_MAX
 #include <termios.h> // For terminal raw mode (Unix-like systems)
 #include <unistd.h>  // For read() and STDIN_FILENO
 #include <fcntl.h>   // Needed for fcntl
+#include <sys/stat.h> // fstat(), for reading the end of the log file and mapping stream input
+#include <pthread.h> // Worker threads for parallel batch and stream evaluation
+#include <sys/mman.h> // Mapping function libraries (and executable memory for the native code)
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>   // Server mode: Unix domain sockets...
+#include <sys/un.h>
+#include <sys/epoll.h>    // ...served by an epoll event loop...
+#include <sys/signalfd.h> // ...that also receives SIGINT and SIGTERM
+#include "nmri.h"    // Public compile/evaluate API
+
+// Hot programs are compiled to native code on x86-64 and (little-endian)
+// AArch64 Unix systems. Build with -DNMRI_NO_JIT to always interpret them.
+#if !defined(NMRI_NO_JIT) && defined(__GNUC__) && defined(__unix__) && \
+    (defined(__x86_64__) || (defined(__aarch64__) && defined(__AARCH64EL__)))
+#define NMRI_JIT 1
+#endif
+
+// Build with -DNMRI_STATS to count and time the hot-path stages of each session
+// (the `stats` command and the --stats option). Without it the instrumentation
+// compiles to nothing.
 
 /* --- Configuration Constants --- */
 
-#define MAX_TOKENS 100                                 // Maximum tokens allowed in an expression
-#define MAX_IDENTIFIER_LEN 32                          // Maximum length for variable/function names (increased from 20)
-#define MAX_VARIABLES 100                              // Maximum number of user-defined variables
-#define HISTORY_SIZE 20                                // Number of commands to keep in history
-#define NMRI_MAX_INPUT 256                             // Maximum length of user input line
-#define MAX_LOG_LINE 1024                              // Maximum length of a single log line
-#define DEFAULT_LOG_FILENAME "nmri.log"                // Default name for the log file
-#define CMD_LINE_EXPR_BUFFER_SIZE (NMRI_MAX_INPUT * 2) // Buffer for concatenated cmd line args
+#define MAX_IDENTIFIER_LEN 32           // Maximum length for variable/function names (increased from 20)
+#define INITIAL_TOKENS 32               // Initial capacity of the token array (grows as needed)
+#define INITIAL_VARIABLES 16            // Initial capacity of the variable store (grows as needed)
+#define INITIAL_INPUT 128               // Initial capacity of the interactive line buffer (grows as needed)
+#define ARENA_MIN_BLOCK 4096            // Smallest block allocated by an arena, in bytes
+#define ARENA_ALIGN 16                  // Alignment of every arena allocation
+#define EVAL_STACK_INLINE 64            // Evaluation stack entries `nmri_eval()` keeps on the C stack
+#define INITIAL_CODE 32                 // Initial capacity of the bytecode and constant pool (grow as needed)
+#define MAX_OPERAND ((1 << 24) - 1)     // Largest instruction operand (constant or variable index)
+#define MAX_PARSE_NESTING 1000          // Recursion depth of the single-pass parser before it defers to the token pipeline
+#define PROGRAM_CACHE_SIZE 64           // Compiled expressions kept per session (least recently used are evicted)
+#define PROGRAM_CACHE_WAYS 4            // Entries an expression may occupy (the cache is set-associative)
+#define PROGRAM_CACHE_SEEN 256          // Recently missed expressions remembered (by hash) before caching them
+#define JIT_THRESHOLD 1000              // Evaluations of a program before it is compiled to native code
+#define JIT_MAX_DEPTH 14                // Deepest evaluation stack the native code keeps in registers
+#define FAST_TRIG_LIMIT 0x1p20          // Largest |x| the fast-math sin and cos reduce themselves (beyond: libm)
+#define NUMBER_BUFFER 32                // Room for any number printed by `format_number()`
+#define HISTORY_SIZE 1000               // Number of commands to keep in history
+#define HISTORY_FILE ".nmri_history"    // History file in $HOME (NMRI_HISTORY gives another path, "" none)
+#define HISTORY_FILE_LIMIT (1 << 20)    // History file size at which loading it rewrites it with the kept commands
+#define TERMINAL_READ_SIZE 4096         // Bytes read from the terminal at a time by the line editor
+#define LOG_SHOW_LINES 20               // Lines shown by 'log show' without a count
+#define MAX_LOG_LINE 1024               // Maximum length of a single log line
+#define ERROR_MESSAGE_SIZE 256          // Room for the message returned by `nmri_last_error()`
+#define ERROR_MAX_ARGS 4                // Arguments an error message recorded by `set_error()` may have
+#define ERROR_TEXT_SIZE 96              // Room for the string arguments of such a message
+#define DEFAULT_LOG_FILENAME "nmri.log" // Default name for the log file
+#define LOG_TAIL_BLOCK (64 * 1024)      // Bytes read at a time when searching the log file backwards
+#define LOG_RING_SIZE (64 * 1024)       // Bytes of log records waiting for the writer thread (a power of two)
+#define LOG_FLUSH_RECORDS 256           // Default: write the log after this many records...
+#define LOG_FLUSH_MS 200                // ...or at least this often (milliseconds)
+#define BINARY_LOG_MAGIC "NMRIBLG1"     // First 8 bytes of a binary log ('log binary')
+#define BINARY_LOG_HEADER 24            // Bytes of a binary log record before its line
+#define LIBRARY_MAGIC "NMRILIB1"        // First 8 bytes of a function library ('save')
+#define LIBRARY_BYTE_ORDER 0x01020304u  // Written in native byte order; other machines reject the file
+#define MAX_FUNCTION_PARAMS 16          // Parameters of a user-defined function
+#define STREAM_BUFFER_SIZE (1 << 16)    // stdio buffer size for stream mode input and output
+#define BATCH_BLOCK_ROWS 256            // Rows evaluated per postfix op in batch mode
+#define BATCH_MIN_TASK_BLOCKS 16        // Smallest share of a parallel batch, in blocks
+#define STREAM_CHUNK_LINES 4096         // Lines read ahead per chunk in parallel stream mode
+#define STREAM_RELEASE_SIZE (64 << 20)  // Bytes of a mapped stream input released at a time once read
+#define CSV_BLOCK_ROWS (1 << 14)        // Rows parsed before each batch evaluation in CSV mode
+#define MAX_THREADS 256                 // Upper bound for the -j option
+#define RESULT_BUFFER (NUMBER_BUFFER + 1) // Room for one result written by `format_result()`
+#define SERVE_READ_SIZE (1 << 16)       // Bytes read from a server client at a time
+#define SERVE_MAX_REQUEST (1 << 20)     // Longest request; a client sending a longer one is disconnected
+#define SERVE_OUTPUT_LIMIT (1 << 20)    // Unsent response bytes at which a client's requests stop being read
+#define SERVE_MAX_EVENTS 64             // Events handled per `epoll_wait()` call
 
 /* --- ANSI Color Codes --- */
-#define COLOR_RESET "\033[0m"
-#define COLOR_BOLD "\033[1m"
-#define COLOR_DIM "\033[2m"
-#define COLOR_ITALIC "\033[3m"
-#define COLOR_UNDERL "\033[4m"
-#define COLOR_BLINK "\033[5m"
-#define COLOR_REVERSE "\033[7m"
-#define COLOR_BLACK "\033[30m"
-#define COLOR_RED "\033[31m"
-#define COLOR_GREEN "\033[32m"
-#define COLOR_YELLOW "\033[33m"
-#define COLOR_BLUE "\033[34m"
-#define COLOR_MAGENTA "\033[35m"
-#define COLOR_CYAN "\033[36m"
-#define COLOR_WHITE "\033[37m"
-#define COLOR_BG_BLACK "\033[40m"
-#define COLOR_BG_RED "\033[41m"
-#define COLOR_BG_GREEN "\033[42m"
-#define COLOR_BG_YELLOW "\033[43m"
-#define COLOR_BG_BLUE "\033[44m"
-#define COLOR_BG_MAGENTA "\033[45m"
-#define COLOR_BG_CYAN "\033[46m"
-#define COLOR_BG_WHITE "\033[47m"
+// Every code expands to "" while `terminal_colors` is 0 (output is not a terminal)
+#define ANSI_COLOR(code) (terminal_colors ? "\033[" code "m" : "")
+#define COLOR_RESET ANSI_COLOR("0")
+#define COLOR_BOLD ANSI_COLOR("1")
+#define COLOR_DIM ANSI_COLOR("2")
+#define COLOR_ITALIC ANSI_COLOR("3")
+#define COLOR_UNDERL ANSI_COLOR("4")
+#define COLOR_BLINK ANSI_COLOR("5")
+#define COLOR_REVERSE ANSI_COLOR("7")
+#define COLOR_BLACK ANSI_COLOR("30")
+#define COLOR_RED ANSI_COLOR("31")
+#define COLOR_GREEN ANSI_COLOR("32")
+#define COLOR_YELLOW ANSI_COLOR("33")
+#define COLOR_BLUE ANSI_COLOR("34")
+#define COLOR_MAGENTA ANSI_COLOR("35")
+#define COLOR_CYAN ANSI_COLOR("36")
+#define COLOR_WHITE ANSI_COLOR("37")
+#define COLOR_BG_BLACK ANSI_COLOR("40")
+#define COLOR_BG_RED ANSI_COLOR("41")
+#define COLOR_BG_GREEN ANSI_COLOR("42")
+#define COLOR_BG_YELLOW ANSI_COLOR("43")
+#define COLOR_BG_BLUE ANSI_COLOR("44")
+#define COLOR_BG_MAGENTA ANSI_COLOR("45")
+#define COLOR_BG_CYAN ANSI_COLOR("46")
+#define COLOR_BG_WHITE ANSI_COLOR("47")
 
 /* --- Type Definitions --- */
 
@@ -89,8 +155,10 @@ typedef enum
     TOKEN_FUNCTION,  // A mathematical function (sin, cos, log, etc.)
     TOKEN_LPAREN,    // Left parenthesis '('
     TOKEN_RPAREN,    // Right parenthesis ')'
-    TOKEN_VARIABLE,  // An identifier representing a variable (legacy, maybe remove if not needed)
-    TOKEN_ASSIGNMENT // An identifier followed by '=' (e.g., "x =")
+    TOKEN_VARIABLE,  // A variable resolved at evaluation time (compiled programs only)
+    TOKEN_ASSIGNMENT, // An identifier followed by '=' (e.g., "x =")
+    TOKEN_CALL,      // A user-defined function followed by '(' (e.g., "f(")
+    TOKEN_COMMA      // ',' between the arguments of a call
 } TokenType;
 
 // Specific type of arithmetic operator
@@ -120,375 +188,2132 @@ typedef enum
     FUNC_FLOOR,       // Round down
     FUNC_CEIL,        // Round up
     FUNC_ROUND,       // Round to nearest integer
+    FUNC_FAST_SIN,    // Polynomial approximations emitted instead of sin, cos,
+    FUNC_FAST_COS,    // exp and log in NMRI_MATH_FAST (see `math_function()`);
+    FUNC_FAST_EXP,    // they have no names of their own
+    FUNC_FAST_LOG,
     FUNC_INVALID = -1 // Represents an invalid/unknown function
 } FunctionType;
 
-// Represents a single token in the input expression
+// Represents a single token in the input expression. Kept to 16 bytes: token
+// arrays are scanned by every stage, so names are not copied into tokens.
 typedef struct
 {
     TokenType type;
     int is_percentage; // Flag: 1 if the token represents a percentage value (e.g., "20%")
     union
     {
-        double number;                     // Value if TOKEN_NUMBER
-        OperatorType op;                   // Value if TOKEN_OPERATOR
-        FunctionType func;                 // Value if TOKEN_FUNCTION
-        char var_name[MAX_IDENTIFIER_LEN]; // Name if TOKEN_ASSIGNMENT or TOKEN_VARIABLE
+        double number;     // Value if TOKEN_NUMBER
+        OperatorType op;   // Value if TOKEN_OPERATOR
+        FunctionType func; // Value if TOKEN_FUNCTION
+        struct
+        {
+            int offset; // Start of the name in the input string
+            int length; // Length of the name
+        } name;         // Name if TOKEN_ASSIGNMENT
+        int slot;       // Variable slot in the program if TOKEN_VARIABLE, function index if TOKEN_CALL
     } value;
 } Token;
 
-// Represents a value on the evaluation stack (used in RPN evaluation)
-// Needed to differentiate between raw numbers and percentages during calculations.
+// Bytecode operations. The binary arithmetic opcodes follow the OperatorType order.
+typedef enum
+{
+    BC_CONST,   // Push constants[operand]
+    BC_VAR,     // Push the value bound to variable slot `operand`
+    BC_ADD,     // a + b
+    BC_SUB,     // a - b
+    BC_MUL,     // a * b
+    BC_DIV,     // a / b (error if b is 0)
+    BC_POW,     // pow(a, b)
+    BC_MOD,     // fmod(a, b) (error if b is 0)
+    BC_ADD_PCT, // a + b * a, for "a + b%" (b already divided by 100)
+    BC_SUB_PCT, // a - b * a, for "a - b%" (b already divided by 100)
+    BC_FUNC,    // Apply function `operand` (a FunctionType) to the top value
+    BC_NEG,     // -a, for "a * -1" (a unary minus is "0 - a", which differs for a = +0)
+    BC_DUP      // Push a copy of the top value, for "a ^ 2" -> "a * a"
+} Opcode;
+
+// Instructions are 32-bit words: the opcode in the low byte, the operand above it
+#define INSTR(op, operand) ((uint32_t)(op) | ((uint32_t)(operand) << 8))
+#define INSTR_OP(instr) ((Opcode)((instr) & 0xFF))
+#define INSTR_ARG(instr) ((int)((instr) >> 8))
+
+// Compact compiled form of an expression for the stack machine evaluator.
+// Percentages are resolved while compiling (see `emit_operator()`), so the
+// evaluator works on plain doubles.
 typedef struct
 {
-    double num;        // The numeric value
-    int is_percentage; // Flag: 1 if this value originated from a percentage token
-} Value;
+    uint32_t *code;     // Instructions
+    int count;          // Number of instructions
+    double *constants;  // Constant pool, indexed by BC_CONST operands
+    int constant_count; // Number of constants
+    int max_depth;      // Deepest evaluation stack the code needs
+    int power_warnings;  // Percentages ignored by '^' (reported when compiled)
+    int modulo_warnings; // Percentages ignored by '%' (reported when compiled)
+    NmriMath math;       // Arithmetic the code was compiled for (NMRI_MATH_EXTENDED runs `evaluate_bytecode_extended()`)
+} Bytecode;
+
+// How `execute_line()` and the stream mode print results
+typedef enum
+{
+    OUTPUT_GENERAL, // Six significant digits, like printf("%g") (values below 1e-10 print as 0)
+    OUTPUT_EXACT,   // Shortest text that reads back as the same double
+    OUTPUT_BINARY,  // Raw native doubles, 8 bytes per result (NaN for failed lines)
+    OUTPUT_NONE     // Results are not printed (`replay_log()`)
+} OutputFormat;
+
+// How `show_error()` presents the error of a failed line
+typedef enum
+{
+    ERRORS_MESSAGE, // "Error: message" (with a caret under the line in the REPL)
+    ERRORS_RECORD,  // "line:column: code: message", one per failed line (stream mode)
+    ERRORS_NONE     // Not shown (server mode: the client gets "nan")
+} ErrorOutput;
+
+// What kind of line `execute_line()` ran, as recorded in the binary log
+typedef enum
+{
+    LINE_COMMAND = 1, // A built-in command (no result)
+    LINE_ASSIGNMENT,  // name = expression
+    LINE_EXPRESSION   // An expression
+} LineKind;
 
-// Structure to map function names (strings) to their corresponding enum type
+// What a built-in name stands for
+typedef enum
+{
+    BUILTIN_NONE = 0, // Free slot in `builtin_names`
+    BUILTIN_CONSTANT, // A number (`value`)
+    BUILTIN_FUNCTION, // A function (`func`)
+    BUILTIN_ANS       // The last result (a variable in compiled programs)
+} BuiltinKind;
+
+// A built-in constant or function name
 typedef struct
 {
     const char *name;
+    BuiltinKind kind;
+    double value;
     FunctionType func;
-} FunctionMap;
+} BuiltinName;
+
+// Expression a variable is recomputed from in reactive mode ('reactive on')
+typedef struct
+{
+    NmriProgram *program; // The compiled expression
+    int *inputs;          // Index of the variable bound to each slot of the program
+    double *bindings;     // Room for the values of the slots
+    char *expression;     // Source text, shown by 'variables' (allocated)
+    NmriError error;      // Error of its last recomputation, NMRI_OK if it succeeded
+} Formula;
 
 // Structure to store user-defined variables
 typedef struct
 {
     char name[MAX_IDENTIFIER_LEN];
+    unsigned hash; // Cached hash of `name`, compared before the full name
     double value;
+    Formula *formula;                       // Formula the value follows in reactive mode, or NULL
+    int *dependents;                        // Variables whose formula reads this one (allocated)
+    int dependent_count, dependent_capacity;
+    unsigned mark;                          // Visit mark of `reactive_collect()`
 } Variable;
 
-/* --- Global Variables --- */
+// A user-defined function ("f(x, y) = x^2 + y"). The body is compiled once like
+// a program whose first `param_count` variable slots are the parameters; the
+// other slots are session variables read by the body. Calls are inlined into the
+// calling expression's bytecode by `emit_call()`, so the evaluators, the native
+// code and the batch mode never see them.
+typedef struct
+{
+    char name[MAX_IDENTIFIER_LEN];
+    unsigned hash;                          // Value of `hash_name(name)`
+    int param_count;                        // Parameters, in slots 0..param_count-1
+    Bytecode bc;                            // Compiled body
+    char (*var_names)[MAX_IDENTIFIER_LEN]; // Name of each variable slot (parameters first)
+    int var_count;                          // Number of variable slots
+    char *source;                           // The definition as written, for `functions`
+    int mapped;                             // `bc`, `var_names` and `source` point into a loaded library
+} UserFunction;
+
+// A library file mapped by `load_library()`, kept until the session ends
+typedef struct
+{
+    void *data;
+    size_t size;
+} MappedLibrary;
+
+// Layout of a library file ('save' / 'load'). Every part is a multiple of 8 bytes
+// and the file is read in place through mmap(), so loading it parses nothing:
+//   LibraryHeader
+//   LibraryVariable[variable_count]
+//   function_count times: LibraryFunction, then constants (double[constant_count]),
+//   variable names (char[var_count][MAX_IDENTIFIER_LEN]), code (uint32_t[code_count])
+//   and the NUL-terminated source, both padded to 8 bytes.
+typedef struct
+{
+    char magic[8];           // LIBRARY_MAGIC
+    uint32_t byte_order;     // LIBRARY_BYTE_ORDER
+    uint32_t variable_count; // Variables stored after the header
+    uint32_t function_count; // Functions stored after the variables
+    uint32_t reserved;
+    uint64_t size; // Size of the whole file
+} LibraryHeader;
+
+typedef struct
+{
+    char name[MAX_IDENTIFIER_LEN];
+    double value;
+} LibraryVariable;
+
+typedef struct
+{
+    char name[MAX_IDENTIFIER_LEN];
+    uint32_t param_count;
+    uint32_t var_count;
+    uint32_t code_count;
+    uint32_t constant_count;
+    uint32_t max_depth;
+    uint32_t source_length; // Without the terminating NUL
+} LibraryFunction;
+
+// One block of memory owned by an arena. The usable bytes follow the header.
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next; // Previously filled block, or NULL
+    size_t size;             // Usable bytes in this block
+    size_t used;             // Bytes handed out so far
+} ArenaBlock;
+
+// Bump allocator for the scratch buffers of one expression (tokens, postfix
+// queue, operator stack, evaluation stack). Allocations are never freed one by
+// one: `arena_reset()` releases them all at once and keeps the memory for the
+// next expression, so evaluating does not call malloc() once the arena is warm.
+typedef struct
+{
+    ArenaBlock *block; // Current block (earlier blocks are chained behind it)
+    size_t last;       // Offset of the latest allocation in `block`, so it can grow in place
+} Arena;
+
+// What the emitter knows about one value on the evaluation stack
+typedef struct
+{
+    int start;         // Index of the first instruction computing the value
+    int is_percentage; // The value is a percentage literal (a single BC_CONST at `start`)
+} EmitEntry;
+
+// Builds bytecode from operands and operators given in postfix order. A shadow
+// stack records where the code of each stack entry starts, so the percentage
+// rules are applied once at compile time and constant subexpressions and
+// identities are simplified as they are emitted.
+typedef struct
+{
+    Arena *arena;          // Arena the code, constants and shadow stack are allocated from
+    Bytecode bc;           // Code emitted so far
+    int code_capacity;     // Allocated entries in `bc.code`
+    int constant_capacity; // Allocated entries in `bc.constants`
+    int dead_constants;    // Constants no longer referenced after simplification
+    EmitEntry *stack;      // Shadow stack, one entry per value the code leaves on the evaluation stack
+    int depth;             // Current stack depth
+    int stack_capacity;    // Allocated entries in `stack`
+} Emitter;
+
+// State of the single-pass parser: the input position and one token of lookahead.
+typedef struct
+{
+    const NmriContext *ctx; // Session the identifiers are resolved in (only its functions when `program` is set; may be NULL then)
+    NmriProgram *program;   // Program collecting variable slots, or NULL to inline variable values
+    const char *input;      // Start of the expression
+    const char *pos;        // First character after the lookahead token
+    Token token;            // Lookahead token
+    int has_token;          // 0 once the input is exhausted
+    int nesting;            // Current recursion depth
+    Emitter em;             // Receives the code
+} Parser;
+
+// A user function call being inlined by `emit_replay()`: the code of each argument
+// and where the body's other variables come from in the calling expression
+typedef struct
+{
+    const uint32_t *code;   // Code of all the arguments, one after the other
+    const double *constants; // Constant of each BC_CONST in `code`, indexed by its operand
+    const int *arg_start;   // Start of each argument in `code` (param_count + 1 entries)
+    int param_count;
+    const int *slots;       // Caller slot of each other body variable, or -1 to push `values[i]`
+    const double *values;   // Inlined value of each other body variable
+} InlineCall;
+
+// Native code compiled from a program: returns the result, or NAN when the
+// interpreter has to run instead (errors are only reported by the interpreter)
+typedef double (*JitFunction)(const double *bindings);
+
+// Progress of a program towards native code
+typedef enum
+{
+    JIT_COLD,       // Interpreted, counting evaluations
+    JIT_COMPILING,  // One thread is generating the code
+    JIT_READY,      // `entry` may be called
+    JIT_UNAVAILABLE // The program cannot be compiled; it stays interpreted
+} JitStatus;
+
+// Native code state of a program. Several threads may evaluate the same
+// program, so `status` and `evaluations` are only accessed atomically.
+typedef struct
+{
+    int status;                // A JitStatus
+    unsigned long evaluations; // Interpreted evaluations so far
+    JitFunction entry;         // Native entry point, once JIT_READY
+    void *memory;              // Executable mapping holding the code
+    size_t size;               // Size of `memory` in bytes
+} JitState;
+
+// Code being generated for a program
+typedef struct
+{
+    unsigned char *data; // Generated bytes (allocated)
+    size_t len;          // Bytes generated so far
+    size_t capacity;     // Allocated bytes in `data`
+    int failed;          // Set if memory ran out
+} JitBuffer;
 
-// Map of recognized function names to their FunctionType
-FunctionMap function_map[] = {
-    {"sin", FUNC_SIN}, {"cos", FUNC_COS}, {"tan", FUNC_TAN}, {"asin", FUNC_ASIN}, {"acos", FUNC_ACOS}, {"atan", FUNC_ATAN}, {"log", FUNC_LOG}, {"ln", FUNC_LOG}, // Alias 'ln' for natural log
-    {"sqrt", FUNC_SQRT},
-    {"exp", FUNC_EXP},
-    {"abs", FUNC_ABS},
-    {"floor", FUNC_FLOOR},
-    {"ceil", FUNC_CEIL},
-    {"round", FUNC_ROUND},
-    {NULL, FUNC_INVALID} // Sentinel value to mark the end of the map
+// A compiled expression: its bytecode plus the table of variable slots it
+// references. Variables are bound by slot at evaluation time.
+struct NmriProgram
+{
+    Bytecode bc;                            // Compiled code (owned by the program)
+    char (*var_names)[MAX_IDENTIFIER_LEN]; // Name of each variable slot
+    int var_count;                          // Number of variable slots
+    int param_count;                        // Leading slots that are the parameters of a function body (not bound by name)
+    JitState *jit;                          // Native code state, or NULL if the program is always interpreted
 };
 
-// Storage for user-defined variables
-Variable variables[MAX_VARIABLES];
-int variable_count = 0; // Number of currently defined variables
+// A compiled expression kept by a ProgramCache
+typedef struct
+{
+    char *key;               // Expression text without insignificant whitespace (allocated), or NULL if unused
+    unsigned hash;           // Value of `hash_name(key)`
+    NmriProgram *program;    // The compiled expression
+    unsigned long last_used; // Lookup tick of the latest use, for LRU eviction
+} CacheEntry;
+
+// Small LRU cache of compiled expressions, keyed by their source text. Variables
+// are bound by name on each evaluation, so entries stay valid when values change.
+// The hash of the key selects a set of PROGRAM_CACHE_WAYS entries, so a lookup
+// compares a few entries only and eviction is least recently used within the set.
+// An expression is only cached when it is seen a second time, so streams of
+// distinct expressions neither pay for building programs nor flush the cache.
+typedef struct
+{
+    CacheEntry entries[PROGRAM_CACHE_SIZE];
+    unsigned seen[PROGRAM_CACHE_SEEN]; // Key hashes of recent misses, indexed by hash
+    unsigned long tick;   // Number of lookups so far
+    unsigned long hits;   // Lookups answered from the cache
+    unsigned long misses; // Lookups that compiled the expression
+    unsigned long functions_version; // Session's `functions_version` the entries were compiled with
+} ProgramCache;
+
+// Hot-path stages counted with NMRI_STATS
+typedef enum
+{
+    STAT_PARSE,           // parse_expression(), the single-pass parser
+    STAT_TOKENIZE,        // tokenize_program() (fallback pipeline)
+    STAT_SHUNTING_YARD,   // shunting_yard() (fallback pipeline)
+    STAT_COMPILE_POSTFIX, // compile_postfix() (fallback pipeline)
+    STAT_EVALUATE,        // Bytecode or native code evaluation
+    STAT_CACHE_LOOKUP,    // Program cache lookups (without compiling on a miss)
+    STAT_LOG,             // log_message() records
+    STAT_COUNT
+} StatKind;
+
+// Number of calls and total time of each stage
+typedef struct
+{
+    unsigned long calls[STAT_COUNT];
+    unsigned long long ns[STAT_COUNT];
+} NmriStats;
+
+#ifdef NMRI_STATS
+// Time a stage into the statistics the current thread reports to (see `stats_sink`).
+// STATS_END may appear several times after one STATS_BEGIN, on different exits.
+#define STATS_BEGIN(kind)               \
+    struct timespec stats_start_##kind; \
+    clock_gettime(CLOCK_MONOTONIC, &stats_start_##kind)
+#define STATS_END(kind) stats_add(stats_sink, kind, &stats_start_##kind)
+#define STATS_END_TO(stats, kind) stats_add(stats, kind, &stats_start_##kind)
+#define STATS_ENTER(stats)                   \
+    NmriStats *stats_saved_sink = stats_sink; \
+    stats_sink = (stats)
+#define STATS_LEAVE() (stats_sink = stats_saved_sink)
+#else
+#define STATS_BEGIN(kind)
+#define STATS_END(kind)
+#define STATS_END_TO(stats, kind)
+#define STATS_ENTER(stats)
+#define STATS_LEAVE()
+#endif
+
+// One entry of the batch evaluation stack: either a scalar (constants and
+// anything computed only from constants) or a block of BATCH_BLOCK_ROWS values.
+typedef struct
+{
+    const double *rows; // Block values, or NULL for a scalar
+    double scalar;      // Value if `rows` is NULL
+} BatchValue;
+
+// Log records on their way to the log file. The session thread formats each
+// record straight into `ring` and a background thread writes the ring to the
+// file in batches. With one producer and one consumer the ring needs no lock:
+// `head` (written only by the session) and `tail` (written only by the writer)
+// count bytes since the start and are published with atomic stores. The mutex
+// and condition variables are only used to put the writer to sleep and wake it.
+typedef struct
+{
+    char *ring;               // LOG_RING_SIZE bytes
+    size_t head;              // Bytes of complete records appended by the session
+    size_t staged;            // Bytes appended so far, including an unfinished record (session only)
+    size_t tail;              // Bytes written to the file
+    unsigned records;         // Records appended since the writer was last woken (session only)
+    unsigned flush_records;   // Wake the writer after this many records (0 = no record limit)
+    unsigned flush_ms;        // Write at least this often, in milliseconds (0 = no time limit)
+    int urgent;               // Set to make the writer write at once
+    int stop;                 // Set to make the writer write everything and exit
+    FILE *file;               // The log file (used only by the writer once started)
+    pthread_t thread;         // The writer thread
+    pthread_mutex_t lock;     // Protects `urgent`, `stop` and the policy for waiting
+    pthread_cond_t wake;      // Signalled to wake the writer
+    pthread_cond_t written;   // Broadcast each time the writer has advanced `tail`
+    time_t stamp_second;      // Second the cached timestamp was formatted for
+    char stamp[32];           // Cached "[YYYY-MM-DD HH:MM:SS] " prefix
+    size_t stamp_length;
+} LogWriter;
+
+// A fixed set of worker threads running the tasks of `thread_pool_run()`.
+// The calling thread works on tasks too, so `thread_count` may be 0.
+typedef struct
+{
+    pthread_t *threads;
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;         // Signalled when new tasks are available (or on shutdown)
+    pthread_cond_t work_done;          // Signalled when the last pending task finishes
+    void (*task)(void *arg, int index); // Current task function
+    void *task_arg;                     // Argument shared by all tasks of the current run
+    int next_index;                     // Next task index to hand out
+    int task_count;                     // Number of tasks in the current run
+    int pending;                        // Tasks not finished yet
+    int shutdown;                       // Set to stop the workers
+} ThreadPool;
+
+// What the line editor last drew after the prompt, so `line_refresh()` only redraws what changed
+typedef struct
+{
+    char *shown;     // Text on the screen (allocated, not NUL-terminated)
+    size_t capacity; // Allocated size of `shown`
+    int length;      // Characters of `shown`
+    int cursor;      // Column of the cursor, counted from the end of the prompt
+} LineEditor;
+
+// Shared description of one multi-threaded batch evaluation
+typedef struct
+{
+    const NmriProgram *program;
+    const double *const *inputs;
+    double *out;
+    size_t n;
+    size_t rows_per_task;
+    int failed;
+} BatchJob;
+
+// One argument of an error message recorded by `set_error()`
+typedef struct
+{
+    char type;  // 'd' (int, also for %c), 'u' (unsigned), 'l' (unsigned long) or 's' (string)
+    long value; // The value, or the offset of a string in `ErrorState.text`
+} ErrorArg;
+
+// The last error reported on a thread (see `report_error()` and `set_error()`).
+// Errors of the evaluation path keep their format and arguments: the message is
+// only formatted when someone asks for it (`error_message()`).
+typedef struct
+{
+    NmriError code;                   // NMRI_OK until an error is reported
+    int position;                     // Offset of the error in the expression, or -1 if unknown
+    int pending;                      // Set until the error has been shown (see `show_error()`)
+    int formatted;                    // `message` holds the message
+    const char *format;               // printf-style format of the message (a string literal)
+    ErrorArg args[ERROR_MAX_ARGS];    // Its arguments
+    char text[ERROR_TEXT_SIZE];       // Copies of its string arguments
+    char message[ERROR_MESSAGE_SIZE]; // The message, without the "Error:" prefix
+} ErrorState;
+
+// Input of the stream mode. A regular file is mapped and its lines are used in
+// place (they end with their newline, see `text_length()`); other inputs are
+// read with getline() into one buffer per slot.
+typedef struct
+{
+    FILE *file;          // The input
+    const char *data;    // The mapped file, or NULL if it is read with getline()
+    size_t size;         // Bytes mapped
+    size_t offset;       // Start of the next line in `data`
+    size_t released;     // Bytes at the start of `data` already released (see STREAM_RELEASE_SIZE)
+    size_t tail_offset;  // Start of a last line without a newline (`size` if there is none)...
+    char *tail;          // ...and its NUL-terminated copy, since its text must not end past the mapping
+    char **buffers;      // Line buffers of the getline() input, one per slot
+    size_t *capacities;
+    int slots;
+    char *copy;          // NUL-terminated copy of a mapped line (see `stream_line_copy()`)
+    size_t copy_capacity;
+} StreamInput;
+
+// A run of consecutive pure expression lines evaluated in parallel by the stream mode
+typedef struct
+{
+    const NmriContext *ctx;      // Session the lines are evaluated in (read only)
+    const char **lines;          // Trimmed input lines (ending at a NUL or a newline)
+    double *results;             // Result of each line (NAN on error)
+    const char **failed_stages;  // Failing stage of each line, for the log
+    ErrorState *errors;          // Error of each failed line, shown in input order
+    unsigned long *line_numbers; // Input line number of each line, for the error records
+    int count;                   // Number of lines in the run
+    int lines_per_task;          // Lines handed to one thread pool task
+    ProgramCache *caches;        // One cache per task index (tasks with the same index never overlap)
+    NmriStats *stats;            // Statistics of each task index, added to the session's afterwards
+    char *output;                // STREAM_BUFFER_SIZE bytes the printed results are collected in
+} StreamRun;
+
+// State of the CSV mode (see `run_csv()`)
+typedef struct
+{
+    NmriProgram *program; // The compiled expression
+    int *column_of;       // Column of each variable slot, or -1 for a session variable
+    int *slot_of;         // Variable slot of each column up to the last one used, or -1
+    int column_count;     // Columns up to the last one used
+    double **values;      // CSV_BLOCK_ROWS values per variable slot
+    double *results;      // Result of each row of the block
+    unsigned char *failed; // Set for each row of the block with a bad or missing field
+    char *output;         // STREAM_BUFFER_SIZE bytes the printed results are collected in
+    ThreadPool *pool;     // Workers evaluating the blocks, or NULL
+} CsvRun;
+
+// One client of the server mode (`run_server()`), with a session of its own
+typedef struct
+{
+    int fd;                 // Connected socket (non-blocking)
+    int index;              // Position in the server's client array
+    NmriContext *ctx;       // Session of this client: variables, functions and program cache
+    char *input;            // Received bytes not executed yet
+    size_t input_length;
+    size_t input_capacity;
+    char *output;           // Responses not sent yet, from `output_start`
+    size_t output_start;
+    size_t output_length;
+    size_t output_capacity;
+    FILE *capture;          // Stands in for stdout while a request runs, to collect what commands print
+    char *captured;         // Buffer of `capture` (managed by open_memstream())
+    size_t captured_size;
+    uint32_t events;        // Events the epoll set waits for on `fd`
+    int input_done;         // The client shut down its side: no more requests will come
+    int closing;            // 'exit' was executed: close once the output is sent
+} ServerClient;
+
+// All the state of one calculator session. Independent contexts can be used
+// concurrently from different threads.
+struct NmriContext
+{
+    // Storage for user-defined variables, in definition order
+    Variable *variables;
+    int variable_count;    // Number of currently defined variables
+    int variable_capacity; // Allocated entries in `variables`
+    // Open-addressing hash index over `variables`: each slot holds index + 1, or 0 if empty.
+    // The size is a power of two and the table is kept at most half full.
+    int *variable_table;
+    int variable_table_size;
+
+    // User-defined functions, in definition order (looked up by `find_function()`)
+    UserFunction *functions;
+    int function_count;
+    int function_capacity;
+    unsigned long functions_version; // Incremented on each definition (and math change), so caches drop inlined bodies
+    MappedLibrary *libraries;        // Libraries mapped by `load`, unmapped with the context
+    int library_count;
+
+    // Calculator state
+    double memory;      // Value stored in the 'M' memory register
+    double last_result; // Result of the last successful calculation (used for 'ans')
+
+    // Command history: a ring of HISTORY_SIZE commands (allocated with the first one), oldest first from
+    // `history_start`, whose entries are allocated. See `history_entry()`.
+    char **command_history;
+    int history_start;   // Ring index of the oldest command
+    int history_count;   // Number of commands currently in history
+    char *history_path;  // File the commands are appended to (allocated), or NULL to keep them in memory only
+    FILE *history_file;  // That file open for appending, or NULL until the next command is added
+    off_t history_base;  // Size of the file before this session appended to it (once opened or loaded)
+    int history_loaded;  // Set once the commands of earlier sessions were read from the file
+
+    // Logging state
+    LogWriter *log;             // Writer of the open log file, or NULL if it is not open
+    int logging_enabled;        // Flag: 1 if logging is active, 0 otherwise
+    char *log_path;             // Path to the log file (allocated)
+    unsigned log_flush_records; // Flush policy of the writers (see `LogWriter`)
+    unsigned log_flush_ms;
+    LogWriter *binary_log;      // Writer of the binary log ('log binary <path>'), or NULL
+
+    // Scratch memory for the expression being evaluated, reset after each one
+    Arena arena;
+
+    // Compiled form of recently evaluated expressions
+    ProgramCache cache;
+
+    // Hot-path counters (only updated when built with NMRI_STATS)
+    NmriStats stats;
+
+    // How results are printed (see `execute_line()`)
+    OutputFormat output_format;
+
+    // Arithmetic of the expressions compiled from now on ('math' command, see `nmri_context_set_math()`)
+    NmriMath math;
+
+    // Reactive mode: assignments keep their formula and changes are propagated (see `reactive_assign()`)
+    int reactive;
+    int *reactive_order;   // Variables listed by `reactive_collect()` (room for `reactive_capacity`)
+    int *reactive_stack;   // Its depth-first walk stack (two entries per variable)
+    int reactive_capacity;
+    unsigned reactive_mark; // Mark of the latest walk
+    int reactive_updated;  // Variables the last assignment recomputed, first in `reactive_order`
+
+    // How the errors of failed lines are shown (see `show_error()`)
+    ErrorOutput error_output;
+    unsigned long line_number; // Input line being executed, for the error records
+};
 
-// Calculator state
-double memory = 0.0;      // Value stored in the 'M' memory register
-double last_result = 0.0; // Result of the last successful calculation (used for 'ans')
+/* --- Global Variables --- */
 
-// Command history
-char command_history[HISTORY_SIZE][NMRI_MAX_INPUT];
-int history_count = 0; // Number of commands currently in history
+// Built-in constants and functions, stored at the slot given by `builtin_hash()`
+// so that an identifier is checked against a single name. The hash has no
+// collisions among these names; a new name goes in the slot its hash selects
+// (the tests use every name, so an entry in the wrong slot is caught), and if
+// that slot is taken the multipliers in `builtin_hash()` need to be changed.
+#define BUILTIN_SLOTS 64
+const BuiltinName builtin_names[BUILTIN_SLOTS] = {
+    [0] = {"acos", BUILTIN_FUNCTION, 0.0, FUNC_ACOS},
+    [1] = {"exp", BUILTIN_FUNCTION, 0.0, FUNC_EXP},
+    [2] = {"cos", BUILTIN_FUNCTION, 0.0, FUNC_COS},
+    [5] = {"e", BUILTIN_CONSTANT, M_E, FUNC_INVALID},
+    [8] = {"gamma", BUILTIN_CONSTANT, 0.5772156649015329, FUNC_INVALID}, // Euler-Mascheroni constant
+    [11] = {"Na", BUILTIN_CONSTANT, 6.02214076e23, FUNC_INVALID},         // Avogadro constant (1/mol)
+    [19] = {"inf", BUILTIN_CONSTANT, INFINITY, FUNC_INVALID},
+    [20] = {"h", BUILTIN_CONSTANT, 6.62607015e-34, FUNC_INVALID}, // Planck constant (J s)
+    [21] = {"pi", BUILTIN_CONSTANT, M_PI, FUNC_INVALID},
+    [22] = {"floor", BUILTIN_FUNCTION, 0.0, FUNC_FLOOR},
+    [27] = {"log", BUILTIN_FUNCTION, 0.0, FUNC_LOG},
+    [32] = {"phi", BUILTIN_CONSTANT, 1.6180339887498949, FUNC_INVALID}, // (1 + sqrt(5)) / 2
+    [35] = {"k", BUILTIN_CONSTANT, 1.380649e-23, FUNC_INVALID},         // Boltzmann constant (J/K)
+    [36] = {"sqrt", BUILTIN_FUNCTION, 0.0, FUNC_SQRT},
+    [40] = {"ceil", BUILTIN_FUNCTION, 0.0, FUNC_CEIL},
+    [42] = {"ln", BUILTIN_FUNCTION, 0.0, FUNC_LOG}, // Alias for natural log
+    [45] = {"round", BUILTIN_FUNCTION, 0.0, FUNC_ROUND},
+    [47] = {"G", BUILTIN_CONSTANT, 6.67430e-11, FUNC_INVALID}, // Gravitational constant (m^3 kg^-1 s^-2)
+    [49] = {"tan", BUILTIN_FUNCTION, 0.0, FUNC_TAN},
+    [51] = {"abs", BUILTIN_FUNCTION, 0.0, FUNC_ABS},
+    [56] = {"sin", BUILTIN_FUNCTION, 0.0, FUNC_SIN},
+    [59] = {"c", BUILTIN_CONSTANT, 299792458.0, FUNC_INVALID}, // Speed of light (m/s)
+    [60] = {"asin", BUILTIN_FUNCTION, 0.0, FUNC_ASIN},
+    [61] = {"atan", BUILTIN_FUNCTION, 0.0, FUNC_ATAN},
+    [63] = {"ans", BUILTIN_ANS, 0.0, FUNC_INVALID},
+};
 
-// Logging state
-FILE *log_file = NULL;                                // File pointer for the log file
-int logging_enabled = 0;                              // Flag: 1 if logging is active, 0 otherwise
-char log_path[NMRI_MAX_INPUT] = DEFAULT_LOG_FILENAME; // Path to the log file
+// Powers of ten that are exactly representable as doubles
+const double exact_powers_of_ten[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+#define MAX_EXACT_POWER 22
 
-// Terminal state (for raw mode)
+// Terminal state (for raw mode, colors and input). The terminal is shared by the whole
+// process, so this is the only mutable global: all calculator state lives in NmriContext.
 struct termios orig_termios; // Stores original terminal settings
+int terminal_colors = 1;     // Print ANSI colors (main() clears it when the output is redirected)
+// Bytes read from the terminal and not handled yet: a paste arrives in one read and
+// may hold several lines, the rest of which is kept for the next `readCommand()`
+char terminal_input[TERMINAL_READ_SIZE];
+int terminal_input_start, terminal_input_length;
+
+// Last error reported on this thread, returned by `nmri_last_error()`
+__thread ErrorState last_error;
+
+#ifdef NMRI_STATS
+// Statistics the stages running on this thread are counted in (NULL = not counted).
+// Set by the session entry points with STATS_ENTER, so the stage functions keep
+// their signatures and the parallel stream tasks count into their own copy.
+__thread NmriStats *stats_sink;
+#endif
 
 /* --- Function Prototypes --- */
-int init_logging(void);
-void log_session_start(void);
-void log_session_stop(void);
-void close_logging(void);
-void log_message(const char *format, ...);
-void show_log(int lines);
+void report_error(NmriError code, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void report_warning(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void set_error(NmriError code, int position, const char *format, ...) __attribute__((format(printf, 3, 4)));
+const char *error_message(ErrorState *error);
+void show_error(NmriContext *ctx, const char *line, int interactive);
+int find_identifier(const char *input, const char *name);
+int unbalanced_parenthesis(const char *input);
+void *arena_alloc(Arena *arena, size_t size);
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+LogWriter *log_writer_open(const char *path, unsigned records, unsigned ms);
+void log_writer_close(LogWriter *log);
+int init_logging(NmriContext *ctx);
+void *log_writer_main(void *arg);
+void log_append(LogWriter *log, const char *text, size_t length);
+void log_end_record(LogWriter *log);
+void log_writer_flush(LogWriter *log);
+void log_set_flush_policy(NmriContext *ctx, unsigned records, unsigned ms);
+void log_session_start(NmriContext *ctx);
+void log_session_stop(NmriContext *ctx);
+void close_logging(NmriContext *ctx);
+void log_message(NmriContext *ctx, const char *format, ...);
+off_t find_log_tail(int fd, off_t size, int lines, int *found);
+void show_log(NmriContext *ctx, int lines);
+int binary_log_open(NmriContext *ctx, const char *path);
+void binary_log_close(NmriContext *ctx);
+void binary_log_record(NmriContext *ctx, LineKind kind, int status, NmriError error, double result, const char *line);
+const char *replay_outcome(int failed, NmriError error, char *buffer, size_t size);
+int replay_log(NmriContext *ctx, const char *path);
+int server_listen(const char *path);
+ServerClient *server_client_open(int fd, const char *library_path, NmriMath math);
+void server_client_close(ServerClient *client);
+int server_respond(ServerClient *client, OutputFormat format, int framed, int status, LineKind kind, double result,
+                   const char *text, size_t text_length);
+int server_client_execute(ServerClient *client, OutputFormat format);
+int server_client_flush(ServerClient *client);
+int server_client_event(int epoll_fd, ServerClient *client, uint32_t events, OutputFormat format);
+int run_server(const char *path, const char *library_path, OutputFormat format, NmriMath math);
 OperatorType char_to_op(char c);
-int find_variable(const char *name);
-int set_variable(const char *name, double value);
-void show_help(void);
-void add_to_history(const char *cmd);
-void show_history(void);
-void show_variables(void);
-int tokenize(const char *input, Token *tokens, int max_tokens);
+unsigned hash_name(const char *name);
+int variable_table_probe(const NmriContext *ctx, const char *name, unsigned hash);
+int variable_store_grow(NmriContext *ctx);
+int find_variable(const NmriContext *ctx, const char *name);
+int set_variable(NmriContext *ctx, const char *name, double value);
+void show_help(const NmriContext *ctx);
+const char *history_entry(const NmriContext *ctx, int index);
+int history_push(NmriContext *ctx, char *command);
+int history_set_file(NmriContext *ctx, const char *path);
+void history_load(NmriContext *ctx);
+void add_to_history(NmriContext *ctx, const char *cmd);
+void show_history(NmriContext *ctx);
+void show_variables(const NmriContext *ctx);
+int tokenize(const NmriContext *ctx, Arena *arena, const char *input, Token **tokens);
+int tokenize_program(const NmriContext *ctx, Arena *arena, const char *input, Token **tokens, NmriProgram *program);
+int lex_token(const NmriContext *ctx, const char *input, const char **pos, Token *token, NmriProgram *program);
+double parse_number(const char *p, char **end);
+unsigned builtin_hash(const char *name, size_t length);
+const BuiltinName *find_builtin(const char *name, size_t length);
+int program_add_variable(NmriProgram *program, const char *name);
+double batch_scalar_op(Opcode op, double x, double y);
+double batch_scalar_func(FunctionType func, double x);
+int batch_function_fails(FunctionType func, double x);
+void batch_eval_block(const NmriProgram *program, const double *const *inputs, double *out, size_t len,
+                      BatchValue *stack, double *scratch);
+int batch_eval_rows(const NmriProgram *program, const double *const *inputs, double *out, size_t n);
 int precedence(OperatorType op);
 int is_left_associative(OperatorType op);
-int shunting_yard(Token *tokens, int token_count, Token *output, int max_output);
-double evaluate_postfix(Token *postfix, int count);
-double handle_assignment(const char *var_name, const char *expression);
-int process_command(const char *input);
-double evaluate_expression(const char *input);
+int shunting_yard(Arena *arena, const Token *tokens, int token_count, Token **output);
+void emitter_init(Emitter *em, Arena *arena, NmriMath math);
+int emit_instruction(Emitter *em, Opcode op, int operand);
+int emit_push(Emitter *em, int start, int is_percentage);
+int emit_entry_constant(const Emitter *em, int entry, double *value);
+void emit_remove_instruction(Emitter *em, int index);
+int emit_constant(Emitter *em, double value, int is_percentage);
+int emit_variable(Emitter *em, int slot);
+int emit_operator(Emitter *em, OperatorType op);
+int emit_function(Emitter *em, FunctionType func);
+int emit_finish(Emitter *em, Bytecode *out);
+void emit_percentage_to_fraction(Emitter *em, int entry);
+void report_percentage_warnings(const Bytecode *bc);
+int emit_call(Emitter *em, const NmriContext *ctx, NmriProgram *program, const UserFunction *function);
+int emit_replay(Emitter *em, const uint32_t *code, int count, const double *constants, const InlineCall *call);
+int compile_postfix(const NmriContext *ctx, Arena *arena, const Token *postfix, int count, NmriProgram *program,
+                    Bytecode *out);
+double evaluate_bytecode(const Bytecode *bc, const double *bindings, double *stack);
+double evaluate_bytecode_extended(const Bytecode *bc, const double *bindings);
+double fast_exp(double x);
+double fast_log(double x);
+double fast_sin_kernel(double x, int quadrant);
+double fast_sin(double x);
+double fast_cos(double x);
+FunctionType math_function(FunctionType func, NmriMath math);
+const char *math_name(NmriMath math);
+int math_from_name(const char *name);
+int parser_advance(Parser *ps);
+int parse_operand(Parser *ps);
+int parse_binary(Parser *ps, int min_precedence);
+int parse_group(Parser *ps);
+int parse_call(Parser *ps);
+int parse_expression(const NmriContext *ctx, Arena *arena, const char *input, NmriProgram *program, Bytecode *out);
+int compile_expression(const NmriContext *ctx, Arena *arena, const char *input, NmriProgram *program, Bytecode *out,
+                       const char **failed_stage);
+double handle_assignment(NmriContext *ctx, const char *var_name, const char *expression);
+void reactive_set_mode(NmriContext *ctx, int enabled);
+int dependent_add(Variable *var, int dependent);
+void formula_release(NmriContext *ctx, int index);
+int reactive_collect(NmriContext *ctx, int root);
+int reactive_update(NmriContext *ctx, int root);
+int reactive_set_value(NmriContext *ctx, const char *name, double value);
+double reactive_assign(NmriContext *ctx, const char *name, const char *expression);
+void show_reactive_updates(const NmriContext *ctx, int interactive);
+int process_command(NmriContext *ctx, const char *input);
+int process_trimmed_command(NmriContext *ctx, const char *trimmed_input);
+double evaluate_expression(NmriContext *ctx, const char *input);
 double clean_near_zero(double value, double epsilon);
+int format_number(double value, char *buffer);
+int format_significant(double value, int precision, char *buffer);
+int format_shortest(double value, char *buffer);
+int format_value(OutputFormat format, double value, char *buffer);
+size_t format_result(OutputFormat format, double value, char *out);
+void print_result(const NmriContext *ctx, const char *name, double value, int interactive);
 void disableRawMode(void);
 void enableRawMode(void);
-void readCommand(char *buffer, int max_size);
+int line_reserve(char **buffer, size_t *capacity, size_t needed);
+int terminal_read_byte(void);
+void cursor_move(FILE *out, int from, int to);
+void line_refresh(LineEditor *editor, const char *buffer, int len, int pos, FILE *out);
+int line_replace(char **buffer, size_t *capacity, const char *text, int *len, int *pos);
+int readCommand(NmriContext *ctx, char **buffer, size_t *capacity);
+int execute_line(NmriContext *ctx, const char *line, int interactive);
+int execute_line_value(NmriContext *ctx, const char *line, int interactive, double *result, LineKind *kind);
+int run_stream(NmriContext *ctx, FILE *in, int threads);
+int stream_open(StreamInput *input, FILE *file, int slots);
+const char *stream_next_line(StreamInput *input, int slot);
+const char *stream_line_copy(StreamInput *input, const char *line);
+void stream_close(StreamInput *input);
+int execute_expression_line(NmriContext *ctx, const char *line);
+double compute_expression(const NmriContext *ctx, Arena *arena, ProgramCache *cache, const char *input,
+                          const char **failed_stage);
+int program_compile(const NmriContext *ctx, Arena *arena, const char *expression, const char (*params)[MAX_IDENTIFIER_LEN],
+                    int param_count, NmriProgram **program_out, const char **failed_stage);
+int program_new_variable(NmriProgram *program, const char *name);
+int find_function(const NmriContext *ctx, const char *name);
+int is_identifier(const char *name, size_t size);
+size_t text_length(const char *text);
+size_t identifier_length(const char *p);
+int bytecode_verify(const Bytecode *bc, int var_count);
+void function_release(UserFunction *function);
+int function_store(NmriContext *ctx, UserFunction *function);
+int parse_function_header(const char *line, char *name, char (*params)[MAX_IDENTIFIER_LEN], int *param_count,
+                          const char **body);
+int define_function(NmriContext *ctx, const char *name, const char (*params)[MAX_IDENTIFIER_LEN], int param_count,
+                    const char *body, const char *definition);
+void show_functions(const NmriContext *ctx);
+int write_padded(FILE *out, const void *data, size_t size);
+int save_library(const NmriContext *ctx, const char *path, int *functions, int *variables);
+int load_library(NmriContext *ctx, const char *path, int *functions, int *variables);
+double program_evaluate(const NmriProgram *program, const double *bindings, double *stack);
+int program_is_native(const NmriProgram *program);
+int jit_supported(void);
+void jit_release(JitState *jit);
+#ifdef NMRI_JIT
+void jit_compile(const Bytecode *bc, JitState *jit);
+void jit_emit(JitBuffer *jb, const void *bytes, size_t n);
+int jit_function_can_fail(FunctionType func);
+int jit_generate(JitBuffer *jb, const Bytecode *bc);
+#if defined(__x86_64__)
+void jit_x86_sse(JitBuffer *jb, uint8_t prefix, uint8_t opcode, int reg, int rm);
+void jit_x86_sse_mem(JitBuffer *jb, uint8_t prefix, uint8_t opcode, int reg, int base, int32_t disp);
+void jit_x86_mov_imm64(JitBuffer *jb, int reg, uint64_t value);
+void jit_x86_load_bits(JitBuffer *jb, int xmm, uint64_t bits);
+void jit_x86_jump(JitBuffer *jb, uint8_t condition, size_t target);
+void jit_x86_call(JitBuffer *jb, uintptr_t function, int selector, int first, int args);
+void jit_x86_check_nan(JitBuffer *jb, int reg, size_t bail);
+#elif defined(__aarch64__)
+void jit_a64(JitBuffer *jb, uint32_t instr);
+void jit_a64_mov_imm64(JitBuffer *jb, int reg, uint64_t value);
+int jit_a64_load(JitBuffer *jb, int store, int reg, int base, int index);
+void jit_a64_fp(JitBuffer *jb, uint32_t opcode, int rd, int rn, int rm);
+void jit_a64_branch(JitBuffer *jb, int condition, size_t target);
+void jit_a64_call(JitBuffer *jb, uintptr_t function, int selector, int first, int args);
+void jit_a64_check_nan(JitBuffer *jb, int reg, size_t bail);
+#endif
+#endif
+size_t cache_key(const char *input, char *key);
+int program_cache_get(const NmriContext *ctx, ProgramCache *cache, Arena *arena, const char *input,
+                      NmriProgram **program_out, const char **failed_stage);
+void program_cache_clear(ProgramCache *cache);
+int thread_pool_init(ThreadPool *pool, int threads);
+void thread_pool_run(ThreadPool *pool, void (*task)(void *arg, int index), void *arg, int task_count);
+void thread_pool_destroy(ThreadPool *pool);
+void *thread_pool_worker(void *arg);
+void batch_job_task(void *arg, int index);
+void stream_run_task(void *arg, int index);
+int flush_stream_run(NmriContext *ctx, ThreadPool *pool, StreamRun *run);
+int run_stream_parallel(NmriContext *ctx, StreamInput *input, int threads);
+int batch_run_pool(ThreadPool *pool, const NmriProgram *program, const double *const *inputs, double *out, size_t n);
+const char *csv_field(const char *p, const char *end, const char **field, size_t *length);
+double csv_number(const char *field, size_t length);
+int csv_map_header(const NmriContext *ctx, CsvRun *run, const char *header);
+void csv_parse_row(NmriContext *ctx, CsvRun *run, const char *line, size_t row);
+int csv_flush(NmriContext *ctx, CsvRun *run, size_t rows);
+int csv_evaluate(NmriContext *ctx, CsvRun *run, StreamInput *input);
+int run_csv(NmriContext *ctx, FILE *in, const char *expression, int threads);
+int line_is_pure_expression(const char *line);
+void show_usage(const char *prog);
+void stats_add(NmriStats *stats, StatKind kind, const struct timespec *start);
+void stats_merge(NmriStats *into, const NmriStats *from);
+void show_stats(const NmriContext *ctx, FILE *out);
+#ifdef FOR_TESTING
+long long benchmark_stage(NmriContext *ctx, const char *input, int stage, int repeat);
+#endif
 
-/* --- Logging Functions --- */
+/* --- Session Context --- */
 
 /**
- * @brief Initializes the log file if not already open.
- * @return 1 if logging is ready (file opened successfully), 0 on error.
+ * @brief Creates a new calculator session with no variables besides 'ans' (= 0).
+ * Logging is off and the log file is not opened until needed.
+ * @return The new context (release with `nmri_context_destroy()`), or NULL if out of memory.
  */
-int init_logging(void)
+NmriContext *nmri_context_create(void)
 {
-    if (!log_file)
+    NmriContext *ctx = calloc(1, sizeof(NmriContext));
+    if (!ctx)
+        return NULL;
+    ctx->log_path = strdup(DEFAULT_LOG_FILENAME);
+    ctx->log_flush_records = LOG_FLUSH_RECORDS;
+    ctx->log_flush_ms = LOG_FLUSH_MS;
+    if (!ctx->log_path || set_variable(ctx, "ans", 0.0) < 0)
     {
-        log_file = fopen(log_path, "a"); // Open in append mode
-        if (!log_file)
-        {
-            fprintf(stderr, "%sError:%s Could not open log file '%s'\n", COLOR_RED, COLOR_RESET, log_path);
-            return 0; // Failure
-        }
+        nmri_context_destroy(ctx);
+        return NULL;
     }
-    return 1; // Success
+    return ctx;
 }
 
 /**
- * @brief Logs the start of a calculator session with a timestamp.
+ * @brief Closes the session's log files (if open), unmaps its libraries and releases the context. Accepts NULL.
  */
-void log_session_start(void)
+void nmri_context_destroy(NmriContext *ctx)
 {
-    if (!logging_enabled || !init_logging())
+    if (!ctx)
         return;
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    if (t)
-    { // Check if localtime returned a valid pointer
-        fprintf(log_file, "\n--- SESSION START on %04d-%02d-%02d %02d:%02d:%02d ---\n",
-                t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-                t->tm_hour, t->tm_min, t->tm_sec);
-        fflush(log_file); // Ensure the message is written immediately
-    }
+    close_logging(ctx);
+    binary_log_close(ctx);
+    for (int i = 0; i < ctx->history_count; i++)
+        free((char *)history_entry(ctx, i));
+    free(ctx->command_history);
+    history_set_file(ctx, NULL);
+    reactive_set_mode(ctx, 0);
+    free(ctx->reactive_order);
+    free(ctx->reactive_stack);
+    free(ctx->variables);
+    free(ctx->variable_table);
+    for (int i = 0; i < ctx->function_count; i++)
+        function_release(&ctx->functions[i]);
+    free(ctx->functions);
+    for (int i = 0; i < ctx->library_count; i++)
+        munmap(ctx->libraries[i].data, ctx->libraries[i].size);
+    free(ctx->libraries);
+    free(ctx->log_path);
+    arena_free(&ctx->arena);
+    program_cache_clear(&ctx->cache);
+    free(ctx);
 }
 
 /**
- * @brief Logs the end of a calculator session with a timestamp.
+ * @brief Returns the result of the session's last successful calculation ('ans').
+ */
+double nmri_context_last_result(const NmriContext *ctx) { return ctx->last_result; }
+
+/**
+ * @brief Returns the value of the session's memory register.
  */
-void log_session_stop(void)
+double nmri_context_memory(const NmriContext *ctx) { return ctx->memory; }
+
+/**
+ * @brief Reports how many evaluated expressions were found in (or compiled into)
+ * the session's cache of compiled expressions.
+ * @param hits Receives the number of cache hits (may be NULL).
+ * @param misses Receives the number of cache misses (may be NULL).
+ */
+void nmri_context_cache_stats(const NmriContext *ctx, unsigned long *hits, unsigned long *misses)
 {
-    if (!logging_enabled || !log_file)
-        return;
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    if (t)
-    {
-        fprintf(log_file, "--- SESSION STOP on %04d-%02d-%02d %02d:%02d:%02d ---\n\n",
-                t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-                t->tm_hour, t->tm_min, t->tm_sec);
-        fflush(log_file);
-    }
+    if (hits)
+        *hits = ctx->cache.hits;
+    if (misses)
+        *misses = ctx->cache.misses;
 }
 
 /**
- * @brief Closes the log file if it's open. Logs session stop if logging was enabled.
+ * @brief Evaluates an expression in the session: its variables, functions and 'ans'
+ * are used, the compiled form is cached, and 'ans' is updated on success.
+ * @param expression The expression (assignments and commands are not accepted).
+ * @return The result, or NAN on error (see `nmri_last_error()`).
  */
-void close_logging(void)
+double nmri_context_eval(NmriContext *ctx, const char *expression) { return evaluate_expression(ctx, expression); }
+
+/**
+ * @brief Sets (or creates) a session variable.
+ * @return 0 on success, -1 if the name is not a valid, non-reserved identifier or out of memory.
+ */
+int nmri_context_set_variable(NmriContext *ctx, const char *name, double value)
 {
-    if (log_file)
+    if (!is_identifier(name, MAX_IDENTIFIER_LEN) || find_builtin(name, strlen(name)))
     {
-        if (logging_enabled)
-        {
-            log_session_stop();
-        }
-        fclose(log_file);
-        log_file = NULL;
+        report_error(NMRI_ERROR_INVALID, "Invalid variable name '%.*s'.", MAX_IDENTIFIER_LEN, name);
+        return -1;
     }
+    return reactive_set_value(ctx, name, value) < 0 ? -1 : 0;
 }
 
 /**
- * @brief Logs a formatted message to the log file with a timestamp.
- * Similar to printf. Appends a newline if not present.
- * @param format The format string.
- * @param ...    Variable arguments for the format string.
+ * @brief Assigns an expression to a session variable, like the line "name = expression"
+ * ('ans' is updated). In reactive mode the variable keeps the expression and is
+ * recomputed whenever a variable it reads changes.
+ * @return The new value, or NAN on error (see `nmri_last_error()`).
  */
-void log_message(const char *format, ...)
+double nmri_context_assign(NmriContext *ctx, const char *name, const char *expression)
 {
-    if (!logging_enabled || !init_logging())
-        return;
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    if (!t)
-        return; // Safety check for localtime result
-
-    // Print timestamp
-    fprintf(log_file, "[%04d-%02d-%02d %02d:%02d:%02d] ",
-            t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-            t->tm_hour, t->tm_min, t->tm_sec);
-
-    // Print the formatted message
-    va_list args;
-    va_start(args, format);
-    vfprintf(log_file, format, args);
-    va_end(args);
-
-    // Ensure the log entry ends with a newline
-    size_t format_len = strlen(format);
-    if (format_len == 0 || format[format_len - 1] != '\n')
+    if (!is_identifier(name, MAX_IDENTIFIER_LEN) || find_builtin(name, strlen(name)))
     {
-        fprintf(log_file, "\n");
+        report_error(NMRI_ERROR_INVALID, "Invalid variable name '%.*s'.", MAX_IDENTIFIER_LEN, name);
+        return NAN;
     }
-    fflush(log_file); // Ensure immediate write
+    return handle_assignment(ctx, name, expression);
 }
 
 /**
- * @brief Displays the last 'n' lines from the log file to the console.
- * Note: This implementation reads the file twice for simplicity, which might
- * be inefficient for very large log files.
- * @param lines The maximum number of recent lines to show.
+ * @brief Turns the reactive mode of a session on or off (it starts off). Turning it
+ * off keeps the current values and forgets the formulas.
+ */
+void nmri_context_set_reactive(NmriContext *ctx, int enabled) { reactive_set_mode(ctx, enabled); }
+
+/**
+ * @brief Selects the arithmetic of the expressions the session compiles from now on
+ * (it starts with NMRI_MATH_DEFAULT). Cached compiled expressions are compiled again;
+ * reactive formulas keep the arithmetic they were assigned with.
+ * @return 0 on success, -1 if `math` is not an NmriMath.
  */
-void show_log(int lines)
+int nmri_context_set_math(NmriContext *ctx, NmriMath math)
 {
-    // Ensure log file is available for reading
-    if (log_file)
+    if (math < NMRI_MATH_DEFAULT || math > NMRI_MATH_EXTENDED)
     {
-        fclose(log_file);
-        log_file = NULL; // Will be reopened in 'a' mode later
+        report_error(NMRI_ERROR_INVALID, "Invalid math mode %d.", (int)math);
+        return -1;
     }
-    FILE *read_log = fopen(log_path, "r");
-    if (!read_log)
+    if (ctx->math != math)
     {
-        fprintf(stderr, "%sError:%s Could not open log file '%s' for reading.\n", COLOR_RED, COLOR_RESET, log_path);
-        init_logging(); // Try to reopen in append mode for future logs
-        return;
+        ctx->math = math;
+        ctx->functions_version++; // Cached programs were compiled for the previous one
     }
+    return 0;
+}
 
-    int total_lines = 0;
-    char buffer[MAX_LOG_LINE];
-    // First pass: Count total lines
-    while (fgets(buffer, sizeof(buffer), read_log))
+/**
+ * @brief Reads a session variable.
+ * @param value Receives the value.
+ * @return 0 on success, -1 if the variable is not defined (`value` is left unchanged).
+ */
+int nmri_context_get_variable(const NmriContext *ctx, const char *name, double *value)
+{
+    int index = find_variable(ctx, name);
+    if (index < 0)
     {
-        total_lines++;
+        report_error(NMRI_ERROR_UNKNOWN_NAME, "Unknown identifier '%.*s'.", MAX_IDENTIFIER_LEN, name);
+        return -1;
     }
+    *value = ctx->variables[index].value;
+    return 0;
+}
 
-    // Calculate the starting line number
-    int start_line = (total_lines > lines) ? (total_lines - lines) : 0;
-    // Second pass: Rewind and skip to the starting line
-    rewind(read_log);
-    int current_line = 0;
-    while (current_line < start_line && fgets(buffer, sizeof(buffer), read_log))
-    {
-        current_line++;
-    }
+/* --- Arena Allocator --- */
 
-    // Print the relevant lines with coloring
-    printf("%s%s=== Recent Log Entries (Last %d lines) ===%s\n", COLOR_BOLD, COLOR_CYAN, (total_lines - start_line), COLOR_RESET);
-    while (fgets(buffer, sizeof(buffer), read_log))
-    {
-        char *line_ptr = buffer;
-        // Basic coloring based on content
-        if (strstr(line_ptr, "Error:"))
-            printf("%s%s", COLOR_RED, line_ptr);
-        else if (strstr(line_ptr, "SESSION START") || strstr(line_ptr, "SESSION STOP"))
-            printf("%s%s", COLOR_GREEN, line_ptr);
-        else if (strstr(line_ptr, "User input:"))
-            printf("%s%s", COLOR_YELLOW, line_ptr);
-        else if (strstr(line_ptr, "Result:") || strstr(line_ptr, "assignment:"))
-            printf("%s%s", COLOR_GREEN, line_ptr);
-        else
-            printf("%s%s", COLOR_CYAN, line_ptr); // Default color for other entries
+// Size of the block header, rounded up so the data that follows is aligned
+#define ARENA_HEADER ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_DATA(block) ((char *)(block) + ARENA_HEADER)
 
-        // Ensure reset at the end of each line if not already present
-        if (line_ptr[strlen(line_ptr) - 1] == '\n')
-        {
-            line_ptr[strlen(line_ptr) - 1] = '\0'; // Temporarily remove newline for check
-            if (!strstr(line_ptr, COLOR_RESET))
-                printf("%s", COLOR_RESET);
-            printf("\n"); // Add newline back
-        }
-        else
-        {
-            if (!strstr(line_ptr, COLOR_RESET))
-                printf("%s", COLOR_RESET);
-        }
+/**
+ * @brief Allocates `size` bytes from an arena, adding a new block if the current one is full.
+ * The memory stays valid until the next `arena_reset()` or `arena_free()`.
+ * @return The allocation (aligned to ARENA_ALIGN), or NULL if out of memory.
+ */
+void *arena_alloc(Arena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaBlock *block = arena->block;
+    if (!block || block->size - block->used < size)
+    {
+        // Each new block is at least twice the previous one, so a large expression needs few blocks
+        size_t block_size = block ? block->size * 2 : ARENA_MIN_BLOCK;
+        if (block_size < size)
+            block_size = size;
+        block = malloc(ARENA_HEADER + block_size);
+        if (!block)
+            return NULL;
+        block->next = arena->block;
+        block->size = block_size;
+        block->used = 0;
+        arena->block = block;
     }
-    printf("%s%s=== End of Log ===%s\n", COLOR_BOLD, COLOR_CYAN, COLOR_RESET);
-    fclose(read_log);
-    init_logging(); // Reopen in append mode for subsequent logs
+    arena->last = block->used;
+    block->used += size;
+    return ARENA_DATA(block) + arena->last;
 }
 
-/* --- Core Calculation Logic --- */
-
 /**
- * @brief Converts a character representation of an operator to its OperatorType enum.
- * @param c The character operator (+, -, *, /, ^, %).
- * @return The corresponding OperatorType, or -1 if invalid.
+ * @brief Resizes an arena allocation, in place if it is the latest one and still fits.
+ * Otherwise a new area is allocated and the old contents are copied (the old area
+ * is reclaimed at the next reset).
+ * @param ptr The allocation to grow (may be NULL, then this is `arena_alloc()`).
+ * @param old_size The current size of `ptr`.
+ * @param new_size The size needed.
+ * @return The resized allocation, or NULL if out of memory (`ptr` stays valid).
  */
-OperatorType char_to_op(char c)
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size)
 {
-    switch (c)
+    ArenaBlock *block = arena->block;
+    size_t rounded = (new_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (ptr && block && (char *)ptr == ARENA_DATA(block) + arena->last && block->size - arena->last >= rounded)
     {
-    case '+':
-        return OP_ADD;
-    case '-':
-        return OP_SUB;
-    case '*':
-        return OP_MUL;
-    case '/':
-        return OP_DIV;
-    case '^':
-        return OP_POW;
-    case '%':
-        return OP_MOD;
-    default:
-        return (OperatorType)-1; // Invalid operator character
+        block->used = arena->last + rounded;
+        return ptr;
     }
+    void *grown = arena_alloc(arena, new_size);
+    if (grown && ptr)
+        memcpy(grown, ptr, old_size);
+    return grown;
 }
 
 /**
- * @brief Finds the index of a variable by its name.
- * @param name The name of the variable to find.
- * @return The index in the `variables` array if found, otherwise -1.
+ * @brief Releases every allocation of an arena at once.
+ * If the last expression needed several blocks they are merged into a single
+ * block of the same total size, so the next one fits without allocating.
  */
-int find_variable(const char *name)
+void arena_reset(Arena *arena)
 {
-    for (int i = 0; i < variable_count; i++)
+    ArenaBlock *block = arena->block;
+    if (block && block->next)
     {
-        if (strcmp(variables[i].name, name) == 0)
+        size_t total = 0;
+        while (block)
+        {
+            ArenaBlock *next = block->next;
+            total += block->size;
+            free(block);
+            block = next;
+        }
+        block = malloc(ARENA_HEADER + total);
+        if (block)
         {
-            return i; // Found
+            block->next = NULL;
+            block->size = total;
         }
+        arena->block = block;
     }
-    return -1; // Not found
+    if (block)
+        block->used = 0;
+    arena->last = 0;
 }
 
 /**
- * @brief Sets or updates the value of a variable.
- * If the variable exists, its value is updated. If not, and there's space,
- * a new variable is created.
- * @param name The name of the variable (max MAX_IDENTIFIER_LEN-1 chars).
- * @param value The double value to assign.
- * @return The index of the variable in the `variables` array, or -1 if failed (e.g., array full).
+ * @brief Releases all the memory held by an arena.
  */
-int set_variable(const char *name, double value)
+void arena_free(Arena *arena)
 {
-    if (name == NULL || name[0] == '\0')
-        return -1; // Invalid name
-    int index = find_variable(name);
-    if (index >= 0)
+    while (arena->block)
     {
-        // Variable exists, update its value
-        variables[index].value = value;
-        return index;
+        ArenaBlock *next = arena->block->next;
+        free(arena->block);
+        arena->block = next;
     }
+    arena->last = 0;
+}
+
+/* --- Error Reporting --- */
+
+/**
+ * @brief Reports an error: records it for `nmri_last_error()` and, except in the
+ * library build (-DNMRI_LIBRARY), prints it to stderr. Commands, files and options
+ * report their errors through here, so an embedding program gets a code and a
+ * message and nothing is written to its standard error. Errors of the evaluation
+ * path are recorded with `set_error()` instead.
+ * @param code The kind of error.
+ * @param format printf-style message, without the "Error:" prefix and the newline.
+ */
+void report_error(NmriError code, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+#ifndef NMRI_LIBRARY
+    va_list print_args;
+    va_copy(print_args, args);
+#endif
+    last_error.code = code;
+    last_error.position = -1;
+    last_error.pending = 0; // Printed now (and the library never prints)
+    last_error.formatted = 1;
+    last_error.format = format;
+    int length = vsnprintf(last_error.message, sizeof(last_error.message), format, args);
+    va_end(args);
+#ifndef NMRI_LIBRARY
+    const char *label = code == NMRI_ERROR_INTERNAL ? "Internal Error" : "Error";
+    if (length < (int)sizeof(last_error.message))
+        fprintf(stderr, "%s%s:%s %s\n", COLOR_RED, label, COLOR_RESET, last_error.message);
     else
     {
-        // Variable doesn't exist, add if space is available
-        if (variable_count >= MAX_VARIABLES)
-        {
-            fprintf(stderr, "%sError:%s Maximum number of variables (%d) reached.\n", COLOR_RED, COLOR_RESET, MAX_VARIABLES);
-            return -1; // Variable storage full
-        }
-        // Copy name safely
-        strncpy(variables[variable_count].name, name, MAX_IDENTIFIER_LEN - 1);
-        variables[variable_count].name[MAX_IDENTIFIER_LEN - 1] = '\0'; // Ensure null termination
-        variables[variable_count].value = value;
-        return variable_count++; // Return the index of the newly added variable
+        fprintf(stderr, "%s%s:%s ", COLOR_RED, label, COLOR_RESET);
+        vfprintf(stderr, format, print_args); // Too long for the buffer (e.g. a long path)
+        fputc('\n', stderr);
     }
+    va_end(print_args);
+#else
+    (void)length;
+#endif
 }
 
-/* --- User Interface & Command Handling --- */
-
 /**
- * @brief Displays the help message with available commands, constants, operators, and functions.
+ * @brief Records an error of the evaluation path without formatting or printing it:
+ * the format and its arguments are kept, `error_message()` formats them if the
+ * message is asked for, and the session shows the error of a failed line with
+ * `show_error()`. A failing expression then costs about what a succeeding one does.
+ * Only %d, %c, %u, %lu, %s, %.*s and %% are supported; strings are copied (and
+ * truncated to ERROR_TEXT_SIZE bytes in all) since they may point into the input.
+ * @param code The kind of error.
+ * @param position Offset of the error in the expression, or -1 if unknown.
+ * @param format printf-style message (a string literal), without the "Error:" prefix.
  */
-void show_help(void)
+void set_error(NmriError code, int position, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    last_error.code = code;
+    last_error.position = position;
+    last_error.pending = 1;
+    last_error.formatted = 0;
+    last_error.format = format;
+    size_t used = 0;
+    int count = 0;
+    for (const char *f = strchr(format, '%'); f && count < ERROR_MAX_ARGS; f = strchr(f, '%'))
+    {
+        f++;
+        if (*f == '%')
+        {
+            f++;
+            continue;
+        }
+        size_t precision = sizeof(last_error.text);
+        if (f[0] == '.' && f[1] == '*')
+        {
+            precision = (size_t)va_arg(args, int);
+            f += 2;
+        }
+        ErrorArg *arg = &last_error.args[count++];
+        if (*f == 's')
+        {
+            const char *text = va_arg(args, const char *);
+            size_t room = sizeof(last_error.text) - 1 - used;
+            size_t length = strnlen(text, precision < room ? precision : room);
+            memcpy(last_error.text + used, text, length);
+            last_error.text[used + length] = '\0';
+            arg->type = 's';
+            arg->value = (long)used;
+            used += length < room ? length + 1 : length; // A full buffer ends with the terminator
+        }
+        else if (f[0] == 'l')
+        {
+            arg->type = 'l';
+            arg->value = (long)va_arg(args, unsigned long);
+            f++;
+        }
+        else
+        {
+            arg->type = *f == 'u' ? 'u' : 'd';
+            arg->value = *f == 'u' ? (long)va_arg(args, unsigned) : va_arg(args, int);
+        }
+        f++;
+    }
+    va_end(args);
+}
+
+/**
+ * @brief Returns the message of an error, formatting it the first time if it was
+ * recorded by `set_error()`.
+ * @param error The error (`last_error` or a copy of it).
+ * @return The message, without the "Error:" prefix ("" if there is no error).
+ */
+const char *error_message(ErrorState *error)
+{
+    if (error->code == NMRI_OK)
+        return "";
+    if (error->formatted)
+        return error->message;
+    char *out = error->message;
+    size_t room = sizeof(error->message);
+    int count = 0;
+    for (const char *f = error->format; *f && room > 1;)
+    {
+        if (*f != '%' || f[1] == '%')
+        {
+            *out++ = *f;
+            room--;
+            f += *f == '%' ? 2 : 1;
+            continue;
+        }
+        // Rebuild the conversion without the precision argument (strings are already truncated)
+        char spec[8] = "%";
+        int length = 1;
+        f++;
+        if (f[0] == '.' && f[1] == '*')
+            f += 2;
+        while (*f == 'l' && length < 3)
+            spec[length++] = *f++;
+        spec[length++] = *f ? *f++ : 's';
+        spec[length] = '\0';
+        if (count >= ERROR_MAX_ARGS)
+            break;
+        const ErrorArg *arg = &error->args[count++];
+        int written;
+        if (arg->type == 's')
+            written = snprintf(out, room, spec, error->text + arg->value);
+        else if (arg->type == 'l')
+            written = snprintf(out, room, spec, (unsigned long)arg->value);
+        else if (arg->type == 'u')
+            written = snprintf(out, room, spec, (unsigned)arg->value);
+        else
+            written = snprintf(out, room, spec, (int)arg->value);
+        if (written < 0 || (size_t)written >= room)
+        {
+            out += room - 1;
+            room = 1;
+            break;
+        }
+        out += written;
+        room -= written;
+    }
+    *out = '\0';
+    error->formatted = 1;
+    return error->message;
+}
+
+/**
+ * @brief Shows the error of the line that just failed, as the session's `error_output`
+ * says, unless it was already printed (by `report_error()`) or shown.
+ * @param line The line, for the caret under the error position (may be NULL).
+ * @param interactive 1 to print the line with a caret under the error position (REPL).
+ */
+void show_error(NmriContext *ctx, const char *line, int interactive)
+{
+    if (!last_error.pending)
+        return;
+    last_error.pending = 0;
+    int position = last_error.position;
+    if (ctx->error_output == ERRORS_NONE)
+        return;
+    const char *message = error_message(&last_error);
+    if (ctx->error_output == ERRORS_RECORD)
+    {
+        if (position >= 0)
+            fprintf(stderr, "%lu:%d: %s: %s\n", ctx->line_number, position + 1, nmri_error_name(last_error.code),
+                    message);
+        else
+            fprintf(stderr, "%lu: %s: %s\n", ctx->line_number, nmri_error_name(last_error.code), message);
+        return;
+    }
+    fprintf(stderr, "%s%s:%s %s\n", COLOR_RED, last_error.code == NMRI_ERROR_INTERNAL ? "Internal Error" : "Error",
+            COLOR_RESET, message);
+    int length = line ? (int)text_length(line) : 0;
+    if (interactive && line && position >= 0 && position <= length)
+        fprintf(stderr, "  %.*s\n  %*s%s^%s\n", length, line, position, "", COLOR_RED, COLOR_RESET);
+}
+
+/**
+ * @brief Finds where a name is used as an identifier in an expression.
+ * @return Its offset, or -1 if it does not appear.
+ */
+int find_identifier(const char *input, const char *name)
+{
+    size_t length = strlen(name);
+    for (const char *p = input; *p && *p != '\n';)
+    {
+        if (!isalpha((unsigned char)*p) && *p != '_')
+        {
+            p++;
+            continue;
+        }
+        const char *start = p;
+        while (isalnum((unsigned char)*p) || *p == '_')
+            p++;
+        if ((size_t)(p - start) == length && memcmp(start, name, length) == 0)
+            return (int)(start - input);
+    }
+    return -1;
+}
+
+/**
+ * @brief Finds the parenthesis that is not matched in an expression.
+ * @return The offset of the first ')' closing nothing, else of the last '(' left
+ * open, or -1 if the parentheses are balanced.
+ */
+int unbalanced_parenthesis(const char *input)
+{
+    int depth = 0;
+    const char *p;
+    for (p = input; *p && *p != '\n'; p++)
+    {
+        if (*p == '(')
+            depth++;
+        else if (*p == ')' && --depth < 0)
+            return (int)(p - input);
+    }
+    if (depth == 0)
+        return -1;
+    // Going backwards, the first '(' not closed by a ')' after it is left open
+    for (depth = 0; p > input;)
+    {
+        p--;
+        if (*p == ')')
+            depth++;
+        else if (*p == '(' && depth-- == 0)
+            return (int)(p - input);
+    }
+    return -1;
+}
+
+/**
+ * @brief Prints a warning to stderr (nothing in the library build). Warnings are not errors:
+ * `nmri_last_error()` does not change.
+ */
+void report_warning(const char *format, ...)
+{
+#ifndef NMRI_LIBRARY
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "%sWarning:%s ", COLOR_YELLOW, COLOR_RESET);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+#else
+    (void)format;
+#endif
+}
+
+/**
+ * @brief Returns the last error reported on the calling thread. Calls that succeed
+ * leave it unchanged (like errno); use `nmri_clear_error()` first to tell a failure
+ * from a result that is NaN.
+ * @param message If not NULL, set to the message (valid until the next error on this thread).
+ * @return The error code, or NMRI_OK if no error was reported since the last `nmri_clear_error()`.
+ */
+NmriError nmri_last_error(const char **message)
+{
+    if (message)
+        *message = error_message(&last_error);
+    return last_error.code;
+}
+
+/**
+ * @brief Returns where the last error reported on the calling thread is in the
+ * expression that failed (syntax errors and unknown names have a position).
+ * @return The offset in the expression, or -1 if the error has no position.
+ */
+int nmri_last_error_position(void) { return last_error.code == NMRI_OK ? -1 : last_error.position; }
+
+/**
+ * @brief Forgets the last error reported on the calling thread.
+ */
+void nmri_clear_error(void)
+{
+    last_error.code = NMRI_OK;
+    last_error.position = -1;
+    last_error.pending = 0;
+    last_error.formatted = 1;
+    last_error.message[0] = '\0';
+}
+
+/**
+ * @brief Returns the short name of an error code, as printed in the error records
+ * of the stream mode (e.g. "division-by-zero").
+ */
+const char *nmri_error_name(NmriError code)
+{
+    static const char *names[] = {"ok",    "syntax",    "unknown-name", "division-by-zero", "domain",  "arguments",
+                                  "limit", "no-memory", "invalid",      "io",               "internal"};
+    return (unsigned)code < sizeof(names) / sizeof(names[0]) ? names[code] : "unknown";
+}
+
+/* --- Logging Functions --- */
+
+/**
+ * @brief Opens (for appending) a log file and starts the thread that writes it.
+ * @param path The file.
+ * @param records, ms Initial flush policy (see `log_set_flush_policy()`).
+ * @return The writer (stop it with `log_writer_close()`), or NULL with an error printed.
+ */
+LogWriter *log_writer_open(const char *path, unsigned records, unsigned ms)
+{
+    LogWriter *log = calloc(1, sizeof(LogWriter));
+    char *ring = malloc(LOG_RING_SIZE);
+    FILE *file = log && ring ? fopen(path, "a") : NULL; // Open in append mode
+    if (!file)
+    {
+        report_error(NMRI_ERROR_IO, "Could not open log file '%s'", path);
+        free(ring);
+        free(log);
+        return NULL; // Failure
+    }
+    log->ring = ring;
+    log->file = file;
+    log->flush_records = records;
+    log->flush_ms = ms;
+    log->stamp_second = (time_t)-1;
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->wake, NULL);
+    pthread_cond_init(&log->written, NULL);
+    // The writer takes no signals, so they reach the thread waiting for them (the server's signalfd)
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    int started = pthread_create(&log->thread, NULL, log_writer_main, log) == 0;
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (!started)
+    {
+        report_error(NMRI_ERROR_IO, "Could not start the log writer for '%s'", path);
+        pthread_cond_destroy(&log->written);
+        pthread_cond_destroy(&log->wake);
+        pthread_mutex_destroy(&log->lock);
+        fclose(file);
+        free(ring);
+        free(log);
+        return NULL;
+    }
+    return log;
+}
+
+/**
+ * @brief Writes everything still in the ring, stops the writer thread and closes the file.
+ */
+void log_writer_close(LogWriter *log)
+{
+    pthread_mutex_lock(&log->lock);
+    log->stop = 1;
+    pthread_cond_signal(&log->wake);
+    pthread_mutex_unlock(&log->lock);
+    pthread_join(log->thread, NULL);
+    pthread_cond_destroy(&log->written);
+    pthread_cond_destroy(&log->wake);
+    pthread_mutex_destroy(&log->lock);
+    fclose(log->file);
+    free(log->ring);
+    free(log);
+}
+
+/**
+ * @brief Opens the log file and starts its writer thread, if not already done.
+ * @return 1 if logging is ready (file opened successfully), 0 on error.
+ */
+int init_logging(NmriContext *ctx)
+{
+    if (!ctx->log)
+        ctx->log = log_writer_open(ctx->log_path, ctx->log_flush_records, ctx->log_flush_ms);
+    return ctx->log != NULL;
+}
+
+/**
+ * @brief Body of the log writer thread: sleeps until the flush policy (or a
+ * full ring, `log_writer_flush()` or shutdown) calls for a write, then writes every
+ * complete byte in the ring with at most two `fwrite()` calls and one `fflush()`.
+ */
+void *log_writer_main(void *arg)
+{
+    LogWriter *log = arg;
+    pthread_mutex_lock(&log->lock);
+    for (;;)
+    {
+        if (!log->urgent && !log->stop)
+        {
+            if (log->flush_ms)
+            {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += log->flush_ms / 1000;
+                deadline.tv_nsec += (long)(log->flush_ms % 1000) * 1000000L;
+                if (deadline.tv_nsec >= 1000000000L)
+                {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&log->wake, &log->lock, &deadline);
+            }
+            else
+                pthread_cond_wait(&log->wake, &log->lock);
+        }
+        int stop = log->stop;
+        log->urgent = 0;
+        pthread_mutex_unlock(&log->lock);
+
+        size_t head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+        size_t tail = log->tail;
+        if (head != tail)
+        {
+            size_t start = tail & (LOG_RING_SIZE - 1), length = head - tail;
+            size_t first = length < LOG_RING_SIZE - start ? length : LOG_RING_SIZE - start;
+            fwrite(log->ring + start, 1, first, log->file);
+            fwrite(log->ring, 1, length - first, log->file);
+            fflush(log->file);
+        }
+
+        pthread_mutex_lock(&log->lock);
+        __atomic_store_n(&log->tail, head, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&log->written);
+        if (stop && __atomic_load_n(&log->head, __ATOMIC_ACQUIRE) == head)
+            break;
+    }
+    pthread_mutex_unlock(&log->lock);
+    return NULL;
+}
+
+/**
+ * @brief Appends bytes of a record to the ring, waiting for the writer when it is full.
+ * Only the session thread calls this.
+ */
+void log_append(LogWriter *log, const char *text, size_t length)
+{
+    size_t head = log->staged;
+    while (length > 0)
+    {
+        size_t tail = __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE);
+        size_t space = LOG_RING_SIZE - (head - tail);
+        if (space == 0)
+        {
+            // Full: wait for the writer to write the whole records before this one.
+            // Only a record longer than the ring has to be published in pieces.
+            if (tail == __atomic_load_n(&log->head, __ATOMIC_RELAXED))
+                __atomic_store_n(&log->head, head, __ATOMIC_RELEASE);
+            pthread_mutex_lock(&log->lock);
+            log->urgent = 1;
+            pthread_cond_signal(&log->wake);
+            while (__atomic_load_n(&log->tail, __ATOMIC_ACQUIRE) == head - LOG_RING_SIZE)
+                pthread_cond_wait(&log->written, &log->lock);
+            pthread_mutex_unlock(&log->lock);
+            continue;
+        }
+        size_t start = head & (LOG_RING_SIZE - 1);
+        size_t chunk = length < space ? length : space;
+        if (chunk > LOG_RING_SIZE - start)
+            chunk = LOG_RING_SIZE - start;
+        memcpy(log->ring + start, text, chunk);
+        head += chunk;
+        text += chunk;
+        length -= chunk;
+    }
+    log->staged = head; // Published by `log_end_record()`: the writer only sees whole records, unless one is longer than the ring
+}
+
+/**
+ * @brief Makes the record appended so far visible to the writer and wakes it
+ * when the number of records reaches the flush policy's limit.
+ */
+void log_end_record(LogWriter *log)
+{
+    __atomic_store_n(&log->head, log->staged, __ATOMIC_RELEASE);
+    if (log->flush_records && ++log->records >= log->flush_records)
+    {
+        log->records = 0;
+        pthread_mutex_lock(&log->lock);
+        log->urgent = 1;
+        pthread_cond_signal(&log->wake);
+        pthread_mutex_unlock(&log->lock);
+    }
+}
+
+/**
+ * @brief Waits until every record appended so far has been written to the file.
+ */
+void log_writer_flush(LogWriter *log)
+{
+    pthread_mutex_lock(&log->lock);
+    log->urgent = 1;
+    pthread_cond_signal(&log->wake);
+    while (__atomic_load_n(&log->tail, __ATOMIC_ACQUIRE) != log->head)
+        pthread_cond_wait(&log->written, &log->lock);
+    pthread_mutex_unlock(&log->lock);
+}
+
+/**
+ * @brief Sets when the log writer writes: after `records` records and at least
+ * every `ms` milliseconds (0 turns a limit off). Records are always written when
+ * the ring is full, before `log show` and when the log is closed.
+ */
+void log_set_flush_policy(NmriContext *ctx, unsigned records, unsigned ms)
+{
+    ctx->log_flush_records = records;
+    ctx->log_flush_ms = ms;
+    LogWriter *writers[] = {ctx->log, ctx->binary_log};
+    for (int i = 0; i < 2; i++)
+    {
+        LogWriter *log = writers[i];
+        if (!log)
+            continue;
+        pthread_mutex_lock(&log->lock);
+        log->flush_records = records;
+        log->flush_ms = ms;
+        log->urgent = 1; // Wake the writer so the new interval applies from now
+        pthread_cond_signal(&log->wake);
+        pthread_mutex_unlock(&log->lock);
+    }
+}
+
+/**
+ * @brief Logs the start of a calculator session with a timestamp.
+ */
+void log_session_start(NmriContext *ctx)
+{
+    if (!ctx->logging_enabled || !init_logging(ctx))
+        return;
+    time_t now = time(NULL);
+    struct tm t;
+    if (localtime_r(&now, &t))
+    { // Check if localtime_r() could convert the time
+        char line[64];
+        int length = snprintf(line, sizeof(line), "\n--- SESSION START on %04d-%02d-%02d %02d:%02d:%02d ---\n",
+                              t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec);
+        log_append(ctx->log, line, (size_t)length);
+        log_end_record(ctx->log);
+    }
+}
+
+/**
+ * @brief Logs the end of a calculator session with a timestamp.
+ */
+void log_session_stop(NmriContext *ctx)
+{
+    if (!ctx->logging_enabled || !ctx->log)
+        return;
+    time_t now = time(NULL);
+    struct tm t;
+    if (localtime_r(&now, &t))
+    {
+        char line[64];
+        int length = snprintf(line, sizeof(line), "--- SESSION STOP on %04d-%02d-%02d %02d:%02d:%02d ---\n\n",
+                              t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec);
+        log_append(ctx->log, line, (size_t)length);
+        log_end_record(ctx->log);
+    }
+}
+
+/**
+ * @brief Closes the log file if it's open. Logs session stop if logging was enabled.
+ * Stops the writer thread once everything logged has been written.
+ */
+void close_logging(NmriContext *ctx)
+{
+    LogWriter *log = ctx->log;
+    if (log)
+    {
+        if (ctx->logging_enabled)
+        {
+            log_session_stop(ctx);
+        }
+        log_writer_close(log);
+        ctx->log = NULL;
+    }
+}
+
+/**
+ * @brief Logs a formatted message to the log file with a timestamp.
+ * Similar to printf. Appends a newline if not present. The record goes to the
+ * writer thread's ring, so the caller never waits for the file unless the ring is full.
+ * @param format The format string.
+ * @param ...    Variable arguments for the format string.
+ */
+void log_message(NmriContext *ctx, const char *format, ...)
+{
+    if (!ctx->logging_enabled || (!ctx->log && !init_logging(ctx)))
+        return;
+    LogWriter *log = ctx->log;
+    STATS_BEGIN(STAT_LOG);
+
+    // The timestamp only changes once per second
+    time_t now = time(NULL);
+    if (now != log->stamp_second)
+    {
+        struct tm t;
+        if (!localtime_r(&now, &t))
+        {
+            STATS_END_TO(&ctx->stats, STAT_LOG);
+            return; // Safety check for localtime_r() result
+        }
+        log->stamp_length = (size_t)snprintf(log->stamp, sizeof(log->stamp), "[%04d-%02d-%02d %02d:%02d:%02d] ",
+                                             t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
+                                             t.tm_hour, t.tm_min, t.tm_sec);
+        log->stamp_second = now;
+    }
+
+    // Format the message, on the heap if it does not fit a log line
+    char line[MAX_LOG_LINE];
+    char *text = line;
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length < 0)
+    {
+        STATS_END_TO(&ctx->stats, STAT_LOG);
+        return;
+    }
+    if ((size_t)length >= sizeof(line))
+    {
+        text = malloc((size_t)length + 1);
+        if (!text)
+        {
+            STATS_END_TO(&ctx->stats, STAT_LOG);
+            return;
+        }
+        va_start(args, format);
+        vsnprintf(text, (size_t)length + 1, format, args);
+        va_end(args);
+    }
+
+    log_append(log, log->stamp, log->stamp_length);
+    log_append(log, text, (size_t)length);
+    // Ensure the log entry ends with a newline
+    if (length == 0 || text[length - 1] != '\n')
+        log_append(log, "\n", 1);
+    log_end_record(log);
+    if (text != line)
+        free(text);
+    STATS_END_TO(&ctx->stats, STAT_LOG);
+}
+
+/**
+ * @brief Finds where the last `lines` lines of a file start by reading it
+ * backwards in blocks from the end, so the cost depends on the length of those
+ * lines and not on the size of the file. A final line without '\n' counts as a line.
+ * @param fd The file, open for reading.
+ * @param size Its size in bytes.
+ * @param lines The number of lines wanted.
+ * @param found Receives the number of lines starting at the returned offset (at most `lines`).
+ * @return The offset of the first of those lines, or -1 on a read error.
+ */
+off_t find_log_tail(int fd, off_t size, int lines, int *found)
+{
+    char block[LOG_TAIL_BLOCK];
+    off_t end = size;
+    int newlines = 0;
+    *found = 0;
+    if (size == 0 || lines <= 0)
+        return size;
+    while (end > 0)
+    {
+        off_t start = end > LOG_TAIL_BLOCK ? end - LOG_TAIL_BLOCK : 0;
+        size_t length = (size_t)(end - start);
+        if (pread(fd, block, length, start) != (ssize_t)length)
+            return -1;
+        for (size_t i = length; i-- > 0;)
+        {
+            if (block[i] != '\n' || start + (off_t)i == size - 1)
+                continue; // Only a newline ending a line before the last one starts a line
+            if (++newlines == lines)
+            {
+                *found = lines;
+                return start + (off_t)i + 1;
+            }
+        }
+        end = start;
+    }
+    *found = newlines + 1; // The whole file, whose first line has no newline before it
+    return 0;
+}
+
+/**
+ * @brief Displays the last 'n' lines from the log file to the console.
+ * Only the end of the file is read (see `find_log_tail()`), so this is fast
+ * however long the log has grown.
+ * @param lines The maximum number of recent lines to show.
+ */
+void show_log(NmriContext *ctx, int lines)
+{
+    // Make sure everything logged so far is in the file
+    if (ctx->log)
+        log_writer_flush(ctx->log);
+    int fd = open(ctx->log_path, O_RDONLY);
+    FILE *read_log = fd >= 0 ? fdopen(fd, "r") : NULL;
+    struct stat info;
+    off_t start = -1;
+    int found = 0;
+    if (read_log && fstat(fd, &info) == 0)
+        start = find_log_tail(fd, info.st_size, lines, &found);
+    if (start < 0 || fseeko(read_log, start, SEEK_SET) != 0)
+    {
+        report_error(NMRI_ERROR_IO, "Could not open log file '%s' for reading.", ctx->log_path);
+        if (read_log)
+            fclose(read_log);
+        else if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    // Print the relevant lines with coloring
+    printf("%s%s=== Recent Log Entries (Last %d lines) ===%s\n", COLOR_BOLD, COLOR_CYAN, found, COLOR_RESET);
+    char *line_ptr = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line_ptr, &capacity, read_log)) != -1)
+    {
+        if (length > 0 && line_ptr[length - 1] == '\n')
+            line_ptr[length - 1] = '\0';
+        // Basic coloring based on content
+        const char *color = COLOR_CYAN; // Default color for other entries
+        if (strstr(line_ptr, "Error:"))
+            color = COLOR_RED;
+        else if (strstr(line_ptr, "SESSION START") || strstr(line_ptr, "SESSION STOP"))
+            color = COLOR_GREEN;
+        else if (strstr(line_ptr, "User input:"))
+            color = COLOR_YELLOW;
+        else if (strstr(line_ptr, "Result:") || strstr(line_ptr, "assignment:"))
+            color = COLOR_GREEN;
+        printf("%s%s%s\n", color, line_ptr, COLOR_RESET);
+    }
+    free(line_ptr);
+    printf("%s%s=== End of Log ===%s\n", COLOR_BOLD, COLOR_CYAN, COLOR_RESET);
+    fclose(read_log);
+}
+
+/**
+ * @brief Starts recording every executed line to a binary log, through its own writer thread.
+ * The file starts with BINARY_LOG_MAGIC, followed by one record per line:
+ *   uint32 size     bytes after this field (BINARY_LOG_HEADER - 4 + length of the line)
+ *   uint8  kind     a LineKind
+ *   uint8  status   0 if the line succeeded, 1 if it failed
+ *   uint16 error    the NmriError of a failed line, NMRI_OK if it succeeded (logs
+ *                   written before the code was recorded have NMRI_OK for every line)
+ *   int64  time     microseconds since the Unix epoch
+ *   double result   the exact result (NAN for commands and failed lines)
+ *   char   line[]   the line as executed, without a terminating NUL
+ * Numbers are in the byte order of the machine that wrote the log. An existing
+ * binary log is appended to.
+ * @return 1 on success, 0 on error (printed).
+ */
+int binary_log_open(NmriContext *ctx, const char *path)
+{
+    // Never append records to something that is not a binary log
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    int empty = 1;
+    if (fd >= 0)
+    {
+        char magic[sizeof(BINARY_LOG_MAGIC) - 1];
+        empty = fstat(fd, &info) == 0 && info.st_size == 0;
+        int valid = empty || (pread(fd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic) &&
+                              memcmp(magic, BINARY_LOG_MAGIC, sizeof(magic)) == 0);
+        close(fd);
+        if (!valid)
+        {
+            report_error(NMRI_ERROR_IO, "'%s' exists and is not a binary log.", path);
+            return 0;
+        }
+    }
+    LogWriter *log = log_writer_open(path, ctx->log_flush_records, ctx->log_flush_ms);
+    if (!log)
+        return 0;
+    binary_log_close(ctx);
+    ctx->binary_log = log;
+    if (empty)
+    {
+        log_append(log, BINARY_LOG_MAGIC, sizeof(BINARY_LOG_MAGIC) - 1);
+        log_end_record(log);
+    }
+    return 1;
+}
+
+/**
+ * @brief Stops recording the binary log, once everything recorded is written.
+ */
+void binary_log_close(NmriContext *ctx)
+{
+    if (ctx->binary_log)
+    {
+        log_writer_close(ctx->binary_log);
+        ctx->binary_log = NULL;
+    }
+}
+
+/**
+ * @brief Appends a record for an executed line to the binary log (see `binary_log_open()`).
+ * @param status 0 if the line succeeded, 1 if it failed.
+ * @param error The error of a failed line (ignored if it succeeded).
+ * @param result The result (NAN for commands and failed lines).
+ */
+void binary_log_record(NmriContext *ctx, LineKind kind, int status, NmriError error, double result, const char *line)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    size_t length = text_length(line);
+    uint32_t size = (uint32_t)(BINARY_LOG_HEADER - 4 + length);
+    int64_t time_us = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    unsigned char header[BINARY_LOG_HEADER] = {0};
+    memcpy(header, &size, 4);
+    header[4] = (unsigned char)kind;
+    header[5] = (unsigned char)(status != 0);
+    uint16_t code = status != 0 ? (uint16_t)error : (uint16_t)NMRI_OK;
+    memcpy(header + 6, &code, 2);
+    memcpy(header + 8, &time_us, 8);
+    memcpy(header + 16, &result, 8);
+    log_append(ctx->binary_log, (const char *)header, sizeof(header));
+    log_append(ctx->binary_log, line, length);
+    log_end_record(ctx->binary_log);
+}
+
+/* --- Core Calculation Logic --- */
+
+/**
+ * @brief Converts a character representation of an operator to its OperatorType enum.
+ * @param c The character operator (+, -, *, /, ^, %).
+ * @return The corresponding OperatorType, or -1 if invalid.
+ */
+OperatorType char_to_op(char c)
+{
+    switch (c)
+    {
+    case '+':
+        return OP_ADD;
+    case '-':
+        return OP_SUB;
+    case '*':
+        return OP_MUL;
+    case '/':
+        return OP_DIV;
+    case '^':
+        return OP_POW;
+    case '%':
+        return OP_MOD;
+    default:
+        return (OperatorType)-1; // Invalid operator character
+    }
+}
+
+/**
+ * @brief Hashes an identifier (32-bit FNV-1a).
+ * @param name The NUL-terminated identifier.
+ * @return The hash value.
+ */
+unsigned hash_name(const char *name)
+{
+    unsigned hash = 2166136261u;
+    while (*name)
+    {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Looks up a name in the variable hash index using linear probing.
+ * The table is kept at most half full, so the probe terminates.
+ * @param name The variable name.
+ * @param hash The value of `hash_name(name)`.
+ * @return The table slot holding the variable, or the empty slot where it would be inserted.
+ */
+int variable_table_probe(const NmriContext *ctx, const char *name, unsigned hash)
+{
+    int mask = ctx->variable_table_size - 1;
+    int slot = hash & mask;
+    while (ctx->variable_table[slot])
+    {
+        const Variable *var = &ctx->variables[ctx->variable_table[slot] - 1];
+        if (var->hash == hash && strcmp(var->name, name) == 0)
+            break; // Found
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/**
+ * @brief Doubles the variable store and rebuilds its hash index.
+ * @return 0 on success, -1 if out of memory (the store is left unchanged).
+ */
+int variable_store_grow(NmriContext *ctx)
+{
+    int capacity = ctx->variable_capacity ? ctx->variable_capacity * 2 : INITIAL_VARIABLES;
+    Variable *variables = realloc(ctx->variables, capacity * sizeof(Variable));
+    if (!variables)
+        return -1;
+    ctx->variables = variables;
+    int *table = calloc(capacity * 2, sizeof(int));
+    if (!table)
+        return -1; // The larger array is kept, the old index still fits it
+    ctx->variable_capacity = capacity;
+    free(ctx->variable_table);
+    ctx->variable_table = table;
+    ctx->variable_table_size = capacity * 2;
+    for (int i = 0; i < ctx->variable_count; i++)
+        ctx->variable_table[variable_table_probe(ctx, ctx->variables[i].name, ctx->variables[i].hash)] = i + 1;
+    return 0;
+}
+
+/**
+ * @brief Finds the index of a variable by its name.
+ * @param name The name of the variable to find.
+ * @return The index in the `variables` array if found, otherwise -1.
+ */
+int find_variable(const NmriContext *ctx, const char *name)
+{
+    if (ctx->variable_count == 0)
+        return -1;
+    return ctx->variable_table[variable_table_probe(ctx, name, hash_name(name))] - 1;
+}
+
+/**
+ * @brief Sets or updates the value of a variable.
+ * If the variable exists, its value is updated. If not, a new variable is
+ * created (the store grows as needed).
+ * @param name The name of the variable (max MAX_IDENTIFIER_LEN-1 chars).
+ * @param value The double value to assign.
+ * @return The index of the variable in the `variables` array, or -1 if failed (e.g., out of memory).
+ */
+int set_variable(NmriContext *ctx, const char *name, double value)
+{
+    if (name == NULL || name[0] == '\0')
+        return -1; // Invalid name
+    unsigned hash = hash_name(name);
+    int slot = ctx->variable_count > 0 ? variable_table_probe(ctx, name, hash) : 0;
+    int index = ctx->variable_count > 0 ? ctx->variable_table[slot] - 1 : -1;
+    if (index >= 0)
+    {
+        // Variable exists, update its value
+        ctx->variables[index].value = value;
+        return index;
+    }
+    else
+    {
+        // Variable doesn't exist, make room for it
+        if (ctx->variable_count >= ctx->variable_capacity)
+        {
+            if (variable_store_grow(ctx) < 0)
+            {
+                report_error(NMRI_ERROR_NO_MEMORY, "Out of memory while defining variable '%s'.", name);
+                return -1;
+            }
+            slot = variable_table_probe(ctx, name, hash); // The index was rebuilt
+        }
+        Variable *var = &ctx->variables[ctx->variable_count];
+        // Copy name safely
+        strncpy(var->name, name, MAX_IDENTIFIER_LEN - 1);
+        var->name[MAX_IDENTIFIER_LEN - 1] = '\0'; // Ensure null termination
+        var->hash = hash_name(var->name);
+        var->value = value;
+        var->formula = NULL;
+        var->dependents = NULL;
+        var->dependent_count = var->dependent_capacity = 0;
+        var->mark = 0;
+        if (var->hash != hash) // Name was truncated: find its own slot
+            slot = variable_table_probe(ctx, var->name, var->hash);
+        ctx->variable_table[slot] = ctx->variable_count + 1;
+        return ctx->variable_count++; // Return the index of the newly added variable
+    }
+}
+
+/* --- User Interface & Command Handling --- */
+
+/**
+ * @brief Displays the help message with available commands, constants, operators, and functions.
+ */
+void show_help(const NmriContext *ctx)
 {
     printf("\n%s%sNMRI Calculator Help%s\n\n", COLOR_BOLD, COLOR_YELLOW, COLOR_RESET);
     printf("%s%sCommands:%s\n", COLOR_BOLD, COLOR_CYAN, COLOR_RESET);
@@ -502,11 +2327,22 @@ void show_help(void)
     printf("  %sm-%s        Subtract the last result ('ans') from memory.\n", COLOR_GREEN, COLOR_RESET);
     printf("  %smr%s        Recall the value from memory (sets 'ans').\n", COLOR_GREEN, COLOR_RESET);
     printf("  %smc%s        Clear the memory (set to 0).\n", COLOR_GREEN, COLOR_RESET);
+    printf("  %sfuncs%s     List the user-defined functions (alias: functions).\n", COLOR_GREEN, COLOR_RESET);
+    printf("  %ssave <f>%s  Save the functions (compiled) and variables to the library <f>.\n", COLOR_GREEN, COLOR_RESET);
+    printf("  %sload <f>%s  Load a library saved with 'save' (also: nmri --library <f>).\n", COLOR_GREEN, COLOR_RESET);
+    printf("  %sstats%s     Show the hot-path counters and timings (`stats reset` clears them).\n", COLOR_GREEN, COLOR_RESET);
     printf("  %sstore <n>%s Store the last result ('ans') in variable <n> (e.g., store my_var).\n", COLOR_GREEN, COLOR_RESET);
-    printf("  %slog on%s    Enable logging to '%s'.\n", COLOR_GREEN, COLOR_RESET, log_path);
+    printf("  %sreactive on|off%s  Keep the expressions of assignments and recompute the variables\n", COLOR_GREEN, COLOR_RESET);
+    printf("            depending on a variable when it changes, like spreadsheet cells.\n");
+    printf("  %smath default|fast|extended%s  Evaluate with doubles and libm (the default), with faster\n", COLOR_GREEN, COLOR_RESET);
+    printf("            sin/cos/exp/log (within 2 ulp), or with long double intermediate results.\n");
+    printf("  %slog on%s    Enable logging to '%s'.\n", COLOR_GREEN, COLOR_RESET, ctx->log_path);
     printf("  %slog off%s   Disable logging.\n", COLOR_GREEN, COLOR_RESET);
-    printf("  %slog show%s  Show the last %d lines from the log file.\n", COLOR_GREEN, COLOR_RESET, HISTORY_SIZE);
-    printf("  %slog file%s  Show the current log file path.\n\n", COLOR_GREEN, COLOR_RESET);
+    printf("  %slog show [n]%s  Show the last n (default %d) lines from the log file.\n", COLOR_GREEN, COLOR_RESET, LOG_SHOW_LINES);
+    printf("  %slog file%s  Show the current log file path.\n", COLOR_GREEN, COLOR_RESET);
+    printf("  %slog flush <n> <ms>%s  Write the log after <n> records and at least every <ms> ms.\n", COLOR_GREEN, COLOR_RESET);
+    printf("  %slog binary <path>%s  Record every line and its exact result to a binary log (for --replay).\n", COLOR_GREEN, COLOR_RESET);
+    printf("  %slog binary off%s     Stop recording the binary log.\n\n", COLOR_GREEN, COLOR_RESET);
     printf("%s%sConstants:%s\n", COLOR_BOLD, COLOR_CYAN, COLOR_RESET);
     printf("  %spi%s        Pi (π ≈ 3.14159...)\n", COLOR_MAGENTA, COLOR_RESET);
     printf("  %se%s         Euler's number (e ≈ 2.71828...)\n", COLOR_MAGENTA, COLOR_RESET);
@@ -537,7 +2373,8 @@ void show_help(void)
     printf("  %sfloor(x)%s                 Floor (round down).\n", COLOR_CYAN, COLOR_RESET);
     printf("  %sceil(x)%s                  Ceiling (round up).\n", COLOR_CYAN, COLOR_RESET);
     printf("  %sround(x)%s                 Round to nearest integer.\n", COLOR_CYAN, COLOR_RESET);
-    printf("  %sArguments can be percentages: e.g., sin(30%%) == sin(0.3)%s\n\n", COLOR_DIM, COLOR_RESET);
+    printf("  %sArguments can be percentages: e.g., sin(30%%) == sin(0.3)%s\n", COLOR_DIM, COLOR_RESET);
+    printf("  %sf(x, y) = x^2 + y%s         Define a function (called as f(2, 3)).\n\n", COLOR_CYAN, COLOR_RESET);
     printf("%s%sExamples:%s\n", COLOR_BOLD, COLOR_YELLOW, COLOR_RESET);
     printf("  %s> 2 + 2%s\n", COLOR_DIM, COLOR_RESET);
     printf("  %s  4%s\n", COLOR_GREEN, COLOR_RESET);
@@ -558,1343 +2395,7410 @@ void show_help(void)
 }
 
 /**
- * @brief Adds a command to the history buffer.
- * If the history buffer is full, the oldest command is removed.
- * Avoids adding empty commands or the "history" command itself.
- * @param cmd The command string to add.
+ * @brief Returns a command of the history.
+ * @param index 0 for the oldest command, up to `history_count - 1` for the latest.
+ */
+const char *history_entry(const NmriContext *ctx, int index)
+{
+    return ctx->command_history[(ctx->history_start + index) % HISTORY_SIZE];
+}
+
+/**
+ * @brief Appends an allocated command to the history ring, dropping the oldest
+ * command if the ring is full.
+ * @return 0 on success, -1 if out of memory (`command` is then freed).
+ */
+int history_push(NmriContext *ctx, char *command)
+{
+    if (!ctx->command_history && !(ctx->command_history = calloc(HISTORY_SIZE, sizeof(char *))))
+    {
+        free(command);
+        return -1;
+    }
+    if (ctx->history_count == HISTORY_SIZE)
+    {
+        free(ctx->command_history[ctx->history_start]);
+        ctx->command_history[ctx->history_start] = command;
+        ctx->history_start = (ctx->history_start + 1) % HISTORY_SIZE;
+    }
+    else
+        ctx->command_history[(ctx->history_start + ctx->history_count++) % HISTORY_SIZE] = command;
+    return 0;
+}
+
+/**
+ * @brief Makes the history persistent: commands added from now on are appended to
+ * `path`, and the commands of earlier sessions are read from it the first time
+ * the history is used (see `history_load()`), not when the calculator starts.
+ * @param path The history file, or NULL to keep the history in memory only.
+ * @return 0 on success, -1 if out of memory.
+ */
+int history_set_file(NmriContext *ctx, const char *path)
+{
+    char *copy = path ? strdup(path) : NULL;
+    if (path && !copy)
+        return -1;
+    if (ctx->history_file)
+        fclose(ctx->history_file);
+    ctx->history_file = NULL;
+    free(ctx->history_path);
+    ctx->history_path = copy;
+    ctx->history_loaded = 0;
+    return 0;
+}
+
+/**
+ * @brief Reads the last HISTORY_SIZE commands of earlier sessions from the history
+ * file (only the end of the file is read, see `find_log_tail()`) and puts them
+ * before the commands of this session. A file that grew past HISTORY_FILE_LIMIT is
+ * rewritten with the commands kept. Does nothing after the first call.
+ */
+void history_load(NmriContext *ctx)
+{
+    if (ctx->history_loaded || !ctx->history_path)
+        return;
+    ctx->history_loaded = 1;
+    int fd = open(ctx->history_path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return; // No history yet
+    }
+    if (!ctx->history_file)
+        ctx->history_base = info.st_size; // Nothing appended by this session yet
+    int found;
+    off_t start = find_log_tail(fd, ctx->history_base, HISTORY_SIZE, &found);
+    size_t length = start >= 0 ? (size_t)(ctx->history_base - start) : 0;
+    char *text = malloc(length + 1);
+    if (!text || pread(fd, text, length, start) != (ssize_t)length)
+    {
+        free(text);
+        close(fd);
+        return;
+    }
+    close(fd);
+    text[length] = '\0';
+
+    // The earlier commands go first: take this session's out of the ring and add them back after
+    int count = ctx->history_count;
+    char **session = malloc((count + 1) * sizeof(char *));
+    if (!session)
+    {
+        free(text);
+        return;
+    }
+    for (int i = 0; i < count; i++)
+        session[i] = (char *)history_entry(ctx, i);
+    ctx->history_start = 0;
+    ctx->history_count = 0;
+    for (char *line = text, *end; *line; line = end + (*end != '\0'))
+    {
+        end = line + strcspn(line, "\n");
+        char *command = *line != '\n' ? strndup(line, (size_t)(end - line)) : NULL;
+        if (command)
+            history_push(ctx, command);
+    }
+    for (int i = 0; i < count; i++)
+        history_push(ctx, session[i]);
+    free(session);
+    free(text);
+
+    if (info.st_size <= HISTORY_FILE_LIMIT)
+        return;
+    // Rewrite the file with the commands kept, so it does not grow forever
+    size_t path_length = strlen(ctx->history_path);
+    char *temporary = malloc(path_length + 5);
+    if (!temporary)
+        return;
+    memcpy(temporary, ctx->history_path, path_length);
+    memcpy(temporary + path_length, ".tmp", 5);
+    FILE *file = fopen(temporary, "w");
+    for (int i = 0; file && i < ctx->history_count; i++)
+        fprintf(file, "%s\n", history_entry(ctx, i));
+    if (file && fclose(file) == 0 && rename(temporary, ctx->history_path) == 0)
+    {
+        if (ctx->history_file)
+            fclose(ctx->history_file); // Appends must go to the new file
+        ctx->history_file = NULL;
+    }
+    else
+        unlink(temporary);
+    free(temporary);
+}
+
+/**
+ * @brief Adds a command to the history ring (see `history_push()`), and appends it
+ * to the history file if the history is persistent.
+ * Avoids adding empty commands, the "history" command itself or a repetition of the last command.
+ * @param cmd The command string to add.
+ */
+void add_to_history(NmriContext *ctx, const char *cmd)
+{
+    // Basic validation
+    if (cmd == NULL || cmd[0] == '\0' || strchr(cmd, '\n'))
+        return;
+    // Avoid adding the history command itself or duplicates of the last command
+    if (strcmp(cmd, "history") == 0 ||
+        (ctx->history_count > 0 && strcmp(cmd, history_entry(ctx, ctx->history_count - 1)) == 0))
+    {
+        return;
+    }
+    char *copy = strdup(cmd);
+    if (!copy || history_push(ctx, copy) < 0)
+        return; // Out of memory: the command is simply not remembered
+    if (!ctx->history_path)
+        return;
+    if (!ctx->history_file)
+    {
+        struct stat info;
+        ctx->history_file = fopen(ctx->history_path, "a");
+        if (!ctx->history_file)
+        {
+            report_warning("Could not open the history file '%s'; the history will not be saved.", ctx->history_path);
+            history_set_file(ctx, NULL);
+            return;
+        }
+        if (!ctx->history_loaded)
+            ctx->history_base = fstat(fileno(ctx->history_file), &info) == 0 ? info.st_size : 0;
+    }
+    fprintf(ctx->history_file, "%s\n", cmd);
+    fflush(ctx->history_file); // Kept even if the calculator is killed
+}
+
+/**
+ * @brief Displays the command history to the console (reading the history file first if needed).
+ */
+void show_history(NmriContext *ctx)
+{
+    history_load(ctx);
+    printf("%s%s=== Command History ===%s\n", COLOR_BOLD, COLOR_YELLOW, COLOR_RESET);
+    if (ctx->history_count == 0)
+    {
+        printf("  %s(History is empty)%s\n", COLOR_DIM, COLOR_RESET);
+    }
+    else
+    {
+        for (int i = 0; i < ctx->history_count; i++)
+        {
+            printf("  %s%2d:%s %s\n", COLOR_CYAN, i + 1, COLOR_RESET, history_entry(ctx, i));
+        }
+    }
+    printf("%s%s=== End of History ===%s\n", COLOR_BOLD, COLOR_YELLOW, COLOR_RESET);
+}
+
+/**
+ * @brief Displays the currently defined variables and their values.
+ */
+void show_variables(const NmriContext *ctx)
+{
+    printf("%s%s=== Variables ===%s\n", COLOR_BOLD, COLOR_MAGENTA, COLOR_RESET);
+    if (ctx->variable_count == 0)
+    {
+        printf("  %s(No variables defined)%s\n", COLOR_DIM, COLOR_RESET);
+    }
+    else
+    {
+        // Always ensure 'ans' is shown if defined
+        int ans_idx = find_variable(ctx, "ans");
+        if (ans_idx != -1)
+        {
+            printf("  %s%s%s = %s%g%s\n", COLOR_YELLOW, ctx->variables[ans_idx].name, COLOR_RESET,
+                   COLOR_GREEN, ctx->variables[ans_idx].value, COLOR_RESET);
+        }
+        // Print other variables
+        for (int i = 0; i < ctx->variable_count; i++)
+        {
+            if (i == ans_idx)
+                continue; // Skip 'ans' if already printed
+            printf("  %s%s%s = %s%g%s", COLOR_YELLOW, ctx->variables[i].name, COLOR_RESET,
+                   COLOR_GREEN, ctx->variables[i].value, COLOR_RESET);
+            if (ctx->variables[i].formula)
+                printf("  %s(= %s)%s", COLOR_DIM, ctx->variables[i].formula->expression, COLOR_RESET);
+            printf("\n");
+        }
+    }
+    printf("%s%s=== End of Variables ===%s\n", COLOR_BOLD, COLOR_MAGENTA, COLOR_RESET);
+}
+
+/**
+ * @brief Adds one call of a stage, started at `start`, to a set of statistics.
+ * @param stats The statistics (nothing is counted if NULL).
+ * @param kind The stage.
+ * @param start The CLOCK_MONOTONIC time the stage started at.
+ */
+void stats_add(NmriStats *stats, StatKind kind, const struct timespec *start)
+{
+    if (!stats)
+        return;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->calls[kind]++;
+    stats->ns[kind] += (unsigned long long)((end.tv_sec - start->tv_sec) * 1000000000LL + (end.tv_nsec - start->tv_nsec));
+}
+
+/**
+ * @brief Adds the counters of `from` to `into`.
+ */
+void stats_merge(NmriStats *into, const NmriStats *from)
+{
+    for (int i = 0; i < STAT_COUNT; i++)
+    {
+        into->calls[i] += from->calls[i];
+        into->ns[i] += from->ns[i];
+    }
+}
+
+/**
+ * @brief Prints the number of calls and the time spent in each hot-path stage,
+ * with the program cache hit rate.
+ * @param out Where to print (stdout for the `stats` command, stderr for --stats).
+ */
+void show_stats(const NmriContext *ctx, FILE *out)
+{
+    static const char *names[STAT_COUNT] = {"parse", "tokenize", "shunting-yard", "compile postfix",
+                                            "evaluate", "cache lookup", "log"};
+    fprintf(out, "%s%s=== Statistics ===%s\n", COLOR_BOLD, COLOR_YELLOW, COLOR_RESET);
+    fprintf(out, "  %-16s %12s %12s %10s\n", "stage", "calls", "total ms", "ns/call");
+    for (int i = 0; i < STAT_COUNT; i++)
+    {
+        unsigned long calls = ctx->stats.calls[i];
+        fprintf(out, "  %s%-16s%s %12lu %12.3f %10.0f\n", COLOR_CYAN, names[i], COLOR_RESET, calls,
+                ctx->stats.ns[i] / 1e6, calls ? (double)ctx->stats.ns[i] / calls : 0.0);
+    }
+    unsigned long lookups = ctx->cache.hits + ctx->cache.misses;
+    fprintf(out, "  cache: %lu hits, %lu misses (%.1f%% hit rate)\n", ctx->cache.hits, ctx->cache.misses,
+            lookups ? 100.0 * ctx->cache.hits / lookups : 0.0);
+    fprintf(out, "%s%s=== End of Statistics ===%s\n", COLOR_BOLD, COLOR_YELLOW, COLOR_RESET);
+}
+
+/* --- Parsing and Evaluation --- */
+
+/**
+ * @brief Returns the length of an expression's text. The text of an expression ends
+ * at a NUL or at a newline, so the stream mode can evaluate the lines of a mapped
+ * input file in place (see `stream_next_line()`); a "\r\n" line ending is not part of it.
+ */
+size_t text_length(const char *text)
+{
+    size_t length = strcspn(text, "\n");
+    return length > 0 && text[length] == '\n' && text[length - 1] == '\r' ? length - 1 : length;
+}
+
+/**
+ * @brief Tokenizes the input mathematical expression string.
+ * Converts the input string into a sequence of tokens (numbers, operators, functions, etc.).
+ * Handles unary minus, constants (pi, e, etc.), and variables.
+ * Variables (and 'ans') are inlined as TOKEN_NUMBER with their current value.
+ * @param arena Arena the token array is allocated from (it grows as needed).
+ * @param input The input expression string.
+ * @param tokens Set to the token array.
+ * @return The number of tokens generated, or -1 on error.
+ */
+int tokenize(const NmriContext *ctx, Arena *arena, const char *input, Token **tokens)
+{
+    return tokenize_program(ctx, arena, input, tokens, NULL);
+}
+
+/**
+ * @brief Tokenizes an expression, optionally for a compiled program.
+ * When `program` is NULL this behaves like `tokenize(ctx)`. Otherwise variables
+ * (and 'ans') are not looked up: they become TOKEN_VARIABLE tokens referring to
+ * a slot registered in `program`, so their values can be bound at evaluation time.
+ * @param arena Arena the token array is allocated from (it grows as needed).
+ * @param input The input expression string.
+ * @param tokens_out Set to the token array.
+ * @param program The program collecting variable slots, or NULL.
+ * @return The number of tokens generated, or -1 on error.
+ */
+int tokenize_program(const NmriContext *ctx, Arena *arena, const char *input, Token **tokens_out, NmriProgram *program)
+{
+    const char *p = input;
+    int token_count = 0;
+    int expecting_operand = 1; // Start expecting an operand (number, variable, function, parenthesis)
+    int capacity = INITIAL_TOKENS;
+    Token *tokens = arena_alloc(arena, capacity * sizeof(Token));
+    if (!tokens)
+    {
+        set_error(NMRI_ERROR_NO_MEMORY, -1, "Out of memory while parsing expression.");
+        return -1;
+    }
+
+    for (;;)
+    {
+        // Make room for up to two more tokens (a unary minus adds two)
+        if (token_count + 2 > capacity)
+        {
+            Token *grown = arena_grow(arena, tokens, capacity * sizeof(Token), 2 * capacity * sizeof(Token));
+            if (!grown)
+            {
+                set_error(NMRI_ERROR_NO_MEMORY, -1, "Out of memory while parsing expression.");
+                return -1;
+            }
+            tokens = grown;
+            capacity *= 2;
+        }
+
+        int status = lex_token(ctx, input, &p, &tokens[token_count], program);
+        if (status < 0)
+            return -1;
+        if (status == 0)
+            break; // End of input
+        Token *current_token = &tokens[token_count];
+
+        // Special case: Unary minus (or plus, though less common)
+        if (current_token->type == TOKEN_OPERATOR && (current_token->value.op == OP_ADD || current_token->value.op == OP_SUB) &&
+            expecting_operand)
+        {
+            // Simplest way for Shunting-Yard: Insert a zero operand before it.
+            tokens[token_count + 1] = *current_token;
+            current_token->type = TOKEN_NUMBER;
+            current_token->is_percentage = 0;
+            current_token->value.number = 0.0; // Insert 0
+            token_count++;
+            current_token++;
+        }
+        token_count++;
+        // Numbers, variables and ')' are followed by an operator; everything
+        // else (operators, '(', functions, assignments) expects an operand next
+        expecting_operand = current_token->type != TOKEN_NUMBER && current_token->type != TOKEN_VARIABLE &&
+                            current_token->type != TOKEN_RPAREN;
+    }
+    *tokens_out = tokens;
+    return token_count; // Success
+}
+
+/**
+ * @brief Converts the decimal number at `p` like `strtod()` in the "C" locale.
+ * Numbers of at most 19 significant digits whose value is an exact double times
+ * an exact power of ten (nearly all of them in practice) are converted with a
+ * single correctly rounded multiplication or division; others go to `strtod()`.
+ * @param p Start of the number (a digit, or '.' followed by a digit).
+ * @param end Set to the first character after the number.
+ * @return The value of the number.
+ */
+double parse_number(const char *p, char **end)
+{
+#if FLT_EVAL_METHOD == 0 // Rounding once requires plain double arithmetic (no x87 excess precision)
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+        return strtod(p, end); // Hexadecimal floating point
+    const char *s = p;
+    uint64_t mantissa = 0;
+    int digits = 0;   // Significant digits in `mantissa` (it is meaningless beyond 19)
+    int exponent = 0; // Power of ten `mantissa` is multiplied by
+    for (; isdigit((unsigned char)*s); s++)
+    {
+        digits += mantissa != 0 || *s != '0';
+        mantissa = mantissa * 10 + (uint64_t)(*s - '0');
+    }
+    if (*s == '.')
+    {
+        for (s++; isdigit((unsigned char)*s); s++, exponent--)
+        {
+            digits += mantissa != 0 || *s != '0';
+            mantissa = mantissa * 10 + (uint64_t)(*s - '0');
+        }
+    }
+    if (*s == 'e' || *s == 'E')
+    {
+        // Like strtod(), an exponent without digits ("2e", "2e+") is not part of the number
+        const char *q = s + 1;
+        int negative = *q == '-';
+        if (*q == '+' || *q == '-')
+            q++;
+        if (isdigit((unsigned char)*q))
+        {
+            int value = 0;
+            for (; isdigit((unsigned char)*q); q++)
+                if (value < 100000)
+                    value = value * 10 + (*q - '0');
+            exponent += negative ? -value : value;
+            s = q;
+        }
+    }
+    if (digits > 19)
+        return strtod(p, end);
+    *end = (char *)s;
+    if (mantissa == 0)
+        return 0.0;
+    // Move powers of ten into the mantissa while it stays exact
+    while (exponent > MAX_EXACT_POWER && mantissa <= (1ULL << 53) / 10)
+    {
+        mantissa *= 10;
+        exponent--;
+    }
+    if (mantissa <= (1ULL << 53) && exponent >= -MAX_EXACT_POWER && exponent <= MAX_EXACT_POWER)
+    {
+        double value = (double)mantissa;
+        return exponent < 0 ? value / exact_powers_of_ten[-exponent] : value * exact_powers_of_ten[exponent];
+    }
+#endif
+    return strtod(p, end);
+}
+
+/**
+ * @brief Hashes an identifier into a slot of `builtin_names`.
+ * Only the first two characters, the last one and the length are used, which is
+ * enough to tell the built-in names apart.
+ * @param name The identifier (NUL-terminated, at least one character).
+ * @param length Its length.
+ */
+unsigned builtin_hash(const char *name, size_t length)
+{
+    const unsigned char *s = (const unsigned char *)name;
+    return (s[0] + s[1] + 4u * s[length - 1] + 12u * (unsigned)length) & (BUILTIN_SLOTS - 1);
+}
+
+/**
+ * @brief Looks up a built-in constant or function with a single comparison.
+ * @param name The identifier (NUL-terminated, at least one character).
+ * @param length Its length.
+ * @return The built-in, or NULL if the name is not one.
+ */
+const BuiltinName *find_builtin(const char *name, size_t length)
+{
+    const BuiltinName *builtin = &builtin_names[builtin_hash(name, length)];
+    if (builtin->name && strcmp(builtin->name, name) == 0)
+        return builtin;
+    return NULL;
+}
+
+/**
+ * @brief Reads the next token of an expression.
+ * Shared by `tokenize_program()` and the single-pass parser. Signs are always
+ * returned as operators: whether they are unary depends on the caller's state.
+ * The expression ends at a NUL or a newline (see `text_length()`).
+ * @param input Start of the expression (assignment names are stored as offsets into it).
+ * @param pos Current position in `input`, advanced past the token.
+ * @param current_token Receives the token.
+ * @param program The program collecting variable slots, or NULL to inline variable values.
+ * @return 1 if a token was read, 0 at the end of the input, or -1 on error (an error is printed).
+ */
+int lex_token(const NmriContext *ctx, const char *input, const char **pos, Token *current_token, NmriProgram *program)
+{
+    const char *p = *pos;
+    // Skip whitespace
+    while (*p != '\n' && isspace((unsigned char)*p))
+        p++;
+    *pos = p;
+    if (*p == '\0' || *p == '\n')
+        return 0; // End of input (a line of the mapped stream input ends with its newline)
+
+    current_token->is_percentage = 0; // Default
+
+    // Handle identifiers (functions, variables, constants, assignment start)
+    if (isalpha((unsigned char)*p) || *p == '_')
+    { // Allow identifiers to start with _
+        const char *start = p;
+        while (isalnum((unsigned char)*p) || *p == '_')
+            p++; // Read the whole identifier
+        size_t len = p - start;
+        if (len >= MAX_IDENTIFIER_LEN)
+        {
+            set_error(NMRI_ERROR_LIMIT, (int)(start - input), "Identifier '%.*s...' too long (max %d chars).",
+                      MAX_IDENTIFIER_LEN / 2, start, MAX_IDENTIFIER_LEN - 1);
+            return -1;
+        }
+        char identifier[MAX_IDENTIFIER_LEN];
+        strncpy(identifier, start, len);
+        identifier[len] = '\0';
+
+        // Check for assignment (identifier followed by '=')
+        const char *next_char = p;
+        while (*next_char != '\n' && isspace((unsigned char)*next_char))
+            next_char++;
+        if (*next_char == '=')
+        {
+            // Ensure assignment is at the start or after an operator/paren? (No, can be like `y=x=5`)
+            // Current simple implementation allows `y=x=5`, handled in main loop logic.
+            // Here we just mark it as an assignment start token.
+            current_token->type = TOKEN_ASSIGNMENT;
+            current_token->value.name.offset = (int)(start - input);
+            current_token->value.name.length = (int)len;
+            *pos = next_char + 1; // Consume the '='
+            return 1;
+        }
+
+        // Check for predefined constants and functions
+        const BuiltinName *builtin = find_builtin(identifier, len);
+        int function;
+        if (builtin && builtin->kind == BUILTIN_CONSTANT)
+        {
+            current_token->type = TOKEN_NUMBER;
+            current_token->value.number = builtin->value;
+        }
+        else if (builtin && builtin->kind == BUILTIN_ANS && !program)
+        {
+            current_token->type = TOKEN_NUMBER;
+            current_token->value.number = ctx->last_result;
+        }
+        else if (builtin && builtin->kind == BUILTIN_FUNCTION)
+        {
+            // It's a function
+            current_token->type = TOKEN_FUNCTION;
+            current_token->value.func = builtin->func;
+        }
+        else if (*next_char == '(' && (function = find_function(ctx, identifier)) >= 0)
+        {
+            // A user-defined function (only when called: functions and variables have separate names)
+            current_token->type = TOKEN_CALL;
+            current_token->value.slot = function;
+        }
+        else if (program)
+        {
+            // Compiled program: defer the lookup to evaluation time
+            int slot = program_add_variable(program, identifier);
+            if (slot < 0)
+                return -1;
+            current_token->type = TOKEN_VARIABLE;
+            current_token->value.slot = slot;
+        }
+        else
+        {
+            // Assume it's a variable
+            int var_index = find_variable(ctx, identifier);
+            if (var_index < 0)
+            {
+                // Unknown identifier
+                set_error(NMRI_ERROR_UNKNOWN_NAME, (int)(start - input), "Unknown identifier '%s'.", identifier);
+                return -1;
+            }
+            current_token->type = TOKEN_NUMBER; // Treat variable use as injecting its number value
+            current_token->value.number = ctx->variables[var_index].value;
+        }
+    }
+    // Handle numbers (including decimals and percentages)
+    else if (isdigit((unsigned char)*p) || (*p == '.' && isdigit((unsigned char)*(p + 1))))
+    {
+        char *end;
+        current_token->value.number = parse_number(p, &end);
+        if (end == p)
+        { // Should not happen with the check above, but safety first
+            set_error(NMRI_ERROR_SYNTAX, (int)(p - input), "Invalid numeric format near '%.*s'.", 10, p);
+            return -1;
+        }
+        current_token->type = TOKEN_NUMBER;
+        // Check for percentage sign
+        if (*end == '%')
+        {
+            current_token->is_percentage = 1;
+            end++; // Consume the '%'
+        }
+        p = end; // Move parser position
+    }
+    // Handle operators (+, -, *, /, ^, %)
+    else if (strchr("+-*/^%", *p))
+    {
+        OperatorType op = char_to_op(*p);
+        if (op == (OperatorType)-1)
+        { // Should not happen due to strchr check
+            set_error(NMRI_ERROR_SYNTAX, (int)(p - input), "Invalid operator '%c'.", *p);
+            return -1;
+        }
+        current_token->type = TOKEN_OPERATOR;
+        current_token->value.op = op;
+        p++;
+    }
+    // Handle parentheses
+    else if (*p == '(')
+    {
+        current_token->type = TOKEN_LPAREN;
+        p++;
+    }
+    else if (*p == ')')
+    {
+        current_token->type = TOKEN_RPAREN;
+        p++;
+    }
+    else if (*p == ',')
+    {
+        current_token->type = TOKEN_COMMA;
+        p++;
+    }
+    // Handle unrecognized characters
+    else
+    {
+        set_error(NMRI_ERROR_SYNTAX, (int)(p - input), "Invalid character '%c' in expression.", *p);
+        return -1;
+    }
+    *pos = p;
+    return 1;
+}
+
+/**
+ * @brief Gets the precedence level of an operator. Higher value means higher precedence.
+ * @param op The operator type.
+ * @return The precedence level (integer).
+ */
+int precedence(OperatorType op)
+{
+    switch (op)
+    {
+    case OP_ADD:
+    case OP_SUB:
+        return 1;
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+        return 2;
+    case OP_POW:
+        return 3; // Power has the highest precedence
+    default:
+        return 0; // Should not happen for valid operators
+    }
+}
+
+/**
+ * @brief Checks if an operator is left-associative.
+ * Most operators are left-associative (e.g., a - b - c = (a - b) - c).
+ * Power (^) is typically right-associative (e.g., a ^ b ^ c = a ^ (b ^ c)).
+ * @param op The operator type.
+ * @return 1 if left-associative, 0 otherwise.
+ */
+int is_left_associative(OperatorType op) { return op != OP_POW; }
+
+/**
+ * @brief Converts an infix expression (token array) to postfix (RPN) using the Shunting-yard algorithm.
+ * Neither the output queue nor the operator stack can hold more tokens than
+ * the input, so both are allocated from the arena with `token_count` entries.
+ * @param arena Arena the output queue and the operator stack are allocated from.
+ * @param tokens Input array of infix tokens.
+ * @param token_count Number of tokens in the input array.
+ * @param output_out Set to the postfix token array.
+ * @return The number of tokens in the postfix output, or -1 on error.
+ */
+int shunting_yard(Arena *arena, const Token *tokens, int token_count, Token **output_out)
+{
+    Token *output = arena_alloc(arena, token_count * sizeof(Token));  // Postfix output queue
+    Token *op_stack = arena_alloc(arena, token_count * sizeof(Token)); // Stack for operators and parentheses
+    int op_top = -1;                                                   // Operator stack pointer (-1 means empty)
+    int output_count = 0;                                              // Number of tokens added to the output queue
+    if (!output || !op_stack)
+    {
+        set_error(NMRI_ERROR_NO_MEMORY, -1, "Out of memory while parsing expression.");
+        return -1;
+    }
+
+    for (int i = 0; i < token_count; i++)
+    {
+        const Token *token = &tokens[i]; // Tokens are only copied to the queue or the stack
+        switch (token->type)
+        {
+        case TOKEN_NUMBER:
+        case TOKEN_VARIABLE:
+            // Numbers and variables go directly to the output queue
+            output[output_count++] = *token;
+            break;
+        case TOKEN_FUNCTION:
+        case TOKEN_CALL:
+            // Functions go onto the operator stack
+            op_stack[++op_top] = *token;
+            break;
+        case TOKEN_OPERATOR:
+            // Pop operators with higher or equal precedence (respecting associativity)
+            while (op_top >= 0 && op_stack[op_top].type == TOKEN_OPERATOR &&
+                   ((is_left_associative(token->value.op) && precedence(token->value.op) <= precedence(op_stack[op_top].value.op)) ||
+                    (!is_left_associative(token->value.op) && precedence(token->value.op) < precedence(op_stack[op_top].value.op))))
+            {
+                output[output_count++] = op_stack[op_top--]; // Pop from stack to output
+            }
+            // Push the current operator onto the stack
+            op_stack[++op_top] = *token;
+            break;
+        case TOKEN_LPAREN:
+            // Push left parenthesis onto the operator stack
+            op_stack[++op_top] = *token;
+            break;
+        case TOKEN_RPAREN:
+            // Pop operators until a matching left parenthesis is found
+            while (op_top >= 0 && op_stack[op_top].type != TOKEN_LPAREN)
+            {
+                output[output_count++] = op_stack[op_top--]; // Pop from stack to output
+            }
+            // Check for mismatched parentheses
+            if (op_top < 0)
+            {
+                set_error(NMRI_ERROR_SYNTAX, -1, "Mismatched parentheses (extra right parenthesis?).");
+                return -1;
+            }
+            // Pop the left parenthesis itself (discard it)
+            op_top--;
+            // If the token before '(' was a function, pop it to output
+            if (op_top >= 0 && (op_stack[op_top].type == TOKEN_FUNCTION || op_stack[op_top].type == TOKEN_CALL))
+            {
+                output[output_count++] = op_stack[op_top--];
+            }
+            break;
+        case TOKEN_COMMA:
+            // Finish the argument: pop operators down to the call's '('
+            while (op_top >= 0 && op_stack[op_top].type != TOKEN_LPAREN)
+            {
+                output[output_count++] = op_stack[op_top--];
+            }
+            if (op_top < 1 || op_stack[op_top - 1].type != TOKEN_CALL)
+            {
+                set_error(NMRI_ERROR_SYNTAX, -1, "',' outside the arguments of a function call.");
+                return -1;
+            }
+            break;
+        case TOKEN_ASSIGNMENT: // Should ideally be handled before shunting yard
+            set_error(NMRI_ERROR_INTERNAL, -1, "Assignment token found in shunting yard.");
+            return -1;
+        }
+    }
+    // After processing all input tokens, pop any remaining operators from the stack to the output
+    while (op_top >= 0)
+    {
+        // Check for leftover parentheses (mismatched)
+        if (op_stack[op_top].type == TOKEN_LPAREN)
+        {
+            set_error(NMRI_ERROR_SYNTAX, -1, "Mismatched parentheses (extra left parenthesis?).");
+            return -1;
+        }
+        output[output_count++] = op_stack[op_top--];
+    }
+    *output_out = output;
+    return output_count; // Success, return number of tokens in postfix expression
+}
+
+/* --- Bytecode --- */
+
+/**
+ * @brief Prepares an emitter whose buffers are allocated from `arena`.
+ * @param math Arithmetic the code is compiled for (see `math_function()`).
+ */
+void emitter_init(Emitter *em, Arena *arena, NmriMath math)
+{
+    memset(em, 0, sizeof(*em));
+    em->arena = arena;
+    em->bc.math = math;
+}
+
+/**
+ * @brief Appends one instruction, growing the code buffer as needed.
+ * @return The index of the instruction, or -1 if out of memory.
+ */
+int emit_instruction(Emitter *em, Opcode op, int operand)
+{
+    if (em->bc.count == em->code_capacity)
+    {
+        int capacity = em->code_capacity ? em->code_capacity * 2 : INITIAL_CODE;
+        uint32_t *code = arena_grow(em->arena, em->bc.code, em->code_capacity * sizeof(uint32_t), capacity * sizeof(uint32_t));
+        if (!code)
+        {
+            set_error(NMRI_ERROR_NO_MEMORY, -1, "Out of memory while compiling expression.");
+            return -1;
+        }
+        em->bc.code = code;
+        em->code_capacity = capacity;
+    }
+    em->bc.code[em->bc.count] = INSTR(op, operand);
+    return em->bc.count++;
+}
+
+/**
+ * @brief Records a push on the shadow stack.
+ * @param start Index of the instruction pushing the value.
+ * @param is_percentage The value is a percentage literal.
+ * @return 0 on success, -1 if out of memory.
+ */
+int emit_push(Emitter *em, int start, int is_percentage)
+{
+    if (em->depth == em->stack_capacity)
+    {
+        int capacity = em->stack_capacity ? em->stack_capacity * 2 : INITIAL_CODE;
+        EmitEntry *stack = arena_grow(em->arena, em->stack, em->stack_capacity * sizeof(EmitEntry), capacity * sizeof(EmitEntry));
+        if (!stack)
+        {
+            set_error(NMRI_ERROR_NO_MEMORY, -1, "Out of memory while compiling expression.");
+            return -1;
+        }
+        em->stack = stack;
+        em->stack_capacity = capacity;
+    }
+    em->stack[em->depth].start = start;
+    em->stack[em->depth].is_percentage = is_percentage;
+    em->depth++;
+    if (em->depth > em->bc.max_depth)
+        em->bc.max_depth = em->depth;
+    return 0;
+}
+
+/**
+ * @brief Emits a push of a numeric literal.
+ * A percentage literal is stored as written: how it is scaled depends on the
+ * operation that consumes it, which is only known later.
+ * @return 0 on success, -1 on error.
+ */
+int emit_constant(Emitter *em, double value, int is_percentage)
+{
+    if (em->bc.constant_count == em->constant_capacity)
+    {
+        int capacity = em->constant_capacity ? em->constant_capacity * 2 : INITIAL_CODE;
+        double *constants = arena_grow(em->arena, em->bc.constants, em->constant_capacity * sizeof(double), capacity * sizeof(double));
+        if (!constants)
+        {
+            set_error(NMRI_ERROR_NO_MEMORY, -1, "Out of memory while compiling expression.");
+            return -1;
+        }
+        em->bc.constants = constants;
+        em->constant_capacity = capacity;
+    }
+    if (em->bc.constant_count > MAX_OPERAND)
+    {
+        set_error(NMRI_ERROR_LIMIT, -1, "Expression too large to compile.");
+        return -1;
+    }
+    em->bc.constants[em->bc.constant_count] = value;
+    int index = emit_instruction(em, BC_CONST, em->bc.constant_count++);
+    if (index < 0)
+        return -1;
+    return emit_push(em, index, is_percentage);
+}
+
+/**
+ * @brief Emits a push of the value bound to a variable slot.
+ * @return 0 on success, -1 on error.
+ */
+int emit_variable(Emitter *em, int slot)
+{
+    if (slot > MAX_OPERAND)
+    {
+        set_error(NMRI_ERROR_LIMIT, -1, "Expression too large to compile.");
+        return -1;
+    }
+    int index = emit_instruction(em, BC_VAR, slot);
+    if (index < 0)
+        return -1;
+    return emit_push(em, index, 0);
+}
+
+/**
+ * @brief Checks whether a stack entry is computed by a single BC_CONST instruction.
+ * @param entry Shadow stack index of the entry.
+ * @param value Receives the constant.
+ * @return 1 if the entry is a constant, 0 otherwise.
+ */
+int emit_entry_constant(const Emitter *em, int entry, double *value)
+{
+    int start = em->stack[entry].start;
+    int end = entry + 1 < em->depth ? em->stack[entry + 1].start : em->bc.count;
+    if (end - start != 1 || INSTR_OP(em->bc.code[start]) != BC_CONST)
+        return 0;
+    *value = em->bc.constants[INSTR_ARG(em->bc.code[start])];
+    return 1;
+}
+
+/**
+ * @brief Deletes one instruction, releasing its constant if it has one, and moves the following code down.
+ * @param index Index of the instruction.
+ */
+void emit_remove_instruction(Emitter *em, int index)
+{
+    uint32_t instr = em->bc.code[index];
+    if (INSTR_OP(instr) == BC_CONST)
+    {
+        if (INSTR_ARG(instr) == em->bc.constant_count - 1)
+            em->bc.constant_count--;
+        else
+            em->dead_constants++; // Dropped from the pool by `emit_finish()`
+    }
+    memmove(&em->bc.code[index], &em->bc.code[index + 1], (em->bc.count - index - 1) * sizeof(uint32_t));
+    em->bc.count--;
+    // Entries are ordered by start, so only the top ones can follow the instruction
+    for (int i = em->depth - 1; i >= 0 && em->stack[i].start > index; i--)
+        em->stack[i].start--;
+}
+
+/**
+ * @brief Turns a percentage literal on the shadow stack into its fraction (20% -> 0.2)
+ * by rewriting the constant it pushes. Plain values are left alone.
+ * @param entry Shadow stack index of the entry.
+ */
+void emit_percentage_to_fraction(Emitter *em, int entry)
+{
+    if (!em->stack[entry].is_percentage)
+        return;
+    em->bc.constants[INSTR_ARG(em->bc.code[em->stack[entry].start])] /= 100.0;
+    em->stack[entry].is_percentage = 0;
+}
+
+/**
+ * @brief Emits a binary operator, applying the percentage rules:
+ * 'A + B%' and 'A - B%' scale B by A, '*' and '/' use percentages as
+ * fractions, '^' and '%' ignore them (with a warning from `emit_finish()`).
+ * Only literals can be percentages, so every rule reduces to rewriting a constant.
+ * @return 0 on success, -1 on error.
+ */
+int emit_operator(Emitter *em, OperatorType op)
+{
+    if (em->depth < 2)
+    { // Need at least two operands for binary operators
+        set_error(NMRI_ERROR_SYNTAX, -1, "Insufficient operands for operator '%c'.", "+-*/^%"[op]); // Simple way to get char
+        return -1;
+    }
+    int a = em->depth - 2, b = em->depth - 1;
+    Opcode opcode = (Opcode)(BC_ADD + op);
+    switch (op)
+    {
+    case OP_ADD:
+    case OP_SUB:
+        if (em->stack[b].is_percentage)
+        {
+            emit_percentage_to_fraction(em, b);
+            opcode = op == OP_ADD ? BC_ADD_PCT : BC_SUB_PCT;
+        }
+        break;
+    case OP_MUL:
+    case OP_DIV:
+        emit_percentage_to_fraction(em, a);
+        emit_percentage_to_fraction(em, b);
+        break;
+    case OP_POW:
+    case OP_MOD:
+        // Reported once the expression is known to compile, so a parse that is
+        // retried through the token pipeline does not warn twice
+        if (em->stack[a].is_percentage || em->stack[b].is_percentage)
+            *(op == OP_POW ? &em->bc.power_warnings : &em->bc.modulo_warnings) += 1;
+        break;
+    }
+
+    double x = 0.0, y = 0.0;
+    int a_constant = emit_entry_constant(em, a, &x);
+    int b_constant = emit_entry_constant(em, b, &y);
+    double folded = NAN;
+    // x ^ 2 is folded as x * x, like it is evaluated for variables. Extended code folds
+    // nothing: the evaluator keeps more precision than a folded double constant.
+    if (a_constant && b_constant && em->bc.math != NMRI_MATH_EXTENDED)
+        folded = opcode == BC_POW && y == 2.0 ? x * x : batch_scalar_op(opcode, x, y);
+    int status = 0;
+    if (!isnan(folded))
+    {
+        // Constant subexpression: computed once here. Operations that fail
+        // (1/0, ...) are left in the code so the evaluator reports them.
+        emit_remove_instruction(em, em->stack[b].start);
+        em->bc.constants[INSTR_ARG(em->bc.code[em->stack[a].start])] = folded;
+    }
+    // Only the identities that hold for signed zeros too: x + 0 and 0 + x are +0 for
+    // x = -0, and 0 - x (a unary minus) is +0, not -0, for x = +0, so those are kept
+    else if (b_constant && ((y == 0.0 && !signbit(y) && opcode == BC_SUB) ||
+                            (y == 1.0 && (opcode == BC_MUL || opcode == BC_DIV || opcode == BC_POW))))
+    {
+        emit_remove_instruction(em, em->stack[b].start); // x - 0, x * 1, x / 1, x ^ 1
+    }
+    else if (a_constant && x == 1.0 && opcode == BC_MUL)
+    {
+        emit_remove_instruction(em, em->stack[a].start); // 1 * x
+    }
+    else if ((b_constant && y == -1.0 && (opcode == BC_MUL || opcode == BC_DIV)) ||
+             (a_constant && x == -1.0 && opcode == BC_MUL))
+    {
+        emit_remove_instruction(em, em->stack[b_constant && y == -1.0 ? b : a].start); // x * -1, x / -1, -1 * x -> -x
+        if (INSTR_OP(em->bc.code[em->bc.count - 1]) == BC_NEG)
+            emit_remove_instruction(em, em->bc.count - 1); // -(-x) -> x
+        else
+            status = emit_instruction(em, BC_NEG, 0);
+    }
+    else if (b_constant && y == 2.0 && opcode == BC_POW)
+    {
+        emit_remove_instruction(em, em->stack[b].start); // x ^ 2 -> x * x
+        if ((status = emit_instruction(em, BC_DUP, 0)) >= 0)
+            status = emit_instruction(em, BC_MUL, 0);
+    }
+    else
+    {
+        status = emit_instruction(em, opcode, 0);
+    }
+    if (status < 0)
+        return -1;
+    em->depth--;
+    em->stack[em->depth - 1].is_percentage = 0; // The result is never a percentage
+    return 0;
+}
+
+/**
+ * @brief Emits a function call on the top value (a percentage argument is used as a fraction).
+ * The variant of the function is the one of the emitter's math (so bodies of user functions
+ * compiled in another mode are inlined with the functions of this one).
+ * @return 0 on success, -1 on error.
+ */
+int emit_function(Emitter *em, FunctionType func)
+{
+    if (em->depth < 1)
+    { // Need at least one argument
+        set_error(NMRI_ERROR_ARGUMENTS, -1, "Insufficient arguments for function.");
+        return -1;
+    }
+    emit_percentage_to_fraction(em, em->depth - 1);
+    func = math_function(func, em->bc.math);
+    double x;
+    if (em->bc.math != NMRI_MATH_EXTENDED && emit_entry_constant(em, em->depth - 1, &x))
+    {
+        // Constant argument: apply the function now unless it fails (e.g. sqrt(-1))
+        double folded = batch_scalar_func(func, x);
+        if (!isnan(folded))
+        {
+            em->bc.constants[INSTR_ARG(em->bc.code[em->stack[em->depth - 1].start])] = folded;
+            return 0;
+        }
+    }
+    return emit_instruction(em, BC_FUNC, func) < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Emits a call of a user-defined function whose arguments are the top
+ * `param_count` values: their code is taken off the end of the emitted code and
+ * the function body is emitted in its place with each use of a parameter replaced
+ * by the code of its argument. The body is simplified again as it is emitted, so
+ * constant arguments are folded into it. A percentage argument is used as a fraction.
+ * @param ctx Session the body's other variables are read from when `program` is NULL.
+ * @param program The program collecting variable slots, or NULL to inline variable values.
+ * @param function The function.
+ * @return 0 on success, -1 on error (recorded with `set_error()`).
+ */
+int emit_call(Emitter *em, const NmriContext *ctx, NmriProgram *program, const UserFunction *function)
+{
+    int params = function->param_count;
+    if (em->depth < params)
+    {
+        set_error(NMRI_ERROR_ARGUMENTS, -1, "Insufficient arguments for function '%s'.", function->name);
+        return -1;
+    }
+    int first = em->depth - params;
+    int start = params > 0 ? em->stack[first].start : em->bc.count;
+    int length = em->bc.count - start;
+    int others = function->var_count - params;
+    uint32_t *code = arena_alloc(em->arena, length * sizeof(uint32_t));
+    double *constants = arena_alloc(em->arena, length * sizeof(double));
+    int *arg_start = arena_alloc(em->arena, (params + 1) * sizeof(int));
+    int *slots = arena_alloc(em->arena, others * sizeof(int));
+    double *values = arena_alloc(em->arena, others * sizeof(double));
+    if (!code || !constants || !arg_start || !slots || !values)
+    {
+        set_error(NMRI_ERROR_NO_MEMORY, -1, "Out of memory while compiling expression.");
+        return -1;
+    }
+
+    // Take the arguments' code (with its constants) off the emitter
+    for (int i = 0; i < params; i++)
+    {
+        emit_percentage_to_fraction(em, first + i);
+        arg_start[i] = em->stack[first + i].start - start;
+    }
+    arg_start[params] = length;
+    for (int i = 0; i < length; i++)
+    {
+        uint32_t instr = em->bc.code[start + i];
+        code[i] = instr;
+        if (INSTR_OP(instr) == BC_CONST)
+        {
+            constants[i] = em->bc.constants[INSTR_ARG(instr)];
+            code[i] = INSTR(BC_CONST, i);
+        }
+    }
+    for (int i = em->bc.count - 1; i >= start; i--)
+        emit_remove_instruction(em, i);
+    em->depth = first;
+
+    // Bind the body's other variables in the calling expression
+    for (int i = 0; i < others; i++)
+    {
+        const char *name = function->var_names[params + i];
+        slots[i] = -1;
+        if (program)
+        {
+            // Not one of the caller's own parameters if it is a function body too
+            for (int slot = program->param_count; slot < program->var_count && slots[i] < 0; slot++)
+            {
+                if (strcmp(program->var_names[slot], name) == 0)
+                    slots[i] = slot;
+            }
+            if (slots[i] < 0 && (slots[i] = program_new_variable(program, name)) < 0)
+                return -1;
+            continue;
+        }
+        int index = find_variable(ctx, name);
+        if (index < 0)
+        {
+            set_error(NMRI_ERROR_UNKNOWN_NAME, -1, "Unknown identifier '%s'.", name);
+            return -1;
+        }
+        values[i] = ctx->variables[index].value;
+    }
+    InlineCall call = {code, constants, arg_start, params, slots, values};
+    return emit_replay(em, function->bc.code, function->bc.count, function->bc.constants, &call);
+}
+
+/**
+ * @brief Emits compiled code again through the emitter, so it is simplified in
+ * its new context. Used to inline function bodies and the arguments of calls.
+ * @param code The instructions (verified, e.g. by `bytecode_verify()`).
+ * @param count Number of instructions.
+ * @param constants The constant pool the BC_CONST operands index.
+ * @param call The call whose body this is (BC_VAR are parameters or the body's
+ * other variables), or NULL for code of the expression being compiled.
+ * @return 0 on success, -1 on error (recorded with `set_error()`).
+ */
+int emit_replay(Emitter *em, const uint32_t *code, int count, const double *constants, const InlineCall *call)
+{
+    for (int i = 0; i < count; i++)
+    {
+        Opcode op = INSTR_OP(code[i]);
+        int arg = INSTR_ARG(code[i]);
+        int status = 0;
+        double x;
+        switch (op)
+        {
+        case BC_CONST:
+            status = emit_constant(em, constants[arg], 0);
+            break;
+        case BC_VAR:
+            if (!call)
+                status = emit_variable(em, arg);
+            else if (arg < call->param_count)
+                status = emit_replay(em, call->code + call->arg_start[arg], call->arg_start[arg + 1] - call->arg_start[arg],
+                                     call->constants, NULL);
+            else if (call->slots[arg - call->param_count] >= 0)
+                status = emit_variable(em, call->slots[arg - call->param_count]);
+            else
+                status = emit_constant(em, call->values[arg - call->param_count], 0);
+            break;
+        case BC_DUP:
+            // Only emitted as "DUP, MUL" for x ^ 2: emit it as that again
+            status = emit_constant(em, 2.0, 0);
+            if (status == 0)
+                status = emit_operator(em, OP_POW);
+            i++;
+            break;
+        case BC_ADD_PCT:
+        case BC_SUB_PCT:
+            // The percentage is already a fraction: keep the operation as it is
+            status = emit_instruction(em, op, 0) < 0 ? -1 : 0;
+            em->depth--;
+            break;
+        case BC_NEG:
+            if (emit_entry_constant(em, em->depth - 1, &x))
+                em->bc.constants[INSTR_ARG(em->bc.code[em->stack[em->depth - 1].start])] = -x;
+            else if (INSTR_OP(em->bc.code[em->bc.count - 1]) == BC_NEG)
+                emit_remove_instruction(em, em->bc.count - 1); // -(-x) -> x
+            else
+                status = emit_instruction(em, BC_NEG, 0) < 0 ? -1 : 0;
+            break;
+        case BC_FUNC:
+            status = emit_function(em, (FunctionType)arg);
+            break;
+        default: // BC_ADD ... BC_MOD
+            status = emit_operator(em, (OperatorType)(op - BC_ADD));
+            break;
+        }
+        if (status < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Checks that the emitted code leaves exactly one value and returns it.
+ * A final percentage literal (e.g. "50%") evaluates to its fraction.
+ * @param out Receives the code (still owned by the emitter's arena).
+ * @return 0 on success, -1 if the expression is malformed (an error is printed).
+ */
+int emit_finish(Emitter *em, Bytecode *out)
+{
+    if (em->depth != 1)
+    {
+        // This often indicates an invalid expression structure (e.g., "2 3 + 4")
+        set_error(NMRI_ERROR_SYNTAX, -1, "Invalid expression structure (stack top %d, expected 0).", em->depth - 1);
+        return -1;
+    }
+    report_percentage_warnings(&em->bc);
+    emit_percentage_to_fraction(em, 0);
+    if (em->dead_constants > 0)
+    {
+        // Rebuild the constant pool from the constants still referenced
+        double *constants = arena_alloc(em->arena, (em->bc.constant_count - em->dead_constants) * sizeof(double));
+        if (!constants)
+        {
+            set_error(NMRI_ERROR_NO_MEMORY, -1, "Out of memory while compiling expression.");
+            return -1;
+        }
+        int count = 0;
+        for (int i = 0; i < em->bc.count; i++)
+        {
+            if (INSTR_OP(em->bc.code[i]) != BC_CONST)
+                continue;
+            constants[count] = em->bc.constants[INSTR_ARG(em->bc.code[i])];
+            em->bc.code[i] = INSTR(BC_CONST, count++);
+        }
+        em->bc.constants = constants;
+        em->bc.constant_count = count;
+        em->dead_constants = 0;
+    }
+    *out = em->bc;
+    return 0;
+}
+
+/**
+ * @brief Prints the warnings for percentages ignored by '^' and '%' in compiled code.
+ */
+void report_percentage_warnings(const Bytecode *bc)
+{
+    for (int i = 0; i < bc->power_warnings; i++)
+        report_warning("Percentage ignored in power operation.");
+    for (int i = 0; i < bc->modulo_warnings; i++)
+        report_warning("Percentage ignored in modulo operation.");
+}
+
+/**
+ * @brief Compiles a postfix (RPN) token array to bytecode.
+ * @param ctx Session whose functions the TOKEN_CALL tokens refer to (may be NULL if there are none).
+ * @param arena Arena the bytecode is allocated from.
+ * @param postfix Array of tokens in postfix order.
+ * @param count Number of tokens in the `postfix` array.
+ * @param program The program collecting variable slots, or NULL if variable values are inlined.
+ * @param out Receives the bytecode.
+ * @return 0 on success, -1 on error.
+ */
+int compile_postfix(const NmriContext *ctx, Arena *arena, const Token *postfix, int count, NmriProgram *program,
+                    Bytecode *out)
+{
+    Emitter em;
+    emitter_init(&em, arena, ctx ? ctx->math : NMRI_MATH_DEFAULT);
+    for (int i = 0; i < count; i++)
+    {
+        const Token *token = &postfix[i];
+        int status = 0;
+        switch (token->type)
+        {
+        case TOKEN_NUMBER:
+            status = emit_constant(&em, token->value.number, token->is_percentage);
+            break;
+        case TOKEN_VARIABLE:
+            status = emit_variable(&em, token->value.slot);
+            break;
+        case TOKEN_OPERATOR:
+            status = emit_operator(&em, token->value.op);
+            break;
+        case TOKEN_FUNCTION:
+            status = emit_function(&em, token->value.func);
+            break;
+        case TOKEN_CALL:
+            status = emit_call(&em, ctx, program, &ctx->functions[token->value.slot]);
+            break;
+        default:
+            set_error(NMRI_ERROR_INTERNAL, -1, "Unexpected token in postfix expression.");
+            status = -1;
+            break;
+        }
+        if (status < 0)
+            return -1;
+    }
+    return emit_finish(&em, out);
+}
+
+/**
+ * @brief Runs bytecode on the stack machine.
+ * Does not touch any global state, so it is safe to call concurrently.
+ * @param bc The bytecode.
+ * @param bindings Value of each variable slot (may be NULL if there are no BC_VAR instructions).
+ * @param stack Evaluation stack with room for `bc->max_depth` values.
+ * @return The calculated result (double), or NAN (Not a Number) on error.
+ */
+double evaluate_bytecode(const Bytecode *bc, const double *bindings, double *stack)
+{
+    if (bc->math == NMRI_MATH_EXTENDED)
+        return evaluate_bytecode_extended(bc, bindings); // Once per evaluation, not per instruction
+    int top = -1; // Stack pointer (-1 means empty)
+    for (int i = 0; i < bc->count; i++)
+    {
+        uint32_t instr = bc->code[i];
+        switch (INSTR_OP(instr))
+        {
+        case BC_CONST:
+            stack[++top] = bc->constants[INSTR_ARG(instr)];
+            break;
+        case BC_VAR:
+            stack[++top] = bindings[INSTR_ARG(instr)];
+            break;
+        case BC_ADD:
+            top--;
+            stack[top] = stack[top] + stack[top + 1];
+            break;
+        case BC_SUB:
+            top--;
+            stack[top] = stack[top] - stack[top + 1];
+            break;
+        case BC_MUL:
+            top--;
+            stack[top] = stack[top] * stack[top + 1];
+            break;
+        case BC_DIV:
+            top--;
+            if (stack[top + 1] == 0.0)
+            {
+                set_error(NMRI_ERROR_DIVISION_BY_ZERO, -1, "Division by zero.");
+                return NAN;
+            }
+            stack[top] = stack[top] / stack[top + 1];
+            break;
+        case BC_POW:
+            top--;
+            stack[top] = pow(stack[top], stack[top + 1]);
+            break;
+        case BC_MOD:
+            top--;
+            if (stack[top + 1] == 0.0)
+            {
+                set_error(NMRI_ERROR_DIVISION_BY_ZERO, -1, "Modulo by zero.");
+                return NAN;
+            }
+            stack[top] = fmod(stack[top], stack[top + 1]);
+            break;
+        case BC_ADD_PCT:
+            top--;
+            stack[top] = stack[top] + stack[top + 1] * stack[top];
+            break;
+        case BC_SUB_PCT:
+            top--;
+            stack[top] = stack[top] - stack[top + 1] * stack[top];
+            break;
+        case BC_FUNC:
+        {
+            double arg_val = stack[top];
+            double result;
+            // Evaluate the function
+            switch ((FunctionType)INSTR_ARG(instr))
+            {
+            // Trig functions (assume radians)
+            case FUNC_SIN:
+                result = sin(arg_val);
+                break;
+            case FUNC_COS:
+                result = cos(arg_val);
+                break;
+            case FUNC_TAN:
+                result = tan(arg_val);
+                break;
+            // Inverse trig functions
+            case FUNC_ASIN:
+                if (arg_val < -1.0 || arg_val > 1.0)
+                {
+                    set_error(NMRI_ERROR_DOMAIN, -1, "Arcsin argument out of range [-1, 1].");
+                    return NAN;
+                }
+                result = asin(arg_val);
+                break;
+            case FUNC_ACOS:
+                if (arg_val < -1.0 || arg_val > 1.0)
+                {
+                    set_error(NMRI_ERROR_DOMAIN, -1, "Arccos argument out of range [-1, 1].");
+                    return NAN;
+                }
+                result = acos(arg_val);
+                break;
+            case FUNC_ATAN:
+                result = atan(arg_val);
+                break;
+            // Log, Sqrt, Exp
+            case FUNC_LOG:
+                if (arg_val <= 0.0)
+                {
+                    set_error(NMRI_ERROR_DOMAIN, -1, "Logarithm requires positive argument.");
+                    return NAN;
+                }
+                result = log(arg_val);
+                break;
+            case FUNC_SQRT:
+                if (arg_val < 0.0)
+                {
+                    set_error(NMRI_ERROR_DOMAIN, -1, "Square root requires non-negative argument.");
+                    return NAN;
+                }
+                result = sqrt(arg_val);
+                break;
+            case FUNC_EXP:
+                result = exp(arg_val);
+                break;
+            // Utility functions
+            case FUNC_ABS:
+                result = fabs(arg_val);
+                break;
+            case FUNC_FLOOR:
+                result = floor(arg_val);
+                break;
+            case FUNC_CEIL:
+                result = ceil(arg_val);
+                break;
+            case FUNC_ROUND:
+                result = round(arg_val);
+                break;
+            // Fast math (NMRI_MATH_FAST)
+            case FUNC_FAST_SIN:
+                result = fast_sin(arg_val);
+                break;
+            case FUNC_FAST_COS:
+                result = fast_cos(arg_val);
+                break;
+            case FUNC_FAST_EXP:
+                result = fast_exp(arg_val);
+                break;
+            case FUNC_FAST_LOG:
+                if (arg_val <= 0.0)
+                {
+                    set_error(NMRI_ERROR_DOMAIN, -1, "Logarithm requires positive argument.");
+                    return NAN;
+                }
+                result = fast_log(arg_val);
+                break;
+            default: // Includes FUNC_INVALID
+                set_error(NMRI_ERROR_INTERNAL, -1, "Unknown function type.");
+                return NAN;
+            }
+            stack[top] = result;
+        }
+        break;
+        case BC_NEG:
+            stack[top] = -stack[top];
+            break;
+        case BC_DUP:
+            stack[top + 1] = stack[top];
+            top++;
+            break;
+        default:
+            set_error(NMRI_ERROR_INTERNAL, -1, "Unknown bytecode instruction.");
+            return NAN;
+        }
+    }
+    return stack[0];
+}
+
+/**
+ * @brief Runs bytecode compiled for NMRI_MATH_EXTENDED: like `evaluate_bytecode()`,
+ * but every intermediate result is a long double, rounded to double once at the end.
+ * Constants and bindings are doubles, so a decimal literal such as 0.1 is not read
+ * more exactly than in the default mode; the long double functions of libm are used.
+ * @param bc The bytecode.
+ * @param bindings Value of each variable slot (may be NULL if there are no BC_VAR instructions).
+ * @return The calculated result, or NAN on error.
+ */
+double evaluate_bytecode_extended(const Bytecode *bc, const double *bindings)
+{
+    // Typical programs fit the stack buffer; deeper ones get a temporary one
+    long double inline_stack[EVAL_STACK_INLINE];
+    long double *stack = inline_stack;
+    if (bc->max_depth > EVAL_STACK_INLINE && !(stack = malloc(bc->max_depth * sizeof(long double))))
+    {
+        set_error(NMRI_ERROR_NO_MEMORY, -1, "Out of memory while evaluating expression.");
+        return NAN;
+    }
+    int top = -1;
+    double result = NAN;
+    int failed = 0;
+    for (int i = 0; i < bc->count && !failed; i++)
+    {
+        uint32_t instr = bc->code[i];
+        long double x = top >= 0 ? stack[top] : 0.0L;
+        switch (INSTR_OP(instr))
+        {
+        case BC_CONST:
+            stack[++top] = bc->constants[INSTR_ARG(instr)];
+            break;
+        case BC_VAR:
+            stack[++top] = bindings[INSTR_ARG(instr)];
+            break;
+        case BC_ADD:
+            top--;
+            stack[top] = stack[top] + x;
+            break;
+        case BC_SUB:
+            top--;
+            stack[top] = stack[top] - x;
+            break;
+        case BC_MUL:
+            top--;
+            stack[top] = stack[top] * x;
+            break;
+        case BC_DIV:
+            top--;
+            if (x == 0.0L)
+            {
+                set_error(NMRI_ERROR_DIVISION_BY_ZERO, -1, "Division by zero.");
+                failed = 1;
+                break;
+            }
+            stack[top] = stack[top] / x;
+            break;
+        case BC_POW:
+            top--;
+            stack[top] = powl(stack[top], x);
+            break;
+        case BC_MOD:
+            top--;
+            if (x == 0.0L)
+            {
+                set_error(NMRI_ERROR_DIVISION_BY_ZERO, -1, "Modulo by zero.");
+                failed = 1;
+                break;
+            }
+            stack[top] = fmodl(stack[top], x);
+            break;
+        case BC_ADD_PCT:
+            top--;
+            stack[top] = stack[top] + x * stack[top];
+            break;
+        case BC_SUB_PCT:
+            top--;
+            stack[top] = stack[top] - x * stack[top];
+            break;
+        case BC_FUNC:
+            switch ((FunctionType)INSTR_ARG(instr))
+            {
+            case FUNC_SIN:
+                stack[top] = sinl(x);
+                break;
+            case FUNC_COS:
+                stack[top] = cosl(x);
+                break;
+            case FUNC_TAN:
+                stack[top] = tanl(x);
+                break;
+            case FUNC_ASIN:
+                if (x < -1.0L || x > 1.0L)
+                {
+                    set_error(NMRI_ERROR_DOMAIN, -1, "Arcsin argument out of range [-1, 1].");
+                    failed = 1;
+                }
+                else
+                    stack[top] = asinl(x);
+                break;
+            case FUNC_ACOS:
+                if (x < -1.0L || x > 1.0L)
+                {
+                    set_error(NMRI_ERROR_DOMAIN, -1, "Arccos argument out of range [-1, 1].");
+                    failed = 1;
+                }
+                else
+                    stack[top] = acosl(x);
+                break;
+            case FUNC_ATAN:
+                stack[top] = atanl(x);
+                break;
+            case FUNC_LOG:
+                if (x <= 0.0L)
+                {
+                    set_error(NMRI_ERROR_DOMAIN, -1, "Logarithm requires positive argument.");
+                    failed = 1;
+                }
+                else
+                    stack[top] = logl(x);
+                break;
+            case FUNC_SQRT:
+                if (x < 0.0L)
+                {
+                    set_error(NMRI_ERROR_DOMAIN, -1, "Square root requires non-negative argument.");
+                    failed = 1;
+                }
+                else
+                    stack[top] = sqrtl(x);
+                break;
+            case FUNC_EXP:
+                stack[top] = expl(x);
+                break;
+            case FUNC_ABS:
+                stack[top] = fabsl(x);
+                break;
+            case FUNC_FLOOR:
+                stack[top] = floorl(x);
+                break;
+            case FUNC_CEIL:
+                stack[top] = ceill(x);
+                break;
+            case FUNC_ROUND:
+                stack[top] = roundl(x);
+                break;
+            default: // Fast-math functions are never emitted for extended code
+                set_error(NMRI_ERROR_INTERNAL, -1, "Unknown function type.");
+                failed = 1;
+                break;
+            }
+            break;
+        case BC_NEG:
+            stack[top] = -x;
+            break;
+        case BC_DUP:
+            stack[top + 1] = x;
+            top++;
+            break;
+        default:
+            set_error(NMRI_ERROR_INTERNAL, -1, "Unknown bytecode instruction.");
+            failed = 1;
+            break;
+        }
+    }
+    if (!failed)
+        result = (double)stack[0];
+    if (stack != inline_stack)
+        free(stack);
+    return result;
+}
+
+/* --- Math Modes --- */
+
+// NMRI_MATH_FAST replaces sin, cos, exp and log by the functions below: range
+// reduction plus a polynomial, without tables or branches, so the batch evaluator's
+// loops over them are vectorized (with -fno-trapping-math, which the Makefile passes).
+// They stay within 2 ulp of the correctly rounded result. Integers are extracted
+// from doubles by adding FAST_ROUND, which needs plain double arithmetic; with
+// excess precision (x87) they just call libm.
+
+#define FAST_ROUND 0x1.8p52               // x + FAST_ROUND - FAST_ROUND rounds |x| < 2^51 to an integer
+#define FAST_ROUND_BITS 0x4338000000000000ULL // Bits of FAST_ROUND: those of x + FAST_ROUND are these plus x
+#define FAST_LN2_HI 0x1.62e42fee00000p-1 // ln 2 in two parts, the first with trailing zero bits
+#define FAST_LN2_LO 0x1.a39ef35793c76p-33
+
+/**
+ * @brief e^x within 2 ulp: x = k ln 2 + r with |r| <= ln 2 / 2, e^r by its Taylor
+ * polynomial of degree 13 and 2^k built from bits (in two factors, so subnormal
+ * results are rounded once).
+ */
+inline double fast_exp(double x)
+{
+#if FLT_EVAL_METHOD == 0
+    double t = x < 709.8 ? x : 709.8; // Beyond: overflow to infinity, or underflow to 0
+    t = t > -745.2 ? t : -745.2;
+    double k = (t * 0x1.71547652b82fep0 + FAST_ROUND) - FAST_ROUND; // round(t / ln 2)
+    double r = (t - k * FAST_LN2_HI) - k * FAST_LN2_LO;
+    double p = 1.0 / 6227020800.0;
+    p = p * r + 1.0 / 479001600.0;
+    p = p * r + 1.0 / 39916800.0;
+    p = p * r + 1.0 / 3628800.0;
+    p = p * r + 1.0 / 362880.0;
+    p = p * r + 1.0 / 40320.0;
+    p = p * r + 1.0 / 5040.0;
+    p = p * r + 1.0 / 720.0;
+    p = p * r + 1.0 / 120.0;
+    p = p * r + 1.0 / 24.0;
+    p = p * r + 1.0 / 6.0;
+    p = p * r + 0.5;
+    p = p * r + 1.0;
+    p = p * r + 1.0;
+    double half = (k * 0.5 + FAST_ROUND) - FAST_ROUND;
+    double first = half + FAST_ROUND, second = (k - half) + FAST_ROUND;
+    uint64_t first_bits, second_bits;
+    memcpy(&first_bits, &first, sizeof(first_bits));
+    memcpy(&second_bits, &second, sizeof(second_bits));
+    first_bits = (first_bits - FAST_ROUND_BITS + 1023) << 52; // 2^half
+    second_bits = (second_bits - FAST_ROUND_BITS + 1023) << 52; // 2^(k - half)
+    memcpy(&first, &first_bits, sizeof(first));
+    memcpy(&second, &second_bits, sizeof(second));
+    double y = p * first * second;
+    return x == x ? y : x;
+#else
+    return exp(x);
+#endif
+}
+
+/**
+ * @brief log(x) within 2 ulp: x = 2^e m with sqrt(1/2) <= m < sqrt(2), and
+ * log(m) = 2 atanh(s) with s = (m - 1) / (m + 1), by its series up to s^23.
+ * Negative arguments give NaN and 0 gives -infinity, like `log()`.
+ */
+inline double fast_log(double x)
+{
+#if FLT_EVAL_METHOD == 0
+    int tiny = x < 0x1p-1022; // Subnormal: scaled to a normal number first
+    double scaled = tiny ? x * 0x1p54 : x;
+    uint64_t bits;
+    memcpy(&bits, &scaled, sizeof(bits));
+    uint64_t mantissa_bits = (bits & 0x000FFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL;
+    uint64_t exponent_bits = (bits >> 52) | 0x4330000000000000ULL; // 2^52 + biased exponent
+    double m, e;
+    memcpy(&m, &mantissa_bits, sizeof(m));
+    memcpy(&e, &exponent_bits, sizeof(e));
+    e -= 0x1p52 + 1023.0;
+    int above = m > 0x1.6a09e667f3bcdp0; // m > sqrt(2)
+    m = above ? m * 0.5 : m;
+    e = above ? e + 1.0 : e;
+    e = tiny ? e - 54.0 : e;
+    double s = (m - 1.0) / (m + 1.0);
+    double z = s * s;
+    double p = 1.0 / 23.0;
+    p = p * z + 1.0 / 21.0;
+    p = p * z + 1.0 / 19.0;
+    p = p * z + 1.0 / 17.0;
+    p = p * z + 1.0 / 15.0;
+    p = p * z + 1.0 / 13.0;
+    p = p * z + 1.0 / 11.0;
+    p = p * z + 1.0 / 9.0;
+    p = p * z + 1.0 / 7.0;
+    p = p * z + 1.0 / 5.0;
+    p = p * z + 1.0 / 3.0;
+    double y = e * FAST_LN2_HI + (2.0 * s + 2.0 * s * z * p + e * FAST_LN2_LO);
+    return x > 0.0 && x < INFINITY ? y : (x == 0.0 ? -INFINITY : (x > 0.0 ? x : NAN));
+#else
+    return log(x);
+#endif
+}
+
+/**
+ * @brief sin(x + quadrant * pi / 2) within 2 ulp for |x| <= FAST_TRIG_LIMIT, NaN beyond:
+ * x = k pi / 2 + r with |r| <= pi / 4 (pi / 2 in three parts, the first two of 33
+ * bits, so k times them is exact), then the Taylor polynomial of sin or cos of r.
+ * @param quadrant 0 for sin(x), 1 for cos(x).
+ */
+inline double fast_sin_kernel(double x, int quadrant)
+{
+#if FLT_EVAL_METHOD == 0
+    double k = (x * 0x1.45f306dc9c883p-1 + FAST_ROUND) - FAST_ROUND; // round(x * 2 / pi)
+    double r = ((x - k * 0x1.921fb544p0) - k * 0x1.0b4611a6p-34) - k * 0x1.3198a2e037073p-69;
+    double shifted = k + FAST_ROUND;
+    uint64_t q; // Quadrant of x in its two lowest bits
+    memcpy(&q, &shifted, sizeof(q));
+    q += (uint64_t)quadrant;
+    double z = r * r;
+    double s = 1.0 / 355687428096000.0;
+    s = s * z - 1.0 / 1307674368000.0;
+    s = s * z + 1.0 / 6227020800.0;
+    s = s * z - 1.0 / 39916800.0;
+    s = s * z + 1.0 / 362880.0;
+    s = s * z - 1.0 / 5040.0;
+    s = s * z + 1.0 / 120.0;
+    s = s * z - 1.0 / 6.0;
+    s = r + r * z * s;
+    double c = 1.0 / 20922789888000.0;
+    c = c * z - 1.0 / 87178291200.0;
+    c = c * z + 1.0 / 479001600.0;
+    c = c * z - 1.0 / 3628800.0;
+    c = c * z + 1.0 / 40320.0;
+    c = c * z - 1.0 / 720.0;
+    c = c * z + 1.0 / 24.0;
+    c = 1.0 - 0.5 * z + z * z * c;
+    double y = (q & 1) ? c : s;
+    y = (q & 2) ? -y : y;
+    return fabs(x) <= FAST_TRIG_LIMIT ? y : NAN;
+#else
+    return quadrant ? cos(x) : sin(x);
+#endif
+}
+
+/**
+ * @brief Fast-math sin(x): `fast_sin_kernel()`, or libm for the arguments it does not reduce.
+ */
+double fast_sin(double x)
+{
+    double y = fast_sin_kernel(x, 0);
+    return y == y ? y : sin(x);
+}
+
+/**
+ * @brief Fast-math cos(x): `fast_sin_kernel()`, or libm for the arguments it does not reduce.
+ */
+double fast_cos(double x)
+{
+    double y = fast_sin_kernel(x, 1);
+    return y == y ? y : cos(x);
+}
+
+/**
+ * @brief Gives the variant of a function compiled for an arithmetic: the fast-math
+ * one in NMRI_MATH_FAST where there is one, the libm one otherwise.
+ */
+FunctionType math_function(FunctionType func, NmriMath math)
+{
+    int fast = math == NMRI_MATH_FAST;
+    switch (func)
+    {
+    case FUNC_SIN:
+    case FUNC_FAST_SIN:
+        return fast ? FUNC_FAST_SIN : FUNC_SIN;
+    case FUNC_COS:
+    case FUNC_FAST_COS:
+        return fast ? FUNC_FAST_COS : FUNC_COS;
+    case FUNC_EXP:
+    case FUNC_FAST_EXP:
+        return fast ? FUNC_FAST_EXP : FUNC_EXP;
+    case FUNC_LOG:
+    case FUNC_FAST_LOG:
+        return fast ? FUNC_FAST_LOG : FUNC_LOG;
+    default:
+        return func;
+    }
+}
+
+/**
+ * @brief Returns the name of an arithmetic, as the 'math' command takes it ("unknown" if it is not one).
+ */
+const char *math_name(NmriMath math)
+{
+    static const char *names[] = {"default", "fast", "extended"};
+    return (unsigned)math < sizeof(names) / sizeof(names[0]) ? names[math] : "unknown";
+}
+
+/**
+ * @brief Looks up an arithmetic by name ("default", "fast" or "extended").
+ * @return The NmriMath, or -1 if the name is unknown.
+ */
+int math_from_name(const char *name)
+{
+    for (int math = NMRI_MATH_DEFAULT; math <= NMRI_MATH_EXTENDED; math++)
+    {
+        if (strcmp(name, math_name((NmriMath)math)) == 0)
+            return math;
+    }
+    return -1;
+}
+
+/* --- Single-Pass Parser --- */
+
+/**
+ * @brief Reads the next token into the parser's lookahead.
+ * @return 0 on success, -1 on error (an error is printed).
+ */
+int parser_advance(Parser *ps)
+{
+    int status = lex_token(ps->ctx, ps->input, &ps->pos, &ps->token, ps->program);
+    if (status < 0)
+        return -1;
+    ps->has_token = status;
+    return 0;
+}
+
+/**
+ * @brief Parses an operand: a number, a variable, a parenthesized group or a function call.
+ * A sign where an operand is expected pushes a zero and is left as the lookahead,
+ * so "-x" is parsed as the binary "0 - x" exactly like `tokenize_program()` does.
+ * @return 0 on success, -1 on error (recorded with `set_error()`), -2 if the syntax is not accepted (nothing recorded).
+ */
+int parse_operand(Parser *ps)
+{
+    if (!ps->has_token)
+        return -2; // Missing operand
+    const Token *token = &ps->token;
+    int status;
+    switch (token->type)
+    {
+    case TOKEN_NUMBER:
+        status = emit_constant(&ps->em, token->value.number, token->is_percentage);
+        return status < 0 ? -1 : parser_advance(ps);
+    case TOKEN_VARIABLE:
+        status = emit_variable(&ps->em, token->value.slot);
+        return status < 0 ? -1 : parser_advance(ps);
+    case TOKEN_OPERATOR:
+        if (token->value.op != OP_ADD && token->value.op != OP_SUB)
+            return -2;
+        return emit_constant(&ps->em, 0.0, 0);
+    case TOKEN_LPAREN:
+        if (parser_advance(ps) < 0)
+            return -1;
+        if ((status = parse_group(ps)) != 0)
+            return status;
+        if (!ps->has_token)
+            return -2; // Missing ')'
+        return parser_advance(ps);
+    case TOKEN_FUNCTION:
+    {
+        FunctionType func = token->value.func;
+        if (parser_advance(ps) < 0)
+            return -1;
+        if (ps->has_token && ps->token.type == TOKEN_LPAREN)
+            status = parse_operand(ps);
+        else
+            status = parse_group(ps); // Without parentheses a function applies to the rest of the group
+        if (status != 0)
+            return status;
+        return emit_function(&ps->em, func);
+    }
+    case TOKEN_CALL:
+        return parse_call(ps);
+    default:
+        return -2; // ')', ',' or an assignment where an operand is expected
+    }
+}
+
+/**
+ * @brief Parses operands joined by operators binding at least as tightly as `min_precedence`
+ * (precedence climbing over `precedence()` and `is_left_associative()`).
+ * @return 0 on success, -1 on error (recorded with `set_error()`), -2 if the syntax is not accepted (nothing recorded).
+ */
+int parse_binary(Parser *ps, int min_precedence)
+{
+    if (ps->nesting >= MAX_PARSE_NESTING)
+        return -2; // Leave very deep nesting to the non-recursive token pipeline
+    ps->nesting++;
+    int status = parse_operand(ps);
+    while (status == 0 && ps->has_token && ps->token.type == TOKEN_OPERATOR &&
+           precedence(ps->token.value.op) >= min_precedence)
+    {
+        OperatorType op = ps->token.value.op;
+        if ((status = parser_advance(ps)) < 0)
+            break;
+        // The right operand takes tighter operators only, or equal ones too if right-associative
+        status = parse_binary(ps, precedence(op) + is_left_associative(op));
+        if (status == 0)
+            status = emit_operator(&ps->em, op);
+    }
+    ps->nesting--;
+    return status;
+}
+
+/**
+ * @brief Parses the contents of a group, up to the closing ')' or the end of the input.
+ * @return 0 on success, -1 on error (recorded with `set_error()`), -2 if the syntax is not accepted (nothing recorded).
+ */
+int parse_group(Parser *ps)
+{
+    int status = parse_binary(ps, 0);
+    if (status == 0 && ps->has_token && ps->token.type != TOKEN_RPAREN)
+        return -2; // Juxtaposed operands such as "2 3"
+    return status;
+}
+
+/**
+ * @brief Parses a call of a user-defined function: its parenthesized, comma-separated
+ * arguments, which are then replaced by the inlined body (see `emit_call()`).
+ * @return 0 on success, -1 on error (recorded with `set_error()`), -2 if the syntax is not accepted (nothing recorded).
+ */
+int parse_call(Parser *ps)
+{
+    const UserFunction *function = &ps->ctx->functions[ps->token.value.slot];
+    if (parser_advance(ps) < 0 || parser_advance(ps) < 0) // The name, then the '(' the lexer saw after it
+        return -1;
+    int args = 0;
+    if (!ps->has_token || ps->token.type != TOKEN_RPAREN) // Unless there are no arguments
+    {
+        for (;;)
+        {
+            int status = parse_binary(ps, 0);
+            if (status != 0)
+                return status;
+            args++;
+            if (!ps->has_token)
+                return -2; // Missing ')'
+            if (ps->token.type == TOKEN_RPAREN)
+                break;
+            if (ps->token.type != TOKEN_COMMA)
+                return -2;
+            if (parser_advance(ps) < 0)
+                return -1;
+        }
+    }
+    if (args != function->param_count)
+    {
+        // The lookahead token is the call's ')'
+        set_error(NMRI_ERROR_ARGUMENTS, (int)(ps->pos - ps->input) - 1, "Function '%s' takes %d argument%s (%d given).",
+                  function->name, function->param_count, function->param_count == 1 ? "" : "s", args);
+        return -1;
+    }
+    if (emit_call(&ps->em, ps->ctx, ps->program, function) < 0)
+        return -1;
+    return parser_advance(ps);
+}
+
+/**
+ * @brief Compiles an expression to bytecode in a single pass over its characters.
+ * Well-formed input both parses and compiles here; for anything else nothing is
+ * printed, so the caller can rerun the token pipeline to get its diagnostics.
+ * @param arena Arena the bytecode is allocated from.
+ * @param input The expression string.
+ * @param program The program collecting variable slots, or NULL to inline variable values.
+ * @param out Receives the bytecode.
+ * @return 0 on success, 1 for an empty expression, -1 on error (recorded with `set_error()`),
+ * -2 if the syntax is not accepted (nothing recorded).
+ */
+int parse_expression(const NmriContext *ctx, Arena *arena, const char *input, NmriProgram *program, Bytecode *out)
+{
+    Parser ps;
+    ps.ctx = ctx;
+    ps.program = program;
+    ps.input = input;
+    ps.pos = input;
+    ps.nesting = 0;
+    emitter_init(&ps.em, arena, ctx ? ctx->math : NMRI_MATH_DEFAULT);
+    if (parser_advance(&ps) < 0)
+        return -1;
+    if (!ps.has_token)
+        return 1;
+    int status = parse_group(&ps);
+    if (status != 0)
+        return status;
+    if (ps.has_token)
+        return -2; // Unbalanced ')'
+    return emit_finish(&ps.em, out);
+}
+
+/**
+ * @brief Compiles an expression string to bytecode.
+ * The single-pass parser handles well-formed input; whatever it does not accept
+ * goes through `tokenize_program()`, `shunting_yard()` and `compile_postfix()`,
+ * which report the error (or, for very deep nesting, compile it without recursion).
+ * @param arena Arena the bytecode and scratch buffers are allocated from.
+ * @param input The expression string.
+ * @param program The program collecting variable slots, or NULL to inline variable values.
+ * @param out Receives the bytecode.
+ * @param failed_stage Set to the name of the failing stage for tokenization and
+ * Shunting-yard errors (left untouched otherwise).
+ * @return 0 on success, 1 for an empty expression, -1 on error (recorded with `set_error()`).
+ */
+int compile_expression(const NmriContext *ctx, Arena *arena, const char *input, NmriProgram *program, Bytecode *out,
+                       const char **failed_stage)
+{
+    STATS_BEGIN(STAT_PARSE);
+    int status = parse_expression(ctx, arena, input, program, out);
+    STATS_END(STAT_PARSE);
+    if (status == -1)
+        *failed_stage = "Tokenization";
+    if (status != -2)
+        return status;
+    Token *tokens, *postfix;
+    STATS_BEGIN(STAT_TOKENIZE);
+    int token_count = tokenize_program(ctx, arena, input, &tokens, program);
+    STATS_END(STAT_TOKENIZE);
+    if (token_count < 0)
+    {
+        *failed_stage = "Tokenization";
+        return -1;
+    }
+    if (token_count == 0)
+        return 1;
+    STATS_BEGIN(STAT_SHUNTING_YARD);
+    int postfix_count = shunting_yard(arena, tokens, token_count, &postfix);
+    STATS_END(STAT_SHUNTING_YARD);
+    if (postfix_count < 0)
+    {
+        *failed_stage = "Shunting-yard";
+        if (last_error.code == NMRI_ERROR_SYNTAX && last_error.position < 0)
+            last_error.position = unbalanced_parenthesis(input); // Tokens do not keep their position
+        return -1;
+    }
+    STATS_BEGIN(STAT_COMPILE_POSTFIX);
+    status = compile_postfix(ctx, arena, postfix, postfix_count, program, out);
+    STATS_END(STAT_COMPILE_POSTFIX);
+    return status;
+}
+
+/* --- Commands and Evaluation --- */
+
+/**
+ * @brief Handles variable assignment (e.g., "x = 1 + 2").
+ * Parses and evaluates the expression on the right-hand side and assigns
+ * the result to the specified variable.
+ * @param var_name The name of the variable to assign to.
+ * @param expression The expression string to evaluate.
+ * @return The calculated result, or NAN on error.
+ */
+double handle_assignment(NmriContext *ctx, const char *var_name, const char *expression)
+{
+    if (ctx->reactive)
+    {
+        STATS_ENTER(&ctx->stats);
+        double value = reactive_assign(ctx, var_name, expression);
+        STATS_LEAVE();
+        if (isnan(value))
+            return NAN;
+        ctx->last_result = value;
+        set_variable(ctx, "ans", value);
+        log_message(ctx, "Assignment: %s = %g (Expression: '%s')", var_name, value, expression);
+        return value;
+    }
+    // 1. Evaluate the right-hand side expression
+    const char *failed_stage = NULL;
+    STATS_ENTER(&ctx->stats);
+    double result = compute_expression(ctx, &ctx->arena, &ctx->cache, expression, &failed_stage);
+    STATS_LEAVE();
+    arena_reset(&ctx->arena); // The scratch buffers are no longer needed
+    if (isnan(result) && !failed_stage)
+    {
+        set_error(NMRI_ERROR_SYNTAX, (int)text_length(expression), "Missing expression after '=' for assignment to '%s'.",
+                  var_name);
+        log_message(ctx, "Assignment Error: Missing expression for '%s'", var_name);
+        return NAN;
+    }
+    // 2. Assign the result to the variable if evaluation was successful
+    if (!isnan(result))
+    {
+        if (set_variable(ctx, var_name, result) < 0)
+        {
+            log_message(ctx, "Assignment Error: Failed to store result %g in variable '%s'", result, var_name);
+            return NAN;
+        }
+        // Update last_result and 'ans' only if assignment is successful
+        ctx->last_result = result;
+        set_variable(ctx, "ans", result); // Keep 'ans' variable updated
+        log_message(ctx, "Assignment: %s = %g (Expression: '%s')", var_name, result, expression);
+    }
+    else
+    {
+        log_message(ctx, "Assignment Error: %s failed for '%s = %s'", failed_stage, var_name, expression);
+    }
+    return result; // Return the calculated value (or NAN if evaluation failed)
+}
+
+/**
+ * @brief Processes built-in text commands (non-mathematical).
+ * @param input The user input string.
+ * @return
+ * 1 if a command was processed (and no further evaluation needed).
+ * -1 if the 'exit' command was given.
+ * 0 if the input was not a recognized command (should be treated as expression).
+ */
+int process_command(NmriContext *ctx, const char *input)
+{
+    // Trim leading/trailing whitespace for simpler comparison
+    const char *start = input;
+    while (isspace((unsigned char)*start))
+        start++;
+    size_t len = strlen(start);
+    while (len > 0 && isspace((unsigned char)start[len - 1]))
+        len--;
+    char *trimmed_input = arena_alloc(&ctx->arena, len + 1);
+    if (!trimmed_input)
+    {
+        report_error(NMRI_ERROR_NO_MEMORY, "Out of memory.");
+        return 1;
+    }
+    memcpy(trimmed_input, start, len);
+    trimmed_input[len] = '\0';
+    int result = process_trimmed_command(ctx, trimmed_input);
+    arena_reset(&ctx->arena);
+    return result;
+}
+
+/**
+ * @brief Processes a built-in command whose surrounding whitespace is already removed.
+ * @param trimmed_input The command.
+ * @return Same as `process_command(ctx)`.
+ */
+int process_trimmed_command(NmriContext *ctx, const char *trimmed_input)
+{
+    // Handle simple commands
+    if (strcmp(trimmed_input, "help") == 0)
+    {
+        show_help(ctx);
+        return 1;
+    }
+    if (strcmp(trimmed_input, "exit") == 0 || strcmp(trimmed_input, "quit") == 0)
+    {
+        return -1;
+    }
+    if (strcmp(trimmed_input, "clear") == 0 || strcmp(trimmed_input, "cls") == 0)
+    {
+        printf("\033[2J\033[H");
+        return 1;
+    }
+    if (strcmp(trimmed_input, "history") == 0)
+    {
+        show_history(ctx);
+        return 1;
+    }
+    if (strcmp(trimmed_input, "variables") == 0 || strcmp(trimmed_input, "vars") == 0)
+    {
+        show_variables(ctx);
+        return 1;
+    }
+    if (strcmp(trimmed_input, "reactive") == 0 || strcmp(trimmed_input, "reactive on") == 0 ||
+        strcmp(trimmed_input, "reactive off") == 0)
+    {
+        if (trimmed_input[8] != '\0')
+            reactive_set_mode(ctx, strcmp(trimmed_input + 9, "on") == 0);
+        printf("Reactive mode is %s.\n", ctx->reactive ? "on" : "off");
+        log_message(ctx, "Reactive mode: %s", ctx->reactive ? "on" : "off");
+        return 1;
+    }
+    if (strcmp(trimmed_input, "math") == 0 || strncmp(trimmed_input, "math ", 5) == 0)
+    {
+        if (trimmed_input[4] != '\0')
+        {
+            int math = math_from_name(trimmed_input + 5);
+            if (math < 0)
+            {
+                printf("Usage: math [default|fast|extended]\n");
+                return 1;
+            }
+            nmri_context_set_math(ctx, (NmriMath)math);
+        }
+        printf("Math mode is %s.\n", math_name(ctx->math));
+        log_message(ctx, "Math mode: %s", math_name(ctx->math));
+        return 1;
+    }
+    if (strcmp(trimmed_input, "memory") == 0 || strcmp(trimmed_input, "mem") == 0)
+    {
+        printf("Memory: %g\n", ctx->memory);
+        return 1;
+    }
+    if (strcmp(trimmed_input, "m+") == 0)
+    {
+        ctx->memory += ctx->last_result;
+        printf("Memory = %g (added %g)\n", ctx->memory, ctx->last_result);
+        log_message(ctx, "Memory += %g --> %g", ctx->last_result, ctx->memory);
+        return 1;
+    }
+    if (strcmp(trimmed_input, "m-") == 0)
+    {
+        ctx->memory -= ctx->last_result;
+        printf("Memory = %g (subtracted %g)\n", ctx->memory, ctx->last_result);
+        log_message(ctx, "Memory -= %g --> %g", ctx->last_result, ctx->memory);
+        return 1;
+    }
+    if (strcmp(trimmed_input, "mr") == 0)
+    {
+        printf("Recalled from memory: %g\n", ctx->memory);
+        ctx->last_result = ctx->memory;
+        set_variable(ctx, "ans", ctx->last_result);
+        log_message(ctx, "Memory Recall (mr): %g", ctx->memory);
+        return 1;
+    }
+    if (strcmp(trimmed_input, "mc") == 0)
+    {
+        ctx->memory = 0.0;
+        printf("Memory cleared.\n");
+        log_message(ctx, "Memory Cleared (mc)");
+        return 1;
+    }
+    if (strcmp(trimmed_input, "functions") == 0 || strcmp(trimmed_input, "funcs") == 0)
+    {
+        show_functions(ctx);
+        return 1;
+    }
+    if (strncmp(trimmed_input, "save ", 5) == 0 || strncmp(trimmed_input, "load ", 5) == 0)
+    {
+        const char *path = trimmed_input + 5;
+        while (isspace((unsigned char)*path))
+            path++;
+        int functions = 0, variables = 0;
+        if (*trimmed_input == 's')
+        {
+            if (save_library(ctx, path, &functions, &variables) == 0)
+            {
+                printf("Saved %d function%s and %d variable%s to '%s'.\n", functions, functions == 1 ? "" : "s",
+                       variables, variables == 1 ? "" : "s", path);
+                log_message(ctx, "Library saved: %s (%d functions, %d variables)", path, functions, variables);
+            }
+        }
+        else if (load_library(ctx, path, &functions, &variables) == 0)
+        {
+            printf("Loaded %d function%s and %d variable%s from '%s'.\n", functions, functions == 1 ? "" : "s",
+                   variables, variables == 1 ? "" : "s", path);
+            log_message(ctx, "Library loaded: %s (%d functions, %d variables)", path, functions, variables);
+        }
+        return 1;
+    }
+    if (strcmp(trimmed_input, "stats") == 0 || strncmp(trimmed_input, "stats ", 6) == 0)
+    {
+        const char *arg = trimmed_input + 5;
+        while (isspace((unsigned char)*arg))
+            arg++;
+#ifdef NMRI_STATS
+        if (*arg == '\0')
+            show_stats(ctx, stdout);
+        else if (strcmp(arg, "reset") == 0)
+        {
+            memset(&ctx->stats, 0, sizeof(ctx->stats));
+            ctx->cache.hits = ctx->cache.misses = 0;
+            printf("Statistics reset.\n");
+        }
+        else
+            printf("Usage: stats [reset]\n");
+#else
+        (void)arg;
+        report_error(NMRI_ERROR_INVALID, "Statistics are not compiled in (build with `make STATS_FLAGS=-DNMRI_STATS`).");
+#endif
+        return 1;
+    }
+    // Handle 'store <varname>' command
+    if (strncmp(trimmed_input, "store ", 6) == 0)
+    {
+        const char *var_name = trimmed_input + 6;
+        while (isspace((unsigned char)*var_name))
+            var_name++;
+        if (*var_name == '\0')
+        {
+            report_error(NMRI_ERROR_INVALID, "Missing variable name for 'store' command.");
+            log_message(ctx, "Command Error: Missing variable name for store");
+            return 1;
+        }
+        char name_buf[MAX_IDENTIFIER_LEN] = {0};
+        int i = 0;
+        const char *name_start = var_name;
+        if (!isalpha((unsigned char)*name_start) && *name_start != '_')
+        {
+            report_error(NMRI_ERROR_INVALID, "Invalid variable name '%s' for 'store'. Must start with a letter or underscore.", name_start);
+            log_message(ctx, "Command Error: Invalid store variable name '%s'", name_start);
+            return 1;
+        }
+        while (*var_name && !isspace((unsigned char)*var_name) && i < MAX_IDENTIFIER_LEN - 1)
+        {
+            if (!isalnum((unsigned char)*var_name) && *var_name != '_')
+            {
+                report_error(NMRI_ERROR_INVALID, "Invalid character '%c' in variable name for 'store'.", *var_name);
+                log_message(ctx, "Command Error: Invalid char in store variable name '%s'", name_start);
+                return 1;
+            }
+            name_buf[i++] = *var_name++;
+        }
+        name_buf[i] = '\0';
+        if (*var_name != '\0' && !isspace((unsigned char)*var_name))
+        {
+            report_error(NMRI_ERROR_INVALID, "Variable name '%s...' too long or invalid for 'store'.", name_buf);
+            log_message(ctx, "Command Error: Store variable name too long or invalid '%s'", name_buf);
+            return 1;
+        }
+        if (reactive_set_value(ctx, name_buf, ctx->last_result) >= 0)
+        {
+            printf("Stored %g in variable '%s'\n", ctx->last_result, name_buf);
+            if (ctx->reactive)
+                show_reactive_updates(ctx, 0);
+            log_message(ctx, "Command: Stored %g in variable '%s'", ctx->last_result, name_buf);
+        }
+        else
+        {
+            log_message(ctx, "Command Error: Failed to store %g in variable '%s'", ctx->last_result, name_buf);
+        }
+        return 1;
+    }
+    // Handle 'log ...' commands
+    if (strncmp(trimmed_input, "log ", 4) == 0)
+    {
+        const char *subcommand = trimmed_input + 4;
+        while (isspace((unsigned char)*subcommand))
+            subcommand++;
+        if (strcmp(subcommand, "on") == 0)
+        {
+            if (!ctx->logging_enabled)
+            {
+                if (init_logging(ctx))
+                {
+                    ctx->logging_enabled = 1;
+                    printf("%sLogging enabled.%s To file: %s\n", COLOR_GREEN, COLOR_RESET, ctx->log_path);
+                    log_session_start(ctx);
+                    log_message(ctx, "Command: Logging enabled");
+                }
+            }
+            else
+            {
+                printf("Logging is already enabled. Log file: %s\n", ctx->log_path);
+            }
+            return 1;
+        }
+        if (strcmp(subcommand, "off") == 0)
+        {
+            if (ctx->logging_enabled)
+            {
+                log_message(ctx, "Command: Logging disabled");
+                log_session_stop(ctx);
+                ctx->logging_enabled = 0;
+                printf("%sLogging disabled.%s\n", COLOR_YELLOW, COLOR_RESET);
+            }
+            else
+            {
+                printf("Logging is already disabled.\n");
+            }
+            return 1;
+        }
+        if (strcmp(subcommand, "show") == 0 || strncmp(subcommand, "show ", 5) == 0)
+        {
+            char *end;
+            long lines = subcommand[4] ? strtol(subcommand + 5, &end, 10) : LOG_SHOW_LINES;
+            if (subcommand[4])
+                while (isspace((unsigned char)*end))
+                    end++;
+            if (lines <= 0 || lines > INT_MAX || (subcommand[4] && *end))
+            {
+                printf("Usage: log show [<lines>]\n");
+                return 1;
+            }
+            log_message(ctx, "Command: Show log requested");
+            show_log(ctx, (int)lines);
+            return 1;
+        }
+        if (strcmp(subcommand, "file") == 0)
+        {
+            printf("Current log file path: %s%s%s\n", COLOR_YELLOW, ctx->log_path, COLOR_RESET);
+            log_message(ctx, "Command: Log file path requested (%s)", ctx->log_path);
+            return 1;
+        }
+        if (strncmp(subcommand, "file ", 5) == 0)
+        {
+            const char *new_path = subcommand + 5;
+            while (isspace((unsigned char)*new_path))
+                new_path++;
+            char *path_copy = *new_path ? strdup(new_path) : NULL;
+            if (*new_path && !path_copy)
+            {
+                report_error(NMRI_ERROR_NO_MEMORY, "Out of memory while setting the log file path.");
+            }
+            else if (*new_path)
+            {
+                close_logging(ctx);
+                free(ctx->log_path);
+                ctx->log_path = path_copy;
+                printf("Log file path set to: %s%s%s\n", COLOR_YELLOW, ctx->log_path, COLOR_RESET);
+                if (ctx->logging_enabled)
+                {
+                    init_logging(ctx);
+                    log_session_start(ctx);
+                    log_message(ctx, "Command: Log file path changed to %s", ctx->log_path);
+                }
+                else
+                {
+                    log_message(ctx, "Command: Log file path set to %s (logging is off)", ctx->log_path);
+                }
+            }
+            else
+            {
+                printf("Usage: log file <new_path>\n");
+            }
+            return 1;
+        }
+        if (strcmp(subcommand, "binary") == 0)
+        {
+            printf(ctx->binary_log ? "A binary log is being recorded.\n" : "No binary log is being recorded.\n");
+            return 1;
+        }
+        if (strcmp(subcommand, "binary off") == 0)
+        {
+            binary_log_close(ctx);
+            printf("%sBinary log stopped.%s\n", COLOR_YELLOW, COLOR_RESET);
+            return 1;
+        }
+        if (strncmp(subcommand, "binary ", 7) == 0)
+        {
+            const char *path = subcommand + 7;
+            while (isspace((unsigned char)*path))
+                path++;
+            if (binary_log_open(ctx, path))
+            {
+                printf("%sRecording binary log to:%s %s\n", COLOR_GREEN, COLOR_RESET, path);
+                log_message(ctx, "Command: Binary log started (%s)", path);
+            }
+            return 1;
+        }
+        if (strcmp(subcommand, "flush") == 0)
+        {
+            printf("Log writes after %u records (0 = no limit) and every %u ms (0 = no limit).\n",
+                   ctx->log_flush_records, ctx->log_flush_ms);
+            return 1;
+        }
+        if (strncmp(subcommand, "flush ", 6) == 0)
+        {
+            char *end;
+            long records = strtol(subcommand + 6, &end, 10);
+            long ms = end > subcommand + 6 ? strtol(end, &end, 10) : -1;
+            while (isspace((unsigned char)*end))
+                end++;
+            if (records < 0 || ms < 0 || records > 1000000 || ms > 3600000 || *end)
+            {
+                printf("Usage: log flush <records> <milliseconds>   (0 turns a limit off)\n");
+                return 1;
+            }
+            log_set_flush_policy(ctx, (unsigned)records, (unsigned)ms);
+            printf("Log writes after %u records and every %u ms.\n", ctx->log_flush_records, ctx->log_flush_ms);
+            log_message(ctx, "Command: Log flush policy set to %u records / %u ms", ctx->log_flush_records, ctx->log_flush_ms);
+            return 1;
+        }
+        report_error(NMRI_ERROR_INVALID, "Unknown 'log' subcommand '%s'. Use 'on', 'off', 'show', 'file', 'file <path>', 'binary <path>', 'binary off' or 'flush <records> <ms>'.", subcommand);
+        log_message(ctx, "Command Error: Unknown log subcommand '%s'", subcommand);
+        return 1;
+    }
+    // If none of the above, it's not a recognized command
+    return 0;
+}
+
+/**
+ * @brief Evaluates a complete mathematical expression string.
+ * This function orchestrates the tokenization, Shunting-yard conversion,
+ * and postfix evaluation steps. Updates `last_result` and 'ans' variable on success.
+ * @param input The mathematical expression string.
+ * @return The calculated result, or NAN on error.
+ */
+double evaluate_expression(NmriContext *ctx, const char *input)
+{
+    const char *failed_stage = NULL;
+    STATS_ENTER(&ctx->stats);
+    double result = compute_expression(ctx, &ctx->arena, &ctx->cache, input, &failed_stage);
+    STATS_LEAVE();
+    arena_reset(&ctx->arena); // The scratch buffers are no longer needed
+    // Update global state if successful
+    if (!isnan(result))
+    {
+        ctx->last_result = result;
+        set_variable(ctx, "ans", result);
+        if (ctx->logging_enabled)
+            log_message(ctx, "Result: %.*s = %g", (int)text_length(input), input, result);
+    }
+    else if (failed_stage)
+    {
+        log_message(ctx, "Evaluation Error: %s failed for '%.*s'", failed_stage, (int)text_length(input), input);
+    }
+    return result;
+}
+
+/**
+ * @brief Evaluates an expression string without any side effect.
+ * Compiles it with `compile_expression()` (or takes its compiled form from
+ * `cache`) and runs the bytecode but neither updates `last_result`/'ans' nor
+ * logs, so it may run concurrently on several threads as long as no variable
+ * is being modified at the same time (each thread using its own arena and cache).
+ * @param arena Arena for the scratch buffers; the caller resets it afterwards.
+ * @param cache Cache of compiled expressions, or NULL to compile with the variable values inlined.
+ * @param input The mathematical expression string.
+ * @param failed_stage Set to the name of the failing stage on error (left untouched for an empty expression).
+ * @return The calculated result, or NAN on error.
+ */
+double compute_expression(const NmriContext *ctx, Arena *arena, ProgramCache *cache, const char *input,
+                          const char **failed_stage)
+{
+    // 1. Look up the compiled program or compile (a single pass for well-formed input)
+    Bytecode bc;
+    double *bindings = NULL;
+    NmriProgram *program = NULL;
+    if (cache && program_cache_get(ctx, cache, arena, input, &program, failed_stage) != 0)
+        return NAN; // Empty or invalid expression
+    if (program)
+    {
+        bindings = arena_alloc(arena, program->var_count * sizeof(double));
+        if (!bindings)
+        {
+            set_error(NMRI_ERROR_NO_MEMORY, -1, "Out of memory while evaluating expression.");
+            *failed_stage = "Postfix evaluation";
+            return NAN;
+        }
+        if (nmri_bind_variables(ctx, program, bindings) < 0)
+        {
+            // Point at the undefined variable (the message's only argument), as when values are inlined
+            if (last_error.code == NMRI_ERROR_UNKNOWN_NAME)
+                last_error.position = find_identifier(input, last_error.text);
+            *failed_stage = "Tokenization"; // Unknown identifier, as reported when values are inlined
+            return NAN;
+        }
+        bc = program->bc;
+    }
+    else
+    {
+        const char *stage = "Postfix evaluation";
+        int status = compile_expression(ctx, arena, input, NULL, &bc, &stage);
+        if (status == 1)
+        {
+            return NAN;
+        } // Empty expression is invalid for evaluation
+        if (status < 0)
+        {
+            *failed_stage = stage;
+            return NAN;
+        }
+    }
+    // 2. Evaluate
+    double *stack = arena_alloc(arena, bc.max_depth * sizeof(double));
+    if (!stack)
+    {
+        set_error(NMRI_ERROR_NO_MEMORY, -1, "Out of memory while evaluating expression.");
+        *failed_stage = "Postfix evaluation";
+        return NAN;
+    }
+    STATS_BEGIN(STAT_EVALUATE);
+    double result = program ? program_evaluate(program, bindings, stack) : evaluate_bytecode(&bc, bindings, stack);
+    STATS_END(STAT_EVALUATE);
+    if (isnan(result))
+        *failed_stage = "Postfix evaluation";
+    return result;
+}
+
+/* --- Compiled Expressions --- */
+
+/**
+ * @brief Registers a variable name in a program, reusing its slot if already present.
+ * @param program The program being compiled.
+ * @param name The variable name.
+ * @return The slot index, or -1 if memory could not be allocated.
+ */
+int program_add_variable(NmriProgram *program, const char *name)
+{
+    int slot = nmri_program_var_slot(program, name);
+    return slot >= 0 ? slot : program_new_variable(program, name);
+}
+
+/**
+ * @brief Adds a variable slot to a program, without looking for an existing one.
+ * @return The slot index, or -1 if memory could not be allocated.
+ */
+int program_new_variable(NmriProgram *program, const char *name)
+{
+    char(*names)[MAX_IDENTIFIER_LEN] = realloc(program->var_names, (program->var_count + 1) * sizeof(*names));
+    if (!names)
+    {
+        set_error(NMRI_ERROR_NO_MEMORY, -1, "Out of memory while compiling expression.");
+        return -1;
+    }
+    program->var_names = names;
+    strncpy(names[program->var_count], name, MAX_IDENTIFIER_LEN - 1);
+    names[program->var_count][MAX_IDENTIFIER_LEN - 1] = '\0';
+    return program->var_count++;
+}
+
+/**
+ * @brief Compiles an expression once so it can be evaluated many times.
+ * Constants and functions are resolved now; variables (including 'ans') are
+ * kept as slots and bound on each call to `nmri_eval()`.
+ * @param expression The expression string (no assignment).
+ * @return A new program (release with `nmri_free()`), or NULL on error.
+ */
+NmriProgram *nmri_compile(const char *expression)
+{
+    Arena arena = {0}; // Scratch buffers, released before returning
+    const char *failed_stage = NULL;
+    NmriProgram *program = NULL;
+    if (program_compile(NULL, &arena, expression, NULL, 0, &program, &failed_stage) == 1)
+        report_error(NMRI_ERROR_SYNTAX, "Empty expression.");
+    arena_free(&arena);
+    return program;
+}
+
+/**
+ * @brief Compiles an expression into a new program, like `nmri_compile()`.
+ * @param ctx Session whose user-defined functions may be called, or NULL.
+ * @param arena Arena for the scratch buffers; the caller resets it afterwards.
+ * @param expression The expression string (no assignment).
+ * @param params Names given the first variable slots, for the body of a function (may be NULL).
+ * @param param_count Number of `params`.
+ * @param program_out Set to the new program (release with `nmri_free()`), or NULL.
+ * @param failed_stage Set to the name of the failing stage on error.
+ * @return 0 on success, 1 for an empty expression, -1 on error (recorded with `set_error()`).
+ */
+int program_compile(const NmriContext *ctx, Arena *arena, const char *expression, const char (*params)[MAX_IDENTIFIER_LEN],
+                    int param_count, NmriProgram **program_out, const char **failed_stage)
+{
+    *program_out = NULL;
+    NmriProgram *program = calloc(1, sizeof(*program));
+    if (!program)
+    {
+        set_error(NMRI_ERROR_NO_MEMORY, -1, "Out of memory while compiling expression.");
+        *failed_stage = "Postfix evaluation";
+        return -1;
+    }
+    for (int i = 0; i < param_count; i++)
+    {
+        if (program_new_variable(program, params[i]) < 0)
+        {
+            *failed_stage = "Postfix evaluation";
+            nmri_free(program);
+            return -1;
+        }
+    }
+    program->param_count = param_count;
+    Bytecode bc;
+    const char *stage = "Postfix evaluation";
+    int status = compile_expression(ctx, arena, expression, program, &bc, &stage);
+    if (status != 0)
+    {
+        if (status < 0)
+            *failed_stage = stage;
+        nmri_free(program);
+        return status;
+    }
+    // Move the code out of the arena into the program
+    program->bc = bc;
+    program->bc.code = malloc(bc.count * sizeof(uint32_t));
+    program->bc.constants = malloc((bc.constant_count + 1) * sizeof(double));
+    if (!program->bc.code || !program->bc.constants)
+    {
+        set_error(NMRI_ERROR_NO_MEMORY, -1, "Out of memory while compiling expression.");
+        *failed_stage = "Postfix evaluation";
+        nmri_free(program);
+        return -1;
+    }
+    memcpy(program->bc.code, bc.code, bc.count * sizeof(uint32_t));
+    if (bc.constant_count > 0) // A program of variables only has no constant pool
+        memcpy(program->bc.constants, bc.constants, bc.constant_count * sizeof(double));
+    if (jit_supported())
+        program->jit = calloc(1, sizeof(JitState)); // Without it the program is just never compiled to native code
+    *program_out = program;
+    return 0;
+}
+
+/**
+ * @brief Evaluates a compiled program.
+ * @param program The compiled program.
+ * @param bindings One value per variable slot, in slot order (may be NULL if the program has no variables).
+ * @return The calculated result, or NAN on error.
+ */
+double nmri_eval(const NmriProgram *program, const double *bindings)
+{
+    if (!program || (program->var_count > 0 && !bindings))
+        return NAN;
+    // Typical programs fit the stack buffer; deeper ones get a temporary one
+    double inline_stack[EVAL_STACK_INLINE];
+    double *stack = inline_stack;
+    if (program->bc.max_depth > EVAL_STACK_INLINE && !(stack = malloc(program->bc.max_depth * sizeof(double))))
+    {
+        set_error(NMRI_ERROR_NO_MEMORY, -1, "Out of memory while evaluating expression.");
+        return NAN;
+    }
+    double result = program_evaluate(program, bindings, stack);
+    if (stack != inline_stack)
+        free(stack);
+    return result;
+}
+
+/* --- Reactive Variables --- */
+
+/**
+ * @brief Turns the reactive mode of a session on or off. Turning it off drops the
+ * formulas: the variables keep their current values.
+ */
+void reactive_set_mode(NmriContext *ctx, int enabled)
+{
+    if (!enabled)
+    {
+        for (int i = 0; i < ctx->variable_count; i++)
+        {
+            formula_release(ctx, i);
+            free(ctx->variables[i].dependents);
+            ctx->variables[i].dependents = NULL;
+            ctx->variables[i].dependent_count = ctx->variables[i].dependent_capacity = 0;
+        }
+    }
+    ctx->reactive = enabled != 0;
+}
+
+/**
+ * @brief Records that the formula of variable `dependent` reads `var`.
+ * @return 0 on success, -1 if out of memory.
+ */
+int dependent_add(Variable *var, int dependent)
+{
+    if (var->dependent_count == var->dependent_capacity)
+    {
+        int capacity = var->dependent_capacity ? var->dependent_capacity * 2 : 4;
+        int *dependents = realloc(var->dependents, capacity * sizeof(int));
+        if (!dependents)
+            return -1;
+        var->dependents = dependents;
+        var->dependent_capacity = capacity;
+    }
+    var->dependents[var->dependent_count++] = dependent;
+    return 0;
+}
+
+/**
+ * @brief Drops the formula of a variable (its value is kept) and detaches it from the variables it read.
+ * @param index The variable (nothing is done if it has no formula).
+ */
+void formula_release(NmriContext *ctx, int index)
+{
+    Formula *formula = ctx->variables[index].formula;
+    if (!formula)
+        return;
+    for (int i = 0; i < formula->program->var_count; i++)
+    {
+        Variable *input = &ctx->variables[formula->inputs[i]];
+        for (int j = 0; j < input->dependent_count; j++)
+        {
+            if (input->dependents[j] == index)
+            {
+                input->dependents[j] = input->dependents[--input->dependent_count];
+                break;
+            }
+        }
+    }
+    nmri_free(formula->program);
+    free(formula->inputs);
+    free(formula->bindings);
+    free(formula->expression);
+    free(formula);
+    ctx->variables[index].formula = NULL;
+}
+
+/**
+ * @brief Lists the variables whose formula depends, directly or not, on `root` in
+ * `ctx->reactive_order`, each after all the variables it reads (the reverse
+ * postorder of a depth-first walk of the dependents, done with an explicit stack
+ * so long chains of formulas do not overflow the call stack). The listed variables
+ * and `root` get the new `ctx->reactive_mark`.
+ * @return The number of variables listed, or -1 if out of memory.
+ */
+int reactive_collect(NmriContext *ctx, int root)
+{
+    if (ctx->reactive_capacity < ctx->variable_count)
+    {
+        int *order = realloc(ctx->reactive_order, ctx->variable_capacity * sizeof(int));
+        if (order)
+            ctx->reactive_order = order;
+        int *stack = order ? realloc(ctx->reactive_stack, ctx->variable_capacity * 2 * sizeof(int)) : NULL;
+        if (!stack)
+            return -1;
+        ctx->reactive_stack = stack;
+        ctx->reactive_capacity = ctx->variable_capacity;
+    }
+    if (++ctx->reactive_mark == 0) // Wrapped around: clear the old marks
+    {
+        for (int i = 0; i < ctx->variable_count; i++)
+            ctx->variables[i].mark = 0;
+        ctx->reactive_mark = 1;
+    }
+    unsigned mark = ctx->reactive_mark;
+    int *stack = ctx->reactive_stack; // Pairs of a variable and the next of its dependents to visit
+    int depth = 1, count = 0;
+    stack[0] = root;
+    stack[1] = 0;
+    ctx->variables[root].mark = mark;
+    while (depth > 0)
+    {
+        int *top = &stack[2 * (depth - 1)];
+        const Variable *var = &ctx->variables[top[0]];
+        if (top[1] < var->dependent_count)
+        {
+            int dependent = var->dependents[top[1]++];
+            if (ctx->variables[dependent].mark != mark)
+            {
+                ctx->variables[dependent].mark = mark;
+                stack[2 * depth] = dependent;
+                stack[2 * depth + 1] = 0;
+                depth++;
+            }
+        }
+        else
+        {
+            ctx->reactive_order[count++] = top[0]; // All its dependents are listed
+            depth--;
+        }
+    }
+    count--; // The root is finished last
+    for (int i = 0; i < count / 2; i++)
+    {
+        int swap = ctx->reactive_order[i];
+        ctx->reactive_order[i] = ctx->reactive_order[count - 1 - i];
+        ctx->reactive_order[count - 1 - i] = swap;
+    }
+    return count;
+}
+
+/**
+ * @brief Recomputes the formulas that depend on a variable whose value just changed,
+ * each once and after the variables it reads. The other variables are not touched,
+ * so the cost depends on the affected part of the model only. A formula that fails
+ * (e.g. divides by zero) gets NAN, and so do the formulas reading it; its error is kept
+ * in the formula for `show_reactive_updates()`, not in `last_error`, since the change
+ * itself succeeded.
+ * @param root The variable that changed.
+ * @return The number of recomputed variables (listed in `ctx->reactive_order`), or -1 if out of memory.
+ */
+int reactive_update(NmriContext *ctx, int root)
+{
+    ctx->reactive_updated = 0;
+    int count = reactive_collect(ctx, root);
+    ErrorState saved = last_error;
+    for (int i = 0; i < count; i++)
+    {
+        Variable *var = &ctx->variables[ctx->reactive_order[i]];
+        Formula *formula = var->formula;
+        for (int slot = 0; slot < formula->program->var_count; slot++)
+            formula->bindings[slot] = ctx->variables[formula->inputs[slot]].value;
+        last_error.pending = 0;
+        double value = nmri_eval(formula->program, formula->bindings);
+        formula->error = isnan(value) && last_error.pending ? last_error.code : NMRI_OK;
+        var->value = isnan(value) ? NAN : value;
+    }
+    if (count > 0)
+        last_error = saved;
+    ctx->reactive_updated = count > 0 ? count : 0;
+    return count;
+}
+
+/**
+ * @brief Sets a variable to a plain value (dropping its formula in reactive mode)
+ * and recomputes the formulas depending on it.
+ * @return The index of the variable, or -1 if out of memory.
+ */
+int reactive_set_value(NmriContext *ctx, const char *name, double value)
+{
+    int index = set_variable(ctx, name, value);
+    if (index >= 0 && ctx->reactive)
+    {
+        formula_release(ctx, index);
+        reactive_update(ctx, index);
+    }
+    return index;
+}
+
+/**
+ * @brief `handle_assignment()` in reactive mode: the expression is compiled once and,
+ * if it reads other variables, kept as the variable's formula along with the index
+ * of each variable it reads, so that changing any of them recomputes it (see
+ * `reactive_update()`). An expression of constants only, or one that reads 'ans' or
+ * the variable being assigned (e.g. "n = n + 1"), is evaluated once as in normal mode.
+ * A formula that would depend on itself through other formulas is refused.
+ * @return The new value of the variable, or NAN on error (recorded with `set_error()`).
+ */
+double reactive_assign(NmriContext *ctx, const char *name, const char *expression)
+{
+    ctx->reactive_updated = 0;
+    NmriProgram *program = NULL;
+    const char *failed_stage = NULL;
+    int status = program_compile(ctx, &ctx->arena, expression, NULL, 0, &program, &failed_stage);
+    arena_reset(&ctx->arena);
+    if (status == 1)
+    {
+        set_error(NMRI_ERROR_SYNTAX, (int)text_length(expression), "Missing expression after '=' for assignment to '%s'.",
+                  name);
+        log_message(ctx, "Assignment Error: Missing expression for '%s'", name);
+        return NAN;
+    }
+    if (status < 0)
+    {
+        log_message(ctx, "Assignment Error: %s failed for '%s = %s'", failed_stage, name, expression);
+        return NAN;
+    }
+    int vars = program->var_count, snapshot = vars == 0;
+    int *inputs = malloc((vars + 1) * sizeof(int));
+    double *bindings = malloc((vars + 1) * sizeof(double));
+    char *text = strndup(expression + strspn(expression, " \t"), text_length(expression + strspn(expression, " \t")));
+    double result = NAN;
+    if (!inputs || !bindings || !text)
+        set_error(NMRI_ERROR_NO_MEMORY, -1, "Out of memory while compiling expression.");
+    else
+    {
+        result = 0.0;
+        for (int i = 0; i < vars && !isnan(result); i++)
+        {
+            const char *input = program->var_names[i];
+            if ((inputs[i] = find_variable(ctx, input)) < 0)
+            {
+                set_error(NMRI_ERROR_UNKNOWN_NAME, find_identifier(expression, input), "Unknown identifier '%s'.", input);
+                result = NAN;
+                break;
+            }
+            bindings[i] = ctx->variables[inputs[i]].value;
+            if (strcmp(input, "ans") == 0 || strcmp(input, name) == 0)
+                snapshot = 1; // Evaluated once, as without reactive mode
+        }
+        if (!isnan(result))
+            result = nmri_eval(program, bindings);
+    }
+    int target = isnan(result) ? -1 : find_variable(ctx, name);
+    if (!isnan(result) && !snapshot && target >= 0)
+    {
+        // Refuse a cycle: one of the inputs must not depend on the variable being assigned
+        if (reactive_collect(ctx, target) < 0)
+        {
+            set_error(NMRI_ERROR_NO_MEMORY, -1, "Out of memory while compiling expression.");
+            result = NAN;
+        }
+        for (int i = 0; i < vars && !isnan(result); i++)
+        {
+            if (ctx->variables[inputs[i]].mark == ctx->reactive_mark)
+            {
+                set_error(NMRI_ERROR_INVALID, find_identifier(expression, program->var_names[i]),
+                          "Circular reference: '%s' depends on '%s'.", program->var_names[i], name);
+                result = NAN;
+            }
+        }
+    }
+    if (!isnan(result) && target < 0 && (target = set_variable(ctx, name, result)) < 0)
+        result = NAN;
+    if (isnan(result))
+    {
+        log_message(ctx, "Assignment Error: Evaluation failed for '%s = %s'", name, expression);
+        nmri_free(program);
+        free(inputs);
+        free(bindings);
+        free(text);
+        return NAN;
+    }
+
+    formula_release(ctx, target);
+    Formula *formula = snapshot ? NULL : malloc(sizeof(Formula));
+    if (formula)
+    {
+        *formula = (Formula){program, inputs, bindings, text, NMRI_OK};
+        ctx->variables[target].formula = formula;
+        for (int i = 0; i < vars; i++)
+        {
+            if (dependent_add(&ctx->variables[inputs[i]], target) < 0)
+            {
+                formula_release(ctx, target); // Out of memory: keep the value only
+                break;
+            }
+        }
+    }
+    else
+    {
+        nmri_free(program);
+        free(inputs);
+        free(bindings);
+        free(text);
+    }
+    ctx->variables[target].value = result;
+    reactive_update(ctx, target);
+    return result;
+}
+
+/**
+ * @brief Shows what the last assignment recomputed in reactive mode: every recomputed
+ * variable in the REPL, and in any mode the formulas that failed, as the session's
+ * `error_output` says (e.g. "3: division-by-zero: 'ratio' could not be recomputed." in the stream mode).
+ * @param interactive 1 to also print the recomputed values (REPL).
+ */
+void show_reactive_updates(const NmriContext *ctx, int interactive)
+{
+    for (int i = 0; i < ctx->reactive_updated; i++)
+    {
+        const Variable *var = &ctx->variables[ctx->reactive_order[i]];
+        if (interactive)
+        {
+            char number[NUMBER_BUFFER];
+            format_value(ctx->output_format, var->value, number);
+            printf("  %s%s = %s%s\n", COLOR_DIM, var->name, number, COLOR_RESET);
+        }
+        NmriError error = var->formula->error;
+        if (error == NMRI_OK || ctx->error_output == ERRORS_NONE)
+            continue;
+        if (ctx->error_output == ERRORS_RECORD)
+            fprintf(stderr, "%lu: %s: '%s' could not be recomputed.\n", ctx->line_number, nmri_error_name(error),
+                    var->name);
+        else
+            fprintf(stderr, "%sError:%s '%s' could not be recomputed (%s).\n", COLOR_RED, COLOR_RESET, var->name,
+                    nmri_error_name(error));
+    }
+}
+
+/* --- User-Defined Functions --- */
+
+/**
+ * @brief Finds a user-defined function by name.
+ * @param ctx The session (may be NULL: then there are no functions).
+ * @return The index in `ctx->functions`, or -1 if there is no such function.
+ */
+int find_function(const NmriContext *ctx, const char *name)
+{
+    if (!ctx || ctx->function_count == 0)
+        return -1;
+    unsigned hash = hash_name(name);
+    for (int i = 0; i < ctx->function_count; i++)
+    {
+        if (ctx->functions[i].hash == hash && strcmp(ctx->functions[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * @brief Checks that a name is an identifier (a letter or '_', then letters, digits and '_')
+ * ending with a NUL within `size` bytes.
+ */
+int is_identifier(const char *name, size_t size)
+{
+    size_t len = strnlen(name, size);
+    if (len == 0 || len == size || (!isalpha((unsigned char)name[0]) && name[0] != '_'))
+        return 0;
+    for (size_t i = 1; i < len; i++)
+    {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '_')
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Checks that bytecode from outside the compiler (a loaded library) is
+ * something the compiler could have produced: known opcodes, operands within the
+ * constant pool and the variable slots, and a stack that never underflows and
+ * ends with one value.
+ * @param var_count Number of variable slots the code may read.
+ * @return 0 if the code is valid, -1 otherwise.
+ */
+int bytecode_verify(const Bytecode *bc, int var_count)
+{
+    int depth = 0, max_depth = 0;
+    for (int i = 0; i < bc->count; i++)
+    {
+        int arg = INSTR_ARG(bc->code[i]);
+        switch (INSTR_OP(bc->code[i]))
+        {
+        case BC_CONST:
+            if (arg >= bc->constant_count)
+                return -1;
+            depth++;
+            break;
+        case BC_VAR:
+            if (arg >= var_count)
+                return -1;
+            depth++;
+            break;
+        case BC_ADD:
+        case BC_SUB:
+        case BC_MUL:
+        case BC_DIV:
+        case BC_POW:
+        case BC_MOD:
+        case BC_ADD_PCT:
+        case BC_SUB_PCT:
+            if (depth < 2)
+                return -1;
+            depth--;
+            break;
+        case BC_FUNC:
+            if (depth < 1 || arg < FUNC_SIN || arg > FUNC_FAST_LOG)
+                return -1;
+            break;
+        case BC_NEG:
+            if (depth < 1)
+                return -1;
+            break;
+        case BC_DUP: // Always followed by BC_MUL (see `emit_replay()`)
+            if (depth < 1 || i + 1 >= bc->count || INSTR_OP(bc->code[i + 1]) != BC_MUL)
+                return -1;
+            depth++;
+            break;
+        default:
+            return -1;
+        }
+        if (depth > max_depth)
+            max_depth = depth;
+    }
+    return depth == 1 && max_depth <= bc->max_depth ? 0 : -1;
+}
+
+/**
+ * @brief Releases what a function owns (nothing if it lives in a loaded library).
+ */
+void function_release(UserFunction *function)
+{
+    if (function->mapped)
+        return;
+    free(function->bc.code);
+    free(function->bc.constants);
+    free(function->var_names);
+    free(function->source);
+}
+
+/**
+ * @brief Adds a function to the session, replacing any function of the same name.
+ * Programs compiled before keep the body they inlined, so the caches are emptied.
+ * @param function The function (the session takes over what it owns).
+ * @return 0 on success, -1 if out of memory (the function is released).
+ */
+int function_store(NmriContext *ctx, UserFunction *function)
+{
+    int index = find_function(ctx, function->name);
+    if (index >= 0)
+    {
+        function_release(&ctx->functions[index]);
+    }
+    else
+    {
+        if (ctx->function_count == ctx->function_capacity)
+        {
+            int capacity = ctx->function_capacity ? ctx->function_capacity * 2 : INITIAL_VARIABLES;
+            UserFunction *functions = realloc(ctx->functions, capacity * sizeof(UserFunction));
+            if (!functions)
+            {
+                report_error(NMRI_ERROR_NO_MEMORY, "Out of memory while defining function '%s'.", function->name);
+                function_release(function);
+                return -1;
+            }
+            ctx->functions = functions;
+            ctx->function_capacity = capacity;
+        }
+        index = ctx->function_count++;
+    }
+    ctx->functions[index] = *function;
+    ctx->functions_version++;
+    return 0;
+}
+
+/**
+ * @brief Recognizes the start of a function definition, "name(a, b) =".
+ * @param line The input line.
+ * @param name Receives the function name.
+ * @param params Receives the parameter names (MAX_FUNCTION_PARAMS entries).
+ * @param param_count Receives the number of parameters.
+ * @param body Set to the first character after '='.
+ * @return 1 for a definition, 0 if the line is not one, -1 if it has too many parameters (printed).
+ */
+int parse_function_header(const char *line, char *name, char (*params)[MAX_IDENTIFIER_LEN], int *param_count,
+                          const char **body)
+{
+    const char *p = line;
+    while (isspace((unsigned char)*p))
+        p++;
+    size_t len = identifier_length(p);
+    if (len == 0 || len >= MAX_IDENTIFIER_LEN)
+        return 0; // Not a definition (or reported as an invalid name by the assignment)
+    memcpy(name, p, len);
+    name[len] = '\0';
+    p += len;
+    while (isspace((unsigned char)*p))
+        p++;
+    if (*p++ != '(')
+        return 0;
+    while (isspace((unsigned char)*p))
+        p++;
+    int count = 0;
+    if (*p != ')')
+    {
+        for (;;)
+        {
+            len = identifier_length(p);
+            if (len == 0 || len >= MAX_IDENTIFIER_LEN)
+                return 0;
+            if (count == MAX_FUNCTION_PARAMS)
+            {
+                report_error(NMRI_ERROR_LIMIT, "Functions take at most %d parameters.", MAX_FUNCTION_PARAMS);
+                return -1;
+            }
+            memcpy(params[count], p, len);
+            params[count++][len] = '\0';
+            p += len;
+            while (isspace((unsigned char)*p))
+                p++;
+            if (*p == ')')
+                break;
+            if (*p++ != ',')
+                return 0;
+            while (isspace((unsigned char)*p))
+                p++;
+        }
+    }
+    p++; // ')'
+    while (isspace((unsigned char)*p))
+        p++;
+    if (*p != '=')
+        return 0;
+    *param_count = count;
+    *body = p + 1;
+    return 1;
+}
+
+/**
+ * @brief Returns the length of the identifier at `p` (0 if `p` does not start one).
+ */
+size_t identifier_length(const char *p)
+{
+    if (!isalpha((unsigned char)*p) && *p != '_')
+        return 0;
+    size_t len = 1;
+    while (isalnum((unsigned char)p[len]) || p[len] == '_')
+        len++;
+    return len;
+}
+
+/**
+ * @brief Defines (or redefines) a function: checks the names, compiles the body once
+ * and stores it with the definition's text.
+ * @param name The function name.
+ * @param params The parameter names.
+ * @param param_count Number of parameters.
+ * @param body The expression after '='.
+ * @param definition The whole definition, as shown by `functions` (surrounding whitespace is dropped).
+ * @return 0 on success, -1 on error (printed).
+ */
+int define_function(NmriContext *ctx, const char *name, const char (*params)[MAX_IDENTIFIER_LEN], int param_count,
+                    const char *body, const char *definition)
+{
+    if (find_builtin(name, strlen(name)))
+    {
+        report_error(NMRI_ERROR_INVALID, "Cannot define a function with the reserved name '%s'.", name);
+        return -1;
+    }
+    for (int i = 0; i < param_count; i++)
+    {
+        int duplicate = 0;
+        for (int j = 0; j < i; j++)
+            duplicate |= strcmp(params[i], params[j]) == 0;
+        if (duplicate || find_builtin(params[i], strlen(params[i])))
+        {
+            report_error(NMRI_ERROR_INVALID, "Invalid parameter '%s' for function '%s'%s.", params[i], name,
+                         duplicate ? " (given twice)" : " (a reserved name)");
+            return -1;
+        }
+    }
+
+    NmriProgram *program;
+    const char *failed_stage = NULL;
+    int status = program_compile(ctx, &ctx->arena, body, params, param_count, &program, &failed_stage);
+    arena_reset(&ctx->arena);
+    if (status == 1)
+        report_error(NMRI_ERROR_SYNTAX, "Missing expression after '=' for function '%s'.", name);
+    if (status != 0)
+        return -1;
+
+    UserFunction function = {0};
+    strcpy(function.name, name);
+    function.hash = hash_name(name);
+    function.param_count = param_count;
+    function.bc = program->bc;
+    function.var_names = program->var_names;
+    function.var_count = program->var_count;
+    program->bc.code = NULL; // Now owned by the function
+    program->bc.constants = NULL;
+    program->var_names = NULL;
+    nmri_free(program);
+    while (isspace((unsigned char)*definition))
+        definition++;
+    size_t len = strlen(definition);
+    while (len > 0 && isspace((unsigned char)definition[len - 1]))
+        len--;
+    function.source = strndup(definition, len);
+    if (!function.source)
+    {
+        report_error(NMRI_ERROR_NO_MEMORY, "Out of memory while defining function '%s'.", name);
+        function_release(&function);
+        return -1;
+    }
+    return function_store(ctx, &function);
+}
+
+/**
+ * @brief Displays the user-defined functions.
+ */
+void show_functions(const NmriContext *ctx)
+{
+    printf("%s%s=== Functions ===%s\n", COLOR_BOLD, COLOR_MAGENTA, COLOR_RESET);
+    if (ctx->function_count == 0)
+        printf("  %s(No functions defined)%s\n", COLOR_DIM, COLOR_RESET);
+    for (int i = 0; i < ctx->function_count; i++)
+        printf("  %s%s%s\n", COLOR_YELLOW, ctx->functions[i].source, COLOR_RESET);
+    printf("%s%s=== End of Functions ===%s\n", COLOR_BOLD, COLOR_MAGENTA, COLOR_RESET);
+}
+
+/**
+ * @brief Writes `size` bytes followed by zeros up to the next multiple of 8.
+ * @return 0 on success, -1 on a write error.
+ */
+int write_padded(FILE *out, const void *data, size_t size)
+{
+    static const char zeros[8];
+    if (size > 0 && fwrite(data, 1, size, out) != size)
+        return -1;
+    size_t padding = (8 - size % 8) % 8;
+    return padding > 0 && fwrite(zeros, 1, padding, out) != padding ? -1 : 0;
+}
+
+#define LIBRARY_PADDED(size) (((uint64_t)(size) + 7) & ~(uint64_t)7)
+
+/**
+ * @brief Saves the session's functions (compiled) and variables (except 'ans') to a
+ * library file that `load_library()` maps without parsing. The file is written
+ * next to `path` and renamed over it, so a failed save leaves the old library.
+ * @param functions Receives the number of functions saved.
+ * @param variables Receives the number of variables saved.
+ * @return 0 on success, -1 on error (printed).
+ */
+int save_library(const NmriContext *ctx, const char *path, int *functions, int *variables)
+{
+    LibraryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LIBRARY_MAGIC, sizeof(header.magic));
+    header.byte_order = LIBRARY_BYTE_ORDER;
+    header.function_count = (uint32_t)ctx->function_count;
+    header.size = sizeof(header);
+    for (int i = 0; i < ctx->variable_count; i++)
+    {
+        if (strcmp(ctx->variables[i].name, "ans") != 0)
+            header.variable_count++;
+    }
+    header.size += header.variable_count * sizeof(LibraryVariable);
+    for (int i = 0; i < ctx->function_count; i++)
+    {
+        const UserFunction *function = &ctx->functions[i];
+        header.size += sizeof(LibraryFunction) + function->bc.constant_count * sizeof(double) +
+                       function->var_count * (uint64_t)MAX_IDENTIFIER_LEN +
+                       LIBRARY_PADDED(function->bc.count * sizeof(uint32_t)) + LIBRARY_PADDED(strlen(function->source) + 1);
+    }
+
+    size_t path_length = strlen(path);
+    char *temp = malloc(path_length + 5);
+    if (!temp)
+    {
+        report_error(NMRI_ERROR_NO_MEMORY, "Out of memory.");
+        return -1;
+    }
+    memcpy(temp, path, path_length);
+    memcpy(temp + path_length, ".tmp", 5);
+    FILE *out = fopen(temp, "wb");
+    if (!out)
+    {
+        report_error(NMRI_ERROR_IO, "Could not create '%s'.", temp);
+        free(temp);
+        return -1;
+    }
+    int status = write_padded(out, &header, sizeof(header));
+    for (int i = 0; i < ctx->variable_count && status == 0; i++)
+    {
+        if (strcmp(ctx->variables[i].name, "ans") == 0)
+            continue;
+        LibraryVariable variable = {{0}, ctx->variables[i].value};
+        strcpy(variable.name, ctx->variables[i].name);
+        status = write_padded(out, &variable, sizeof(variable));
+    }
+    for (int i = 0; i < ctx->function_count && status == 0; i++)
+    {
+        const UserFunction *function = &ctx->functions[i];
+        LibraryFunction record = {{0}, (uint32_t)function->param_count, (uint32_t)function->var_count,
+                                  (uint32_t)function->bc.count, (uint32_t)function->bc.constant_count,
+                                  (uint32_t)function->bc.max_depth, (uint32_t)strlen(function->source)};
+        strcpy(record.name, function->name);
+        if (write_padded(out, &record, sizeof(record)) < 0 ||
+            write_padded(out, function->bc.constants, function->bc.constant_count * sizeof(double)) < 0 ||
+            write_padded(out, function->var_names, function->var_count * (size_t)MAX_IDENTIFIER_LEN) < 0 ||
+            write_padded(out, function->bc.code, function->bc.count * sizeof(uint32_t)) < 0 ||
+            write_padded(out, function->source, record.source_length + 1) < 0)
+            status = -1;
+    }
+    if (fclose(out) != 0)
+        status = -1;
+    if (status == 0 && rename(temp, path) != 0)
+        status = -1;
+    if (status < 0)
+    {
+        report_error(NMRI_ERROR_IO, "Could not write the library '%s'.", path);
+        remove(temp);
+    }
+    free(temp);
+    *functions = (int)header.function_count;
+    *variables = (int)header.variable_count;
+    return status;
+}
+
+/**
+ * @brief Loads a library written by `save_library()`: the file is mapped read-only
+ * and the functions use their compiled code in place, so nothing is parsed or
+ * compiled. Everything in the file is checked before anything is defined; functions
+ * and variables of the same names are replaced (in reactive mode a loaded variable
+ * drops its formula and its dependents are recomputed, as with `store`).
+ * @param functions Receives the number of functions loaded.
+ * @param variables Receives the number of variables loaded.
+ * @return 0 on success, -1 on error (printed).
+ */
+int load_library(NmriContext *ctx, const char *path, int *functions, int *variables)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        report_error(NMRI_ERROR_IO, "Could not open the library '%s'.", path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    void *data = size >= sizeof(LibraryHeader) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    const LibraryHeader *header = data;
+    if (data == MAP_FAILED || memcmp(header->magic, LIBRARY_MAGIC, sizeof(header->magic)) != 0 ||
+        header->byte_order != LIBRARY_BYTE_ORDER)
+    {
+        report_error(NMRI_ERROR_IO, "'%s' is not a library saved on this kind of machine.", path);
+        if (data != MAP_FAILED)
+            munmap(data, size);
+        return -1;
+    }
+    if (header->size != size || header->variable_count > (size - sizeof(*header)) / sizeof(LibraryVariable))
+    {
+        report_error(NMRI_ERROR_IO, "The library '%s' is damaged.", path);
+        munmap(data, size);
+        return -1;
+    }
+
+    // Check every part of the file before defining anything
+    const char *bytes = data;
+    const LibraryVariable *library_variables = (const LibraryVariable *)(bytes + sizeof(*header));
+    uint64_t offset = sizeof(*header) + header->variable_count * sizeof(LibraryVariable);
+    int valid = 1;
+    for (uint32_t i = 0; i < header->variable_count && valid; i++)
+        valid = is_identifier(library_variables[i].name, MAX_IDENTIFIER_LEN);
+    UserFunction *loaded = calloc(header->function_count ? header->function_count : 1, sizeof(UserFunction));
+    if (!loaded)
+    {
+        report_error(NMRI_ERROR_NO_MEMORY, "Out of memory.");
+        munmap(data, size);
+        return -1;
+    }
+    for (uint32_t i = 0; i < header->function_count && valid; i++)
+    {
+        if (offset + sizeof(LibraryFunction) > size)
+        {
+            valid = 0;
+            break;
+        }
+        const LibraryFunction *record = (const LibraryFunction *)(bytes + offset);
+        uint64_t end = offset + sizeof(*record) + record->constant_count * (uint64_t)sizeof(double) +
+                       record->var_count * (uint64_t)MAX_IDENTIFIER_LEN +
+                       LIBRARY_PADDED(record->code_count * (uint64_t)sizeof(uint32_t)) +
+                       LIBRARY_PADDED(record->source_length + (uint64_t)1);
+        if (end > size || !is_identifier(record->name, MAX_IDENTIFIER_LEN) ||
+            find_builtin(record->name, strlen(record->name)) || record->param_count > MAX_FUNCTION_PARAMS ||
+            record->param_count > record->var_count || record->code_count > MAX_OPERAND ||
+            record->constant_count > MAX_OPERAND + 1u || record->var_count > MAX_OPERAND + 1u)
+        {
+            valid = 0;
+            break;
+        }
+        UserFunction *function = &loaded[i];
+        const char *part = bytes + offset + sizeof(*record);
+        strcpy(function->name, record->name);
+        function->hash = hash_name(function->name);
+        function->param_count = (int)record->param_count;
+        function->var_count = (int)record->var_count;
+        function->bc.constants = (double *)part;
+        function->bc.constant_count = (int)record->constant_count;
+        part += record->constant_count * sizeof(double);
+        function->var_names = (char(*)[MAX_IDENTIFIER_LEN])part;
+        part += record->var_count * (size_t)MAX_IDENTIFIER_LEN;
+        function->bc.code = (uint32_t *)part;
+        function->bc.count = (int)record->code_count;
+        function->bc.max_depth = (int)record->max_depth;
+        part += LIBRARY_PADDED(record->code_count * sizeof(uint32_t));
+        function->source = (char *)part;
+        function->mapped = 1;
+        for (int slot = 0; slot < function->var_count && valid; slot++)
+            valid = is_identifier(function->var_names[slot], MAX_IDENTIFIER_LEN);
+        valid = valid && strnlen(function->source, record->source_length + 1) == record->source_length &&
+                bytecode_verify(&function->bc, function->var_count) == 0;
+        offset = end;
+    }
+    if (!valid || offset != size)
+    {
+        report_error(NMRI_ERROR_IO, "The library '%s' is damaged.", path);
+        free(loaded);
+        munmap(data, size);
+        return -1;
+    }
+
+    // Keep the mapping for as long as the functions may be called
+    if (header->function_count > 0)
+    {
+        MappedLibrary *libraries = realloc(ctx->libraries, (ctx->library_count + 1) * sizeof(MappedLibrary));
+        if (!libraries)
+        {
+            report_error(NMRI_ERROR_NO_MEMORY, "Out of memory.");
+            free(loaded);
+            munmap(data, size);
+            return -1;
+        }
+        ctx->libraries = libraries;
+        ctx->libraries[ctx->library_count++] = (MappedLibrary){data, size};
+    }
+    int status = 0;
+    for (uint32_t i = 0; i < header->variable_count && status >= 0; i++)
+        status = reactive_set_value(ctx, library_variables[i].name, library_variables[i].value);
+    for (uint32_t i = 0; i < header->function_count && status >= 0; i++)
+        status = function_store(ctx, &loaded[i]);
+    *functions = (int)header->function_count;
+    *variables = (int)header->variable_count;
+    free(loaded);
+    if (header->function_count == 0)
+        munmap(data, size);
+    return status < 0 ? -1 : 0;
+}
+
+/* --- Native Code (JIT) --- */
+
+// Programs are interpreted until they have been evaluated JIT_THRESHOLD times;
+// then their bytecode is translated into a native function. The native code
+// keeps evaluation stack entry i in floating point register i, loads constants
+// and bindings straight from their arrays and calls `batch_scalar_op()` and
+// `batch_scalar_func()` for pow, fmod and the library functions, so results are
+// bit-for-bit those of the interpreter. It does not report errors: wherever the
+// interpreter could fail (a zero divisor, a NaN out of a checked function) it
+// returns NAN at once and `program_evaluate()` reruns the program in the
+// interpreter, which yields the same result and prints the message.
+
+/**
+ * @brief Evaluates a program, with its native code once it is hot.
+ * @param program The compiled program.
+ * @param bindings One value per variable slot, in slot order.
+ * @param stack Scratch entries for the interpreter, `program->bc.max_depth` of them.
+ * @return The calculated result, or NAN on error (recorded with `set_error()`).
+ */
+double program_evaluate(const NmriProgram *program, const double *bindings, double *stack)
+{
+#ifdef NMRI_JIT
+    JitState *jit = program->jit;
+    if (jit)
+    {
+        int status = __atomic_load_n(&jit->status, __ATOMIC_ACQUIRE);
+        if (status == JIT_READY)
+        {
+            double result = jit->entry(bindings);
+            if (!isnan(result))
+                return result;
+        }
+        else if (status == JIT_COLD)
+        {
+            // Plain load and store: a lost count under contention only delays compiling
+            unsigned long evaluations = __atomic_load_n(&jit->evaluations, __ATOMIC_RELAXED) + 1;
+            __atomic_store_n(&jit->evaluations, evaluations, __ATOMIC_RELAXED);
+            if (evaluations >= JIT_THRESHOLD)
+                jit_compile(&program->bc, jit);
+        }
+    }
+#endif
+    return evaluate_bytecode(&program->bc, bindings, stack);
+}
+
+/**
+ * @brief Tells whether a program is evaluated by native code now.
+ */
+int program_is_native(const NmriProgram *program)
+{
+#ifdef NMRI_JIT
+    return program->jit && __atomic_load_n(&program->jit->status, __ATOMIC_ACQUIRE) == JIT_READY;
+#else
+    (void)program;
+    return 0;
+#endif
+}
+
+/**
+ * @brief Tells whether this build compiles hot programs to native code.
+ */
+int jit_supported(void)
+{
+#ifdef NMRI_JIT
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * @brief Releases the native code state of a program.
+ */
+void jit_release(JitState *jit)
+{
+    if (!jit)
+        return;
+#ifdef NMRI_JIT
+    if (jit->memory)
+        munmap(jit->memory, jit->size);
+#endif
+    free(jit);
+}
+
+#ifdef NMRI_JIT
+/**
+ * @brief Compiles a program to native code, unless another thread already does.
+ * On failure (unsupported code, no executable memory) the program stays interpreted.
+ */
+void jit_compile(const Bytecode *bc, JitState *jit)
+{
+    int expected = JIT_COLD;
+    if (!__atomic_compare_exchange_n(&jit->status, &expected, JIT_COMPILING, 0, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED))
+        return;
+    int status = JIT_UNAVAILABLE;
+    JitBuffer jb = {0};
+    // Extended code needs long double arithmetic, which the native code does not have
+    int entry = bc->math != NMRI_MATH_EXTENDED && bc->max_depth <= JIT_MAX_DEPTH ? jit_generate(&jb, bc) : -1;
+    if (entry >= 0 && !jb.failed)
+    {
+        long page = sysconf(_SC_PAGESIZE);
+        size_t size = (jb.len + page - 1) / page * page;
+        void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory != MAP_FAILED)
+        {
+            memcpy(memory, jb.data, jb.len);
+            __builtin___clear_cache((char *)memory, (char *)memory + jb.len);
+            if (mprotect(memory, size, PROT_READ | PROT_EXEC) == 0)
+            {
+                // ISO C has no cast from object to function pointers; copy the address instead
+                unsigned char *address = (unsigned char *)memory + entry;
+                memcpy(&jit->entry, &address, sizeof(jit->entry));
+                jit->memory = memory;
+                jit->size = size;
+                status = JIT_READY;
+            }
+            else
+            {
+                munmap(memory, size); // Executable memory is not allowed here
+            }
+        }
+    }
+    free(jb.data);
+    __atomic_store_n(&jit->status, status, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Appends bytes to the generated code.
+ */
+void jit_emit(JitBuffer *jb, const void *bytes, size_t n)
+{
+    if (jb->len + n > jb->capacity)
+    {
+        size_t capacity = jb->capacity ? jb->capacity * 2 : 256;
+        while (capacity < jb->len + n)
+            capacity *= 2;
+        unsigned char *data = realloc(jb->data, capacity);
+        if (!data)
+        {
+            jb->failed = 1;
+            return;
+        }
+        jb->data = data;
+        jb->capacity = capacity;
+    }
+    memcpy(jb->data + jb->len, bytes, n);
+    jb->len += n;
+}
+
+#define JIT_NAN_BITS 0x7FF8000000000000ULL  // Quiet NaN
+#define JIT_SIGN_BITS 0x8000000000000000ULL // Sign bit of a double
+
+/**
+ * @brief Tells whether the native code has to check the result of a function
+ * for NaN, because the interpreter reports an error for that argument.
+ */
+int jit_function_can_fail(FunctionType func)
+{
+    return func == FUNC_ASIN || func == FUNC_ACOS || func == FUNC_LOG || func == FUNC_SQRT ||
+           func == FUNC_FAST_LOG;
+}
+
+#if defined(__x86_64__)
+// x86-64 (System V ABI): entry i of the evaluation stack lives in xmm<i> and
+// xmm15 is scratch. rbx holds the bindings and rbp the constant pool. Every
+// xmm register is caller-saved, so the live entries are spilled to the frame
+// around calls.
+
+#define X86_RAX 0
+#define X86_RSP 4
+#define X86_RBX 3
+#define X86_RBP 5
+#define X86_SCRATCH 15
+#define X86_FRAME (8 * JIT_MAX_DEPTH + 8) // Spill slots, keeping rsp 16-byte aligned at calls
+
+/**
+ * @brief Emits an SSE instruction on two registers: prefix (REX) 0F opcode ModRM.
+ */
+void jit_x86_sse(JitBuffer *jb, uint8_t prefix, uint8_t opcode, int reg, int rm)
+{
+    uint8_t code[5];
+    size_t n = 0;
+    code[n++] = prefix;
+    if (reg >= 8 || rm >= 8)
+        code[n++] = (uint8_t)(0x40 | (reg >= 8 ? 0x04 : 0) | (rm >= 8 ? 0x01 : 0));
+    code[n++] = 0x0F;
+    code[n++] = opcode;
+    code[n++] = (uint8_t)(0xC0 | (reg & 7) << 3 | (rm & 7));
+    jit_emit(jb, code, n);
+}
+
+/**
+ * @brief Emits an SSE instruction with a [base + disp32] memory operand.
+ */
+void jit_x86_sse_mem(JitBuffer *jb, uint8_t prefix, uint8_t opcode, int reg, int base, int32_t disp)
+{
+    uint8_t code[10];
+    size_t n = 0;
+    code[n++] = prefix;
+    if (reg >= 8)
+        code[n++] = 0x44;
+    code[n++] = 0x0F;
+    code[n++] = opcode;
+    code[n++] = (uint8_t)(0x80 | (reg & 7) << 3 | base);
+    if (base == X86_RSP)
+        code[n++] = 0x24; // SIB byte: no index
+    for (int i = 0; i < 4; i++)
+        code[n++] = (uint8_t)((uint32_t)disp >> (8 * i));
+    jit_emit(jb, code, n);
+}
+
+/**
+ * @brief Emits `mov reg, imm64` for a general purpose register below r8.
+ */
+void jit_x86_mov_imm64(JitBuffer *jb, int reg, uint64_t value)
+{
+    uint8_t code[10] = {0x48, (uint8_t)(0xB8 + reg)};
+    for (int i = 0; i < 8; i++)
+        code[2 + i] = (uint8_t)(value >> (8 * i));
+    jit_emit(jb, code, sizeof(code));
+}
+
+/**
+ * @brief Loads the bit pattern of a double into an xmm register (through rax).
+ */
+void jit_x86_load_bits(JitBuffer *jb, int xmm, uint64_t bits)
+{
+    jit_x86_mov_imm64(jb, X86_RAX, bits);
+    uint8_t code[5] = {0x66, (uint8_t)(0x48 | (xmm >= 8 ? 0x04 : 0)), 0x0F, 0x6E,
+                       (uint8_t)(0xC0 | (xmm & 7) << 3 | X86_RAX)}; // movq xmm, rax
+    jit_emit(jb, code, sizeof(code));
+}
+
+/**
+ * @brief Emits a jump (condition code 0) or a conditional jump (0x84 je, 0x8A jp)
+ * to code already generated.
+ */
+void jit_x86_jump(JitBuffer *jb, uint8_t condition, size_t target)
+{
+    uint8_t code[6];
+    size_t n = 0;
+    if (condition)
+    {
+        code[n++] = 0x0F;
+        code[n++] = condition;
+    }
+    else
+    {
+        code[n++] = 0xE9;
+    }
+    int32_t rel = (int32_t)((long)target - (long)(jb->len + n + 4));
+    for (int i = 0; i < 4; i++)
+        code[n++] = (uint8_t)((uint32_t)rel >> (8 * i));
+    jit_emit(jb, code, n);
+}
+
+/**
+ * @brief Calls `function(selector, xmm<first>, ...)` with `args` stack entries and
+ * leaves the result in xmm<first>, preserving the entries below it.
+ */
+void jit_x86_call(JitBuffer *jb, uintptr_t function, int selector, int first, int args)
+{
+    for (int i = 0; i < first; i++)
+        jit_x86_sse_mem(jb, 0xF2, 0x11, i, X86_RSP, 8 * i); // movsd [rsp + 8i], xmm<i>
+    for (int i = 0; first > 0 && i < args; i++)
+        jit_x86_sse(jb, 0x66, 0x28, i, first + i); // movapd xmm<i>, xmm<first + i>
+    uint8_t mov_edi[5] = {0xBF, (uint8_t)selector, 0, 0, 0};
+    jit_emit(jb, mov_edi, sizeof(mov_edi));
+    jit_x86_mov_imm64(jb, X86_RAX, function);
+    jit_emit(jb, "\xFF\xD0", 2); // call rax
+    if (first > 0)
+        jit_x86_sse(jb, 0x66, 0x28, first, 0);
+    for (int i = 0; i < first; i++)
+        jit_x86_sse_mem(jb, 0xF2, 0x10, i, X86_RSP, 8 * i); // movsd xmm<i>, [rsp + 8i]
+}
+
+/**
+ * @brief Jumps to `bail` if xmm<reg> holds a NaN.
+ */
+void jit_x86_check_nan(JitBuffer *jb, int reg, size_t bail)
+{
+    jit_x86_sse(jb, 0x66, 0x2E, reg, reg); // ucomisd: unordered only for NaN
+    jit_x86_jump(jb, 0x8A, bail);
+}
+
+/**
+ * @brief Generates x86-64 code for a program.
+ * @return Offset of the entry point in `jb`, or -1 if the code is not supported.
+ */
+int jit_generate(JitBuffer *jb, const Bytecode *bc)
+{
+    // The exits come first, so every jump to them goes backwards to a known address
+    size_t epilogue = jb->len;
+    const uint8_t leave[] = {0x48, 0x83, 0xC4, X86_FRAME, 0x5B, 0x5D, 0xC3}; // add rsp; pop rbx; pop rbp; ret
+    jit_emit(jb, leave, sizeof(leave));
+    size_t bail = jb->len;
+    jit_x86_load_bits(jb, 0, JIT_NAN_BITS);
+    jit_x86_jump(jb, 0, epilogue);
+
+    size_t entry = jb->len;
+    const uint8_t enter[] = {0x55, 0x53, 0x48, 0x89, 0xFB, 0x48, 0x83, 0xEC, X86_FRAME}; // push; mov rbx, rdi; sub rsp
+    jit_emit(jb, enter, sizeof(enter));
+    jit_x86_mov_imm64(jb, X86_RBP, (uint64_t)(uintptr_t)bc->constants);
+
+    int depth = 0;
+    for (int i = 0; i < bc->count; i++)
+    {
+        Opcode op = INSTR_OP(bc->code[i]);
+        int arg = INSTR_ARG(bc->code[i]);
+        int top = depth - 1;
+        switch (op)
+        {
+        case BC_CONST:
+            jit_x86_sse_mem(jb, 0xF2, 0x10, depth++, X86_RBP, 8 * arg);
+            break;
+        case BC_VAR:
+            jit_x86_sse_mem(jb, 0xF2, 0x10, depth++, X86_RBX, 8 * arg);
+            break;
+        case BC_ADD:
+            jit_x86_sse(jb, 0xF2, 0x58, top - 1, top);
+            depth--;
+            break;
+        case BC_SUB:
+            jit_x86_sse(jb, 0xF2, 0x5C, top - 1, top);
+            depth--;
+            break;
+        case BC_MUL:
+            jit_x86_sse(jb, 0xF2, 0x59, top - 1, top);
+            depth--;
+            break;
+        case BC_DIV:
+            jit_x86_sse(jb, 0x66, 0x57, X86_SCRATCH, X86_SCRATCH); // xorpd: 0.0
+            jit_x86_sse(jb, 0x66, 0x2E, top, X86_SCRATCH);         // ucomisd
+            jit_x86_jump(jb, 0x84, bail);                           // Zero divisor (or NaN)
+            jit_x86_sse(jb, 0xF2, 0x5E, top - 1, top);
+            depth--;
+            break;
+        case BC_POW:
+        case BC_MOD:
+            jit_x86_call(jb, (uintptr_t)&batch_scalar_op, op, top - 1, 2);
+            if (op == BC_MOD)
+                jit_x86_check_nan(jb, top - 1, bail);
+            depth--;
+            break;
+        case BC_ADD_PCT:
+        case BC_SUB_PCT:
+            jit_x86_sse(jb, 0x66, 0x28, X86_SCRATCH, top);     // movapd
+            jit_x86_sse(jb, 0xF2, 0x59, X86_SCRATCH, top - 1); // b * a
+            jit_x86_sse(jb, 0xF2, op == BC_ADD_PCT ? 0x58 : 0x5C, top - 1, X86_SCRATCH);
+            depth--;
+            break;
+        case BC_FUNC:
+            if (arg == FUNC_ABS)
+            {
+                jit_x86_load_bits(jb, X86_SCRATCH, ~JIT_SIGN_BITS);
+                jit_x86_sse(jb, 0x66, 0x54, top, X86_SCRATCH); // andpd
+                break;
+            }
+            if (arg == FUNC_SQRT)
+                jit_x86_sse(jb, 0xF2, 0x51, top, top); // sqrtsd: NaN for negative arguments
+            else if (arg >= FUNC_SIN && arg <= FUNC_FAST_LOG)
+                jit_x86_call(jb, (uintptr_t)&batch_scalar_func, arg, top, 1);
+            else
+                return -1;
+            if (jit_function_can_fail((FunctionType)arg))
+                jit_x86_check_nan(jb, top, bail);
+            break;
+        case BC_NEG:
+            jit_x86_load_bits(jb, X86_SCRATCH, JIT_SIGN_BITS);
+            jit_x86_sse(jb, 0x66, 0x57, top, X86_SCRATCH); // xorpd
+            break;
+        case BC_DUP:
+            jit_x86_sse(jb, 0x66, 0x28, depth, top);
+            depth++;
+            break;
+        default:
+            return -1;
+        }
+    }
+    jit_x86_jump(jb, 0, epilogue); // The result is entry 0, already in xmm0
+    return (int)entry;
+}
+
+#elif defined(__aarch64__)
+// AArch64 (AAPCS64): entry i of the evaluation stack lives in A64_REG(i) and
+// d30 is scratch. x19 holds the bindings and x20 the constant pool; x16 holds call
+// targets. The live entries are spilled to the frame around calls.
+
+#define A64_FRAME (8 * JIT_MAX_DEPTH) // Spill slots (a multiple of 16)
+#define A64_SCRATCH 30
+#define A64_REG(entry) ((entry) < 8 ? (entry) : (entry) + 8) // Skips d8-d15, which are callee-saved
+
+/**
+ * @brief Appends one instruction.
+ */
+void jit_a64(JitBuffer *jb, uint32_t instr) { jit_emit(jb, &instr, sizeof(instr)); }
+
+/**
+ * @brief Loads a 64-bit value into general purpose register `reg` (movz + 3 movk).
+ */
+void jit_a64_mov_imm64(JitBuffer *jb, int reg, uint64_t value)
+{
+    jit_a64(jb, 0xD2800000 | (uint32_t)(value & 0xFFFF) << 5 | (uint32_t)reg);
+    for (uint32_t hw = 1; hw < 4; hw++)
+        jit_a64(jb, 0xF2800000 | hw << 21 | (uint32_t)((value >> (16 * hw)) & 0xFFFF) << 5 | (uint32_t)reg);
+}
+
+/**
+ * @brief Emits `ldr d<reg>, [x<base>, #8*index]` (or `str` if `store`).
+ * @return 0, or -1 if the offset does not fit the instruction.
+ */
+int jit_a64_load(JitBuffer *jb, int store, int reg, int base, int index)
+{
+    if (index > 4095)
+        return -1;
+    jit_a64(jb, (store ? 0xFD000000 : 0xFD400000) | (uint32_t)index << 10 | (uint32_t)base << 5 | (uint32_t)reg);
+    return 0;
+}
+
+/**
+ * @brief Emits a floating point data-processing instruction `d<rd> = op(d<rn>, d<rm>)`.
+ */
+void jit_a64_fp(JitBuffer *jb, uint32_t opcode, int rd, int rn, int rm)
+{
+    jit_a64(jb, opcode | (uint32_t)rm << 16 | (uint32_t)rn << 5 | (uint32_t)rd);
+}
+
+/**
+ * @brief Emits a branch (condition -1) or a conditional branch to code already generated.
+ */
+void jit_a64_branch(JitBuffer *jb, int condition, size_t target)
+{
+    int32_t rel = (int32_t)(((long)target - (long)jb->len) / 4);
+    if (condition < 0)
+        jit_a64(jb, 0x14000000 | ((uint32_t)rel & 0x3FFFFFF));
+    else
+        jit_a64(jb, 0x54000000 | ((uint32_t)rel & 0x7FFFF) << 5 | (uint32_t)condition);
+}
+
+/**
+ * @brief Calls `function(selector, entry first, ...)` with `args` stack entries and
+ * leaves the result in entry `first`, preserving the entries below it.
+ */
+void jit_a64_call(JitBuffer *jb, uintptr_t function, int selector, int first, int args)
+{
+    for (int i = 0; i < first; i++)
+        jit_a64_load(jb, 1, A64_REG(i), 31, i); // str, [sp, #8i]
+    for (int i = 0; first > 0 && i < args; i++)
+        jit_a64_fp(jb, 0x1E604000, i, A64_REG(first + i), 0); // fmov d<i>, entry first + i
+    jit_a64(jb, 0x52800000 | (uint32_t)selector << 5); // mov w0, #selector
+    jit_a64_mov_imm64(jb, 16, function);
+    jit_a64(jb, 0xD63F0200); // blr x16
+    if (first > 0)
+        jit_a64_fp(jb, 0x1E604000, A64_REG(first), 0, 0);
+    for (int i = 0; i < first; i++)
+        jit_a64_load(jb, 0, A64_REG(i), 31, i);
+}
+
+/**
+ * @brief Branches to `bail` if register d<reg> holds a NaN.
+ */
+void jit_a64_check_nan(JitBuffer *jb, int reg, size_t bail)
+{
+    jit_a64_fp(jb, 0x1E602000, 0, reg, reg); // fcmp: unordered (V set) only for NaN
+    jit_a64_branch(jb, 6, bail);             // b.vs
+}
+
+/**
+ * @brief Generates AArch64 code for a program.
+ * @return Offset of the entry point in `jb`, or -1 if the code is not supported.
+ */
+int jit_generate(JitBuffer *jb, const Bytecode *bc)
+{
+    // The exits come first, so every branch to them goes backwards to a known address
+    size_t epilogue = jb->len;
+    jit_a64(jb, 0x910003FF | A64_FRAME << 10); // add sp, sp, #frame
+    jit_a64(jb, 0xA8C153F3);                   // ldp x19, x20, [sp], #16
+    jit_a64(jb, 0xA8C17BFD);                   // ldp x29, x30, [sp], #16
+    jit_a64(jb, 0xD65F03C0);                   // ret
+    size_t bail = jb->len;
+    jit_a64(jb, 0xD2E00000 | 0x7FF8 << 5 | 16); // movz x16, #0x7ff8, lsl #48: NaN
+    jit_a64(jb, 0x9E670200);                    // fmov d0, x16
+    jit_a64_branch(jb, -1, epilogue);
+
+    size_t entry = jb->len;
+    jit_a64(jb, 0xA9BF7BFD);                   // stp x29, x30, [sp, #-16]!
+    jit_a64(jb, 0x910003FD);                   // mov x29, sp
+    jit_a64(jb, 0xA9BF53F3);                   // stp x19, x20, [sp, #-16]!
+    jit_a64(jb, 0xD10003FF | A64_FRAME << 10); // sub sp, sp, #frame
+    jit_a64(jb, 0xAA0003F3);                   // mov x19, x0
+    jit_a64_mov_imm64(jb, 20, (uint64_t)(uintptr_t)bc->constants);
+
+    int depth = 0;
+    for (int i = 0; i < bc->count; i++)
+    {
+        Opcode op = INSTR_OP(bc->code[i]);
+        int arg = INSTR_ARG(bc->code[i]);
+        int top = A64_REG(depth - 1), below = A64_REG(depth - 2);
+        switch (op)
+        {
+        case BC_CONST:
+        case BC_VAR:
+            if (jit_a64_load(jb, 0, A64_REG(depth), op == BC_CONST ? 20 : 19, arg) < 0)
+                return -1;
+            depth++;
+            break;
+        case BC_ADD:
+            jit_a64_fp(jb, 0x1E602800, below, below, top);
+            depth--;
+            break;
+        case BC_SUB:
+            jit_a64_fp(jb, 0x1E603800, below, below, top);
+            depth--;
+            break;
+        case BC_MUL:
+            jit_a64_fp(jb, 0x1E600800, below, below, top);
+            depth--;
+            break;
+        case BC_DIV:
+            jit_a64_fp(jb, 0x1E602008, 0, top, 0); // fcmp d<top>, #0.0
+            jit_a64_branch(jb, 0, bail);           // b.eq
+            jit_a64_fp(jb, 0x1E601800, below, below, top);
+            depth--;
+            break;
+        case BC_POW:
+        case BC_MOD:
+            jit_a64_call(jb, (uintptr_t)&batch_scalar_op, op, depth - 2, 2);
+            if (op == BC_MOD)
+                jit_a64_check_nan(jb, below, bail);
+            depth--;
+            break;
+        case BC_ADD_PCT:
+        case BC_SUB_PCT:
+            jit_a64_fp(jb, 0x1E600800, A64_SCRATCH, top, below); // b * a (not fused, like the interpreter)
+            jit_a64_fp(jb, op == BC_ADD_PCT ? 0x1E602800 : 0x1E603800, below, below, A64_SCRATCH);
+            depth--;
+            break;
+        case BC_FUNC:
+            if (arg == FUNC_ABS)
+                jit_a64_fp(jb, 0x1E60C000, top, top, 0);
+            else if (arg == FUNC_SQRT)
+                jit_a64_fp(jb, 0x1E61C000, top, top, 0); // NaN for negative arguments
+            else if (arg >= FUNC_SIN && arg <= FUNC_FAST_LOG)
+                jit_a64_call(jb, (uintptr_t)&batch_scalar_func, arg, depth - 1, 1);
+            else
+                return -1;
+            if (jit_function_can_fail((FunctionType)arg))
+                jit_a64_check_nan(jb, top, bail);
+            break;
+        case BC_NEG:
+            jit_a64_fp(jb, 0x1E614000, top, top, 0);
+            break;
+        case BC_DUP:
+            jit_a64_fp(jb, 0x1E604000, A64_REG(depth), top, 0);
+            depth++;
+            break;
+        default:
+            return -1;
+        }
+    }
+    jit_a64_branch(jb, -1, epilogue); // The result is entry 0, already in d0
+    return (int)entry;
+}
+#endif
+#endif // NMRI_JIT
+
+/* --- Program Cache --- */
+
+/**
+ * @brief Builds the cache key of an expression: its text without whitespace,
+ * except single spaces where removing them would join two tokens ("1 2", "5 % 3").
+ * @param input The expression string.
+ * @param key Receives the key (room for `text_length(input) + 1` characters).
+ * @return The length of the key.
+ */
+size_t cache_key(const char *input, char *key)
+{
+    size_t len = 0;
+    int pending_space = 0;
+    for (const char *p = input; *p && *p != '\n'; p++)
+    {
+        unsigned char c = (unsigned char)*p;
+        if (isspace(c))
+        {
+            pending_space = 1;
+            continue;
+        }
+        if (pending_space && len > 0 && (isalnum(c) || c == '_' || c == '.' || c == '%'))
+        {
+            unsigned char prev = (unsigned char)key[len - 1];
+            if (isalnum(prev) || prev == '_' || prev == '.')
+                key[len++] = ' ';
+        }
+        pending_space = 0;
+        key[len++] = (char)c;
+    }
+    key[len] = '\0';
+    return len;
+}
+
+/**
+ * @brief Looks up the compiled form of an expression, compiling and caching it on
+ * a miss if the expression was missed recently already.
+ * The cache is emptied first if the session's functions changed since it was filled.
+ * When the expression's set is full its least recently used entry is replaced. Expressions
+ * that do not compile are not cached, so their errors are reported every time.
+ * @param ctx Session whose functions the expression may call.
+ * @param arena Arena for the key and the scratch buffers; the caller resets it afterwards.
+ * @param input The expression string.
+ * @param program_out Set to the program (owned by the cache, valid until the next
+ * lookup), or NULL if the expression is not cached and should be compiled directly.
+ * @param failed_stage Set to the name of the failing stage on error.
+ * @return 0 on success, 1 for an empty expression, -1 on error (recorded with `set_error()`).
+ */
+int program_cache_get(const NmriContext *ctx, ProgramCache *cache, Arena *arena, const char *input,
+                      NmriProgram **program_out, const char **failed_stage)
+{
+    *program_out = NULL;
+    if (cache->functions_version != ctx->functions_version)
+    {
+        program_cache_clear(cache); // The entries may have inlined a function (or used a math) that changed since
+        cache->functions_version = ctx->functions_version;
+    }
+    STATS_BEGIN(STAT_CACHE_LOOKUP);
+    char *key = arena_alloc(arena, text_length(input) + 1);
+    if (!key)
+    {
+        set_error(NMRI_ERROR_NO_MEMORY, -1, "Out of memory while compiling expression.");
+        *failed_stage = "Postfix evaluation";
+        return -1;
+    }
+    cache_key(input, key);
+    unsigned hash = hash_name(key);
+    cache->tick++;
+    CacheEntry *set = &cache->entries[hash % (PROGRAM_CACHE_SIZE / PROGRAM_CACHE_WAYS) * PROGRAM_CACHE_WAYS];
+    CacheEntry *victim = &set[0];
+    for (int i = 0; i < PROGRAM_CACHE_WAYS; i++)
+    {
+        CacheEntry *entry = &set[i];
+        if (entry->key && entry->hash == hash && strcmp(entry->key, key) == 0)
+        {
+            cache->hits++;
+            entry->last_used = cache->tick;
+            report_percentage_warnings(&entry->program->bc); // As if it had just been compiled
+            *program_out = entry->program;
+            STATS_END(STAT_CACHE_LOOKUP);
+            return 0;
+        }
+        // Unused entries have last_used == 0, so they are taken first
+        if (entry->last_used < victim->last_used)
+            victim = entry;
+    }
+
+    cache->misses++;
+    STATS_END(STAT_CACHE_LOOKUP);
+    unsigned *seen = &cache->seen[hash % PROGRAM_CACHE_SEEN];
+    if (*seen != hash)
+    {
+        *seen = hash; // First miss: remember it, but let the caller compile it as usual
+        return 0;
+    }
+    NmriProgram *program;
+    int status = program_compile(ctx, arena, input, NULL, 0, &program, failed_stage);
+    if (status != 0)
+        return status;
+    char *owned_key = strdup(key);
+    if (!owned_key)
+    {
+        set_error(NMRI_ERROR_NO_MEMORY, -1, "Out of memory while compiling expression.");
+        *failed_stage = "Postfix evaluation";
+        nmri_free(program);
+        return -1;
+    }
+    free(victim->key);
+    nmri_free(victim->program);
+    victim->key = owned_key;
+    victim->hash = hash;
+    victim->program = program;
+    victim->last_used = cache->tick;
+    *program_out = program;
+    return 0;
+}
+
+/**
+ * @brief Releases every program held by a cache (the hit and miss counters are kept).
+ */
+void program_cache_clear(ProgramCache *cache)
+{
+    for (int i = 0; i < PROGRAM_CACHE_SIZE; i++)
+    {
+        free(cache->entries[i].key);
+        nmri_free(cache->entries[i].program);
+        cache->entries[i] = (CacheEntry){0};
+    }
+}
+
+/* --- Batch (Columnar) Evaluation --- */
+
+// Applies EXPR (written in terms of x and y) over a block for each of the
+// vector/vector, scalar/vector and vector/scalar operand shapes. The loops are
+// branch-free so the compiler can vectorize them.
+#define BATCH_BINARY(EXPR)                          \
+    do                                              \
+    {                                               \
+        if (a.rows && b.rows)                       \
+            for (size_t r = 0; r < len; r++)        \
+            {                                       \
+                double x = a.rows[r], y = b.rows[r]; \
+                dst[r] = (EXPR);                    \
+            }                                       \
+        else if (b.rows)                            \
+        {                                           \
+            double x = a.scalar;                    \
+            for (size_t r = 0; r < len; r++)        \
+            {                                       \
+                double y = b.rows[r];               \
+                dst[r] = (EXPR);                    \
+            }                                       \
+        }                                           \
+        else                                        \
+        {                                           \
+            double y = b.scalar;                    \
+            for (size_t r = 0; r < len; r++)        \
+            {                                       \
+                double x = a.rows[r];               \
+                dst[r] = (EXPR);                    \
+            }                                       \
+        }                                           \
+    } while (0)
+
+// Applies EXPR (written in terms of x) over a block.
+#define BATCH_UNARY(EXPR)                    \
+    do                                       \
+    {                                        \
+        for (size_t r = 0; r < len; r++)     \
+        {                                    \
+            double x = arg.rows[r];          \
+            dst[r] = (EXPR);                 \
+        }                                    \
+    } while (0)
+
+/**
+ * @brief Applies a binary opcode to two scalars, with the same rules as `evaluate_bytecode()`.
+ * Errors (division or modulo by zero) yield NAN without printing anything.
+ */
+double batch_scalar_op(Opcode op, double x, double y)
+{
+    switch (op)
+    {
+    case BC_ADD:
+        return x + y;
+    case BC_SUB:
+        return x - y;
+    case BC_MUL:
+        return x * y;
+    case BC_DIV:
+        return y == 0.0 ? NAN : x / y;
+    case BC_POW:
+        return pow(x, y);
+    case BC_MOD:
+        return y == 0.0 ? NAN : fmod(x, y);
+    case BC_ADD_PCT:
+        return x + y * x;
+    case BC_SUB_PCT:
+        return x - y * x;
+    default:
+        return NAN;
+    }
+}
+
+/**
+ * @brief Applies a function to a scalar, with the same domain checks as `evaluate_bytecode()`.
+ * Domain errors yield NAN without printing anything.
+ */
+double batch_scalar_func(FunctionType func, double x)
+{
+    switch (func)
+    {
+    case FUNC_SIN:
+        return sin(x);
+    case FUNC_COS:
+        return cos(x);
+    case FUNC_TAN:
+        return tan(x);
+    case FUNC_ASIN:
+        return (x < -1.0 || x > 1.0) ? NAN : asin(x);
+    case FUNC_ACOS:
+        return (x < -1.0 || x > 1.0) ? NAN : acos(x);
+    case FUNC_ATAN:
+        return atan(x);
+    case FUNC_LOG:
+        return x <= 0.0 ? NAN : log(x);
+    case FUNC_SQRT:
+        return x < 0.0 ? NAN : sqrt(x);
+    case FUNC_EXP:
+        return exp(x);
+    case FUNC_ABS:
+        return fabs(x);
+    case FUNC_FLOOR:
+        return floor(x);
+    case FUNC_CEIL:
+        return ceil(x);
+    case FUNC_ROUND:
+        return round(x);
+    case FUNC_FAST_SIN:
+        return fast_sin(x);
+    case FUNC_FAST_COS:
+        return fast_cos(x);
+    case FUNC_FAST_EXP:
+        return fast_exp(x);
+    case FUNC_FAST_LOG:
+        return x <= 0.0 ? NAN : fast_log(x);
+    default:
+        return NAN;
+    }
+}
+
+/**
+ * @brief Tells whether `evaluate_bytecode()` reports a domain error for a function argument.
+ * A NaN argument is not an error: it just propagates.
+ */
+int batch_function_fails(FunctionType func, double x)
+{
+    switch (func)
+    {
+    case FUNC_ASIN:
+    case FUNC_ACOS:
+        return x < -1.0 || x > 1.0;
+    case FUNC_LOG:
+    case FUNC_FAST_LOG:
+        return x <= 0.0;
+    case FUNC_SQRT:
+        return x < 0.0;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Evaluates one block of rows: every instruction runs over the whole block.
+ * Failures are tracked per row and the failed rows are forced to NAN at the end, since
+ * a later operation may turn their NaN back into a number (e.g. `pow(1, NAN)` is 1).
+ * @param program The compiled program.
+ * @param inputs One column per variable slot, already offset to the first row of the block.
+ * @param out Output for the block.
+ * @param len Number of rows in the block (at most BATCH_BLOCK_ROWS).
+ * @param stack Scratch entries, `program->bc.max_depth` of them.
+ * @param scratch Scratch storage, `program->bc.max_depth` blocks of BATCH_BLOCK_ROWS values.
+ */
+void batch_eval_block(const NmriProgram *program, const double *const *inputs, double *out, size_t len,
+                      BatchValue *stack, double *scratch)
+{
+    const Bytecode *bc = &program->bc;
+    unsigned char failed[BATCH_BLOCK_ROWS]; // Rows where an operation reported an error
+    int block_failed = 0;                   // An error on a scalar: every row failed
+    memset(failed, 0, len);
+    int top = -1;
+    for (int i = 0; i < bc->count; i++)
+    {
+        uint32_t instr = bc->code[i];
+        Opcode op = INSTR_OP(instr);
+        if (op == BC_CONST)
+        {
+            stack[++top] = (BatchValue){.rows = NULL, .scalar = bc->constants[INSTR_ARG(instr)]};
+        }
+        else if (op == BC_VAR)
+        {
+            stack[++top] = (BatchValue){.rows = inputs[INSTR_ARG(instr)], .scalar = 0.0};
+        }
+        else if (op == BC_DUP)
+        {
+            // Sharing the rows is safe: slot `top` is only written again once the copy is consumed
+            stack[top + 1] = stack[top];
+            top++;
+        }
+        else if (op == BC_NEG)
+        {
+            BatchValue arg = stack[top];
+            if (!arg.rows)
+            {
+                stack[top].scalar = -arg.scalar;
+                continue;
+            }
+            double *dst = scratch + (size_t)top * BATCH_BLOCK_ROWS;
+            BATCH_UNARY(-x);
+            stack[top] = (BatchValue){.rows = dst, .scalar = 0.0};
+        }
+        else if (op == BC_FUNC)
+        {
+            FunctionType func = (FunctionType)INSTR_ARG(instr);
+            BatchValue arg = stack[top];
+            if (!arg.rows)
+            {
+                block_failed |= batch_function_fails(func, arg.scalar);
+                stack[top] = (BatchValue){.rows = NULL, .scalar = batch_scalar_func(func, arg.scalar)};
+                continue;
+            }
+            for (size_t r = 0; r < len; r++)
+                failed[r] |= batch_function_fails(func, arg.rows[r]);
+            double *dst = scratch + (size_t)top * BATCH_BLOCK_ROWS;
+            switch (func)
+            {
+            case FUNC_SQRT:
+                BATCH_UNARY(x < 0.0 ? NAN : sqrt(x));
+                break;
+            case FUNC_ABS:
+                BATCH_UNARY(fabs(x));
+                break;
+            case FUNC_FLOOR:
+                BATCH_UNARY(floor(x));
+                break;
+            case FUNC_CEIL:
+                BATCH_UNARY(ceil(x));
+                break;
+            case FUNC_ROUND:
+                BATCH_UNARY(round(x));
+                break;
+            case FUNC_FAST_SIN:
+            case FUNC_FAST_COS:
+            {
+                int quadrant = func == FUNC_FAST_COS;
+                BATCH_UNARY(fast_sin_kernel(x, quadrant));
+                for (size_t r = 0; r < len; r++)
+                {
+                    if (isnan(dst[r])) // Too large for the kernel (or NaN): through libm
+                        dst[r] = batch_scalar_func(func, arg.rows[r]);
+                }
+                break;
+            }
+            case FUNC_FAST_EXP:
+                BATCH_UNARY(fast_exp(x));
+                break;
+            case FUNC_FAST_LOG:
+                BATCH_UNARY(x <= 0.0 ? NAN : fast_log(x));
+                break;
+            default:
+                BATCH_UNARY(batch_scalar_func(func, x));
+                break;
+            }
+            stack[top] = (BatchValue){.rows = dst, .scalar = 0.0};
+        }
+        else
+        {
+            // Binary operator
+            BatchValue b = stack[top--];
+            BatchValue a = stack[top];
+            if (op == BC_DIV || op == BC_MOD)
+            {
+                if (b.rows)
+                {
+                    for (size_t r = 0; r < len; r++)
+                        failed[r] |= b.rows[r] == 0.0;
+                }
+                else
+                    block_failed |= b.scalar == 0.0;
+            }
+            if (!a.rows && !b.rows)
+            {
+                // Constant subexpression: computed once for the whole block
+                stack[top] = (BatchValue){.rows = NULL, .scalar = batch_scalar_op(op, a.scalar, b.scalar)};
+                continue;
+            }
+            double *dst = scratch + (size_t)top * BATCH_BLOCK_ROWS;
+            switch (op)
+            {
+            case BC_ADD:
+                BATCH_BINARY(x + y);
+                break;
+            case BC_SUB:
+                BATCH_BINARY(x - y);
+                break;
+            case BC_MUL:
+                BATCH_BINARY(x * y);
+                break;
+            case BC_DIV:
+                BATCH_BINARY(y == 0.0 ? NAN : x / y);
+                break;
+            case BC_POW:
+                BATCH_BINARY(pow(x, y));
+                break;
+            case BC_MOD:
+                BATCH_BINARY(y == 0.0 ? NAN : fmod(x, y));
+                break;
+            case BC_ADD_PCT:
+                BATCH_BINARY(x + y * x);
+                break;
+            case BC_SUB_PCT:
+                BATCH_BINARY(x - y * x);
+                break;
+            default: // Not a binary opcode
+                for (size_t r = 0; r < len; r++)
+                    dst[r] = NAN;
+                break;
+            }
+            stack[top] = (BatchValue){.rows = dst, .scalar = 0.0};
+        }
+    }
+    BatchValue result = stack[0];
+    if (result.rows)
+        memcpy(out, result.rows, len * sizeof(double));
+    else
+    {
+        for (size_t r = 0; r < len; r++)
+            out[r] = result.scalar;
+    }
+    for (size_t r = 0; r < len; r++)
+    {
+        if (block_failed || failed[r])
+            out[r] = NAN;
+    }
+}
+
+/**
+ * @brief Evaluates a compiled program over `n` rows of column data.
+ * The rows are processed in blocks of BATCH_BLOCK_ROWS; each instruction is applied
+ * to the whole block at once. Rows that fail (e.g. division by zero) produce NAN.
+ * Does not touch any global state, so it is safe to call concurrently.
+ * @param program The compiled program.
+ * @param inputs One column of `n` values per variable slot, in slot order (may be NULL if the program has no variables).
+ * @param out Output array of `n` values.
+ * @param n Number of rows.
+ * @return 0 on success, -1 on invalid arguments or if memory could not be allocated.
+ */
+int nmri_eval_batch(const NmriProgram *program, const double *const *inputs, double *out, size_t n)
+{
+    if (!program || !out || (program->var_count > 0 && !inputs))
+        return -1;
+    for (int i = 0; i < program->var_count; i++)
+    {
+        if (!inputs[i])
+            return -1;
+    }
+    if (program->bc.math == NMRI_MATH_EXTENDED)
+        return batch_eval_rows(program, inputs, out, n);
+    BatchValue *stack = malloc(program->bc.max_depth * sizeof(BatchValue));
+    double *scratch = malloc((size_t)program->bc.max_depth * BATCH_BLOCK_ROWS * sizeof(double));
+    const double **columns = malloc((program->var_count + 1) * sizeof(double *));
+    if (!stack || !scratch || !columns)
+    {
+        free(stack);
+        free(scratch);
+        free(columns);
+        return -1;
+    }
+    for (size_t base = 0; base < n; base += BATCH_BLOCK_ROWS)
+    {
+        size_t len = (n - base < BATCH_BLOCK_ROWS) ? n - base : BATCH_BLOCK_ROWS;
+        for (int i = 0; i < program->var_count; i++)
+            columns[i] = inputs[i] + base;
+        batch_eval_block(program, columns, out + base, len, stack, scratch);
+    }
+    free(stack);
+    free(scratch);
+    free(columns);
+    return 0;
+}
+
+/**
+ * @brief `nmri_eval_batch()` of a program compiled for NMRI_MATH_EXTENDED, one row
+ * at a time with `evaluate_bytecode_extended()`: the columnar evaluator works on doubles.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int batch_eval_rows(const NmriProgram *program, const double *const *inputs, double *out, size_t n)
+{
+    double *bindings = malloc((program->var_count + 1) * sizeof(double));
+    if (!bindings)
+        return -1;
+    ErrorState saved = last_error; // Rows that fail give NAN, without an error for the caller
+    for (size_t r = 0; r < n; r++)
+    {
+        for (int i = 0; i < program->var_count; i++)
+            bindings[i] = inputs[i][r];
+        out[r] = evaluate_bytecode_extended(&program->bc, bindings);
+    }
+    last_error = saved;
+    free(bindings);
+    return 0;
+}
+
+/**
+ * @brief Thread pool task: evaluates one contiguous share of a BatchJob.
+ */
+void batch_job_task(void *arg, int index)
+{
+    BatchJob *job = arg;
+    size_t base = (size_t)index * job->rows_per_task;
+    size_t len = (job->n - base < job->rows_per_task) ? job->n - base : job->rows_per_task;
+    const double **columns = malloc((job->program->var_count + 1) * sizeof(double *));
+    if (!columns)
+    {
+        job->failed = 1;
+        return;
+    }
+    for (int i = 0; i < job->program->var_count; i++)
+        columns[i] = job->inputs[i] + base;
+    if (nmri_eval_batch(job->program, columns, job->out + base, len) != 0)
+        job->failed = 1;
+    free(columns);
+}
+
+/**
+ * @brief Evaluates a compiled program over `n` rows using several threads.
+ * The rows are split into contiguous shares (a few per thread, for load balancing)
+ * that are evaluated with `nmri_eval_batch()`; each share writes its own slice of
+ * `out`, so results are always in input order.
+ * @param program The compiled program.
+ * @param inputs One column of `n` values per variable slot, in slot order.
+ * @param out Output array of `n` values.
+ * @param n Number of rows.
+ * @param threads Number of threads to use (values < 2 evaluate on the calling thread).
+ * @return 0 on success, -1 on invalid arguments or resource exhaustion.
+ */
+int nmri_eval_batch_mt(const NmriProgram *program, const double *const *inputs, double *out, size_t n, int threads)
+{
+    if (!program || !out || (program->var_count > 0 && !inputs))
+        return -1;
+    for (int i = 0; i < program->var_count; i++)
+    {
+        if (!inputs[i])
+            return -1;
+    }
+    size_t min_rows = (size_t)BATCH_MIN_TASK_BLOCKS * BATCH_BLOCK_ROWS;
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    if (threads < 2 || n <= min_rows)
+        return nmri_eval_batch(program, inputs, out, n);
+    ThreadPool pool;
+    if (thread_pool_init(&pool, threads - 1) != 0) // The calling thread is the last worker
+        return -1;
+    int status = batch_run_pool(&pool, program, inputs, out, n);
+    thread_pool_destroy(&pool);
+    return status;
+}
+
+/**
+ * @brief `nmri_eval_batch_mt()` on an existing pool, for callers evaluating many batches.
+ * @param pool The workers (the calling thread takes part as well).
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int batch_run_pool(ThreadPool *pool, const NmriProgram *program, const double *const *inputs, double *out, size_t n)
+{
+    size_t min_rows = (size_t)BATCH_MIN_TASK_BLOCKS * BATCH_BLOCK_ROWS;
+    size_t threads = (size_t)pool->thread_count + 1;
+    if (n <= min_rows)
+        return nmri_eval_batch(program, inputs, out, n);
+
+    // About four shares per thread, each a whole number of blocks
+    size_t rows_per_task = n / (threads * 4);
+    if (rows_per_task < min_rows)
+        rows_per_task = min_rows;
+    rows_per_task = (rows_per_task + BATCH_BLOCK_ROWS - 1) / BATCH_BLOCK_ROWS * BATCH_BLOCK_ROWS;
+    BatchJob job = {program, inputs, out, n, rows_per_task, 0};
+    thread_pool_run(pool, batch_job_task, &job, (int)((n + rows_per_task - 1) / rows_per_task));
+    return job.failed ? -1 : 0;
+}
+
+/**
+ * @brief Fills a bindings array with the current values of the session variables.
+ * @param program The compiled program.
+ * @param bindings Output array with room for `nmri_program_var_count()` values.
+ * @return 0 on success, -1 if a referenced variable is not defined.
+ */
+int nmri_bind_variables(const NmriContext *ctx, const NmriProgram *program, double *bindings)
+{
+    for (int i = 0; i < program->var_count; i++)
+    {
+        int index = find_variable(ctx, program->var_names[i]);
+        if (index < 0)
+        {
+            set_error(NMRI_ERROR_UNKNOWN_NAME, -1, "Unknown identifier '%s'.", program->var_names[i]);
+            return -1;
+        }
+        bindings[i] = ctx->variables[index].value;
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns the number of variable slots referenced by a program.
+ */
+int nmri_program_var_count(const NmriProgram *program) { return program->var_count; }
+
+/**
+ * @brief Returns the name bound to a variable slot, or NULL if the slot is out of range.
+ */
+const char *nmri_program_var_name(const NmriProgram *program, int slot)
+{
+    return (slot >= 0 && slot < program->var_count) ? program->var_names[slot] : NULL;
+}
+
+/**
+ * @brief Finds the slot of a variable referenced by a program.
+ * @return The slot index, or -1 if the program does not reference `name`.
+ */
+int nmri_program_var_slot(const NmriProgram *program, const char *name)
+{
+    for (int i = 0; i < program->var_count; i++)
+    {
+        if (strcmp(program->var_names[i], name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * @brief Releases a compiled program. Accepts NULL.
+ */
+void nmri_free(NmriProgram *program)
+{
+    if (!program)
+        return;
+    free(program->bc.code);
+    free(program->bc.constants);
+    free(program->var_names);
+    jit_release(program->jit);
+    free(program);
+}
+
+/**
+ * @brief Cleans up floating point results that are very close to zero.
+ * @param value The double value to clean.
+ * @param epsilon The threshold below which values are considered zero.
+ * @return The cleaned value (0.0 if very close to zero, original value otherwise).
+ */
+double clean_near_zero(double value, double epsilon)
+{
+    return (fabs(value) < epsilon) ? 0.0 : value;
+}
+
+/**
+ * @brief Formats a number exactly like `printf("%g")`.
+ * @param value The number.
+ * @param buffer Receives the text (room for NUMBER_BUFFER characters).
+ * @return The length of the text.
+ */
+int format_number(double value, char *buffer) { return format_significant(value, 6, buffer); }
+
+/**
+ * @brief Formats a number exactly like `printf("%.*g", precision)`.
+ * Finite numbers are rounded to `precision` significant digits with one scaling
+ * by an exact power of ten; when the digit after them is too close to a tie for
+ * the scaled value to decide (or the number is very large or small), or for
+ * infinities and NaN, `snprintf()` is used.
+ * @param value The number.
+ * @param precision Significant digits, 1 to 17.
+ * @param buffer Receives the text (room for NUMBER_BUFFER characters).
+ * @return The length of the text.
+ */
+int format_significant(double value, int precision, char *buffer)
+{
+#if FLT_EVAL_METHOD == 0
+    char *out = buffer;
+    if (isfinite(value))
+    {
+        double magnitude = fabs(value);
+        if (signbit(value))
+            *out++ = '-';
+        if (magnitude == 0.0)
+        {
+            *out++ = '0';
+            *out = '\0';
+            return (int)(out - buffer);
+        }
+        // Decimal exponent: 10^x <= value < 10^(x+1), corrected below if the guess is off by one
+        int x = 0;
+        int lowest = precision - 1 - MAX_EXACT_POWER; // Smallest exponent that can be scaled exactly
+        if (magnitude >= 1.0)
+            while (x < MAX_EXACT_POWER && magnitude >= exact_powers_of_ten[x + 1])
+                x++;
+        else
+            while (x > lowest && magnitude * exact_powers_of_ten[-x] < 1.0)
+                x--;
+        double low = exact_powers_of_ten[precision - 1], high = exact_powers_of_ten[precision];
+        for (int attempt = 0; attempt < 2 && x <= MAX_EXACT_POWER && x >= lowest; attempt++)
+        {
+            // Scale to [10^(precision-1), 10^precision). The result is off by at most half
+            // an ulp, so a fraction clearly away from .5 rounds the same as the exact value.
+            int k = precision - 1 - x;
+            double scaled = k >= 0 ? magnitude * exact_powers_of_ten[k] : magnitude / exact_powers_of_ten[-k];
+            if (scaled < low || scaled >= high)
+            {
+                x += scaled < low ? -1 : 1;
+                continue;
+            }
+            double whole = floor(scaled);
+            double fraction = scaled - whole;
+            if (fabs(fraction - 0.5) <= scaled * (2 * DBL_EPSILON))
+                break;
+            uint64_t n = (uint64_t)whole + (fraction > 0.5);
+            if (n == (uint64_t)high)
+            {
+                n = (uint64_t)low;
+                x++;
+            }
+            char digits[17];
+            for (int i = precision - 1; i >= 0; i--, n /= 10)
+                digits[i] = (char)('0' + n % 10);
+            int count = precision;
+            while (count > 1 && digits[count - 1] == '0')
+                count--;
+            if (x < -4 || x >= precision)
+            {
+                *out++ = digits[0];
+                if (count > 1)
+                {
+                    *out++ = '.';
+                    memcpy(out, digits + 1, count - 1);
+                    out += count - 1;
+                }
+                *out++ = 'e';
+                *out++ = x < 0 ? '-' : '+';
+                int e = x < 0 ? -x : x;
+                *out++ = (char)('0' + e / 10);
+                *out++ = (char)('0' + e % 10);
+            }
+            else if (x >= 0)
+            {
+                memcpy(out, digits, x + 1);
+                out += x + 1;
+                if (count > x + 1)
+                {
+                    *out++ = '.';
+                    memcpy(out, digits + x + 1, count - x - 1);
+                    out += count - x - 1;
+                }
+            }
+            else
+            {
+                *out++ = '0';
+                *out++ = '.';
+                for (int i = -1; i > x; i--)
+                    *out++ = '0';
+                memcpy(out, digits, count);
+                out += count;
+            }
+            *out = '\0';
+            return (int)(out - buffer);
+        }
+    }
+#endif
+    return snprintf(buffer, NUMBER_BUFFER, "%.*g", precision, value);
+}
+
+/**
+ * @brief Formats a number with the fewest significant digits that convert back
+ * to exactly the same double (at most 17), in the style of `%g`.
+ * @param value The number.
+ * @param buffer Receives the text (room for NUMBER_BUFFER characters).
+ * @return The length of the text.
+ */
+int format_shortest(double value, char *buffer)
+{
+    int length = 0;
+    // 15 digits are always enough for a number read from 15 or fewer digits, and they
+    // are exactly the shortest form then (the %g style drops trailing zeros)
+    for (int precision = 15; precision <= 17; precision++)
+    {
+        length = format_significant(value, precision, buffer);
+        if (!isfinite(value))
+            break;
+        char *end;
+        const char *digits = buffer[0] == '-' ? buffer + 1 : buffer;
+        double parsed = parse_number(digits, &end);
+        if ((signbit(value) ? -parsed : parsed) == value)
+            break;
+    }
+    return length;
+}
+
+/**
+ * @brief Formats a result as text in the given format (OUTPUT_BINARY is formatted as OUTPUT_GENERAL).
+ * @param value The result, or NAN for a line that failed ("nan").
+ * @param buffer Receives the text (room for NUMBER_BUFFER characters).
+ * @return The length of the text.
+ */
+int format_value(OutputFormat format, double value, char *buffer)
+{
+    if (format == OUTPUT_EXACT)
+        return format_shortest(value, buffer);
+    return format_number(clean_near_zero(value, 1e-10), buffer);
+}
+
+/**
+ * @brief Writes one result the way the stream mode prints it: a line of text,
+ * or the raw double for OUTPUT_BINARY.
+ * @param value The result, or NAN for a line that failed.
+ * @param out Receives the bytes (room for RESULT_BUFFER of them, not NUL-terminated).
+ * @return The number of bytes written to `out`.
+ */
+size_t format_result(OutputFormat format, double value, char *out)
+{
+    if (format == OUTPUT_BINARY)
+    {
+        memcpy(out, &value, sizeof(value));
+        return sizeof(value);
+    }
+    size_t length = (size_t)format_value(format, value, out);
+    out[length++] = '\n';
+    return length;
+}
+
+/**
+ * @brief Prints a result to stdout in the session's output format.
+ * @param name Variable the result was assigned to (printed as "name = value"), or NULL.
+ * @param value The result, or NAN for a line that failed.
+ * @param interactive 1 for the colored REPL output, 0 for plain text.
+ */
+void print_result(const NmriContext *ctx, const char *name, double value, int interactive)
+{
+    if (ctx->output_format == OUTPUT_NONE)
+        return;
+    if (ctx->output_format == OUTPUT_BINARY)
+    {
+        fwrite(&value, sizeof(value), 1, stdout);
+        return;
+    }
+    char number[NUMBER_BUFFER];
+    format_value(ctx->output_format, value, number);
+    if (name && interactive)
+        printf("%s%s = %s%s%s\n", COLOR_YELLOW, name, COLOR_GREEN, number, COLOR_RESET);
+    else if (name)
+        printf("%s = %s\n", name, number);
+    else if (interactive)
+        printf("%s%s%s\n", COLOR_GREEN, number, COLOR_RESET);
+    else
+        puts(number);
+}
+
+/* --- Terminal Raw Mode & Input Handling --- */
+
+/**
+ * @brief Restores the original terminal settings upon program exit.
+ */
+void disableRawMode(void)
+{
+    // Restore original terminal attributes
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+    printf("%s", COLOR_RESET); // Ensure colors are reset on exit
+}
+
+/**
+ * @brief Enables raw mode for the terminal.
+ * Disables canonical mode (line buffering) and echoing of input characters.
+ * Registers `disableRawMode` to be called automatically on exit.
+ */
+void enableRawMode(void)
+{
+    // Get current terminal attributes
+    if (tcgetattr(STDIN_FILENO, &orig_termios) == -1)
+    {
+        perror("Error getting terminal attributes");
+        exit(EXIT_FAILURE);
+    }
+    // Register the cleanup function to restore settings on exit (once: this runs for every line)
+    static int registered = 0;
+    if (!registered)
+        atexit(disableRawMode);
+    registered = 1;
+    // Create a copy and modify it for raw mode
+    struct termios raw = orig_termios;
+    // ICANON: Disable canonical mode (don't wait for Enter)
+    // ECHO: Disable echoing input characters
+    raw.c_lflag &= ~(ECHO | ICANON);
+    // VMIN = 1: read() waits for at least 1 byte
+    // VTIME = 0: read() waits indefinitely
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    // Apply the modified attributes
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
+    {
+        perror("Error setting terminal attributes");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Define key codes for clarity
+#define KEY_ENTER '\n'
+#define KEY_RETURN '\r'
+#define KEY_BACKSPACE 127 // ASCII DEL character often used for backspace
+#define KEY_CTRL_A 1
+#define KEY_CTRL_D 4
+#define KEY_CTRL_E 5
+#define KEY_CTRL_H 8 // Sent for backspace by some terminals
+#define KEY_ESC 27
+
+/**
+ * @brief Returns the next byte typed (or pasted) on the terminal. Everything available
+ * is read at once, so a pasted burst costs one read() instead of one per character.
+ * @return The byte, or -1 at the end of the input or on a read error.
+ */
+int terminal_read_byte(void)
+{
+    if (terminal_input_start == terminal_input_length)
+    {
+        ssize_t got;
+        do
+            got = read(STDIN_FILENO, terminal_input, sizeof(terminal_input));
+        while (got < 0 && errno == EINTR);
+        if (got <= 0)
+            return -1;
+        terminal_input_start = 0;
+        terminal_input_length = (int)got;
+    }
+    return (unsigned char)terminal_input[terminal_input_start++];
+}
+
+/**
+ * @brief Writes the shortest escape sequence moving the cursor from column `from` to column `to` of the line.
+ */
+void cursor_move(FILE *out, int from, int to)
+{
+    if (to == from - 1)
+        fputc('\b', out);
+    else if (to < from)
+        fprintf(out, "\033[%dD", from - to);
+    else if (to == from + 1)
+        fputs("\033[C", out);
+    else if (to > from)
+        fprintf(out, "\033[%dC", to - from);
+}
+
+/**
+ * @brief Brings the line on the screen up to date with the edited line: only the text
+ * from the first changed character is written (nothing at all if only the cursor
+ * moved), the rest of a longer old line is cleared and the cursor is put at `pos`.
+ * @param editor What is on the screen; updated.
+ * @param buffer The edited line, of `len` characters.
+ * @param out The terminal.
+ */
+void line_refresh(LineEditor *editor, const char *buffer, int len, int pos, FILE *out)
+{
+    int tracked = line_reserve(&editor->shown, &editor->capacity, (size_t)len + 1) == 0;
+    int same = 0;
+    while (tracked && same < len && same < editor->length && buffer[same] == editor->shown[same])
+        same++;
+    if (same < len || same < editor->length || !tracked)
+    {
+        cursor_move(out, editor->cursor, same);
+        fwrite(buffer + same, 1, (size_t)(len - same), out);
+        if (len < editor->length || !tracked)
+            fputs("\033[K", out); // Clear the end of the old line
+        editor->cursor = len;
+    }
+    cursor_move(out, editor->cursor, pos);
+    editor->cursor = pos;
+    if (tracked)
+        memcpy(editor->shown, buffer, (size_t)len);
+    editor->length = tracked ? len : 0;
+}
+
+/**
+ * @brief Replaces the edited line with `text` (a history entry), cursor at the end.
+ * @return 0 on success, -1 if out of memory (the line is left unchanged).
+ */
+int line_replace(char **buffer, size_t *capacity, const char *text, int *len, int *pos)
+{
+    size_t length = strlen(text);
+    if (line_reserve(buffer, capacity, length + 1) < 0)
+        return -1;
+    memcpy(*buffer, text, length + 1);
+    *len = *pos = (int)length;
+    return 0;
+}
+
+/**
+ * @brief Reads a line of input from the user with basic line editing features.
+ * Supports backspace, delete (Ctrl+D), moving cursor (left/right), history (up/down),
+ * jumping to start/end (Ctrl+A/Ctrl+E, Home/End). Uses raw terminal mode.
+ * Input is read in bulk and the screen is only updated once the bytes read so far
+ * are handled, with the minimal redraw of `line_refresh()`, so pasting a long
+ * expression over a slow connection is one read and one write. Pasted text after
+ * a newline is kept for the next call. The history file is read on the first Up.
+ * The line buffer grows as needed, like with getline().
+ * @param buffer Line buffer (may point to NULL); set to the read command.
+ * @param capacity Allocated size of `*buffer`, updated when it grows.
+ * @return 0 on success, -1 at the end of the input (the line read so far is returned).
+ */
+int readCommand(NmriContext *ctx, char **buffer_ptr, size_t *capacity)
+{
+    if (line_reserve(buffer_ptr, capacity, INITIAL_INPUT) < 0)
+    {
+        report_error(NMRI_ERROR_NO_MEMORY, "Out of memory.");
+        exit(EXIT_FAILURE);
+    }
+    enableRawMode(); // Switch to raw mode for character-by-character input
+    LineEditor editor = {0};
+    int pos = 0, len = 0, history_pos = ctx->history_count, status = 0;
+    char *current_typed = NULL; // Saved current input when navigating history
+    (*buffer_ptr)[0] = '\0';    // Clear the input buffer initially
+    // Print the prompt
+    printf("%s%s■%s ", COLOR_BOLD, COLOR_CYAN, COLOR_RESET);
+    fflush(stdout);
+
+    while (1)
+    {
+        char *buffer = *buffer_ptr;
+        int c = terminal_read_byte();
+        if (c < 0)
+        {
+            status = -1;
+            break;
+        }
+
+        // Handle character input
+        if (c == KEY_ENTER || c == KEY_RETURN)
+            break;
+        else if (c == KEY_BACKSPACE || c == KEY_CTRL_H)
+        { // Backspace pressed
+            if (pos > 0)
+            {
+                memmove(buffer + pos - 1, buffer + pos, len - pos);
+                len--;
+                pos--;
+            }
+        }
+        else if (c == KEY_CTRL_D)
+        { // Ctrl+D (Delete character under cursor)
+            if (pos < len)
+            {
+                memmove(buffer + pos, buffer + pos + 1, len - pos - 1);
+                len--;
+            }
+        }
+        else if (c == KEY_CTRL_A)
+            pos = 0; // Ctrl+A (Move cursor to beginning of line)
+        else if (c == KEY_CTRL_E)
+            pos = len; // Ctrl+E (Move cursor to end of line)
+        else if (c == KEY_ESC)
+        { // Escape sequence (likely arrow keys or other special keys)
+            int seq0 = terminal_read_byte(), seq1 = seq0 == '[' ? terminal_read_byte() : -1;
+            // Extended escape sequences (Home, End, Delete) end with '~'
+            int extended = seq1 >= '0' && seq1 <= '9' && terminal_read_byte() == '~';
+            if (extended && seq1 == '3' && pos < len)
+            { // Delete key: same as Ctrl+D
+                memmove(buffer + pos, buffer + pos + 1, len - pos - 1);
+                len--;
+            }
+            else if ((extended && seq1 == '1') || seq1 == 'H')
+                pos = 0; // Home
+            else if ((extended && seq1 == '4') || seq1 == 'F')
+                pos = len; // End
+            else if (seq1 == 'A') // Up Arrow (History Previous)
+            {
+                if (!ctx->history_loaded)
+                {
+                    history_load(ctx); // Puts the commands of earlier sessions first
+                    history_pos = ctx->history_count;
+                }
+                if (history_pos == ctx->history_count)
+                {
+                    buffer[len] = '\0';
+                    free(current_typed);
+                    current_typed = strdup(buffer);
+                }
+                if (history_pos > 0 &&
+                    line_replace(buffer_ptr, capacity, history_entry(ctx, history_pos - 1), &len, &pos) == 0)
+                    history_pos--;
+            }
+            else if (seq1 == 'B') // Down Arrow (History Next)
+            {
+                const char *next = history_pos + 1 < ctx->history_count ? history_entry(ctx, history_pos + 1)
+                                   : current_typed                       ? current_typed
+                                                                         : "";
+                if (history_pos < ctx->history_count && line_replace(buffer_ptr, capacity, next, &len, &pos) == 0)
+                    history_pos++;
+            }
+            else if (seq1 == 'C' && pos < len)
+                pos++; // Right Arrow
+            else if (seq1 == 'D' && pos > 0)
+                pos--; // Left Arrow
+        }
+        else if (!iscntrl(c) && line_reserve(buffer_ptr, capacity, len + 2) == 0)
+        { // Printable character: insert it at the cursor position
+            buffer = *buffer_ptr;
+            memmove(buffer + pos + 1, buffer + pos, len - pos); // Shift right
+            buffer[pos++] = (char)c;
+            len++;
+        }
+        if (terminal_input_start == terminal_input_length)
+        {
+            // Everything read so far is handled: show the result
+            line_refresh(&editor, *buffer_ptr, len, pos, stdout);
+            fflush(stdout);
+        }
+    }
+    line_refresh(&editor, *buffer_ptr, len, pos, stdout);
+    printf("\n");
+    fflush(stdout);
+    disableRawMode();         // Restore terminal settings before returning
+    (*buffer_ptr)[len] = '\0'; // Ensure final null termination
+    free(current_typed);
+    free(editor.shown);
+    return status;
+}
+
+/**
+ * @brief Makes sure a heap line buffer can hold `needed` bytes, doubling it if not.
+ * @param buffer The buffer (may point to NULL); updated if it moves.
+ * @param capacity Allocated size of `*buffer`, updated when it grows.
+ * @param needed Bytes required, including the terminating NUL.
+ * @return 0 on success, -1 if out of memory (the buffer is left unchanged).
  */
-void add_to_history(const char *cmd)
+int line_reserve(char **buffer, size_t *capacity, size_t needed)
 {
-    // Basic validation
-    if (cmd == NULL || cmd[0] == '\0')
-        return;
-    // Avoid adding the history command itself or duplicates of the last command
-    if (strcmp(cmd, "history") == 0 || (history_count > 0 && strcmp(cmd, command_history[history_count - 1]) == 0))
-    {
-        return;
-    }
-    if (history_count == HISTORY_SIZE)
+    if (*buffer && *capacity >= needed)
+        return 0;
+    size_t new_capacity = *capacity ? *capacity : INITIAL_INPUT;
+    while (new_capacity < needed)
+        new_capacity *= 2;
+    char *grown = realloc(*buffer, new_capacity);
+    if (!grown)
+        return -1;
+    *buffer = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+/* --- Thread Pool --- */
+
+/**
+ * @brief Worker thread body: repeatedly takes the next task index of the current run.
+ */
+void *thread_pool_worker(void *arg)
+{
+    ThreadPool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while (1)
     {
-        // History is full, shift existing commands up
-        memmove(command_history[0], command_history[1], (HISTORY_SIZE - 1) * NMRI_MAX_INPUT);
-        history_count--; // Make space for the new command
+        while (!pool->shutdown && pool->next_index >= pool->task_count)
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        if (pool->shutdown)
+            break;
+        int index = pool->next_index++;
+        pthread_mutex_unlock(&pool->lock);
+        pool->task(pool->task_arg, index);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+            pthread_cond_signal(&pool->work_done);
     }
-    // Add the new command at the end
-    strncpy(command_history[history_count], cmd, NMRI_MAX_INPUT - 1);
-    command_history[history_count][NMRI_MAX_INPUT - 1] = '\0'; // Ensure null termination
-    history_count++;
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
 }
 
 /**
- * @brief Displays the command history to the console.
+ * @brief Starts a pool of worker threads.
+ * @param pool The pool to initialize.
+ * @param threads Number of worker threads to start (the caller of `thread_pool_run()` also works).
+ * @return 0 on success, -1 on failure.
  */
-void show_history(void)
+int thread_pool_init(ThreadPool *pool, int threads)
 {
-    printf("%s%s=== Command History ===%s\n", COLOR_BOLD, COLOR_YELLOW, COLOR_RESET);
-    if (history_count == 0)
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+    pool->threads = calloc(threads > 0 ? threads : 1, sizeof(pthread_t));
+    if (!pool->threads)
     {
-        printf("  %s(History is empty)%s\n", COLOR_DIM, COLOR_RESET);
+        thread_pool_destroy(pool);
+        return -1;
     }
-    else
+    for (int i = 0; i < threads; i++)
     {
-        for (int i = 0; i < history_count; i++)
+        if (pthread_create(&pool->threads[i], NULL, thread_pool_worker, pool) != 0)
         {
-            printf("  %s%2d:%s %s\n", COLOR_CYAN, i + 1, COLOR_RESET, command_history[i]);
+            report_error(NMRI_ERROR_IO, "Could not start worker thread.");
+            thread_pool_destroy(pool);
+            return -1;
         }
+        pool->thread_count++;
     }
-    printf("%s%s=== End of History ===%s\n", COLOR_BOLD, COLOR_YELLOW, COLOR_RESET);
+    return 0;
 }
 
 /**
- * @brief Displays the currently defined variables and their values.
+ * @brief Runs `task(arg, i)` for every i in [0, task_count) and waits for all of them.
+ * The calling thread takes tasks as well.
  */
-void show_variables(void)
+void thread_pool_run(ThreadPool *pool, void (*task)(void *arg, int index), void *arg, int task_count)
 {
-    printf("%s%s=== Variables ===%s\n", COLOR_BOLD, COLOR_MAGENTA, COLOR_RESET);
-    if (variable_count == 0)
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->task_arg = arg;
+    pool->next_index = 0;
+    pool->task_count = task_count;
+    pool->pending = task_count;
+    pthread_cond_broadcast(&pool->work_ready);
+    while (pool->next_index < pool->task_count)
     {
-        printf("  %s(No variables defined)%s\n", COLOR_DIM, COLOR_RESET);
+        int index = pool->next_index++;
+        pthread_mutex_unlock(&pool->lock);
+        task(arg, index);
+        pthread_mutex_lock(&pool->lock);
+        pool->pending--;
     }
-    else
+    while (pool->pending > 0)
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    pool->task_count = 0;
+    pool->next_index = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * @brief Stops and joins the worker threads and releases the pool.
+ */
+void thread_pool_destroy(ThreadPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->thread_count; i++)
+        pthread_join(pool->threads[i], NULL);
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->work_done);
+}
+
+/* --- Line Execution --- */
+
+/**
+ * @brief Executes a single line of input: a built-in command, an assignment or an expression.
+ * Shared by the interactive loop and the stream mode so both follow exactly the same rules.
+ * Results are printed to stdout in the session's output format (colored only when `interactive` is set),
+ * the error of a failed line is shown with `show_error()`, and the line is recorded to the binary log if one is open.
+ * @param line The input line (leading whitespace already trimmed, not empty).
+ * @param interactive 1 for the colored REPL output, 0 for the plain stream output.
+ * @return 0 on success, 1 if the line failed, -1 if the 'exit' command was given.
+ */
+int execute_line(NmriContext *ctx, const char *line, int interactive)
+{
+    double result;
+    LineKind kind;
+    int status = execute_line_value(ctx, line, interactive, &result, &kind);
+    if (status == 1)
+        show_error(ctx, line, interactive);
+    if (ctx->binary_log && status >= 0)
+        binary_log_record(ctx, kind, status, last_error.code, result, line);
+    return status;
+}
+
+/**
+ * @brief `execute_line()` without the binary log, also returning what the line was and its result.
+ * The error of a failed line is left in `last_error` (its position is an offset in `line`) for
+ * the caller to show or not.
+ * @param result_out Receives the result (NAN for commands and failed lines).
+ * @param kind Receives the kind of line.
+ * @return 0 on success, 1 if the line failed, -1 if the 'exit' command was given.
+ */
+int execute_line_value(NmriContext *ctx, const char *line, int interactive, double *result_out, LineKind *kind)
+{
+    *result_out = NAN;
+    *kind = LINE_COMMAND;
+    last_error.pending = 0; // Only an error of this line is shown
+    // Process built-in commands first
+    int cmd_result = process_command(ctx, line);
+    if (cmd_result == 1)
+        return 0; // Command was handled
+    if (cmd_result == -1)
+        return -1; // Exit command received
+    *kind = LINE_EXPRESSION;
+
+    // If not a built-in command, check for a function definition: name(parameters) = expression
+    char function_name[MAX_IDENTIFIER_LEN];
+    char params[MAX_FUNCTION_PARAMS][MAX_IDENTIFIER_LEN];
+    int param_count;
+    const char *body;
+    int header = parse_function_header(line, function_name, params, &param_count, &body);
+    if (header != 0)
     {
-        // Always ensure 'ans' is shown if defined
-        int ans_idx = find_variable("ans");
-        if (ans_idx != -1)
+        *kind = LINE_COMMAND;
+        if (header < 0 || define_function(ctx, function_name, (const char(*)[MAX_IDENTIFIER_LEN])params, param_count,
+                                          body, line) < 0)
+        {
+            if (last_error.pending && last_error.position >= 0)
+                last_error.position += (int)(body - line); // An error in the body
+
+            log_message(ctx, "Function Error: Definition failed for: %s", line);
+            return 1;
+        }
+        log_message(ctx, "Function defined: %s", ctx->functions[find_function(ctx, function_name)].source);
+        if (ctx->output_format == OUTPUT_GENERAL || ctx->output_format == OUTPUT_EXACT)
+            printf("%s%s%s defined with %d parameter%s\n", COLOR_YELLOW, function_name, COLOR_RESET, param_count,
+                   param_count == 1 ? "" : "s");
+        return 0;
+    }
+
+    // Otherwise check for assignment or treat as expression
+
+    // Check for assignment: identifier = expression
+    const char *equals_pos = strchr(line, '=');
+    const char *first_op = strpbrk(line, "+-*/^%"); // Find first non-assignment operator
+    // Check if '=' exists and appears *before* any other operator (or if no other ops exist)
+    // Also ensure it's not the first character (e.g. "= 5")
+    if (equals_pos != NULL && equals_pos != line && (first_op == NULL || equals_pos < first_op))
+    {
+        // Potential assignment found
+        *kind = LINE_ASSIGNMENT;
+        char var_name[MAX_IDENTIFIER_LEN];
+        const char *name_end = equals_pos;
+        // Trim whitespace before '='
+        while (name_end > line && isspace((unsigned char)*(name_end - 1)))
+            name_end--;
+
+        size_t name_len = name_end - line;
+        if (name_len == 0 || name_len >= MAX_IDENTIFIER_LEN)
         {
-            printf("  %s%s%s = %s%g%s\n", COLOR_YELLOW, variables[ans_idx].name, COLOR_RESET,
-                   COLOR_GREEN, variables[ans_idx].value, COLOR_RESET);
+            report_error(NMRI_ERROR_INVALID, "Invalid variable name length for assignment.");
+            log_message(ctx, "Assignment Error: Invalid variable name length near '%s'", line);
+            return 1;
         }
-        // Print other variables
-        for (int i = 0; i < variable_count; i++)
+        strncpy(var_name, line, name_len);
+        var_name[name_len] = '\0';
+
+        // Validate variable name (starts with letter/_, contains letter/digit/_)
+        int valid_name = (isalpha((unsigned char)var_name[0]) || var_name[0] == '_');
+        for (size_t k = 1; k < name_len && valid_name; k++)
         {
-            if (i == ans_idx)
-                continue; // Skip 'ans' if already printed
-            printf("  %s%s%s = %s%g%s\n", COLOR_YELLOW, variables[i].name, COLOR_RESET,
-                   COLOR_GREEN, variables[i].value, COLOR_RESET);
+            if (!isalnum((unsigned char)var_name[k]) && var_name[k] != '_')
+                valid_name = 0;
+        }
+        // Simplified reserved word check - expand this list as needed
+        if (valid_name && (strcmp(var_name, "help") == 0 || strcmp(var_name, "exit") == 0 ||
+                           strcmp(var_name, "pi") == 0 || strcmp(var_name, "e") == 0 ||
+                           strcmp(var_name, "sin") == 0 /* add more reserved words */))
+        {
+            report_error(NMRI_ERROR_INVALID, "Cannot assign to reserved name '%s'.", var_name);
+            log_message(ctx, "Assignment Error: Attempt to assign to reserved name '%s'", var_name);
+            valid_name = 0;
+        }
+        if (!valid_name)
+        {
+            report_error(NMRI_ERROR_INVALID, "Invalid variable name '%s' for assignment.", var_name);
+            log_message(ctx, "Assignment Error: Invalid variable name '%s'", var_name);
+            return 1; // Invalid assignment syntax
+        }
+
+        const char *expr_start = equals_pos + 1; // Start of the expression part
+        double result = handle_assignment(ctx, var_name, expr_start);
+        if (isnan(result))
+        {
+            if (last_error.pending && last_error.position >= 0)
+                last_error.position += (int)(expr_start - line);
+            log_message(ctx, "Assignment failed for: %s", line);
+            return 1;
         }
+        print_result(ctx, var_name, result, interactive);
+        if (ctx->reactive)
+            show_reactive_updates(ctx, interactive);
+        *result_out = result;
+        return 0;
     }
-    printf("%s%s=== End of Variables ===%s\n", COLOR_BOLD, COLOR_MAGENTA, COLOR_RESET);
+
+    // If not an assignment or command, evaluate as a mathematical expression
+    double result = evaluate_expression(ctx, line);
+    if (isnan(result))
+        return 1; // Logged by evaluate_expression
+    print_result(ctx, NULL, result, interactive);
+    *result_out = result;
+    return 0;
 }
 
-/* --- Parsing and Evaluation --- */
+/**
+ * @brief Opens the input of the stream mode: maps it if it is a regular file, else
+ * prepares the getline() buffers.
+ * @param file The input, from its current offset.
+ * @param slots Lines that must stay valid at the same time (see `stream_next_line()`).
+ * @return 0 on success, -1 if out of memory (printed).
+ */
+int stream_open(StreamInput *input, FILE *file, int slots)
+{
+    memset(input, 0, sizeof(*input));
+    input->file = file;
+    struct stat info;
+    off_t start = lseek(fileno(file), 0, SEEK_CUR);
+    if (fstat(fileno(file), &info) == 0 && S_ISREG(info.st_mode) && start >= 0 && info.st_size > start &&
+        (uint64_t)info.st_size <= SIZE_MAX)
+    {
+        void *data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (data != MAP_FAILED)
+        {
+            madvise(data, (size_t)info.st_size, MADV_SEQUENTIAL);
+            input->data = data;
+            input->size = (size_t)info.st_size;
+            input->offset = (size_t)start;
+            input->tail_offset = input->size;
+            if (input->data[input->size - 1] != '\n')
+            {
+                while (input->tail_offset > input->offset && input->data[input->tail_offset - 1] != '\n')
+                    input->tail_offset--;
+                size_t length = input->size - input->tail_offset;
+                if (!(input->tail = malloc(length + 1)))
+                {
+                    report_error(NMRI_ERROR_NO_MEMORY, "Out of memory.");
+                    stream_close(input);
+                    return -1;
+                }
+                memcpy(input->tail, input->data + input->tail_offset, length);
+                input->tail[length] = '\0';
+            }
+            return 0;
+        }
+    }
+    input->buffers = calloc(slots, sizeof(char *));
+    input->capacities = calloc(slots, sizeof(size_t));
+    input->slots = slots;
+    if (!input->buffers || !input->capacities)
+    {
+        report_error(NMRI_ERROR_NO_MEMORY, "Out of memory.");
+        stream_close(input);
+        return -1;
+    }
+    return 0;
+}
 
 /**
- * @brief Tokenizes the input mathematical expression string.
- * Converts the input string into a sequence of tokens (numbers, operators, functions, etc.).
- * Handles unary minus, constants (pi, e, etc.), and variables.
- * @param input The input expression string.
- * @param tokens Output array where tokens will be stored.
- * @param max_tokens The maximum capacity of the `tokens` array.
- * @return The number of tokens generated, or -1 on error.
+ * @brief Returns the next line of the stream input. A mapped line is returned in
+ * place and ends with its newline; a line read with getline() is stored in the
+ * buffer of `slot` (so it stays valid until that slot is read again) without its line terminator.
+ * @return The line, or NULL at the end of the input.
  */
-int tokenize(const char *input, Token *tokens, int max_tokens)
+const char *stream_next_line(StreamInput *input, int slot)
 {
-    const char *p = input;
-    int token_count = 0;
-    int expecting_operand = 1; // Start expecting an operand (number, variable, function, parenthesis)
+    if (!input->data)
+    {
+        ssize_t len = getline(&input->buffers[slot], &input->capacities[slot], input->file);
+        if (len == -1)
+            return NULL;
+        char *line = input->buffers[slot];
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        return line;
+    }
+    if (input->offset >= input->size)
+        return NULL;
+    if (input->offset == input->tail_offset)
+    {
+        input->offset = input->size;
+        return input->tail;
+    }
+    const char *line = input->data + input->offset;
+    const char *end = memchr(line, '\n', input->tail_offset - input->offset);
+    input->offset = (size_t)(end + 1 - input->data);
+    if (input->offset - input->released >= 2 * (size_t)STREAM_RELEASE_SIZE)
+    {
+        // Lines that far behind are no longer used: drop their pages from the process
+        // (they stay in the page cache), so reading a huge file does not grow it
+        madvise((void *)(input->data + input->released), STREAM_RELEASE_SIZE, MADV_DONTNEED);
+        input->released += STREAM_RELEASE_SIZE;
+    }
+    return line;
+}
 
-    while (*p)
+/**
+ * @brief Returns a line of the stream input as a NUL-terminated string, for the
+ * commands and assignments that are not evaluated in place.
+ * @param line A line from `stream_next_line()` (or a suffix of it).
+ * @return The line (copied if it is mapped; valid until the next copy), or NULL if out of memory (printed).
+ */
+const char *stream_line_copy(StreamInput *input, const char *line)
+{
+    if (!input->data)
+        return line;
+    size_t length = text_length(line);
+    if (line_reserve(&input->copy, &input->copy_capacity, length + 1) < 0)
     {
-        // Skip whitespace
-        while (isspace((unsigned char)*p))
-            p++;
-        if (*p == '\0')
-            break; // End of input
+        report_error(NMRI_ERROR_NO_MEMORY, "Out of memory.");
+        return NULL;
+    }
+    memcpy(input->copy, line, length);
+    input->copy[length] = '\0';
+    return input->copy;
+}
+
+/**
+ * @brief Unmaps or frees what `stream_open()` set up (the file itself is not closed).
+ */
+void stream_close(StreamInput *input)
+{
+    if (input->data)
+        munmap((void *)input->data, input->size);
+    for (int i = 0; input->buffers && i < input->slots; i++)
+        free(input->buffers[i]);
+    free(input->buffers);
+    free(input->capacities);
+    free(input->tail);
+    free(input->copy);
+    memset(input, 0, sizeof(*input));
+}
+
+/**
+ * @brief `execute_line()` for a line `line_is_pure_expression()` accepts: evaluates it,
+ * prints the result (or shows the error) and records it to the binary log. The line
+ * may end with a newline, so the stream mode evaluates mapped lines in place.
+ * @return 0 on success, 1 if the line failed.
+ */
+int execute_expression_line(NmriContext *ctx, const char *line)
+{
+    last_error.pending = 0; // Only an error of this line is shown
+    double result = evaluate_expression(ctx, line);
+    int failed = isnan(result);
+    if (failed)
+    {
+        result = NAN;
+        show_error(ctx, line, 0);
+    }
+    else
+        print_result(ctx, NULL, result, 0);
+    if (ctx->binary_log)
+        binary_log_record(ctx, LINE_EXPRESSION, failed, last_error.code, result, line);
+    return failed;
+}
 
-        // Check for token limit
-        if (token_count >= max_tokens)
+/**
+ * @brief Evaluates a stream of lines (one command, assignment or expression per line).
+ * Used for batch jobs: no raw terminal mode, no history, fully buffered stdin/stdout
+ * and no per-line flush. Blank lines and lines starting with '#' are skipped.
+ * A regular file is mapped in memory and its expression lines are evaluated in place,
+ * without being copied. A failed line prints "nan" so the output stays aligned with the input, and its
+ * error goes to stderr as a "line:column: code: message" record (see `show_error()`).
+ * @param in The input stream (a file or stdin).
+ * @param threads Number of threads evaluating expression lines (values < 2 run sequentially).
+ * @return 0 if every line succeeded, 1 if at least one line failed.
+ */
+int run_stream(NmriContext *ctx, FILE *in, int threads)
+{
+    static char in_buffer[STREAM_BUFFER_SIZE], out_buffer[STREAM_BUFFER_SIZE], error_buffer[STREAM_BUFFER_SIZE];
+    setvbuf(in, in_buffer, _IOFBF, sizeof(in_buffer));
+    setvbuf(stdout, out_buffer, _IOFBF, sizeof(out_buffer));
+    setvbuf(stderr, error_buffer, _IOFBF, sizeof(error_buffer));
+    ctx->error_output = ERRORS_RECORD;
+    ctx->line_number = 0;
+    StreamInput input;
+    if (stream_open(&input, in, threads > 1 ? STREAM_CHUNK_LINES : 1) < 0)
+        return 1;
+    int status = 0;
+    if (threads > 1)
+        status = run_stream_parallel(ctx, &input, threads);
+    else
+    {
+        const char *line;
+        while ((line = stream_next_line(&input, 0)) != NULL)
         {
-            fprintf(stderr, "%sError:%s Expression too complex (too many tokens).\n", COLOR_RED, COLOR_RESET);
-            return -1;
-        }
+            ctx->line_number++;
+            while (*line != '\n' && isspace((unsigned char)*line))
+                line++;
+            if (*line == '\0' || *line == '\n' || *line == '#')
+                continue; // Ignore blank lines and comments
 
-        Token *current_token = &tokens[token_count];
-        current_token->is_percentage = 0; // Default
+            int line_result = 1;
+            if (line_is_pure_expression(line))
+                line_result = execute_expression_line(ctx, line);
+            else if ((line = stream_line_copy(&input, line)) != NULL)
+                line_result = execute_line(ctx, line, 0);
+            if (line_result == -1)
+                break; // 'exit' stops the stream early
+            if (line_result == 1)
+            {
+                print_result(ctx, NULL, NAN, 0);
+                status = 1;
+            }
+        }
+    }
+    stream_close(&input);
+    fflush(stdout);
+    fflush(stderr);
+    return status;
+}
 
-        // Handle identifiers (functions, variables, constants, assignment start)
+/**
+ * @brief Tells whether a line is an expression that can be evaluated out of order.
+ * Commands, assignments and expressions using 'ans' depend on (or change) the
+ * state left by previous lines, so the parallel stream mode runs them in order.
+ * Pure expressions are evaluated in place by `execute_expression_line()`, without
+ * going through `process_command(ctx)`, whose command names must match these.
+ * @param line The input line (leading whitespace already trimmed), ending at a NUL or a newline.
+ * @return 1 if the line is a pure expression, 0 otherwise.
+ */
+int line_is_pure_expression(const char *line)
+{
+    static const char *commands[] = {"help", "exit", "quit", "clear", "cls", "history", "variables", "vars",
+                                     "memory", "mem", "m+", "m-", "mr", "mc", "stats", "functions", "funcs", "reactive",
+                                     "math", NULL};
+    size_t len = text_length(line);
+    while (len > 0 && isspace((unsigned char)line[len - 1]))
+        len--;
+    for (int i = 0; commands[i]; i++)
+    {
+        if (strlen(commands[i]) == len && strncmp(line, commands[i], len) == 0)
+            return 0;
+    }
+    if (strncmp(line, "store ", 6) == 0 || strncmp(line, "log ", 4) == 0 || strncmp(line, "stats ", 6) == 0 ||
+        strncmp(line, "save ", 5) == 0 || strncmp(line, "load ", 5) == 0 || strncmp(line, "reactive ", 9) == 0 ||
+        strncmp(line, "math ", 5) == 0)
+        return 0;
+    if (memchr(line, '=', len))
+        return 0; // Assignment (valid or not)
+    for (const char *p = line; p < line + len;)
+    {
         if (isalpha((unsigned char)*p) || *p == '_')
-        { // Allow identifiers to start with _
+        {
             const char *start = p;
             while (isalnum((unsigned char)*p) || *p == '_')
-                p++; // Read the whole identifier
-            size_t len = p - start;
-            if (len >= MAX_IDENTIFIER_LEN)
-            {
-                fprintf(stderr, "%sError:%s Identifier '%.*s...' too long (max %d chars).\n",
-                        COLOR_RED, COLOR_RESET, MAX_IDENTIFIER_LEN / 2, start, MAX_IDENTIFIER_LEN - 1);
-                return -1;
-            }
-            char identifier[MAX_IDENTIFIER_LEN];
-            strncpy(identifier, start, len);
-            identifier[len] = '\0';
-
-            // Check for assignment (identifier followed by '=')
-            const char *next_char = p;
-            while (isspace((unsigned char)*next_char))
-                next_char++;
-            if (*next_char == '=')
-            {
-                // Ensure assignment is at the start or after an operator/paren? (No, can be like `y=x=5`)
-                // Current simple implementation allows `y=x=5`, handled in main loop logic.
-                // Here we just mark it as an assignment start token.
-                current_token->type = TOKEN_ASSIGNMENT;
-                strncpy(current_token->value.var_name, identifier, MAX_IDENTIFIER_LEN - 1);
-                current_token->value.var_name[MAX_IDENTIFIER_LEN - 1] = '\0';
-                token_count++;
-                p = next_char + 1; // Consume the '='
-                expecting_operand = 1;
-                continue;
-            }
+                p++;
+            if (p - start == 3 && strncmp(start, "ans", 3) == 0)
+                return 0;
+        }
+        else
+            p++;
+    }
+    return 1;
+}
 
-            // Check for predefined constants
-            if (strcmp(identifier, "pi") == 0)
-            {
-                current_token->type = TOKEN_NUMBER;
-                current_token->value.number = M_PI;
-            }
-            else if (strcmp(identifier, "e") == 0)
-            {
-                current_token->type = TOKEN_NUMBER;
-                current_token->value.number = M_E;
-            }
-            else if (strcmp(identifier, "phi") == 0)
-            {
-                current_token->type = TOKEN_NUMBER;
-                current_token->value.number = (1.0 + sqrt(5.0)) / 2.0;
-            }
-            else if (strcmp(identifier, "gamma") == 0)
-            {
-                current_token->type = TOKEN_NUMBER;
-                current_token->value.number = 0.5772156649015329;
-            }
-            else if (strcmp(identifier, "c") == 0)
-            {
-                current_token->type = TOKEN_NUMBER;
-                current_token->value.number = 299792458.0;
-            }
-            else if (strcmp(identifier, "h") == 0)
-            {
-                current_token->type = TOKEN_NUMBER;
-                current_token->value.number = 6.62607015e-34;
-            }
-            else if (strcmp(identifier, "G") == 0)
-            {
-                current_token->type = TOKEN_NUMBER;
-                current_token->value.number = 6.67430e-11;
-            }
-            else if (strcmp(identifier, "Na") == 0)
-            {
-                current_token->type = TOKEN_NUMBER;
-                current_token->value.number = 6.02214076e23;
-            }
-            else if (strcmp(identifier, "k") == 0)
-            {
-                current_token->type = TOKEN_NUMBER;
-                current_token->value.number = 1.380649e-23;
-            }
-            else if (strcmp(identifier, "inf") == 0)
-            {
-                current_token->type = TOKEN_NUMBER;
-                current_token->value.number = INFINITY;
-            }
-            else if (strcmp(identifier, "ans") == 0)
-            {
-                current_token->type = TOKEN_NUMBER;
-                current_token->value.number = last_result;
-            }
-            else
-            {
-                // Check if it's a known function
-                FunctionType func = FUNC_INVALID;
-                for (int i = 0; function_map[i].name; i++)
-                {
-                    if (strcmp(identifier, function_map[i].name) == 0)
-                    {
-                        func = function_map[i].func;
-                        break;
-                    }
-                }
-                if (func != FUNC_INVALID)
-                {
-                    // It's a function
-                    current_token->type = TOKEN_FUNCTION;
-                    current_token->value.func = func;
-                    expecting_operand = 1; // Function must be followed by '('
-                }
-                else
-                {
-                    // Assume it's a variable
-                    int var_index = find_variable(identifier);
-                    if (var_index >= 0)
-                    {
-                        // Known variable
-                        current_token->type = TOKEN_NUMBER; // Treat variable use as injecting its number value
-                        current_token->value.number = variables[var_index].value;
-                        expecting_operand = 0; // Variable acts as an operand
-                    }
-                    else
-                    {
-                        // Unknown identifier
-                        fprintf(stderr, "%sError:%s Unknown identifier '%s'.\n", COLOR_RED, COLOR_RESET, identifier);
-                        return -1;
-                    }
-                }
-            }
-            if (current_token->type == TOKEN_NUMBER)
-            {
-                expecting_operand = 0;
-            } // Constants and variables are operands
-            token_count++;
+/**
+ * @brief Thread pool task: evaluates one share of a StreamRun.
+ */
+void stream_run_task(void *arg, int index)
+{
+    StreamRun *run = arg;
+    int first = index * run->lines_per_task;
+    int last = first + run->lines_per_task < run->count ? first + run->lines_per_task : run->count;
+    Arena arena = {0}; // The session arena is not shared between threads
+    STATS_ENTER(&run->stats[index]);
+    for (int i = first; i < last; i++)
+    {
+        run->failed_stages[i] = NULL;
+        last_error.pending = 0;
+        run->results[i] = compute_expression(run->ctx, &arena, &run->caches[index], run->lines[i], &run->failed_stages[i]);
+        run->errors[i].pending = 0;
+        if (isnan(run->results[i]) && last_error.pending)
+            run->errors[i] = last_error; // Shown by the calling thread, in input order
+        arena_reset(&arena);
+    }
+    STATS_LEAVE();
+    arena_free(&arena);
+}
+
+/**
+ * @brief Evaluates the pending run of pure expressions in parallel, then prints
+ * the results in input order and updates 'ans' as a sequential run would have.
+ * @param pool The worker pool.
+ * @param run The pending run (emptied on return).
+ * @return 0 if every line succeeded, 1 otherwise.
+ */
+int flush_stream_run(NmriContext *ctx, ThreadPool *pool, StreamRun *run)
+{
+    if (run->count == 0)
+        return 0;
+    int tasks = (pool->thread_count + 1) * 4;
+    run->lines_per_task = (run->count + tasks - 1) / tasks;
+    tasks = (run->count + run->lines_per_task - 1) / run->lines_per_task;
+    thread_pool_run(pool, stream_run_task, run, tasks);
+
+    // The results are formatted into one block and written with a single call
+    int status = 0, have_result = 0;
+    double last = 0.0;
+    size_t used = 0;
+    for (int i = 0; i < run->count; i++)
+    {
+        if (used > STREAM_BUFFER_SIZE - RESULT_BUFFER)
+        {
+            fwrite(run->output, 1, used, stdout);
+            used = 0;
         }
-        // Handle numbers (including decimals and percentages)
-        else if (isdigit((unsigned char)*p) || (*p == '.' && isdigit((unsigned char)*(p + 1))))
+        double result = run->results[i];
+        // Failed lines print a plain NAN whatever sign the evaluator left on theirs
+        used += format_result(ctx->output_format, isnan(result) ? NAN : result, run->output + used);
+        if (ctx->binary_log)
+            binary_log_record(ctx, LINE_EXPRESSION, isnan(result), run->errors[i].code, isnan(result) ? NAN : result,
+                              run->lines[i]);
+        if (isnan(result))
         {
-            char *end;
-            current_token->value.number = strtod(p, &end);
-            if (end == p)
-            { // Should not happen with the check above, but safety first
-                fprintf(stderr, "%sError:%s Invalid numeric format near '%.*s'.\n", COLOR_RED, COLOR_RESET, 10, p);
-                return -1;
-            }
-            current_token->type = TOKEN_NUMBER;
-            // Check for percentage sign
-            if (*end == '%')
+            if (run->failed_stages[i])
+                log_message(ctx, "Evaluation Error: %s failed for '%.*s'", run->failed_stages[i],
+                            (int)text_length(run->lines[i]), run->lines[i]);
+            if (run->errors[i].pending)
             {
-                current_token->is_percentage = 1;
-                end++; // Consume the '%'
+                last_error = run->errors[i];
+                ctx->line_number = run->line_numbers[i];
+                show_error(ctx, run->lines[i], 0);
             }
-            p = end; // Move parser position
-            token_count++;
-            expecting_operand = 0; // A number is an operand
+            status = 1;
+            continue;
         }
-        // Handle operators (+, -, *, /, ^, %)
-        else if (strchr("+-*/^%", *p))
+        if (ctx->logging_enabled)
+            log_message(ctx, "Result: %.*s = %g", (int)text_length(run->lines[i]), run->lines[i], result);
+        last = result;
+        have_result = 1;
+    }
+    fwrite(run->output, 1, used, stdout);
+    if (have_result)
+    {
+        ctx->last_result = last;
+        set_variable(ctx, "ans", last);
+    }
+    run->count = 0;
+    return status;
+}
+
+/**
+ * @brief Stream mode with several threads.
+ * Lines are read in chunks; consecutive pure expressions are evaluated in parallel
+ * while commands, assignments and lines using 'ans' act as barriers executed in
+ * order, so the output is identical to the sequential stream mode. The lines of a
+ * mapped input are handed to the workers in place.
+ * @param input The input (opened by `run_stream(ctx)` with STREAM_CHUNK_LINES slots).
+ * @param threads Number of threads (including the calling one).
+ * @return 0 if every line succeeded, 1 if at least one line failed.
+ */
+int run_stream_parallel(NmriContext *ctx, StreamInput *input, int threads)
+{
+    ThreadPool pool;
+    const char **lines = calloc(STREAM_CHUNK_LINES, sizeof(char *));
+    // `flush_stream_run()` splits a run into at most 4 tasks per thread
+    int cache_count = threads * 4;
+    StreamRun run = {ctx, calloc(STREAM_CHUNK_LINES, sizeof(char *)), calloc(STREAM_CHUNK_LINES, sizeof(double)),
+                     calloc(STREAM_CHUNK_LINES, sizeof(const char *)), calloc(STREAM_CHUNK_LINES, sizeof(ErrorState)),
+                     calloc(STREAM_CHUNK_LINES, sizeof(unsigned long)), 0, 0, calloc(cache_count, sizeof(ProgramCache)),
+                     calloc(cache_count, sizeof(NmriStats)), malloc(STREAM_BUFFER_SIZE)};
+    int status = 0, stop = 0;
+    unsigned long line_number = 0;
+    if (!lines || !run.lines || !run.results || !run.failed_stages || !run.errors || !run.line_numbers ||
+        !run.caches || !run.stats || !run.output ||
+        thread_pool_init(&pool, threads - 1) != 0)
+    {
+        report_error(NMRI_ERROR_IO, "Could not set up parallel stream evaluation.");
+        free(lines);
+        free(run.lines);
+        free(run.results);
+        free(run.failed_stages);
+        free(run.errors);
+        free(run.line_numbers);
+        free(run.caches);
+        free(run.stats);
+        free(run.output);
+        return 1;
+    }
+
+    while (!stop)
+    {
+        // Read ahead one chunk of lines
+        int line_count = 0;
+        while (line_count < STREAM_CHUNK_LINES && (lines[line_count] = stream_next_line(input, line_count)) != NULL)
+            line_count++;
+        if (line_count == 0)
+            break;
+
+        for (int i = 0; i < line_count; i++)
         {
-            // Special case: Unary minus (or plus, though less common)
-            if ((*p == '-' || *p == '+') && expecting_operand)
+            line_number++;
+            const char *start = lines[i];
+            while (*start != '\n' && isspace((unsigned char)*start))
+                start++;
+            if (*start == '\0' || *start == '\n' || *start == '#')
+                continue; // Ignore blank lines and comments
+            if (line_is_pure_expression(start))
             {
-                // Treat as part of the number or implicitly multiplying by -1/1.
-                // Simplest way for Shunting-Yard: Insert a zero operand before it.
-                // ** MODIFIED: Insert 0 and then the operator (+ or -) **
-                if (token_count >= max_tokens)
-                {
-                    fprintf(stderr, "%sError:%s Expression too complex (unary op).\n", COLOR_RED, COLOR_RESET);
-                    return -1;
-                }
-                tokens[token_count].type = TOKEN_NUMBER;
-                tokens[token_count].is_percentage = 0;
-                tokens[token_count].value.number = 0.0; // Insert 0
-                token_count++;
-
-                if (token_count >= max_tokens)
-                { // Check again before adding operator
-                    fprintf(stderr, "%sError:%s Expression too complex (unary op).\n", COLOR_RED, COLOR_RESET);
-                    return -1;
-                }
-                // Now add the actual operator (+ or -)
-                tokens[token_count].type = TOKEN_OPERATOR;
-                tokens[token_count].is_percentage = 0;
-                tokens[token_count].value.op = char_to_op(*p);
-                token_count++;
-                p++;
-                expecting_operand = 1; // Operator expects an operand next
+                run.line_numbers[run.count] = line_number;
+                run.lines[run.count++] = start;
+                continue;
             }
-            else
+            // Barrier: finish the pending run, then execute this line in order
+            status |= flush_stream_run(ctx, &pool, &run);
+            ctx->line_number = line_number; // `flush_stream_run()` sets it to the lines of the run
+            start = stream_line_copy(input, start);
+            int line_result = start ? execute_line(ctx, start, 0) : 1;
+            if (line_result == -1)
             {
-                // Binary operator
-                OperatorType op = char_to_op(*p);
-                if (op == (OperatorType)-1)
-                { // Should not happen due to strchr check
-                    fprintf(stderr, "%sError:%s Invalid operator '%c'.\n", COLOR_RED, COLOR_RESET, *p);
-                    return -1;
-                }
-                current_token->type = TOKEN_OPERATOR;
-                current_token->value.op = op;
-                token_count++;
-                p++;
-                expecting_operand = 1; // Operator expects an operand next
+                stop = 1; // 'exit' stops the stream early
+                break;
+            }
+            if (line_result == 1)
+            {
+                print_result(ctx, NULL, NAN, 0);
+                status = 1;
             }
         }
-        // Handle parentheses
-        else if (*p == '(')
+        status |= flush_stream_run(ctx, &pool, &run);
+    }
+
+    thread_pool_destroy(&pool);
+    for (int i = 0; i < cache_count; i++)
+    {
+        // Account the workers' lookups to the session
+        ctx->cache.hits += run.caches[i].hits;
+        ctx->cache.misses += run.caches[i].misses;
+        stats_merge(&ctx->stats, &run.stats[i]);
+        program_cache_clear(&run.caches[i]);
+    }
+    free(run.caches);
+    free(run.stats);
+    free(lines);
+    free(run.lines);
+    free(run.results);
+    free(run.failed_stages);
+    free(run.errors);
+    free(run.line_numbers);
+    free(run.output);
+    return status;
+}
+
+/**
+ * @brief Re-executes the lines recorded in a binary log (`--replay`) without
+ * printing their results, and reports every line whose status, error or result
+ * (compared bit for bit) differs from the recorded one, then the time the replay took.
+ * Errors are only shown for those lines: a failure the log recorded too is expected.
+ * `log ...` commands are skipped so the replay does not write to the logs.
+ * @param path The binary log (see `binary_log_open()`).
+ * @return 0 if everything matched, 1 otherwise.
+ */
+int replay_log(NmriContext *ctx, const char *path)
+{
+    FILE *in = fopen(path, "rb");
+    char magic[sizeof(BINARY_LOG_MAGIC) - 1];
+    if (!in || fread(magic, 1, sizeof(magic), in) != sizeof(magic) || memcmp(magic, BINARY_LOG_MAGIC, sizeof(magic)) != 0)
+    {
+        report_error(NMRI_ERROR_IO, "'%s' is not a binary log.", path);
+        if (in)
+            fclose(in);
+        return 1;
+    }
+    OutputFormat output_format = ctx->output_format;
+    ctx->output_format = OUTPUT_NONE;
+    unsigned char header[BINARY_LOG_HEADER];
+    char *line = NULL;
+    size_t capacity = 0;
+    unsigned long records = 0, replayed = 0, differing = 0;
+    int status = 0;
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (fread(header, 1, sizeof(header), in) == sizeof(header))
+    {
+        uint32_t size;
+        memcpy(&size, header, 4);
+        size_t length = size >= BINARY_LOG_HEADER - 4 ? size - (BINARY_LOG_HEADER - 4) : 0;
+        if (length + 1 > capacity)
         {
-            current_token->type = TOKEN_LPAREN;
-            token_count++;
-            p++;
-            expecting_operand = 1; // Expect an operand inside parentheses
+            char *grown = size >= BINARY_LOG_HEADER - 4 ? realloc(line, length + 1) : NULL;
+            if (!grown)
+            {
+                report_error(NMRI_ERROR_IO, "Invalid record %lu in '%s'.", records + 1, path);
+                status = 1;
+                break;
+            }
+            line = grown;
+            capacity = length + 1;
         }
-        else if (*p == ')')
+        if (fread(line, 1, length, in) != length)
         {
-            current_token->type = TOKEN_RPAREN;
-            token_count++;
-            p++;
-            expecting_operand = 0; // After ')', expect an operator or end of expression
+            report_error(NMRI_ERROR_IO, "'%s' ends in the middle of record %lu.", path, records + 1);
+            status = 1;
+            break;
         }
-        // Handle unrecognized characters
-        else
+        line[length] = '\0';
+        records++;
+        LineKind kind = (LineKind)header[4];
+        int logged_status = header[5];
+        uint16_t logged_error;
+        memcpy(&logged_error, header + 6, sizeof(logged_error));
+        double logged;
+        memcpy(&logged, header + 16, sizeof(logged));
+        if (kind == LINE_COMMAND && strncmp(line, "log", 3) == 0 && (line[3] == '\0' || isspace((unsigned char)line[3])))
+            continue;
+
+        double result;
+        LineKind replayed_kind;
+        int line_status = execute_line_value(ctx, line, 0, &result, &replayed_kind);
+        if (line_status < 0)
+            break; // 'exit'
+        replayed++;
+        NmriError error = line_status ? last_error.code : NMRI_OK;
+        // A failed line logged without its error (an older log) only has to fail again
+        int same = line_status == logged_status && replayed_kind == kind &&
+                   (!logged_status || logged_error == NMRI_OK || logged_error == (uint16_t)error) &&
+                   (isnan(result) ? isnan(logged) : memcmp(&result, &logged, sizeof(result)) == 0);
+        if (!same)
         {
-            fprintf(stderr, "%sError:%s Invalid character '%c' in expression.\n", COLOR_RED, COLOR_RESET, *p);
-            return -1;
+            // Failures the log recorded too are expected: only the error of a difference is shown
+            if (line_status == 1)
+                show_error(ctx, line, 0);
+            char now[NUMBER_BUFFER], then[NUMBER_BUFFER];
+            char now_outcome[64], then_outcome[64];
+            format_shortest(result, now);
+            format_shortest(logged, then);
+            printf("Record %lu differs: '%s' gave %s%s, the log has %s%s\n", records, line, now,
+                   replay_outcome(line_status, error, now_outcome, sizeof(now_outcome)), then,
+                   replay_outcome(logged_status, (NmriError)logged_error, then_outcome, sizeof(then_outcome)));
+            differing++;
         }
     }
-    return token_count; // Success
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double seconds = (double)(stop.tv_sec - start.tv_sec) + (double)(stop.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Replayed %lu of %lu records in %.3f s (%.0f lines/s): %lu differ from the log.\n", replayed, records,
+           seconds, seconds > 0 ? (double)replayed / seconds : 0.0, differing);
+    free(line);
+    fclose(in);
+    ctx->output_format = output_format;
+    return status || differing > 0;
 }
 
 /**
- * @brief Gets the precedence level of an operator. Higher value means higher precedence.
- * @param op The operator type.
- * @return The precedence level (integer).
+ * @brief Describes how a line ended, for the "differs" lines of `replay_log()`.
+ * @return "" if it succeeded, else " (failed: <error name>)", or " (failed)" without an error.
+ * @param buffer Storage for the text.
  */
-int precedence(OperatorType op)
+const char *replay_outcome(int failed, NmriError error, char *buffer, size_t size)
 {
-    switch (op)
+    if (!failed)
+        return "";
+    if (error == NMRI_OK)
+        return " (failed)";
+    snprintf(buffer, size, " (failed: %s)", nmri_error_name(error));
+    return buffer;
+}
+
+/* --- CSV Mode --- */
+
+/**
+ * @brief Splits off the next field of a CSV row. A field may be enclosed in double
+ * quotes to contain commas (a doubled quote inside is kept as it is); the spaces
+ * around a field are not part of it.
+ * @param p Start of the field.
+ * @param end End of the row.
+ * @param field Set to the start of the field's text.
+ * @param length Set to the length of the field's text.
+ * @return The position of the comma after the field, or `end` for the last field of the row.
+ */
+const char *csv_field(const char *p, const char *end, const char **field, size_t *length)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    const char *start = p, *stop;
+    if (p < end && *p == '"')
     {
-    case OP_ADD:
-    case OP_SUB:
-        return 1;
-    case OP_MUL:
-    case OP_DIV:
-    case OP_MOD:
-        return 2;
-    case OP_POW:
-        return 3; // Power has the highest precedence
-    default:
-        return 0; // Should not happen for valid operators
+        start = ++p;
+        while (p < end && (*p != '"' || (p + 1 < end && p[1] == '"')))
+            p += *p == '"' ? 2 : 1;
+        stop = p;
+    }
+    else
+    {
+        while (p < end && *p != ',')
+            p++;
+        stop = p;
+        while (stop > start && (stop[-1] == ' ' || stop[-1] == '\t'))
+            stop--;
     }
+    *field = start;
+    *length = (size_t)(stop - start);
+    while (p < end && *p != ',')
+        p++; // Closing quote and anything after it
+    return p;
 }
 
 /**
- * @brief Checks if an operator is left-associative.
- * Most operators are left-associative (e.g., a - b - c = (a - b) - c).
- * Power (^) is typically right-associative (e.g., a ^ b ^ c = a ^ (b ^ c)).
- * @param op The operator type.
- * @return 1 if left-associative, 0 otherwise.
+ * @brief Reads a CSV field as a number: a decimal number with an optional sign and
+ * an optional '%' sign (so "15%" is 0.15, as in expressions).
+ * @return The value, or NAN if the field is empty or not a number.
  */
-int is_left_associative(OperatorType op) { return op != OP_POW; }
+double csv_number(const char *field, size_t length)
+{
+    const char *p = field, *end = field + length;
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+    if (p == end || !(isdigit((unsigned char)*p) || (*p == '.' && p + 1 < end && isdigit((unsigned char)p[1]))))
+        return NAN;
+    char *stop;
+    double value = parse_number(p, &stop);
+    if (stop > end)
+        return NAN;
+    p = stop;
+    if (p < end && *p == '%')
+    {
+        value /= 100.0;
+        p++;
+    }
+    if (p != end)
+        return NAN;
+    return negative ? -value : value;
+}
 
 /**
- * @brief Converts an infix expression (token array) to postfix (RPN) using the Shunting-yard algorithm.
- * @param tokens Input array of infix tokens.
- * @param token_count Number of tokens in the input array.
- * @param output Output array where postfix tokens will be stored.
- * @param max_output The maximum capacity of the `output` array.
- * @return The number of tokens in the postfix output, or -1 on error.
+ * @brief Maps the CSV header to the variables of the program: each variable is the
+ * column of the same name, or else the session variable of that name.
+ * @param header The header line.
+ * @return 0 on success, -1 if a variable has neither a column nor a value, or out of memory (printed).
  */
-int shunting_yard(Token *tokens, int token_count, Token *output, int max_output)
+int csv_map_header(const NmriContext *ctx, CsvRun *run, const char *header)
 {
-    Token op_stack[MAX_TOKENS]; // Stack for operators and parentheses
-    int op_top = -1;            // Operator stack pointer (-1 means empty)
-    int output_count = 0;       // Number of tokens added to the output queue
-
-    for (int i = 0; i < token_count; i++)
+    const NmriProgram *program = run->program;
+    for (int i = 0; i < program->var_count; i++)
+        run->column_of[i] = -1;
+    const char *end = header + text_length(header);
+    for (int column = 0; column < INT_MAX; column++)
     {
-        Token token = tokens[i];
-        switch (token.type)
+        const char *field;
+        size_t length;
+        const char *next = csv_field(header, end, &field, &length);
+        for (int i = 0; i < program->var_count; i++)
         {
-        case TOKEN_NUMBER:
-            // Numbers go directly to the output queue
-            if (output_count >= max_output)
-            {
-                fprintf(stderr, "%sError:%s Output queue overflow during parsing.\n", COLOR_RED, COLOR_RESET);
-                return -1;
-            }
-            output[output_count++] = token;
-            break;
-        case TOKEN_FUNCTION:
-            // Functions go onto the operator stack
-            if (op_top >= MAX_TOKENS - 1)
-            {
-                fprintf(stderr, "%sError:%s Operator stack overflow (function).\n", COLOR_RED, COLOR_RESET);
-                return -1;
-            }
-            op_stack[++op_top] = token;
-            break;
-        case TOKEN_OPERATOR:
-            // Pop operators with higher or equal precedence (respecting associativity)
-            while (op_top >= 0 && op_stack[op_top].type == TOKEN_OPERATOR &&
-                   ((is_left_associative(token.value.op) && precedence(token.value.op) <= precedence(op_stack[op_top].value.op)) ||
-                    (!is_left_associative(token.value.op) && precedence(token.value.op) < precedence(op_stack[op_top].value.op))))
-            {
-                if (output_count >= max_output)
-                {
-                    fprintf(stderr, "%sError:%s Output queue overflow (operator pop).\n", COLOR_RED, COLOR_RESET);
-                    return -1;
-                }
-                output[output_count++] = op_stack[op_top--]; // Pop from stack to output
-            }
-            // Push the current operator onto the stack
-            if (op_top >= MAX_TOKENS - 1)
-            {
-                fprintf(stderr, "%sError:%s Operator stack overflow (operator push).\n", COLOR_RED, COLOR_RESET);
-                return -1;
-            }
-            op_stack[++op_top] = token;
-            break;
-        case TOKEN_LPAREN:
-            // Push left parenthesis onto the operator stack
-            if (op_top >= MAX_TOKENS - 1)
-            {
-                fprintf(stderr, "%sError:%s Operator stack overflow (left paren).\n", COLOR_RED, COLOR_RESET);
-                return -1;
-            }
-            op_stack[++op_top] = token;
-            break;
-        case TOKEN_RPAREN:
-            // Pop operators until a matching left parenthesis is found
-            while (op_top >= 0 && op_stack[op_top].type != TOKEN_LPAREN)
+            if (run->column_of[i] < 0 && strlen(program->var_names[i]) == length &&
+                strncmp(program->var_names[i], field, length) == 0)
             {
-                if (output_count >= max_output)
-                {
-                    fprintf(stderr, "%sError:%s Output queue overflow (right paren pop).\n", COLOR_RED, COLOR_RESET);
-                    return -1;
-                }
-                output[output_count++] = op_stack[op_top--]; // Pop from stack to output
-            }
-            // Check for mismatched parentheses
-            if (op_top < 0)
-            {
-                fprintf(stderr, "%sError:%s Mismatched parentheses (extra right parenthesis?).\n", COLOR_RED, COLOR_RESET);
-                return -1;
-            }
-            // Pop the left parenthesis itself (discard it)
-            op_top--;
-            // If the token before '(' was a function, pop it to output
-            if (op_top >= 0 && op_stack[op_top].type == TOKEN_FUNCTION)
-            {
-                if (output_count >= max_output)
-                {
-                    fprintf(stderr, "%sError:%s Output queue overflow (function pop).\n", COLOR_RED, COLOR_RESET);
-                    return -1;
-                }
-                output[output_count++] = op_stack[op_top--];
+                run->column_of[i] = column; // The first of two columns with the same name is used
+                if (column >= run->column_count)
+                    run->column_count = column + 1;
             }
-            break;
-        case TOKEN_ASSIGNMENT: // Should ideally be handled before shunting yard
-            fprintf(stderr, "%sInternal Error:%s Assignment token found in shunting yard.\n", COLOR_RED, COLOR_RESET);
-            return -1;
-        case TOKEN_VARIABLE: // Should have been resolved to TOKEN_NUMBER by tokenizer
-            fprintf(stderr, "%sInternal Error:%s Variable token found in shunting yard.\n", COLOR_RED, COLOR_RESET);
-            return -1;
         }
+        if (next == end)
+            break;
+        header = next + 1;
     }
-    // After processing all input tokens, pop any remaining operators from the stack to the output
-    while (op_top >= 0)
+    for (int i = 0; i < program->var_count; i++)
     {
-        // Check for leftover parentheses (mismatched)
-        if (op_stack[op_top].type == TOKEN_LPAREN)
-        {
-            fprintf(stderr, "%sError:%s Mismatched parentheses (extra left parenthesis?).\n", COLOR_RED, COLOR_RESET);
-            return -1;
-        }
-        if (output_count >= max_output)
+        if (run->column_of[i] >= 0)
+            continue;
+        int index = find_variable(ctx, program->var_names[i]);
+        if (index < 0)
         {
-            fprintf(stderr, "%sError:%s Output queue overflow (final pop).\n", COLOR_RED, COLOR_RESET);
+            report_error(NMRI_ERROR_UNKNOWN_NAME, "No column or variable named '%s'.", program->var_names[i]);
             return -1;
         }
-        output[output_count++] = op_stack[op_top--];
+        for (size_t row = 0; row < CSV_BLOCK_ROWS; row++)
+            run->values[i][row] = ctx->variables[index].value;
     }
-    return output_count; // Success, return number of tokens in postfix expression
+    if (!(run->slot_of = malloc((run->column_count + 1) * sizeof(int))))
+    {
+        report_error(NMRI_ERROR_NO_MEMORY, "Out of memory.");
+        return -1;
+    }
+    for (int column = 0; column < run->column_count; column++)
+        run->slot_of[column] = -1;
+    for (int i = 0; i < program->var_count; i++)
+    {
+        if (run->column_of[i] >= 0)
+            run->slot_of[run->column_of[i]] = i;
+    }
+    return 0;
 }
 
 /**
- * @brief Evaluates a postfix (RPN) expression.
- * @param postfix Array of tokens in postfix order.
- * @param count Number of tokens in the `postfix` array.
- * @return The calculated result (double), or NAN (Not a Number) on error.
+ * @brief Parses the fields a CSV row has for the variables into row `row` of the
+ * value columns. A field that is not a number, or is missing, becomes NAN, its
+ * error is shown and the row is marked as failed (an expression such as "1^x"
+ * would otherwise turn the NAN back into a number).
+ * @param line The row (ending at a NUL or a newline).
  */
-double evaluate_postfix(Token *postfix, int count)
+void csv_parse_row(NmriContext *ctx, CsvRun *run, const char *line, size_t row)
 {
-    Value stack[MAX_TOKENS]; // Evaluation stack holding intermediate 'Value' structs
-    int top = -1;            // Stack pointer (-1 means empty)
-
-    for (int i = 0; i < count; i++)
+    const char *end = line + text_length(line);
+    int column = 0;
+    run->failed[row] = 0;
+    for (const char *p = line; column < run->column_count; column++)
     {
-        Token token = postfix[i];
-        if (token.type == TOKEN_NUMBER)
+        const char *field;
+        size_t length;
+        const char *next = csv_field(p, end, &field, &length);
+        int slot = run->slot_of[column];
+        if (slot >= 0 && isnan(run->values[slot][row] = csv_number(field, length)))
         {
-            // Push numbers onto the stack
-            if (top >= MAX_TOKENS - 1)
-            {
-                fprintf(stderr, "%sError:%s Evaluation stack overflow.\n", COLOR_RED, COLOR_RESET);
-                return NAN;
-            }
-            stack[++top] = (Value){.num = token.value.number, .is_percentage = token.is_percentage};
+            set_error(NMRI_ERROR_INVALID, (int)(field - line), "Column '%s' is not a number.",
+                      run->program->var_names[slot]);
+            show_error(ctx, line, 0);
+            run->failed[row] = 1;
         }
-        else if (token.type == TOKEN_OPERATOR)
+        if (next == end)
         {
-            // Apply operator to the top two stack elements
-            if (top < 1)
-            { // Need at least two operands for binary operators
-                fprintf(stderr, "%sError:%s Insufficient operands for operator '%c'.\n",
-                        COLOR_RED, COLOR_RESET, "+-*/^%"[token.value.op]); // Simple way to get char
-                return NAN;
-            }
-            Value op_b = stack[top--]; // Pop second operand
-            Value op_a = stack[top--]; // Pop first operand
-            double result;
-            // Perform the operation
-            switch (token.value.op)
-            {
-            case OP_ADD:
-                result = op_b.is_percentage ? op_a.num + (op_b.num / 100.0 * op_a.num) : op_a.num + op_b.num;
-                break;
-            case OP_SUB:
-                result = op_b.is_percentage ? op_a.num - (op_b.num / 100.0 * op_a.num) : op_a.num - op_b.num;
-                break;
-            case OP_MUL:
-            {
-                double a = op_a.is_percentage ? op_a.num / 100.0 : op_a.num;
-                double b = op_b.is_percentage ? op_b.num / 100.0 : op_b.num;
-                result = a * b;
-            }
-            break;
-            case OP_DIV:
-            {
-                double a = op_a.is_percentage ? op_a.num / 100.0 : op_a.num;
-                double b = op_b.is_percentage ? op_b.num / 100.0 : op_b.num;
-                if (b == 0.0)
-                {
-                    fprintf(stderr, "%sError:%s Division by zero.\n", COLOR_RED, COLOR_RESET);
-                    return NAN;
-                }
-                result = a / b;
-            }
+            column++;
             break;
-            case OP_POW:
-                if (op_a.is_percentage || op_b.is_percentage)
-                    fprintf(stderr, "%sWarning:%s Percentage ignored in power operation.\n", COLOR_YELLOW, COLOR_RESET);
-                result = pow(op_a.num, op_b.num);
-                break;
-            case OP_MOD:
-                if (op_a.is_percentage || op_b.is_percentage)
-                    fprintf(stderr, "%sWarning:%s Percentage ignored in modulo operation.\n", COLOR_YELLOW, COLOR_RESET);
-                if (op_b.num == 0.0)
-                {
-                    fprintf(stderr, "%sError:%s Modulo by zero.\n", COLOR_RED, COLOR_RESET);
-                    return NAN;
-                }
-                result = fmod(op_a.num, op_b.num);
-                break;
-            default:
-                fprintf(stderr, "%sInternal Error:%s Unknown operator type.\n", COLOR_RED, COLOR_RESET);
-                return NAN;
-            }
-            // Push the result back onto the stack (result is never a percentage itself)
-            if (top >= MAX_TOKENS - 1)
-            { // Check before pushing
-                fprintf(stderr, "%sError:%s Evaluation stack overflow after operation.\n", COLOR_RED, COLOR_RESET);
-                return NAN;
-            }
-            stack[++top] = (Value){.num = result, .is_percentage = 0};
-        }
-        else if (token.type == TOKEN_FUNCTION)
-        {
-            // Apply function to the top stack element
-            if (top < 0)
-            { // Need at least one argument
-                fprintf(stderr, "%sError:%s Insufficient arguments for function.\n", COLOR_RED, COLOR_RESET);
-                // Could lookup function name here for better error message
-                return NAN;
-            }
-            Value arg = stack[top--];                                       // Pop argument
-            double arg_val = arg.is_percentage ? arg.num / 100.0 : arg.num; // Convert percentage if needed
-            double result;
-            // Evaluate the function
-            switch (token.value.func)
-            {
-            // Trig functions (assume radians)
-            case FUNC_SIN:
-                result = sin(arg_val);
-                break;
-            case FUNC_COS:
-                result = cos(arg_val);
-                break;
-            case FUNC_TAN:
-                result = tan(arg_val);
-                break;
-            // Inverse trig functions
-            case FUNC_ASIN:
-                if (arg_val < -1.0 || arg_val > 1.0)
-                {
-                    fprintf(stderr, "%sError:%s Arcsin argument out of range [-1, 1].\n", COLOR_RED, COLOR_RESET);
-                    return NAN;
-                }
-                result = asin(arg_val);
-                break;
-            case FUNC_ACOS:
-                if (arg_val < -1.0 || arg_val > 1.0)
-                {
-                    fprintf(stderr, "%sError:%s Arccos argument out of range [-1, 1].\n", COLOR_RED, COLOR_RESET);
-                    return NAN;
-                }
-                result = acos(arg_val);
-                break;
-            case FUNC_ATAN:
-                result = atan(arg_val);
-                break;
-            // Log, Sqrt, Exp
-            case FUNC_LOG:
-                if (arg_val <= 0.0)
-                {
-                    fprintf(stderr, "%sError:%s Logarithm requires positive argument.\n", COLOR_RED, COLOR_RESET);
-                    return NAN;
-                }
-                result = log(arg_val);
-                break;
-            case FUNC_SQRT:
-                if (arg_val < 0.0)
-                {
-                    fprintf(stderr, "%sError:%s Square root requires non-negative argument.\n", COLOR_RED, COLOR_RESET);
-                    return NAN;
-                }
-                result = sqrt(arg_val);
-                break;
-            case FUNC_EXP:
-                result = exp(arg_val);
-                break;
-            // Utility functions
-            case FUNC_ABS:
-                result = fabs(arg_val);
-                break;
-            case FUNC_FLOOR:
-                result = floor(arg_val);
-                break;
-            case FUNC_CEIL:
-                result = ceil(arg_val);
-                break;
-            case FUNC_ROUND:
-                result = round(arg_val);
-                break;
-            default: // Includes FUNC_INVALID
-                fprintf(stderr, "%sInternal Error:%s Unknown function type.\n", COLOR_RED, COLOR_RESET);
-                return NAN;
-            }
-            // Push the result back onto the stack (result is never a percentage)
-            if (top >= MAX_TOKENS - 1)
-            { // Check before pushing
-                fprintf(stderr, "%sError:%s Evaluation stack overflow after function.\n", COLOR_RED, COLOR_RESET);
-                return NAN;
-            }
-            stack[++top] = (Value){.num = result, .is_percentage = 0};
         }
+        p = next + 1;
     }
-    // After processing all tokens, the final result should be the only item on the stack
-    if (top != 0)
-    {
-        // This often indicates an invalid expression structure (e.g., "2 3 + 4")
-        fprintf(stderr, "%sError:%s Invalid expression structure (stack top %d, expected 0).\n", COLOR_RED, COLOR_RESET, top);
-        return NAN;
+    for (; column < run->column_count; column++)
+    {
+        int slot = run->slot_of[column];
+        if (slot < 0)
+            continue;
+        run->values[slot][row] = NAN;
+        set_error(NMRI_ERROR_INVALID, -1, "Missing column '%s'.", run->program->var_names[slot]);
+        show_error(ctx, line, 0);
+        run->failed[row] = 1;
     }
-    // Return the final result (handle potential remaining percentage)
-    // This shouldn't happen if operators/functions clear the flag, but safety check:
-    Value final_val = stack[0];
-    return final_val.is_percentage ? final_val.num / 100.0 : final_val.num;
 }
 
 /**
- * @brief Handles variable assignment (e.g., "x = 1 + 2").
- * Parses and evaluates the expression on the right-hand side and assigns
- * the result to the specified variable.
- * @param var_name The name of the variable to assign to.
- * @param expression The expression string to evaluate.
- * @return The calculated result, or NAN on error.
+ * @brief Evaluates the rows of a CSV block and prints their results in input order.
+ * @param rows Number of rows parsed into the value columns.
+ * @return 0 if every row succeeded, 1 if at least one failed, -1 if out of memory (printed).
  */
-double handle_assignment(const char *var_name, const char *expression)
+int csv_flush(NmriContext *ctx, CsvRun *run, size_t rows)
 {
-    Token tokens[MAX_TOKENS], postfix[MAX_TOKENS];
-    // 1. Tokenize the right-hand side expression
-    int token_count = tokenize(expression, tokens, MAX_TOKENS);
-    if (token_count < 0)
+    const double *const *inputs = (const double *const *)run->values;
+    int evaluated = run->pool ? batch_run_pool(run->pool, run->program, inputs, run->results, rows)
+                              : nmri_eval_batch(run->program, inputs, run->results, rows);
+    if (evaluated != 0)
     {
-        log_message("Assignment Error: Tokenization failed for '%s = %s'", var_name, expression);
-        return NAN;
+        report_error(NMRI_ERROR_NO_MEMORY, "Out of memory.");
+        return -1;
     }
-    if (token_count == 0)
+    int status = 0;
+    size_t used = 0;
+    for (size_t i = 0; i < rows; i++)
     {
-        fprintf(stderr, "%sError:%s Missing expression after '=' for assignment to '%s'.\n", COLOR_RED, COLOR_RESET, var_name);
-        log_message("Assignment Error: Missing expression for '%s'", var_name);
-        return NAN;
+        if (used > STREAM_BUFFER_SIZE - RESULT_BUFFER)
+        {
+            fwrite(run->output, 1, used, stdout);
+            used = 0;
+        }
+        double result = run->failed[i] ? NAN : run->results[i];
+        if (isnan(result))
+            status = 1;
+        // Failed rows print a plain NAN whatever sign the evaluator left on theirs
+        used += format_result(ctx->output_format, isnan(result) ? NAN : result, run->output + used);
     }
-    // 2. Convert the expression to postfix (RPN)
-    int postfix_count = shunting_yard(tokens, token_count, postfix, MAX_TOKENS);
-    if (postfix_count < 0)
+    fwrite(run->output, 1, used, stdout);
+    return status;
+}
+
+/**
+ * @brief Reads the header and the rows of a CSV input, evaluating and printing them a block at a time.
+ * @return 0 if every row succeeded, 1 otherwise.
+ */
+int csv_evaluate(NmriContext *ctx, CsvRun *run, StreamInput *input)
+{
+    const char *line;
+    do
     {
-        log_message("Assignment Error: Shunting-yard failed for '%s = %s'", var_name, expression);
-        return NAN;
+        ctx->line_number++;
+        line = stream_next_line(input, 0);
+    } while (line && line + strspn(line, " \t\r") >= line + text_length(line));
+    if (!line)
+    {
+        report_error(NMRI_ERROR_INVALID, "The CSV input has no header line.");
+        return 1;
     }
-    // 3. Evaluate the postfix expression
-    double result = evaluate_postfix(postfix, postfix_count);
-    // 4. Assign the result to the variable if evaluation was successful
-    if (!isnan(result))
+    if (csv_map_header(ctx, run, line) < 0)
+        return 1;
+
+    ctx->error_output = ERRORS_RECORD;
+    int status = 0;
+    size_t rows = 0;
+    while ((line = stream_next_line(input, 0)) != NULL)
     {
-        if (set_variable(var_name, result) < 0)
+        ctx->line_number++;
+        if (line + strspn(line, " \t\r") >= line + text_length(line))
+            continue; // Ignore blank lines
+        csv_parse_row(ctx, run, line, rows);
+        if (++rows == CSV_BLOCK_ROWS)
         {
-            log_message("Assignment Error: Failed to store result %g in variable '%s'", result, var_name);
-            return NAN;
+            int flushed = csv_flush(ctx, run, rows);
+            if (flushed < 0)
+                return 1;
+            status |= flushed;
+            rows = 0;
         }
-        // Update last_result and 'ans' only if assignment is successful
-        last_result = result;
-        set_variable("ans", result); // Keep 'ans' variable updated
-        log_message("Assignment: %s = %g (Expression: '%s')", var_name, result, expression);
     }
-    else
+    if (rows > 0 && csv_flush(ctx, run, rows) != 0)
+        status = 1;
+    return status;
+}
+
+/**
+ * @brief CSV mode: evaluates one expression for every row of a CSV input and prints
+ * one result per row, in the session's output format.
+ * The first non-blank line is the header. Each variable of the expression is the
+ * column of the same name, or else the session variable (e.g. from '--library').
+ * The expression is compiled once; the fields of the columns it uses are parsed into
+ * one array per variable, CSV_BLOCK_ROWS rows at a time, and each block is evaluated
+ * with the batch evaluator. Blank lines are skipped and quoted fields cannot span lines.
+ * A row with a field that is not a number, or whose evaluation fails, prints "nan";
+ * a bad field also gets a "line:column: code: message" record on stderr (see `show_error()`).
+ * @param in The CSV input (a file or stdin).
+ * @param expression The expression (no assignment).
+ * @param threads Number of threads evaluating the blocks (values < 2 evaluate on the calling thread).
+ * @return 0 if every row succeeded, 1 if a row failed or the expression or header is invalid.
+ */
+int run_csv(NmriContext *ctx, FILE *in, const char *expression, int threads)
+{
+    static char in_buffer[STREAM_BUFFER_SIZE], out_buffer[STREAM_BUFFER_SIZE], error_buffer[STREAM_BUFFER_SIZE];
+    CsvRun run = {0};
+    const char *failed_stage = NULL;
+    last_error.pending = 0;
+    int compiled = program_compile(ctx, &ctx->arena, expression, NULL, 0, &run.program, &failed_stage);
+    arena_reset(&ctx->arena);
+    if (compiled != 0)
     {
-        log_message("Assignment Error: Evaluation failed for '%s = %s'", var_name, expression);
+        if (compiled == 1)
+            report_error(NMRI_ERROR_SYNTAX, "Empty expression.");
+        show_error(ctx, expression, 0);
+        return 1;
     }
-    return result; // Return the calculated value (or NAN if evaluation failed)
+    setvbuf(in, in_buffer, _IOFBF, sizeof(in_buffer));
+    setvbuf(stdout, out_buffer, _IOFBF, sizeof(out_buffer));
+    setvbuf(stderr, error_buffer, _IOFBF, sizeof(error_buffer));
+    ctx->line_number = 0;
+
+    int vars = run.program->var_count, ready = 1;
+    run.column_of = malloc((vars + 1) * sizeof(int));
+    run.values = calloc(vars + 1, sizeof(double *));
+    run.results = malloc(CSV_BLOCK_ROWS * sizeof(double));
+    run.failed = malloc(CSV_BLOCK_ROWS);
+    run.output = malloc(STREAM_BUFFER_SIZE);
+    for (int i = 0; run.values && i < vars; i++)
+        ready &= (run.values[i] = malloc(CSV_BLOCK_ROWS * sizeof(double))) != NULL;
+    ThreadPool pool;
+    if (!ready || !run.column_of || !run.values || !run.results || !run.failed || !run.output)
+    {
+        report_error(NMRI_ERROR_NO_MEMORY, "Out of memory.");
+        ready = 0;
+    }
+    else if (threads > 1 && thread_pool_init(&pool, threads - 1) != 0) // The calling thread is the last worker
+    {
+        report_error(NMRI_ERROR_INTERNAL, "Could not start the worker threads.");
+        ready = 0;
+    }
+    else if (threads > 1)
+        run.pool = &pool;
+
+    StreamInput input;
+    int status = 1;
+    if (ready && stream_open(&input, in, 1) == 0)
+    {
+        status = csv_evaluate(ctx, &run, &input);
+        stream_close(&input);
+    }
+    if (run.pool)
+        thread_pool_destroy(run.pool);
+    for (int i = 0; run.values && i < vars; i++)
+        free(run.values[i]);
+    free(run.values);
+    free(run.column_of);
+    free(run.slot_of);
+    free(run.results);
+    free(run.failed);
+    free(run.output);
+    nmri_free(run.program);
+    fflush(stdout);
+    fflush(stderr);
+    return status;
 }
 
+/* --- Server Mode --- */
+
 /**
- * @brief Processes built-in text commands (non-mathematical).
- * @param input The user input string.
- * @return
- * 1 if a command was processed (and no further evaluation needed).
- * -1 if the 'exit' command was given.
- * 0 if the input was not a recognized command (should be treated as expression).
+ * @brief Creates the listening socket of the server mode.
+ * A socket file left behind by a server that is no longer running is replaced;
+ * one a server is still listening on is not.
+ * @param path Path of the Unix domain socket.
+ * @return The non-blocking listening socket, or -1 on error (printed).
  */
-int process_command(const char *input)
+int server_listen(const char *path)
 {
-    // Trim leading/trailing whitespace for simpler comparison
-    char trimmed_input[NMRI_MAX_INPUT];
-    const char *start = input;
-    while (isspace((unsigned char)*start))
-        start++;
-    strncpy(trimmed_input, start, NMRI_MAX_INPUT - 1);
-    trimmed_input[NMRI_MAX_INPUT - 1] = '\0';
-    char *end = trimmed_input + strlen(trimmed_input) - 1;
-    while (end >= trimmed_input && isspace((unsigned char)*end))
-        *end-- = '\0';
-
-    // Handle simple commands
-    if (strcmp(trimmed_input, "help") == 0)
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
     {
-        show_help();
-        return 1;
+        report_error(NMRI_ERROR_INVALID, "Socket path '%s' is too long.", path);
+        return -1;
     }
-    if (strcmp(trimmed_input, "exit") == 0 || strcmp(trimmed_input, "quit") == 0)
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int bound = fd >= 0 && bind(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+    if (fd >= 0 && !bound && errno == EADDRINUSE)
     {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int live = probe >= 0 && connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0;
+        struct stat info;
+        if (probe >= 0)
+            close(probe);
+        if (live)
+        {
+            report_error(NMRI_ERROR_IO, "Another server is listening on '%s'.", path);
+            close(fd);
+            return -1;
+        }
+        bound = stat(path, &info) == 0 && S_ISSOCK(info.st_mode) && unlink(path) == 0 &&
+                bind(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+    }
+    if (!bound || listen(fd, SOMAXCONN) < 0)
+    {
+        report_error(NMRI_ERROR_IO, "Could not listen on '%s': %s.", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
         return -1;
     }
-    if (strcmp(trimmed_input, "clear") == 0 || strcmp(trimmed_input, "cls") == 0)
+    return fd;
+}
+
+/**
+ * @brief Creates the state of a newly accepted client, with a new session.
+ * @param fd The connected socket (non-blocking).
+ * @param library_path Library loaded into the session (as with --library), or NULL.
+ * @param math Arithmetic of the session (as with --math).
+ * @return The client, or NULL on error (the caller closes `fd`).
+ */
+ServerClient *server_client_open(int fd, const char *library_path, NmriMath math)
+{
+    ServerClient *client = calloc(1, sizeof(ServerClient));
+    if (!client || !(client->ctx = nmri_context_create()))
     {
-        printf("\033[2J\033[H");
-        return 1;
+        free(client);
+        return NULL;
     }
-    if (strcmp(trimmed_input, "history") == 0)
+    if (!(client->capture = open_memstream(&client->captured, &client->captured_size)))
     {
-        show_history();
-        return 1;
+        nmri_context_destroy(client->ctx);
+        free(client);
+        return NULL;
     }
-    if (strcmp(trimmed_input, "variables") == 0 || strcmp(trimmed_input, "vars") == 0)
+    client->fd = fd;
+    client->ctx->output_format = OUTPUT_NONE; // Results go to the client, formatted by `server_respond()`
+    client->ctx->error_output = ERRORS_NONE;  // and failed requests get "nan"
+    nmri_context_set_math(client->ctx, math);
+    int functions, variables;
+    if (library_path && load_library(client->ctx, library_path, &functions, &variables) < 0)
     {
-        show_variables();
-        return 1;
+        fclose(client->capture);
+        free(client->captured);
+        nmri_context_destroy(client->ctx);
+        free(client);
+        return NULL;
     }
-    if (strcmp(trimmed_input, "memory") == 0 || strcmp(trimmed_input, "mem") == 0)
+    return client;
+}
+
+/**
+ * @brief Closes a client's socket (which also removes it from the epoll set) and releases its session.
+ */
+void server_client_close(ServerClient *client)
+{
+    close(client->fd);
+    fclose(client->capture);
+    free(client->captured);
+    nmri_context_destroy(client->ctx);
+    free(client->input);
+    free(client->output);
+    free(client);
+}
+
+/**
+ * @brief Queues the response to one request.
+ * The response is what the stream mode prints for the line ("nan" if it failed),
+ * or "ok" for a command, after what the command printed; with `--format binary`
+ * it is the raw 8-byte result, NAN for failures and commands. A length-framed
+ * request is answered with a frame of the same form, holding the response without its newline.
+ * @param framed 1 if the request was length-framed.
+ * @param status Result of `execute_line_value()` for the request (0 or 1).
+ * @param text What the command printed (`text_length` bytes), sent before its "ok".
+ * @return 0 on success, -1 if out of memory.
+ */
+int server_respond(ServerClient *client, OutputFormat format, int framed, int status, LineKind kind, double result,
+                   const char *text, size_t text_length)
+{
+    char response[RESULT_BUFFER];
+    size_t length;
+    if (status == 0 && kind == LINE_COMMAND && format != OUTPUT_BINARY)
     {
-        printf("Memory: %g\n", memory);
-        return 1;
+        memcpy(response, "ok\n", 3);
+        length = 3;
     }
-    if (strcmp(trimmed_input, "m+") == 0)
+    else
     {
-        memory += last_result;
-        printf("Memory = %g (added %g)\n", memory, last_result);
-        log_message("Memory += %g --> %g", last_result, memory);
-        return 1;
+        length = format_result(format, status == 0 ? result : NAN, response);
+        text_length = 0;
     }
-    if (strcmp(trimmed_input, "m-") == 0)
+    if (framed && format != OUTPUT_BINARY)
+        length--; // The frame delimits the response
+    uint32_t frame_length = (uint32_t)(text_length + length);
+    size_t needed = text_length + length + (framed ? 1 + sizeof(frame_length) : 0);
+
+    if (client->output_length + needed > client->output_capacity && client->output_start > 0)
     {
-        memory -= last_result;
-        printf("Memory = %g (subtracted %g)\n", memory, last_result);
-        log_message("Memory -= %g --> %g", last_result, memory);
-        return 1;
+        // Make room by moving the unsent bytes to the front first
+        memmove(client->output, client->output + client->output_start, client->output_length - client->output_start);
+        client->output_length -= client->output_start;
+        client->output_start = 0;
     }
-    if (strcmp(trimmed_input, "mr") == 0)
+    if (client->output_length + needed > client->output_capacity)
     {
-        printf("Recalled from memory: %g\n", memory);
-        last_result = memory;
-        set_variable("ans", last_result);
-        log_message("Memory Recall (mr): %g", memory);
-        return 1;
+        size_t capacity = client->output_capacity ? client->output_capacity * 2 : SERVE_READ_SIZE;
+        while (capacity < client->output_length + needed)
+            capacity *= 2;
+        char *grown = realloc(client->output, capacity);
+        if (!grown)
+            return -1;
+        client->output = grown;
+        client->output_capacity = capacity;
     }
-    if (strcmp(trimmed_input, "mc") == 0)
+    char *out = client->output + client->output_length;
+    if (framed)
     {
-        memory = 0.0;
-        printf("Memory cleared.\n");
-        log_message("Memory Cleared (mc)");
-        return 1;
+        *out++ = '\0';
+        memcpy(out, &frame_length, sizeof(frame_length));
+        out += sizeof(frame_length);
     }
-    // Handle 'store <varname>' command
-    if (strncmp(trimmed_input, "store ", 6) == 0)
+    if (text_length > 0)
+        memcpy(out, text, text_length);
+    memcpy(out + text_length, response, length);
+    client->output_length += needed;
+    return 0;
+}
+
+/**
+ * @brief Executes every complete request a client has sent, in order, and queues the responses.
+ * A request is either a line ending with '\n' (blank lines and '#' comments are
+ * skipped without a response) or a length frame: a NUL byte, the length as a
+ * 32-bit unsigned integer in native byte order, and that many bytes. A last line
+ * without '\n' is executed once the client has shut down its side.
+ * Stops early while SERVE_OUTPUT_LIMIT bytes of responses are unsent, so a client
+ * that does not read its responses cannot make the server buffer without bound.
+ * @return 0 once the complete requests are executed, 1 if some are left because
+ * of the output limit, -1 on a request longer than SERVE_MAX_REQUEST or out of memory.
+ */
+int server_client_execute(ServerClient *client, OutputFormat format)
+{
+    size_t position = 0;
+    int pending = 0, status = 0;
+    while (!client->closing && position < client->input_length)
     {
-        const char *var_name = trimmed_input + 6;
-        while (isspace((unsigned char)*var_name))
-            var_name++;
-        if (*var_name == '\0')
-        {
-            fprintf(stderr, "%sError:%s Missing variable name for 'store' command.\n", COLOR_RED, COLOR_RESET);
-            log_message("Command Error: Missing variable name for store");
-            return 1;
-        }
-        char name_buf[MAX_IDENTIFIER_LEN] = {0};
-        int i = 0;
-        const char *name_start = var_name;
-        if (!isalpha((unsigned char)*name_start) && *name_start != '_')
+        if (client->output_length - client->output_start >= SERVE_OUTPUT_LIMIT)
         {
-            fprintf(stderr, "%sError:%s Invalid variable name '%s' for 'store'. Must start with a letter or underscore.\n", COLOR_RED, COLOR_RESET, name_start);
-            log_message("Command Error: Invalid store variable name '%s'", name_start);
-            return 1;
+            pending = 1;
+            break;
         }
-        while (*var_name && !isspace((unsigned char)*var_name) && i < MAX_IDENTIFIER_LEN - 1)
+        char *request = client->input + position;
+        size_t available = client->input_length - position;
+        size_t length, consumed;
+        int framed = request[0] == '\0';
+        if (framed)
         {
-            if (!isalnum((unsigned char)*var_name) && *var_name != '_')
+            uint32_t frame_length;
+            if (available < 1 + sizeof(frame_length))
+                break;
+            memcpy(&frame_length, request + 1, sizeof(frame_length));
+            length = frame_length;
+            if (length > SERVE_MAX_REQUEST)
             {
-                fprintf(stderr, "%sError:%s Invalid character '%c' in variable name for 'store'.\n", COLOR_RED, COLOR_RESET, *var_name);
-                log_message("Command Error: Invalid char in store variable name '%s'", name_start);
-                return 1;
+                status = -2;
+                break;
             }
-            name_buf[i++] = *var_name++;
-        }
-        name_buf[i] = '\0';
-        if (*var_name != '\0' && !isspace((unsigned char)*var_name))
-        {
-            fprintf(stderr, "%sError:%s Variable name '%s...' too long or invalid for 'store'.\n", COLOR_RED, COLOR_RESET, name_buf);
-            log_message("Command Error: Store variable name too long or invalid '%s'", name_buf);
-            return 1;
-        }
-        if (set_variable(name_buf, last_result) >= 0)
-        {
-            printf("Stored %g in variable '%s'\n", last_result, name_buf);
-            log_message("Command: Stored %g in variable '%s'", last_result, name_buf);
+            if (available - 1 - sizeof(frame_length) < length)
+                break;
+            request += 1 + sizeof(frame_length);
+            consumed = 1 + sizeof(frame_length) + length;
         }
         else
         {
-            log_message("Command Error: Failed to store %g in variable '%s'", last_result, name_buf);
-        }
-        return 1;
-    }
-    // Handle 'log ...' commands
-    if (strncmp(trimmed_input, "log ", 4) == 0)
-    {
-        const char *subcommand = trimmed_input + 4;
-        while (isspace((unsigned char)*subcommand))
-            subcommand++;
-        if (strcmp(subcommand, "on") == 0)
-        {
-            if (!logging_enabled)
-            {
-                if (init_logging())
-                {
-                    logging_enabled = 1;
-                    printf("%sLogging enabled.%s To file: %s\n", COLOR_GREEN, COLOR_RESET, log_path);
-                    log_session_start();
-                    log_message("Command: Logging enabled");
-                }
-            }
-            else
+            const char *newline = memchr(request, '\n', available);
+            if (!newline && available > SERVE_MAX_REQUEST)
             {
-                printf("Logging is already enabled. Log file: %s\n", log_path);
+                status = -2;
+                break;
             }
-            return 1;
+            if (!newline && !client->input_done)
+                break;
+            length = newline ? (size_t)(newline - request) : available;
+            consumed = newline ? length + 1 : length;
         }
-        if (strcmp(subcommand, "off") == 0)
+        position += consumed;
+
+        // Terminate the request in place; the byte after it belongs to the next
+        // request (or is the spare byte after the input) and is put back afterwards
+        char *end = request + length;
+        char saved = *end;
+        *end = '\0';
+        while (length > 0 && (request[length - 1] == '\n' || request[length - 1] == '\r'))
+            request[--length] = '\0';
+        char *start = request;
+        while (isspace((unsigned char)*start))
+            start++;
+        if (!framed && (*start == '\0' || *start == '#'))
         {
-            if (logging_enabled)
-            {
-                log_message("Command: Logging disabled");
-                log_session_stop();
-                logging_enabled = 0;
-                printf("%sLogging disabled.%s\n", COLOR_YELLOW, COLOR_RESET);
-            }
-            else
-            {
-                printf("Logging is already disabled.\n");
-            }
-            return 1;
+            *end = saved;
+            continue; // Ignore blank lines and comments
         }
-        if (strcmp(subcommand, "show") == 0)
+
+        // Commands print to stdout: while the request runs, stdout is the client's
+        // capture stream (glibc lets the standard streams be assigned), so what they
+        // print goes into the response
+        double result;
+        LineKind kind;
+        fflush(stdout);
+        FILE *server_stdout = stdout;
+        stdout = client->capture;
+        int line_status = execute_line_value(client->ctx, start, 0, &result, &kind);
+        stdout = server_stdout;
+        long printed = ftell(client->capture);
+        int captured = fflush(client->capture) == 0 && printed >= 0;
+        if (client->ctx->binary_log && line_status >= 0)
+            binary_log_record(client->ctx, kind, line_status, last_error.code, result, start);
+        *end = saved;
+        if (line_status < 0)
+            client->closing = 1; // 'exit' ends the connection
+        else if (!captured || server_respond(client, format, framed, line_status, kind, result, client->captured,
+                                             (size_t)printed) < 0)
         {
-            log_message("Command: Show log requested");
-            show_log(HISTORY_SIZE);
-            return 1;
+            status = -1;
+            break;
         }
-        if (strcmp(subcommand, "file") == 0)
+        rewind(client->capture);
+    }
+    if (status == -2)
+        report_error(NMRI_ERROR_LIMIT, "A client sent a request longer than %d bytes; disconnecting it.", SERVE_MAX_REQUEST);
+    else if (status < 0)
+        report_error(NMRI_ERROR_NO_MEMORY, "Out of memory; disconnecting a client.");
+    if (position > 0)
+    {
+        memmove(client->input, client->input + position, client->input_length - position);
+        client->input_length -= position;
+    }
+    return status < 0 ? -1 : pending;
+}
+
+/**
+ * @brief Sends as much of a client's queued responses as the socket accepts without blocking.
+ * @return 0 on success (some bytes may remain unsent), -1 if the connection failed.
+ */
+int server_client_flush(ServerClient *client)
+{
+    while (client->output_start < client->output_length)
+    {
+        ssize_t sent = send(client->fd, client->output + client->output_start,
+                            client->output_length - client->output_start, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (sent < 0)
+            return -1;
+        client->output_start += (size_t)sent;
+    }
+    if (client->output_start == client->output_length)
+        client->output_start = client->output_length = 0;
+    return 0;
+}
+
+/**
+ * @brief Handles the epoll events of a client: reads what it sent, executes its
+ * complete requests, sends the responses, and updates the events waited for
+ * (reading pauses while the unsent responses are over SERVE_OUTPUT_LIMIT).
+ * @param events The events reported by `epoll_wait()`.
+ * @return 0 to keep the client, 1 if it should be closed (done or failed).
+ */
+int server_client_event(int epoll_fd, ServerClient *client, uint32_t events, OutputFormat format)
+{
+    if (events & EPOLLERR)
+        return 1;
+    if ((events & (EPOLLIN | EPOLLHUP)) && !client->input_done)
+    {
+        // Always keep a spare byte after the input for `server_client_execute()`
+        if (client->input_capacity - client->input_length < SERVE_READ_SIZE + 1)
         {
-            printf("Current log file path: %s%s%s\n", COLOR_YELLOW, log_path, COLOR_RESET);
-            log_message("Command: Log file path requested (%s)", log_path);
-            return 1;
+            size_t capacity = client->input_capacity ? client->input_capacity * 2 : SERVE_READ_SIZE + 1;
+            while (capacity - client->input_length < SERVE_READ_SIZE + 1)
+                capacity *= 2;
+            char *grown = realloc(client->input, capacity);
+            if (!grown)
+                return 1;
+            client->input = grown;
+            client->input_capacity = capacity;
         }
-        if (strncmp(subcommand, "file ", 5) == 0)
-        {
-            const char *new_path = subcommand + 5;
-            while (isspace((unsigned char)*new_path))
-                new_path++;
-            if (*new_path)
-            {
-                close_logging();
-                strncpy(log_path, new_path, sizeof(log_path) - 1);
-                log_path[sizeof(log_path) - 1] = '\0';
-                printf("Log file path set to: %s%s%s\n", COLOR_YELLOW, log_path, COLOR_RESET);
-                if (logging_enabled)
-                {
-                    init_logging();
-                    log_session_start();
-                    log_message("Command: Log file path changed to %s", log_path);
-                }
-                else
-                {
-                    log_message("Command: Log file path set to %s (logging is off)", log_path);
-                }
-            }
-            else
-            {
-                printf("Usage: log file <new_path>\n");
-            }
+        ssize_t received = read(client->fd, client->input + client->input_length, SERVE_READ_SIZE);
+        if (received > 0)
+            client->input_length += (size_t)received;
+        else if (received == 0)
+            client->input_done = 1;
+        else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
             return 1;
-        }
-        fprintf(stderr, "%sError:%s Unknown 'log' subcommand '%s'. Use 'on', 'off', 'show', 'file', or 'file <path>'.\n", COLOR_RED, COLOR_RESET, subcommand);
-        log_message("Command Error: Unknown log subcommand '%s'", subcommand);
+    }
+
+    // Run the requests and send the responses; requests held back by the output
+    // limit run as soon as sending brings the output under it again
+    int pending;
+    do
+    {
+        pending = server_client_execute(client, format);
+        if (pending < 0 || server_client_flush(client) < 0)
+            return 1;
+    } while (pending > 0 && client->output_length - client->output_start < SERVE_OUTPUT_LIMIT);
+
+    size_t unsent = client->output_length - client->output_start;
+    if (unsent == 0 && (client->closing || (client->input_done && pending == 0)))
         return 1;
+    uint32_t wanted = (!client->closing && !client->input_done && unsent < SERVE_OUTPUT_LIMIT ? EPOLLIN : 0) |
+                      (unsent > 0 ? EPOLLOUT : 0);
+    if (wanted != client->events)
+    {
+        struct epoll_event event = {0};
+        event.events = wanted;
+        event.data.ptr = client;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event) < 0)
+            return 1;
+        client->events = wanted;
     }
-    // If none of the above, it's not a recognized command
     return 0;
 }
 
 /**
- * @brief Evaluates a complete mathematical expression string.
- * This function orchestrates the tokenization, Shunting-yard conversion,
- * and postfix evaluation steps. Updates `last_result` and 'ans' variable on success.
- * @param input The mathematical expression string.
- * @return The calculated result, or NAN on error.
+ * @brief Runs the server mode: accepts clients on a Unix domain socket and executes
+ * their requests until SIGINT or SIGTERM. Each connection has its own session, so its
+ * variables, functions and compiled-expression cache stay warm between requests,
+ * and clients may send any number of requests without waiting for the responses.
+ * All clients are served by one thread with an epoll event loop.
+ * @param path Path of the socket (removed when the server stops).
+ * @param library_path Library loaded into every new session, or NULL.
+ * @param format Format of the responses (see `server_respond()`).
+ * @param math Arithmetic of every new session.
+ * @return 0 after a signal stopped the server, 1 on error.
  */
-double evaluate_expression(const char *input)
+int run_server(const char *path, const char *library_path, OutputFormat format, NmriMath math)
 {
-    Token tokens[MAX_TOKENS], postfix[MAX_TOKENS];
-    // 1. Tokenize
-    int token_count = tokenize(input, tokens, MAX_TOKENS);
-    if (token_count < 0)
+    terminal_colors = 0; // What commands print is sent to the clients
+    // The stop signals are read from a descriptor in the epoll set instead of
+    // interrupting the loop, so no handler (and no global flag) is needed
+    sigset_t signals, previous;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    int listen_fd = signal_fd >= 0 ? server_listen(path) : -1;
+    int epoll_fd = listen_fd >= 0 ? epoll_create1(EPOLL_CLOEXEC) : -1;
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.ptr = &signal_fd;
+    int ready = epoll_fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) == 0;
+    event.data.ptr = &listen_fd;
+    ready = ready && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == 0;
+    if (!ready && (signal_fd < 0 || listen_fd >= 0))
+        report_error(NMRI_ERROR_IO, "Could not start the server: %s.", strerror(errno));
+
+    ServerClient **clients = NULL;
+    int client_count = 0, client_capacity = 0;
+    unsigned long connections = 0;
+    int status = ready ? 0 : 1;
+    if (ready)
     {
-        log_message("Evaluation Error: Tokenization failed for '%s'", input);
-        return NAN;
+        printf("Serving on '%s'.\n", path);
+        fflush(stdout);
     }
-    if (token_count == 0)
-    {
-        return NAN;
-    } // Empty expression is invalid for evaluation
-    // 2. Convert to Postfix (RPN)
-    int postfix_count = shunting_yard(tokens, token_count, postfix, MAX_TOKENS);
-    if (postfix_count < 0)
+    while (ready)
     {
-        log_message("Evaluation Error: Shunting-yard failed for '%s'", input);
-        return NAN;
+        struct epoll_event events[SERVE_MAX_EVENTS];
+        int count = epoll_wait(epoll_fd, events, SERVE_MAX_EVENTS, -1);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+        {
+            report_error(NMRI_ERROR_IO, "epoll_wait failed: %s.", strerror(errno));
+            status = 1;
+            break;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            if (events[i].data.ptr == &signal_fd)
+            {
+                ready = 0;
+                continue;
+            }
+            if (events[i].data.ptr == &listen_fd)
+            {
+                int fd;
+                while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                {
+                    if (client_count == client_capacity)
+                    {
+                        int capacity = client_capacity ? client_capacity * 2 : 16;
+                        ServerClient **grown = realloc(clients, capacity * sizeof(*clients));
+                        if (!grown)
+                        {
+                            close(fd);
+                            break;
+                        }
+                        clients = grown;
+                        client_capacity = capacity;
+                    }
+                    ServerClient *client = server_client_open(fd, library_path, math);
+                    if (!client)
+                    {
+                        close(fd);
+                        continue;
+                    }
+                    struct epoll_event client_event = {0};
+                    client_event.events = client->events = EPOLLIN;
+                    client_event.data.ptr = client;
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &client_event) < 0)
+                    {
+                        server_client_close(client);
+                        continue;
+                    }
+                    client->index = client_count;
+                    clients[client_count++] = client;
+                    connections++;
+                }
+                continue;
+            }
+            ServerClient *client = events[i].data.ptr;
+            if (server_client_event(epoll_fd, client, events[i].events, format) != 0)
+            {
+                clients[client->index] = clients[--client_count];
+                clients[client->index]->index = client->index;
+                server_client_close(client);
+            }
+        }
     }
-    // 3. Evaluate Postfix
-    double result = evaluate_postfix(postfix, postfix_count);
-    // Update global state if successful
-    if (!isnan(result))
+
+    for (int i = 0; i < client_count; i++)
+        server_client_close(clients[i]);
+    free(clients);
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    if (listen_fd >= 0)
     {
-        last_result = result;
-        set_variable("ans", result);
-        log_message("Result: %s = %g", input, result);
+        close(listen_fd);
+        unlink(path);
     }
-    else
+    if (signal_fd >= 0)
     {
-        log_message("Evaluation Error: Postfix evaluation failed for '%s'", input);
+        // Consume the stop signal, so unblocking it does not terminate the process
+        struct signalfd_siginfo info;
+        while (read(signal_fd, &info, sizeof(info)) == (ssize_t)sizeof(info))
+            ;
+        close(signal_fd);
     }
-    return result;
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (status == 0 && listen_fd >= 0)
+        printf("Served %lu connection%s.\n", connections, connections == 1 ? "" : "s");
+    return status;
 }
 
 /**
- * @brief Cleans up floating point results that are very close to zero.
- * @param value The double value to clean.
- * @param epsilon The threshold below which values are considered zero.
- * @return The cleaned value (0.0 if very close to zero, original value otherwise).
+ * @brief Prints the command-line usage summary.
+ * @param prog The program name (argv[0]).
  */
-double clean_near_zero(double value, double epsilon)
+void show_usage(const char *prog)
 {
-    return (fabs(value) < epsilon) ? 0.0 : value;
+    printf("Usage: %s [expression...]\n", prog);
+    printf("       %s -f <file>   Evaluate one line at a time from <file>\n", prog);
+    printf("       %s -           Evaluate one line at a time from standard input\n", prog);
+    printf("       %s --replay <log>  Re-run a binary log ('log binary') and report differences\n", prog);
+    printf("       %s --csv <file> --expr <expression>\n", prog);
+    printf("                    Evaluate <expression> for every row of a CSV file (or '-'), with\n");
+    printf("                    the columns named in its header line as variables\n");
+    printf("       %s --serve <socket>  Execute the lines clients send to a Unix domain socket,\n", prog);
+    printf("                    with one session per connection, until SIGINT or SIGTERM\n");
+    printf("Options:\n");
+    printf("  --library <f> Load the functions and variables of a library saved with 'save'\n");
+    printf("  --format <f>  Print results as 'general' (6 digits, the default), 'exact'\n");
+    printf("                (shortest text that reads back as the same number) or\n");
+    printf("                'binary' (raw 8-byte doubles, not in interactive mode)\n");
+    printf("  --math <m>    Evaluate with 'default' arithmetic, 'fast' sin/cos/exp/log\n");
+    printf("                (within 2 ulp) or 'extended' (long double) precision\n");
+    printf("Stream and CSV options:\n");
+    printf("  -j <n>        Evaluate expression lines (or CSV rows) on <n> threads (0 = one per CPU)\n");
+    printf("  --stats       Print the hot-path statistics to standard error at the end\n");
+    printf("                (builds with -DNMRI_STATS only)\n");
+    printf("Without arguments the interactive calculator is started.\n");
 }
 
-/* --- Terminal Raw Mode & Input Handling --- */
+/* --- Benchmark Support --- */
 
-/**
- * @brief Restores the original terminal settings upon program exit.
- */
-void disableRawMode(void)
+#ifdef FOR_TESTING
+// Stages `benchmark_stage()` can time (the numbering is shared with nmri_bench.c)
+enum
 {
-    // Restore original terminal attributes
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
-    printf("%s", COLOR_RESET); // Ensure colors are reset on exit
-}
+    BENCH_TOKENIZE,            // tokenize()
+    BENCH_SHUNTING_YARD,       // shunting_yard() over the tokens
+    BENCH_COMPILE_POSTFIX,     // compile_postfix() over the postfix queue, with variable slots
+    BENCH_EVALUATE_BYTECODE,   // evaluate_bytecode() of the compiled expression, with bound variables
+    BENCH_PARSE_EXPRESSION,    // parse_expression(), the single-pass parser, with variable slots
+    BENCH_EVALUATE_EXPRESSION, // evaluate_expression(), end to end (session cache included)
+    BENCH_NMRI_EVAL            // nmri_eval() of a program from nmri_compile() (native code once hot)
+};
 
 /**
- * @brief Enables raw mode for the terminal.
- * Disables canonical mode (line buffering) and echoing of input characters.
- * Registers `disableRawMode` to be called automatically on exit.
+ * @brief Times one stage of the evaluation pipeline for the benchmark driver.
+ * The inputs of the stage (tokens, postfix queue, bytecode, bindings) are
+ * prepared beforehand and only the stage itself is measured. Variables are
+ * compiled to slots and bound as `nmri_eval()` does: inlining their values
+ * would fold most expressions to a single constant.
+ * @param input The expression (variables are taken from `ctx`).
+ * @param stage One of the BENCH_* stages.
+ * @param repeat How many times to run the stage.
+ * @return The elapsed time in nanoseconds, or -1 if the expression failed.
  */
-void enableRawMode(void)
+long long benchmark_stage(NmriContext *ctx, const char *input, int stage, int repeat)
 {
-    // Get current terminal attributes
-    if (tcgetattr(STDIN_FILENO, &orig_termios) == -1)
+    Arena setup = {0}, scratch = {0};
+    Token *tokens = NULL, *postfix = NULL;
+    int token_count = 0, postfix_count = 0;
+    double *stack = NULL, *bindings = NULL;
+    NmriProgram *program = NULL;
+    long long elapsed = -1;
+    int ok = 1;
+
+    // Prepare what the measured stage reads
+    if (stage == BENCH_SHUNTING_YARD || stage == BENCH_COMPILE_POSTFIX)
     {
-        perror("Error getting terminal attributes");
-        exit(EXIT_FAILURE);
+        ok = (token_count = tokenize(ctx, &setup, input, &tokens)) > 0;
+        if (ok && stage == BENCH_COMPILE_POSTFIX)
+            ok = (postfix_count = shunting_yard(&setup, tokens, token_count, &postfix)) >= 0;
     }
-    // Register the cleanup function to restore settings on exit
-    atexit(disableRawMode);
-    // Create a copy and modify it for raw mode
-    struct termios raw = orig_termios;
-    // ICANON: Disable canonical mode (don't wait for Enter)
-    // ECHO: Disable echoing input characters
-    raw.c_lflag &= ~(ECHO | ICANON);
-    // VMIN = 1: read() waits for at least 1 byte
-    // VTIME = 0: read() waits indefinitely
-    raw.c_cc[VMIN] = 1;
-    raw.c_cc[VTIME] = 0;
-    // Apply the modified attributes
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
+    if (stage == BENCH_COMPILE_POSTFIX || stage == BENCH_PARSE_EXPRESSION)
     {
-        perror("Error setting terminal attributes");
-        exit(EXIT_FAILURE);
+        // Collects the variable slots; every pass finds the same ones again
+        ok = ok && (program = calloc(1, sizeof(NmriProgram))) != NULL;
+    }
+    else if (stage == BENCH_EVALUATE_BYTECODE)
+    {
+        const char *failed_stage;
+        ok = program_compile(ctx, &setup, input, NULL, 0, &program, &failed_stage) == 0 &&
+             (stack = arena_alloc(&setup, program->bc.max_depth * sizeof(double))) != NULL &&
+             (bindings = arena_alloc(&setup, (program->var_count + 1) * sizeof(double))) != NULL &&
+             nmri_bind_variables(ctx, program, bindings) == 0;
+    }
+    else if (stage == BENCH_NMRI_EVAL)
+    {
+        ok = (program = nmri_compile(input)) != NULL &&
+             (bindings = arena_alloc(&setup, (program->var_count + 1) * sizeof(double))) != NULL &&
+             nmri_bind_variables(ctx, program, bindings) == 0;
+    }
+
+    // The first pass is not timed: it warms up the caches, the session's
+    // program cache and (for nmri_eval()) the native code
+    int warmup = 2;
+#ifdef NMRI_JIT
+    if (stage == BENCH_NMRI_EVAL)
+        warmup = JIT_THRESHOLD;
+#endif
+    struct timespec start = {0, 0}, stop;
+    for (int pass = 0, count = warmup; pass < 2 && ok; pass++, count = repeat)
+    {
+        if (pass == 1)
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < count && ok; i++)
+        {
+            Token *out;
+            Bytecode compiled;
+            switch (stage)
+            {
+            case BENCH_TOKENIZE:
+                ok = tokenize(ctx, &scratch, input, &out) > 0;
+                break;
+            case BENCH_SHUNTING_YARD:
+                ok = shunting_yard(&scratch, tokens, token_count, &out) >= 0;
+                break;
+            case BENCH_COMPILE_POSTFIX:
+                ok = compile_postfix(ctx, &scratch, postfix, postfix_count, program, &compiled) == 0;
+                break;
+            case BENCH_EVALUATE_BYTECODE:
+                ok = !isnan(evaluate_bytecode(&program->bc, bindings, stack));
+                break;
+            case BENCH_PARSE_EXPRESSION:
+                ok = parse_expression(ctx, &scratch, input, program, &compiled) == 0;
+                break;
+            case BENCH_EVALUATE_EXPRESSION:
+                ok = !isnan(evaluate_expression(ctx, input));
+                break;
+            case BENCH_NMRI_EVAL:
+                ok = !isnan(nmri_eval(program, bindings));
+                break;
+            default:
+                ok = 0;
+            }
+            arena_reset(&scratch);
+        }
     }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    if (ok)
+        elapsed = (long long)(stop.tv_sec - start.tv_sec) * 1000000000LL + (stop.tv_nsec - start.tv_nsec);
+    nmri_free(program);
+    arena_free(&scratch);
+    arena_free(&setup);
+    return elapsed;
 }
+#endif
 
-// Define key codes for clarity
-#define KEY_ENTER '\n'
-#define KEY_RETURN '\r'
-#define KEY_BACKSPACE 127 // ASCII DEL character often used for backspace
-#define KEY_CTRL_A 1
-#define KEY_CTRL_D 4
-#define KEY_CTRL_E 5
-#define KEY_ESC 27
+/* --- Main Function --- */
 
-/**
- * @brief Reads a line of input from the user with basic line editing features.
- * Supports backspace, delete (Ctrl+D), moving cursor (left/right), history (up/down),
- * jumping to start/end (Ctrl+A/Ctrl+E). Uses raw terminal mode.
- * @param buffer Buffer to store the read command.
- * @param max_size Maximum size of the `buffer`.
- */
-void readCommand(char *buffer, int max_size)
+#if !defined(FOR_TESTING) && !defined(NMRI_LIBRARY) // Allow compiling without main for testing and the library
+int main(int argc, char *argv[])
 {
-    enableRawMode(); // Switch to raw mode for character-by-character input
-    int pos = 0, len = 0, history_pos = history_count, saved_current = 0;
-    char current_typed[NMRI_MAX_INPUT] = {0}; // Buffer to save current input when navigating history
-    memset(buffer, 0, max_size);              // Clear the input buffer initially
-    // Print the prompt
-    printf("%s%s■%s ", COLOR_BOLD, COLOR_CYAN, COLOR_RESET);
-    fflush(stdout);
-
-    while (1)
+    // --- Option Parsing ---
+    // Options are only recognized before the expression, and negative numbers
+    // (e.g. "nmri -5 + 3") are never mistaken for options.
+    int arg_index = 1;
+    const char *stream_path = NULL;
+    const char *replay_path = NULL;
+    const char *library_path = NULL;
+    const char *serve_path = NULL;
+    const char *csv_path = NULL;
+    const char *csv_expression = NULL;
+    int threads = 1;
+    int dump_stats = 0;
+    OutputFormat output_format = OUTPUT_GENERAL;
+    NmriMath math = NMRI_MATH_DEFAULT;
+    terminal_colors = isatty(STDOUT_FILENO); // No escape codes in pipes and files
+    while (arg_index < argc)
     {
-        char c;
-        // Read one character from standard input
-        if (read(STDIN_FILENO, &c, 1) != 1)
+        if (strcmp(argv[arg_index], "-f") == 0)
         {
-            perror("readCommand read error");
-            break;
+            if (arg_index + 1 >= argc)
+            {
+                report_error(NMRI_ERROR_INVALID, "Option '-f' requires a file name.");
+                return 1;
+            }
+            stream_path = argv[arg_index + 1];
+            arg_index += 2;
         }
-
-        // Handle character input
-        if (c == KEY_ENTER || c == KEY_RETURN)
+        else if (strcmp(argv[arg_index], "-") == 0)
         {
-            printf("\n");
-            break;
-        } // Enter pressed
-        else if (c == KEY_BACKSPACE)
-        { // Backspace pressed
-            if (pos > 0)
+            stream_path = "-";
+            arg_index++;
+        }
+        else if (strcmp(argv[arg_index], "-j") == 0)
+        {
+            char *end = NULL;
+            long value = arg_index + 1 < argc ? strtol(argv[arg_index + 1], &end, 10) : -1;
+            if (!end || *end != '\0' || end == argv[arg_index + 1] || value < 0 || value > MAX_THREADS)
             {
-                memmove(buffer + pos - 1, buffer + pos, len - pos);
-                len--;
-                pos--;
-                buffer[len] = '\0';
-                // Redraw line: move cursor left, print shifted part, print space, move cursor back
-                printf("\033[1D%s \033[%dD", buffer + pos, len - pos + 1);
+                report_error(NMRI_ERROR_INVALID, "Option '-j' requires a thread count between 0 and %d.", MAX_THREADS);
+                return 1;
             }
+            threads = (int)value;
+            if (threads == 0) // 0 means one thread per online CPU
+            {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                threads = cpus > 0 ? (cpus < MAX_THREADS ? (int)cpus : MAX_THREADS) : 1;
+            }
+            arg_index += 2;
         }
-        else if (c == KEY_CTRL_D)
-        { // Ctrl+D (Delete character under cursor)
-            if (pos < len)
+        else if (strcmp(argv[arg_index], "--replay") == 0)
+        {
+            if (arg_index + 1 >= argc)
             {
-                memmove(buffer + pos, buffer + pos + 1, len - pos - 1);
-                len--;
-                buffer[len] = '\0';
-                // Redraw line: print shifted part, print space, move cursor back
-                printf("%s \033[%dD", buffer + pos, len - pos + 1);
+                report_error(NMRI_ERROR_INVALID, "Option '--replay' requires a file name.");
+                return 1;
             }
+            replay_path = argv[arg_index + 1];
+            arg_index += 2;
         }
-        else if (c == KEY_CTRL_A)
-        { // Ctrl+A (Move cursor to beginning of line)
-            if (pos > 0)
+        else if (strcmp(argv[arg_index], "--serve") == 0)
+        {
+            if (arg_index + 1 >= argc)
             {
-                printf("\033[%dD", pos);
-                pos = 0;
+                report_error(NMRI_ERROR_INVALID, "Option '--serve' requires a socket path.");
+                return 1;
             }
+            serve_path = argv[arg_index + 1];
+            arg_index += 2;
         }
-        else if (c == KEY_CTRL_E)
-        { // Ctrl+E (Move cursor to end of line)
-            if (pos < len)
+        else if (strcmp(argv[arg_index], "--csv") == 0)
+        {
+            if (arg_index + 1 >= argc)
             {
-                printf("\033[%dC", len - pos);
-                pos = len;
+                report_error(NMRI_ERROR_INVALID, "Option '--csv' requires a file name.");
+                return 1;
             }
+            csv_path = argv[arg_index + 1];
+            arg_index += 2;
         }
-        else if (c == KEY_ESC)
-        { // Escape sequence (likely arrow keys or other special keys)
-            char seq[3];
-            // Read the next two characters (e.g., '[A' for up arrow)
-            if (read(STDIN_FILENO, &seq[0], 1) != 1)
-                continue;
-            if (read(STDIN_FILENO, &seq[1], 1) != 1)
-                continue;
-            if (seq[0] == '[')
+        else if (strcmp(argv[arg_index], "--expr") == 0)
+        {
+            if (arg_index + 1 >= argc)
             {
-                if (seq[1] >= '0' && seq[1] <= '9')
-                {
-                    // Extended escape sequence (like Home/End/Delete on some terminals)
-                    if (read(STDIN_FILENO, &seq[2], 1) != 1)
-                        continue; // Read '~'
-                    if (seq[1] == '3' && seq[2] == '~')
-                    { // Delete key
-                        // Same logic as Ctrl+D
-                        if (pos < len)
-                        {
-                            memmove(buffer + pos, buffer + pos + 1, len - pos - 1);
-                            len--;
-                            buffer[len] = '\0';
-                            printf("%s \033[%dD", buffer + pos, len - pos + 1);
-                        }
-                    }
-                    // Add more cases for Home (^[1~), End (^[4~) if needed
-                }
-                else
-                {
-                    switch (seq[1])
-                    {
-                    case 'A': // Up Arrow (History Previous)
-                        if (!saved_current && len > 0)
-                        {
-                            strncpy(current_typed, buffer, NMRI_MAX_INPUT - 1);
-                            current_typed[NMRI_MAX_INPUT - 1] = '\0';
-                            saved_current = 1;
-                        }
-                        if (history_pos > 0)
-                        {
-                            history_pos--;
-                            // Clear current line display
-                            printf("\r%s%s■%s ", COLOR_BOLD, COLOR_CYAN, COLOR_RESET);
-                            for (int i = 0; i < len; i++)
-                                printf(" ");
-                            printf("\r%s%s■%s ", COLOR_BOLD, COLOR_CYAN, COLOR_RESET);
-                            // Load history item
-                            strncpy(buffer, command_history[history_pos], max_size - 1);
-                            buffer[max_size - 1] = '\0';
-                            len = strlen(buffer);
-                            pos = len;
-                            printf("%s", buffer);
-                        }
-                        break;
-                    case 'B': // Down Arrow (History Next)
-                        if (history_pos < history_count)
-                        {
-                            history_pos++;
-                            // Clear current line display
-                            printf("\r%s%s■%s ", COLOR_BOLD, COLOR_CYAN, COLOR_RESET);
-                            for (int i = 0; i < len; i++)
-                                printf(" ");
-                            printf("\r%s%s■%s ", COLOR_BOLD, COLOR_CYAN, COLOR_RESET);
-                            // Load next history item or the saved current input
-                            if (history_pos == history_count && saved_current)
-                            {
-                                strncpy(buffer, current_typed, max_size - 1);
-                                buffer[max_size - 1] = '\0';
-                            }
-                            else if (history_pos < history_count)
-                            {
-                                strncpy(buffer, command_history[history_pos], max_size - 1);
-                                buffer[max_size - 1] = '\0';
-                            }
-                            else
-                            {
-                                buffer[0] = '\0';
-                                saved_current = 0;
-                            } // End of history, clear buffer
-                            len = strlen(buffer);
-                            pos = len;
-                            printf("%s", buffer);
-                        }
-                        break;
-                    case 'C':
-                        if (pos < len)
-                        {
-                            printf("\033[1C");
-                            pos++;
-                        }
-                        break; // Right Arrow
-                    case 'D':
-                        if (pos > 0)
-                        {
-                            printf("\033[1D");
-                            pos--;
-                        }
-                        break; // Left Arrow
-                    } // End switch(seq[1])
-                } // End else (seq[1] is not 0-9)
-            } // End if (seq[0] == '[')
-        }
-        else if (!iscntrl((unsigned char)c) && len < max_size - 1)
-        { // Printable character
-            // Insert character at cursor position
-            if (pos == len)
-            { // Inserting at the end
-                buffer[pos++] = c;
-                len++;
-                buffer[len] = '\0';
-                printf("%c", c);
+                report_error(NMRI_ERROR_INVALID, "Option '--expr' requires an expression.");
+                return 1;
+            }
+            csv_expression = argv[arg_index + 1];
+            arg_index += 2;
+        }
+        else if (strcmp(argv[arg_index], "--library") == 0)
+        {
+            if (arg_index + 1 >= argc)
+            {
+                report_error(NMRI_ERROR_INVALID, "Option '--library' requires a file name.");
+                return 1;
             }
+            library_path = argv[arg_index + 1];
+            arg_index += 2;
+        }
+        else if (strcmp(argv[arg_index], "--stats") == 0)
+        {
+#ifndef NMRI_STATS
+            report_error(NMRI_ERROR_INVALID, "Option '--stats' requires a build with `make STATS_FLAGS=-DNMRI_STATS`.");
+            return 1;
+#endif
+            dump_stats = 1;
+            arg_index++;
+        }
+        else if (strcmp(argv[arg_index], "--format") == 0)
+        {
+            const char *name = arg_index + 1 < argc ? argv[arg_index + 1] : "";
+            if (strcmp(name, "general") == 0)
+                output_format = OUTPUT_GENERAL;
+            else if (strcmp(name, "exact") == 0)
+                output_format = OUTPUT_EXACT;
+            else if (strcmp(name, "binary") == 0)
+                output_format = OUTPUT_BINARY;
             else
-            {                                                       // Inserting in the middle
-                memmove(buffer + pos + 1, buffer + pos, len - pos); // Shift right
-                buffer[pos++] = c;
-                len++;
-                buffer[len] = '\0';
-                // Redraw the part of the line from the cursor onwards
-                printf("%s", buffer + pos - 1);
-                // Move cursor back to correct position
-                printf("\033[%dD", len - pos);
+            {
+                report_error(NMRI_ERROR_INVALID, "Option '--format' requires 'general', 'exact' or 'binary'.");
+                return 1;
+            }
+            arg_index += 2;
+        }
+        else if (strcmp(argv[arg_index], "--math") == 0)
+        {
+            int value = arg_index + 1 < argc ? math_from_name(argv[arg_index + 1]) : -1;
+            if (value < 0)
+            {
+                report_error(NMRI_ERROR_INVALID, "Option '--math' requires 'default', 'fast' or 'extended'.");
+                return 1;
             }
+            math = (NmriMath)value;
+            arg_index += 2;
+        }
+        else if (strcmp(argv[arg_index], "-h") == 0 || strcmp(argv[arg_index], "--help") == 0)
+        {
+            show_usage(argv[0]);
+            return 0;
+        }
+        else if (strcmp(argv[arg_index], "--") == 0)
+        {
+            arg_index++;
+            break; // Everything after '--' is part of the expression
+        }
+        else
+        {
+            break; // First non-option argument starts the expression
         }
-        fflush(stdout); // Ensure prompt and input are displayed immediately
     }
-    disableRawMode();   // Restore terminal settings before returning
-    buffer[len] = '\0'; // Ensure final null termination
-}
 
-/* --- Main Function --- */
+    // Create the session ('ans' starts at 0) and initialize logging
+    NmriContext *ctx = nmri_context_create();
+    if (!ctx)
+    {
+        report_error(NMRI_ERROR_NO_MEMORY, "Out of memory.");
+        return 1;
+    }
+    init_logging(ctx); // Initialize logging system
+    ctx->output_format = output_format;
+    nmri_context_set_math(ctx, math);
+    int library_functions, library_variables;
+    if (library_path && load_library(ctx, library_path, &library_functions, &library_variables) < 0)
+    {
+        nmri_context_destroy(ctx);
+        return 1;
+    }
 
-#ifndef FOR_TESTING // Allow compiling without main for testing purposes
-int main(int argc, char *argv[])
-{
-    // --- Option Parsing ---
-    // int opt; // Removed unused variable
-    // Add getopt loop here if options like -h, -v, -l logfile are needed
-    // For now, assume optind starts at 1 if no options are parsed
-    // TODO: Implement getopt for options if needed later
-    optind = 1; // Reset optind if getopt is not used or finished
+    // --- Server Mode ---
+    if (serve_path)
+    {
+        if (stream_path || replay_path || csv_path || arg_index < argc || threads > 1 || dump_stats)
+        {
+            report_error(NMRI_ERROR_INVALID,
+                         "Option '--serve' cannot be combined with an input, '--replay', '--csv', '-j' or '--stats'.");
+            nmri_context_destroy(ctx);
+            return 1;
+        }
+        log_message(ctx, "Serving on: %s", serve_path);
+        int status = run_server(serve_path, library_path, output_format, math);
+        nmri_context_destroy(ctx);
+        return status;
+    }
+
+    // --- Replay Mode ---
+    if (replay_path)
+    {
+        if (stream_path || csv_path || arg_index < argc || threads > 1)
+        {
+            report_error(NMRI_ERROR_INVALID, "Option '--replay' cannot be combined with an input, '--csv' or '-j'.");
+            nmri_context_destroy(ctx);
+            return 1;
+        }
+        int status = replay_log(ctx, replay_path);
+        if (dump_stats)
+            show_stats(ctx, stderr);
+        nmri_context_destroy(ctx);
+        return status;
+    }
+
+    // --- CSV Mode ---
+    if (csv_path || csv_expression)
+    {
+        if (!csv_path || !csv_expression || stream_path || arg_index < argc)
+        {
+            report_error(NMRI_ERROR_INVALID, "Options '--csv <file>' and '--expr <expression>' go together, without another input.");
+            nmri_context_destroy(ctx);
+            return 1;
+        }
+        FILE *in = stdin;
+        if (strcmp(csv_path, "-") != 0 && !(in = fopen(csv_path, "r")))
+        {
+            report_error(NMRI_ERROR_IO, "Could not open input file '%s'.", csv_path);
+            nmri_context_destroy(ctx);
+            return 1;
+        }
+        log_message(ctx, "CSV execution: %s: %s", csv_path, csv_expression);
+        int status = run_csv(ctx, in, csv_expression, threads);
+        if (in != stdin)
+            fclose(in);
+        if (dump_stats)
+            show_stats(ctx, stderr);
+        nmri_context_destroy(ctx);
+        return status;
+    }
+
+    // --- Stream Mode ---
+    if (stream_path)
+    {
+        if (arg_index < argc)
+        {
+            report_error(NMRI_ERROR_INVALID, "Unexpected expression arguments in stream mode.");
+            nmri_context_destroy(ctx);
+            return 1;
+        }
+        FILE *in = stdin;
+        if (strcmp(stream_path, "-") != 0)
+        {
+            in = fopen(stream_path, "r");
+            if (!in)
+            {
+                report_error(NMRI_ERROR_IO, "Could not open input file '%s'.", stream_path);
+                nmri_context_destroy(ctx);
+                return 1;
+            }
+        }
+        log_message(ctx, "Stream execution: %s", stream_path);
+        int status = run_stream(ctx, in, threads);
+        if (in != stdin)
+            fclose(in);
+        if (dump_stats)
+            show_stats(ctx, stderr);
+        nmri_context_destroy(ctx);
+        return status;
+    }
 
-    // Initialize 'ans' and logging
-    set_variable("ans", 0.0);
-    init_logging(); // Initialize logging system
+    if (dump_stats)
+    {
+        report_error(NMRI_ERROR_INVALID, "Option '--stats' is only supported with '-f <file>', '-' or '--csv'.");
+        nmri_context_destroy(ctx);
+        return 1;
+    }
+    if (threads > 1)
+    {
+        report_error(NMRI_ERROR_INVALID, "Option '-j' is only supported with '-f <file>', '-' or '--csv'.");
+        nmri_context_destroy(ctx);
+        return 1;
+    }
+    if (output_format == OUTPUT_BINARY && arg_index >= argc)
+    {
+        report_error(NMRI_ERROR_INVALID, "Binary output is not supported in interactive mode.");
+        nmri_context_destroy(ctx);
+        return 1;
+    }
 
     // --- Check for non-option arguments (the expression) ---
-    if (optind < argc)
+    if (arg_index < argc)
     {
         // --- Command-Line Expression Mode ---
-        char expression_buffer[CMD_LINE_EXPR_BUFFER_SIZE];
-        expression_buffer[0] = '\0';
+        size_t total_len = 0;
+        for (int i = arg_index; i < argc; i++)
+            total_len += strlen(argv[i]) + 1; // Argument plus separator (or final NUL)
+        char *expression_buffer = malloc(total_len);
+        if (!expression_buffer)
+        {
+            report_error(NMRI_ERROR_NO_MEMORY, "Out of memory.");
+            nmri_context_destroy(ctx); // Close log before exiting
+            return 1;
+        }
         size_t current_len = 0;
 
-        // Concatenate all non-option arguments
-        for (int i = optind; i < argc; i++)
+        // Concatenate all non-option arguments, separated by spaces
+        for (int i = arg_index; i < argc; i++)
         {
             size_t arg_len = strlen(argv[i]);
-            // Check for potential buffer overflow before strcat
-            if (current_len + arg_len + (current_len > 0 ? 1 : 0) >= sizeof(expression_buffer))
-            {
-                fprintf(stderr, "%sError:%s Command line expression too long.\n", COLOR_RED, COLOR_RESET);
-                close_logging(); // Close log before exiting
-                return 1;
-            }
-            // Add space separator if not the first argument
             if (current_len > 0)
-            {
-                strcat(expression_buffer, " ");
-                current_len++;
-            }
-            strcat(expression_buffer, argv[i]);
+                expression_buffer[current_len++] = ' ';
+            memcpy(expression_buffer + current_len, argv[i], arg_len);
             current_len += arg_len;
         }
+        expression_buffer[current_len] = '\0';
 
-        log_message("Command line execution: %s", expression_buffer);
+        log_message(ctx, "Command line execution: %s", expression_buffer);
 
         // Evaluate the expression
-        double result = evaluate_expression(expression_buffer);
+        double result = evaluate_expression(ctx, expression_buffer);
+        if (isnan(result))
+            show_error(ctx, expression_buffer, 0);
+        free(expression_buffer);
 
         if (isnan(result))
         {
-            // Error message already printed by evaluate_expression
-            log_message("Command line result: Error");
-            close_logging();
+            log_message(ctx, "Command line result: Error");
+            nmri_context_destroy(ctx);
             return 1; // Indicate error
         }
         else
         {
-            // Print result (consistent format)
-            // Use clean_near_zero to avoid printing "-0"
-            printf("%s%g%s\n", COLOR_GREEN, clean_near_zero(result, 1e-10), COLOR_RESET);
-            log_message("Command line result: %g", result);
-            close_logging();
+            print_result(ctx, NULL, result, 1);
+            log_message(ctx, "Command line result: %g", result);
+            nmri_context_destroy(ctx);
             return 0; // Indicate success
         }
     }
@@ -1905,12 +9809,25 @@ int main(int argc, char *argv[])
         printf("Type '%shelp%s' for instructions, '%sexit%s' to quit.\n\n",
                COLOR_GREEN, COLOR_RESET, COLOR_GREEN, COLOR_RESET);
 
-        log_session_start(); // Log start of interactive session
+        log_session_start(ctx); // Log start of interactive session
+        // The history persists in $NMRI_HISTORY (none if empty) or ~/.nmri_history
+        const char *history_path = getenv("NMRI_HISTORY");
+        const char *home = getenv("HOME");
+        char *default_path = NULL;
+        if (!history_path && home && (default_path = malloc(strlen(home) + sizeof("/" HISTORY_FILE))))
+            sprintf(default_path, "%s/%s", home, HISTORY_FILE);
+        history_set_file(ctx, history_path ? (*history_path ? history_path : NULL) : default_path);
+        free(default_path);
 
+        char *input = NULL; // Line buffer, grown by readCommand() as needed
+        size_t input_capacity = 0;
         while (1)
         {
-            char input[NMRI_MAX_INPUT];
-            readCommand(input, sizeof(input)); // Use line editing function
+            if (readCommand(ctx, &input, &input_capacity) < 0) // Use line editing function
+            {
+                log_message(ctx, "End of input.");
+                break;
+            }
 
             // Trim leading whitespace (readCommand might leave some if only Enter is pressed)
             char *start = input;
@@ -1920,104 +9837,20 @@ int main(int argc, char *argv[])
                 continue; // Ignore empty lines
 
             // Add non-empty command to history
-            add_to_history(start);
+            add_to_history(ctx, start);
             // Log the raw input
-            log_message("User input: %s", start);
+            log_message(ctx, "User input: %s", start);
 
-            // Process built-in commands first
-            int cmd_result = process_command(start);
-            if (cmd_result == 1)
-                continue; // Command was handled, loop for next input
-            if (cmd_result == -1)
+            if (execute_line(ctx, start, 1) == -1)
             { // Exit command received
-                log_message("User requested exit.");
+                log_message(ctx, "User requested exit.");
                 printf("\n%s%sGoodbye!%s\n", COLOR_BOLD, COLOR_GREEN, COLOR_RESET);
                 break;
             }
-
-            // If not a built-in command, check for assignment or treat as expression
-
-            // Check for assignment: identifier = expression
-            char *equals_pos = strchr(start, '=');
-            char *first_op = strpbrk(start, "+-*/^%"); // Find first non-assignment operator
-            // Check if '=' exists and appears *before* any other operator (or if no other ops exist)
-            // Also ensure it's not the first character (e.g. "= 5")
-            if (equals_pos != NULL && equals_pos != start && (first_op == NULL || equals_pos < first_op))
-            {
-                // Potential assignment found
-                char var_name[MAX_IDENTIFIER_LEN];
-                char *name_end = equals_pos;
-                // Trim whitespace before '='
-                while (name_end > start && isspace((unsigned char)*(name_end - 1)))
-                    name_end--;
-
-                size_t name_len = name_end - start;
-                if (name_len > 0 && name_len < MAX_IDENTIFIER_LEN)
-                {
-                    strncpy(var_name, start, name_len);
-                    var_name[name_len] = '\0';
-
-                    // Validate variable name (starts with letter/_, contains letter/digit/_)
-                    int valid_name = (isalpha((unsigned char)var_name[0]) || var_name[0] == '_');
-                    for (size_t k = 1; k < name_len && valid_name; k++)
-                    {
-                        if (!isalnum((unsigned char)var_name[k]) && var_name[k] != '_')
-                            valid_name = 0;
-                    }
-                    // Simplified reserved word check - expand this list as needed
-                    if (valid_name && (strcmp(var_name, "help") == 0 || strcmp(var_name, "exit") == 0 ||
-                                       strcmp(var_name, "pi") == 0 || strcmp(var_name, "e") == 0 ||
-                                       strcmp(var_name, "sin") == 0 /* add more reserved words */))
-                    {
-                        fprintf(stderr, "%sError:%s Cannot assign to reserved name '%s'.\n", COLOR_RED, COLOR_RESET, var_name);
-                        log_message("Assignment Error: Attempt to assign to reserved name '%s'", var_name);
-                        valid_name = 0;
-                    }
-
-                    if (valid_name)
-                    {
-                        const char *expr_start = equals_pos + 1; // Start of the expression part
-                        double result = handle_assignment(var_name, expr_start);
-                        if (!isnan(result))
-                        {
-                            // Print assignment result
-                            printf("%s%s = %s%g%s\n", COLOR_YELLOW, var_name, COLOR_GREEN, clean_near_zero(result, 1e-10), COLOR_RESET);
-                        }
-                        else
-                        {
-                            // Error message already printed by handle_assignment or its sub-functions
-                            log_message("Assignment failed for: %s", start);
-                        }
-                        continue; // Assignment handled, proceed to next input
-                    }
-                    else
-                    {
-                        // Error message for invalid name already printed if needed
-                        // Or print a generic one here if validation fails silently
-                        fprintf(stderr, "%sError:%s Invalid variable name '%s' for assignment.\n", COLOR_RED, COLOR_RESET, var_name);
-                        log_message("Assignment Error: Invalid variable name '%s'", var_name);
-                        continue; // Invalid assignment syntax
-                    }
-                }
-                else
-                {
-                    fprintf(stderr, "%sError:%s Invalid variable name length for assignment.\n", COLOR_RED, COLOR_RESET);
-                    log_message("Assignment Error: Invalid variable name length near '%s'", start);
-                    continue;
-                }
-            }
-
-            // If not an assignment or command, evaluate as a mathematical expression
-            double result = evaluate_expression(start);
-            if (!isnan(result))
-            {
-                // Print the final result, cleaning near-zero values
-                printf("%s%g%s\n", COLOR_GREEN, clean_near_zero(result, 1e-10), COLOR_RESET);
-            }
-            // Error messages and logging handled within evaluate_expression
         } // End while(1)
 
-        close_logging(); // Close the log file properly
+        free(input);
+        nmri_context_destroy(ctx); // Close the log file properly
         // disableRawMode() is called automatically via atexit()
         return 0; // Success
     }
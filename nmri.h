@@ -0,0 +1,100 @@
+/**
+ * NMRI - Command Line Calculator - Public API
+ *
+ * Author: Davide Santangelo
+ *
+ * Each NmriContext is an independent calculator session; separate contexts
+ * can be used from separate threads without locking. In reactive mode
+ * (`nmri_context_set_reactive()`), a variable assigned an expression with
+ * `nmri_context_assign()` is recomputed whenever a variable it reads changes.
+ * `nmri_context_set_math()` trades accuracy for speed, or the reverse, for
+ * everything a context compiles and evaluates.
+ *
+ * Compile an expression once and evaluate it many times with different
+ * variable values. Variables are identified by slot: use
+ * `nmri_program_var_slot()` to find where to put each value in the
+ * bindings array passed to `nmri_eval()`. `nmri_eval_batch()` evaluates the
+ * same program over whole columns of values (one array per slot).
+ *
+ * Functions that fail return NAN, NULL or -1 and record an error code and
+ * message for the calling thread, read with `nmri_last_error()` (and, for
+ * syntax errors and unknown names, the offset of the error in the expression
+ * with `nmri_last_error_position()`). The library (`make lib`: libnmri.a
+ * and libnmri.so) never prints; only the symbols declared here are exported.
+ *
+ * Copyright (c) 2025, Davide Santangelo
+ * All rights reserved. See LICENSE for the BSD-2-Clause terms.
+ */
+
+#ifndef NMRI_H
+#define NMRI_H
+
+#include <stddef.h>
+
+#if defined(__GNUC__) && defined(NMRI_LIBRARY)
+#define NMRI_API __attribute__((visibility("default")))
+#else
+#define NMRI_API
+#endif
+
+// Kind of the last error, returned by nmri_last_error(). New codes are only added at the end.
+typedef enum
+{
+    NMRI_OK = 0,                 // No error
+    NMRI_ERROR_SYNTAX,           // Malformed expression (invalid character, missing operand, mismatched parentheses, ...)
+    NMRI_ERROR_UNKNOWN_NAME,     // Undefined variable or function
+    NMRI_ERROR_DIVISION_BY_ZERO, // Division or modulo by zero
+    NMRI_ERROR_DOMAIN,           // Argument outside a function's domain (sqrt(-1), log(0), asin(2), ...)
+    NMRI_ERROR_ARGUMENTS,        // Wrong number of arguments in a function call
+    NMRI_ERROR_LIMIT,            // Expression, name or request too large
+    NMRI_ERROR_NO_MEMORY,        // Out of memory
+    NMRI_ERROR_INVALID,          // Invalid name, option or command
+    NMRI_ERROR_IO,               // A file or socket could not be used
+    NMRI_ERROR_INTERNAL          // Bug in the calculator
+} NmriError;
+
+// Arithmetic of the expressions a context evaluates, set with nmri_context_set_math()
+typedef enum
+{
+    NMRI_MATH_DEFAULT = 0, // double arithmetic and the C library's functions
+    NMRI_MATH_FAST,        // sin, cos, exp and log as polynomials the batch evaluator vectorizes (within 2 ulp)
+    NMRI_MATH_EXTENDED     // long double intermediate results, rounded to double once at the end
+} NmriMath;
+// NMRI_MATH_EXTENDED only extends the intermediate results: numbers in expressions and
+// variables are still read and stored as doubles, so decimal fractions are not more exact
+// ("1e16 + 1 - 1e16" is 1 instead of 0, but "0.1 + 0.2 - 0.3" is still 2.8e-17, not 0).
+
+// Opaque calculator session (variables, memory, history, log)
+typedef struct NmriContext NmriContext;
+
+// Opaque compiled expression
+typedef struct NmriProgram NmriProgram;
+
+NMRI_API NmriContext *nmri_context_create(void);
+NMRI_API void nmri_context_destroy(NmriContext *ctx);
+NMRI_API double nmri_context_last_result(const NmriContext *ctx);
+NMRI_API double nmri_context_memory(const NmriContext *ctx);
+NMRI_API void nmri_context_cache_stats(const NmriContext *ctx, unsigned long *hits, unsigned long *misses);
+NMRI_API double nmri_context_eval(NmriContext *ctx, const char *expression);
+NMRI_API int nmri_context_set_variable(NmriContext *ctx, const char *name, double value);
+NMRI_API int nmri_context_get_variable(const NmriContext *ctx, const char *name, double *value);
+NMRI_API double nmri_context_assign(NmriContext *ctx, const char *name, const char *expression);
+NMRI_API void nmri_context_set_reactive(NmriContext *ctx, int enabled);
+NMRI_API int nmri_context_set_math(NmriContext *ctx, NmriMath math);
+
+NMRI_API NmriProgram *nmri_compile(const char *expression);
+NMRI_API double nmri_eval(const NmriProgram *program, const double *bindings);
+NMRI_API int nmri_eval_batch(const NmriProgram *program, const double *const *inputs, double *out, size_t n);
+NMRI_API int nmri_eval_batch_mt(const NmriProgram *program, const double *const *inputs, double *out, size_t n, int threads);
+NMRI_API int nmri_bind_variables(const NmriContext *ctx, const NmriProgram *program, double *bindings);
+NMRI_API int nmri_program_var_count(const NmriProgram *program);
+NMRI_API const char *nmri_program_var_name(const NmriProgram *program, int slot);
+NMRI_API int nmri_program_var_slot(const NmriProgram *program, const char *name);
+NMRI_API void nmri_free(NmriProgram *program);
+
+NMRI_API NmriError nmri_last_error(const char **message);
+NMRI_API int nmri_last_error_position(void);
+NMRI_API void nmri_clear_error(void);
+NMRI_API const char *nmri_error_name(NmriError code);
+
+#endif // NMRI_H
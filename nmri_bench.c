@@ -0,0 +1,251 @@
+/*
+ * NMRI - Command Line Calculator - Benchmarks
+ *
+ * Times each stage of the evaluation pipeline over corpora of short, long,
+ * function-heavy and variable-heavy expressions. Run with `make bench`;
+ * `./nmri_bench --format json` (or csv) prints machine-readable results.
+ *
+ * Author: Davide Santangelo
+ */
+
+#define _GNU_SOURCE // For M_PI and M_E under -std=c99
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "nmri.h"
+
+// External functions from nmri.c
+extern long long benchmark_stage(NmriContext *ctx, const char *input, int stage, int repeat);
+extern int set_variable(NmriContext *ctx, const char *name, double value);
+
+// Stages in the numbering of `benchmark_stage()`
+const char *stage_names[] = {"tokenize", "shunting_yard", "compile_postfix", "evaluate_bytecode",
+                             "parse_expression", "evaluate_expression", "nmri_eval"};
+#define STAGE_COUNT 7
+
+#define CORPUS_SIZE 16   // Expressions per corpus
+#define VARIABLE_COUNT 32 // Variables v0..v31 defined for the corpora
+
+// A named set of expressions
+typedef struct
+{
+    const char *name;
+    char *expressions[CORPUS_SIZE];
+} Corpus;
+
+// Statistics of one corpus and stage
+typedef struct
+{
+    double ns_per_expr;  // Total time over total evaluations
+    double expr_per_sec; // 1e9 / ns_per_expr
+    double p50, p90, p99; // Percentiles of the per-sample ns/expr
+    int samples;
+} BenchResult;
+
+// Deterministic pseudo-random numbers, so every run measures the same corpus
+unsigned long bench_seed = 12345;
+unsigned bench_random(unsigned n)
+{
+    bench_seed = bench_seed * 6364136223846793005UL + 1442695040888963407UL;
+    return (unsigned)(bench_seed >> 33) % n;
+}
+
+// Appends formatted text to an expression being generated
+void append_text(char *buffer, size_t size, const char *format, const char *a, unsigned b)
+{
+    size_t used = strlen(buffer);
+    snprintf(buffer + used, size - used, format, a, b);
+}
+
+void build_corpora(Corpus *corpora)
+{
+    const char *short_expressions[CORPUS_SIZE] = {
+        "2 + 3", "7 * 8 - 1", "(1 + 2) * 3", "2 ^ 10", "100 / 7", "-5 + 3", "10 % 3", "3.14159 * 2",
+        "1e3 + 1", "50 + 10%", "v1 + 1", "v2 * v3", "ans + 1", "sqrt(16)", "pi * v4", "(v5 - 2) / 4"};
+    const char *functions[] = {"sin", "cos", "tan", "atan", "sqrt", "exp", "log", "abs", "floor", "ceil", "round"};
+    const char *operators[] = {" + ", " - ", " * ", " / "};
+    char buffer[4096];
+
+    corpora[0].name = "short";
+    for (int i = 0; i < CORPUS_SIZE; i++)
+        corpora[0].expressions[i] = strdup(short_expressions[i]);
+
+    // 100 terms mixing numbers and variables
+    corpora[1].name = "long";
+    for (int i = 0; i < CORPUS_SIZE; i++)
+    {
+        buffer[0] = '\0';
+        for (int term = 0; term < 100; term++)
+        {
+            if (term)
+                append_text(buffer, sizeof(buffer), "%s", operators[bench_random(4)], 0);
+            if (bench_random(2))
+                append_text(buffer, sizeof(buffer), "%sv%u", "", bench_random(VARIABLE_COUNT));
+            else
+                append_text(buffer, sizeof(buffer), "%s%u.5", "", 1 + bench_random(99));
+        }
+        corpora[1].expressions[i] = strdup(buffer);
+    }
+
+    // Nested function calls on variables (all arguments are positive, so nothing fails)
+    corpora[2].name = "functions";
+    for (int i = 0; i < CORPUS_SIZE; i++)
+    {
+        buffer[0] = '\0';
+        for (int term = 0; term < 8; term++)
+        {
+            if (term)
+                append_text(buffer, sizeof(buffer), "%s", " + ", 0);
+            append_text(buffer, sizeof(buffer), "%s(", functions[bench_random(11)], 0);
+            append_text(buffer, sizeof(buffer), "%s(v%u))", functions[4 + bench_random(2)], bench_random(VARIABLE_COUNT) % 8);
+        }
+        corpora[2].expressions[i] = strdup(buffer);
+    }
+
+    // Many variable references with few constants
+    corpora[3].name = "variables";
+    for (int i = 0; i < CORPUS_SIZE; i++)
+    {
+        buffer[0] = '\0';
+        for (int term = 0; term < 24; term++)
+        {
+            if (term)
+                append_text(buffer, sizeof(buffer), "%s", operators[bench_random(4)], 0);
+            append_text(buffer, sizeof(buffer), "%sv%u", "", bench_random(VARIABLE_COUNT));
+        }
+        corpora[3].expressions[i] = strdup(buffer);
+    }
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples
+double percentile(const double *sorted, int count, double p)
+{
+    return sorted[(int)(p * (count - 1) + 0.5)];
+}
+
+/**
+ * @brief Times a stage over every expression of a corpus, `rounds` samples of
+ * `repeat` evaluations each.
+ * @return 0 on success, -1 if an expression failed.
+ */
+int run_benchmark(NmriContext *ctx, const Corpus *corpus, int stage, int repeat, int rounds, BenchResult *result)
+{
+    int count = CORPUS_SIZE * rounds;
+    double *samples = malloc(count * sizeof(double));
+    if (!samples)
+        return -1;
+    long long total = 0;
+    int n = 0;
+    for (int round = 0; round < rounds; round++)
+        for (int i = 0; i < CORPUS_SIZE; i++)
+        {
+            long long ns = benchmark_stage(ctx, corpus->expressions[i], stage, repeat);
+            if (ns < 0)
+            {
+                fprintf(stderr, "Benchmark failed: %s on '%s'\n", stage_names[stage], corpus->expressions[i]);
+                free(samples);
+                return -1;
+            }
+            total += ns;
+            samples[n++] = (double)ns / repeat;
+        }
+    qsort(samples, n, sizeof(double), compare_doubles);
+    result->ns_per_expr = (double)total / ((double)n * repeat);
+    result->expr_per_sec = result->ns_per_expr > 0 ? 1e9 / result->ns_per_expr : 0.0;
+    result->p50 = percentile(samples, n, 0.50);
+    result->p90 = percentile(samples, n, 0.90);
+    result->p99 = percentile(samples, n, 0.99);
+    result->samples = n;
+    free(samples);
+    return 0;
+}
+
+void show_bench_usage(const char *prog)
+{
+    printf("Usage: %s [--format table|json|csv] [--repeat <n>] [--rounds <n>]\n", prog);
+    printf("  --format  Output format (default: table)\n");
+    printf("  --repeat  Evaluations per sample (default: 200)\n");
+    printf("  --rounds  Samples per expression and stage (default: 5)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *format = "table";
+    int repeat = 200, rounds = 5;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+            format = argv[++i];
+        else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+            repeat = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc)
+            rounds = atoi(argv[++i]);
+        else
+        {
+            show_bench_usage(argv[0]);
+            return strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (repeat <= 0 || rounds <= 0 ||
+        (strcmp(format, "table") != 0 && strcmp(format, "json") != 0 && strcmp(format, "csv") != 0))
+    {
+        show_bench_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    NmriContext *ctx = nmri_context_create();
+    char name[16];
+    for (int i = 0; i < VARIABLE_COUNT; i++)
+    {
+        snprintf(name, sizeof(name), "v%d", i);
+        set_variable(ctx, name, 1.0 + i * 0.75);
+    }
+    Corpus corpora[4];
+    build_corpora(corpora);
+
+    if (strcmp(format, "json") == 0)
+        printf("{\"benchmark\": \"nmri\", \"repeat\": %d, \"rounds\": %d, \"results\": [", repeat, rounds);
+    else if (strcmp(format, "csv") == 0)
+        printf("corpus,stage,ns_per_expr,expr_per_sec,p50_ns,p90_ns,p99_ns,samples\n");
+    else
+        printf("%-10s %-20s %10s %12s %10s %10s %10s\n", "corpus", "stage", "ns/expr", "expr/s", "p50", "p90", "p99");
+
+    int status = EXIT_SUCCESS, first = 1;
+    for (int c = 0; c < 4; c++)
+        for (int stage = 0; stage < STAGE_COUNT; stage++)
+        {
+            BenchResult r;
+            if (run_benchmark(ctx, &corpora[c], stage, repeat, rounds, &r) != 0)
+            {
+                status = EXIT_FAILURE;
+                continue;
+            }
+            if (strcmp(format, "json") == 0)
+                printf("%s\n  {\"corpus\": \"%s\", \"stage\": \"%s\", \"ns_per_expr\": %.2f, \"expr_per_sec\": %.0f, "
+                       "\"p50_ns\": %.2f, \"p90_ns\": %.2f, \"p99_ns\": %.2f, \"samples\": %d}",
+                       first ? "" : ",", corpora[c].name, stage_names[stage], r.ns_per_expr, r.expr_per_sec,
+                       r.p50, r.p90, r.p99, r.samples);
+            else if (strcmp(format, "csv") == 0)
+                printf("%s,%s,%.2f,%.0f,%.2f,%.2f,%.2f,%d\n", corpora[c].name, stage_names[stage], r.ns_per_expr,
+                       r.expr_per_sec, r.p50, r.p90, r.p99, r.samples);
+            else
+                printf("%-10s %-20s %10.1f %12.0f %10.1f %10.1f %10.1f\n", corpora[c].name, stage_names[stage],
+                       r.ns_per_expr, r.expr_per_sec, r.p50, r.p90, r.p99);
+            first = 0;
+        }
+    if (strcmp(format, "json") == 0)
+        printf("\n]}\n");
+
+    for (int c = 0; c < 4; c++)
+        for (int i = 0; i < CORPUS_SIZE; i++)
+            free(corpora[c].expressions[i]);
+    nmri_context_destroy(ctx);
+    return status;
+}